@@ -0,0 +1,1144 @@
+/*
+ * Copyright (c) 2017, Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * vgpu-bench: replay ioreq traces through demu's dispatch path and time
+ * console refresh, with demu linked against the stub Xen backend in
+ * xen-stub.c.
+ *
+ * Usage: vgpu-bench [-c config] [-n rounds] [-f trace]...
+ *
+ * Without -f, built-in traces are replayed: a PCI config space scan, a
+ * VBE mode set, VGA text scrolling and a VBE fill through the banked
+ * window, plus a text screen redraw and a palette load posted through
+ * the buffered ioreq ring. Then surface_refresh() is timed over several
+ * VRAM dirty patterns. Last, accesses to the VGA window are checked
+ * against a byte at a time model of it, and a random mix of buffered
+ * writes against the same writes issued one at a time; the bench exits
+ * non-zero if either disagrees. A trace file holds one ioreq per line:
+ *
+ *     pio|copy|pci|inval  r|w  addr  size  count  data  [ptr]
+ *
+ * with numbers in C notation; "ptr" makes data a guest physical address
+ * (scratch RAM starts at XEN_STUB_SCRATCH_ADDRESS). For pci, addr is the
+ * config space offset and the emulated device is targeted implicitly.
+ * Lines starting with '#' are ignored. The plugin configuration (-c)
+ * defaults to bench/vgpu-bench.conf, which loads no plugins.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <xenctrl.h>
+#include <xen/hvm/ioreq.h>
+
+#include "demu.h"
+#include "device.h"
+#include "surface.h"
+#include "bench.h"
+
+#include <vmiop-env.h>
+
+#define BENCH_DOMID         1
+#define BENCH_DEVICE        2
+#define BENCH_SBDF          ((BENCH_DEVICE & 0x1f) << 3)
+#define BENCH_CONFIG        "bench/vgpu-bench.conf"
+#define BENCH_ROUNDS        1000
+
+#define BENCH_XRES          1024
+#define BENCH_YRES          768
+#define BENCH_BPP           32
+
+typedef struct bench_trace {
+    const char  *name;
+    ioreq_t     *ioreq;
+    unsigned int nr;
+    unsigned int size;
+    int         buffered;
+} bench_trace_t;
+
+static uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_add(bench_trace_t *trace, uint8_t type, uint8_t dir, uint64_t addr,
+          uint32_t size, uint32_t count, uint64_t data, int data_is_ptr)
+{
+    ioreq_t *ioreq;
+
+    if (trace->nr == trace->size) {
+        trace->size = (trace->size != 0) ? trace->size * 2 : 64;
+        trace->ioreq = realloc(trace->ioreq,
+                               trace->size * sizeof(ioreq_t));
+        if (trace->ioreq == NULL)
+            err(1, "realloc");
+    }
+
+    ioreq = &trace->ioreq[trace->nr++];
+    memset(ioreq, 0, sizeof(*ioreq));
+
+    ioreq->type = type;
+    ioreq->dir = dir;
+    ioreq->addr = (type == IOREQ_TYPE_PCI_CONFIG) ?
+                  ((uint64_t)BENCH_SBDF << 32) | addr : addr;
+    ioreq->size = size;
+    ioreq->count = count;
+    ioreq->data = data;
+    ioreq->data_is_ptr = !!data_is_ptr;
+    ioreq->state = STATE_IOREQ_READY;
+}
+
+static void
+bench_outb(bench_trace_t *trace, uint16_t port, uint8_t val)
+{
+    bench_add(trace, IOREQ_TYPE_PIO, IOREQ_WRITE, port, 1, 1, val, 0);
+}
+
+static void
+bench_inb(bench_trace_t *trace, uint16_t port)
+{
+    bench_add(trace, IOREQ_TYPE_PIO, IOREQ_READ, port, 1, 1, 0, 0);
+}
+
+static void
+bench_vbe_write(bench_trace_t *trace, uint16_t index, uint16_t val)
+{
+    bench_add(trace, IOREQ_TYPE_PIO, IOREQ_WRITE, 0x1ce, 2, 1, index, 0);
+    bench_add(trace, IOREQ_TYPE_PIO, IOREQ_WRITE, 0x1cf, 2, 1, val, 0);
+}
+
+/* What a driver's probe does: read every dword of config space */
+static void
+bench_trace_pci_scan(bench_trace_t *trace)
+{
+    unsigned int offset;
+
+    trace->name = "pci-scan";
+
+    for (offset = 0; offset < 256; offset += 4)
+        bench_add(trace, IOREQ_TYPE_PCI_CONFIG, IOREQ_READ, offset, 4, 1,
+                  0, 0);
+}
+
+/* VBE mode set to the benchmark resolution, as a BIOS or driver does it */
+static void
+bench_trace_mode_set(bench_trace_t *trace)
+{
+    trace->name = "mode-set";
+
+    bench_vbe_write(trace, VBE_DISPI_INDEX_ID, VBE_DISPI_ID4);
+    bench_add(trace, IOREQ_TYPE_PIO, IOREQ_READ, 0x1cf, 2, 1, 0, 0);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_ENABLE, VBE_DISPI_DISABLED);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_XRES, BENCH_XRES);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_YRES, BENCH_YRES);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_BPP, BENCH_BPP);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_ENABLE,
+                    VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
+
+    /* Reset the attribute flip-flop and enable the palette */
+    bench_inb(trace, 0x3da);
+    bench_outb(trace, 0x3c0, 0x20);
+}
+
+/*
+ * Text mode scrolling: move rows 1-24 of the 80x25 screen up with a
+ * REP MOVSW from a guest buffer, then blank the last row with REP STOSW.
+ */
+static void
+bench_trace_text_scroll(bench_trace_t *trace)
+{
+    unsigned int i;
+
+    trace->name = "text-scroll";
+
+    /* Odd/even addressing of the 0xb8000 window */
+    bench_outb(trace, 0x3c4, 0x04);
+    bench_outb(trace, 0x3c5, 0x02);
+    bench_outb(trace, 0x3ce, 0x05);
+    bench_outb(trace, 0x3cf, 0x10);
+    bench_outb(trace, 0x3ce, 0x06);
+    bench_outb(trace, 0x3cf, 0x0e);
+
+    for (i = 0; i < 25; i++) {
+        bench_add(trace, IOREQ_TYPE_COPY, IOREQ_WRITE, 0xb8000, 2,
+                  80 * 24, XEN_STUB_SCRATCH_ADDRESS, 1);
+        bench_add(trace, IOREQ_TYPE_COPY, IOREQ_WRITE, 0xb8000 + 80 * 24 * 2,
+                  2, 80, 0x0720, 0);
+    }
+}
+
+/*
+ * Fill a 32bpp frame through the 64K window at 0xa0000 (VBE without a
+ * linear framebuffer), one REP STOSD per bank.
+ */
+static void
+bench_trace_banked_fill(bench_trace_t *trace)
+{
+    unsigned int banks = (BENCH_XRES * BENCH_YRES * (BENCH_BPP / 8)) >> 16;
+    unsigned int bank;
+
+    trace->name = "banked-fill";
+
+    bench_vbe_write(trace, VBE_DISPI_INDEX_ENABLE, VBE_DISPI_DISABLED);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_XRES, BENCH_XRES);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_YRES, BENCH_YRES);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_BPP, BENCH_BPP);
+    bench_vbe_write(trace, VBE_DISPI_INDEX_ENABLE,
+                    VBE_DISPI_ENABLED | VBE_DISPI_NOCLEARMEM);
+
+    for (bank = 0; bank < banks; bank++) {
+        bench_vbe_write(trace, VBE_DISPI_INDEX_BANK, bank);
+        bench_add(trace, IOREQ_TYPE_COPY, IOREQ_WRITE, 0xa0000, 4,
+                  0x10000 / 4, 0x00336699, 0);
+    }
+}
+
+/*
+ * Redraw an 80x25 text screen with plain word stores, which Xen posts
+ * to the buffered ring rather than issuing synchronously.
+ */
+static void
+bench_trace_buffered_text(bench_trace_t *trace)
+{
+    unsigned int i;
+
+    trace->name = "buffered-text";
+    trace->buffered = 1;
+
+    bench_outb(trace, 0x3ce, 0x06);
+    bench_outb(trace, 0x3cf, 0x0e);
+
+    for (i = 0; i < 80 * 25; i++)
+        bench_add(trace, IOREQ_TYPE_COPY, IOREQ_WRITE, 0xb8000 + (i * 2), 2,
+                  1, 0x0700 | ('a' + (i % 26)), 0);
+}
+
+/* Load the 256 entry DAC palette, three stores to one port per entry */
+static void
+bench_trace_buffered_palette(bench_trace_t *trace)
+{
+    unsigned int i;
+
+    trace->name = "buffered-dac";
+    trace->buffered = 1;
+
+    bench_outb(trace, 0x3c8, 0);
+
+    for (i = 0; i < 256 * 3; i++)
+        bench_outb(trace, 0x3c9, (i / 3) >> 2);
+}
+
+static int
+bench_trace_load(bench_trace_t *trace, const char *path)
+{
+    char line[256];
+    FILE *f;
+    unsigned int lineno = 0;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    trace->name = path;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char type[8], dir[4], ptr[4];
+        unsigned long long addr, data;
+        unsigned int size, count;
+        uint8_t t;
+        int n;
+
+        lineno++;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        ptr[0] = '\0';
+        n = sscanf(line, "%7s %3s %lli %i %i %lli %3s", type, dir, &addr,
+                   &size, &count, &data, ptr);
+        if (n < 6)
+            goto bad;
+
+        if (strcmp(type, "pio") == 0)
+            t = IOREQ_TYPE_PIO;
+        else if (strcmp(type, "copy") == 0)
+            t = IOREQ_TYPE_COPY;
+        else if (strcmp(type, "pci") == 0)
+            t = IOREQ_TYPE_PCI_CONFIG;
+        else if (strcmp(type, "inval") == 0)
+            t = IOREQ_TYPE_INVALIDATE;
+        else
+            goto bad;
+
+        if ((dir[0] != 'r' && dir[0] != 'w') || size == 0 || size > 8 ||
+            count == 0)
+            goto bad;
+
+        bench_add(trace, t, (dir[0] == 'r') ? IOREQ_READ : IOREQ_WRITE,
+                  addr, size, count, data, strcmp(ptr, "ptr") == 0);
+        continue;
+
+bad:
+        fprintf(stderr, "%s:%u: bad ioreq\n", path, lineno);
+        fclose(f);
+        errno = EINVAL;
+        return -1;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Convert a trace to the entries Xen would post to the buffered ring */
+static buf_ioreq_t *
+bench_trace_buffer(const bench_trace_t *trace)
+{
+    buf_ioreq_t *buf_ioreq;
+    unsigned int i;
+
+    buf_ioreq = calloc(trace->nr, sizeof(buf_ioreq_t));
+    if (buf_ioreq == NULL)
+        err(1, "calloc");
+
+    for (i = 0; i < trace->nr; i++) {
+        const ioreq_t *ioreq = &trace->ioreq[i];
+
+        if (ioreq->count != 1 || ioreq->data_is_ptr || ioreq->size > 4 ||
+            ioreq->addr >= (1 << 20))
+            errx(1, "%s: ioreq %u cannot be buffered", trace->name, i);
+
+        buf_ioreq[i].type = ioreq->type;
+        buf_ioreq[i].dir = ioreq->dir;
+        buf_ioreq[i].size = __builtin_ctz(ioreq->size);
+        buf_ioreq[i].addr = ioreq->addr;
+        buf_ioreq[i].data = ioreq->data;
+    }
+
+    return buf_ioreq;
+}
+
+static void
+bench_replay_buffered(const bench_trace_t *trace, unsigned int rounds)
+{
+    buf_ioreq_t *buf_ioreq = bench_trace_buffer(trace);
+    unsigned int round;
+
+    for (round = 0; round < rounds; round++)
+        demu_bench_handle_buffered(buf_ioreq, trace->nr);
+
+    free(buf_ioreq);
+}
+
+static void
+bench_replay(const bench_trace_t *trace, unsigned int rounds)
+{
+    uint64_t start, ns, nr;
+    unsigned int round, i;
+
+    start = bench_now();
+
+    if (trace->buffered)
+        bench_replay_buffered(trace, rounds);
+    else {
+        for (round = 0; round < rounds; round++) {
+            for (i = 0; i < trace->nr; i++) {
+                /* Dispatch consumes the ioreq, so hand it a copy */
+                ioreq_t ioreq = trace->ioreq[i];
+
+                demu_bench_handle_ioreq(&ioreq);
+            }
+        }
+    }
+
+    ns = bench_now() - start;
+    nr = (uint64_t)trace->nr * rounds;
+
+    printf("%-16s %10" PRIu64 " ioreqs %12.0f ioreqs/s %10.1f ns/ioreq\n",
+           trace->name, nr, (ns != 0) ? nr * 1e9 / ns : 0.0,
+           (nr != 0) ? (double)ns / nr : 0.0);
+}
+
+/* Guest writes to the LFB land in VRAM directly; fake them and their dirt */
+static void
+bench_touch(xen_pfn_t first, unsigned int count, unsigned int stride,
+            uint32_t val)
+{
+    uint8_t *vram = demu_get_vram();
+    xen_pfn_t vram_pfn = demu_get_vram_addr() >> TARGET_PAGE_SHIFT;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        xen_pfn_t pfn = first + (i * stride);
+
+        memset(vram + (pfn << TARGET_PAGE_SHIFT), val, TARGET_PAGE_SIZE);
+        xen_stub_set_dirty(vram_pfn + pfn, 1);
+    }
+}
+
+static void
+bench_refresh(const char *name, unsigned int count, unsigned int stride,
+              unsigned int frames)
+{
+    uint64_t start, ns, touch = 0;
+    uint64_t t;
+    unsigned int i;
+
+    start = bench_now();
+
+    for (i = 0; i < frames; i++) {
+        t = bench_now();
+        bench_touch(0, count, stride, i);
+        touch += bench_now() - t;
+
+        (void) surface_refresh(0);
+    }
+
+    /* Report refresh cost alone, not the cost of faking the writes */
+    ns = bench_now() - start - touch;
+
+    printf("refresh-%-8s %10u frames %12.1f frames/s %10.1f us/frame\n",
+           name, frames, (ns != 0) ? frames * 1e9 / ns : 0.0,
+           (double)ns / frames / 1000);
+}
+
+/*
+ * Equivalence check for the legacy VGA window. device.c handles guest
+ * accesses there as spans; this is the byte at a time model it replaced,
+ * with its own copy of VRAM, the latch and the dirty pages. Random
+ * register state and random accesses (all widths, REP runs in both
+ * directions, to and from guest memory) go through demu's dispatch path
+ * and through the model, and the results must agree.
+ */
+#define BENCH_CHECK_VGA_TRIALS  2000
+#define BENCH_CHECK_VGA_VRAM    0x200000    /* 128K window, banked, x4 */
+#define BENCH_CHECK_SPAN        0x4000      /* guest buffer either side */
+
+typedef struct bench_vga_ref {
+    uint8_t     vram[BENCH_CHECK_VGA_VRAM];
+    uint8_t     dirty[BENCH_CHECK_VGA_VRAM >> TARGET_PAGE_SHIFT];
+    uint32_t    latch;
+    uint32_t    plane_updated;
+} bench_vga_ref_t;
+
+/* One byte of 0xff for each bit of a 4-bit plane mask */
+static uint32_t
+bench_vga_mask16(uint8_t mask)
+{
+    uint32_t val = 0;
+    unsigned int plane;
+
+    for (plane = 0; plane < 4; plane++)
+        if (mask & (1 << plane))
+            val |= 0xffu << (plane * 8);
+
+    return val;
+}
+
+static int64_t
+bench_vga_ref_offset(const vga_t *vga, uint64_t addr)
+{
+    addr &= 0x1ffff;
+
+    switch ((vga->gr[6] >> 2) & 3) {
+    case 0:
+        return addr;
+    case 1:
+        return (addr < 0x10000) ? (int64_t)(addr + vga->bank_offset) : -1;
+    case 2:
+        return (addr - 0x10000 < 0x8000) ? (int64_t)(addr - 0x10000) : -1;
+    default:
+        return (addr - 0x18000 < 0x8000) ? (int64_t)(addr - 0x18000) : -1;
+    }
+}
+
+static uint8_t
+bench_vga_ref_readb(bench_vga_ref_t *ref, const vga_t *vga, uint64_t addr)
+{
+    int64_t offset = bench_vga_ref_offset(vga, addr);
+    uint8_t plane;
+    uint32_t tmp;
+
+    if (offset < 0)
+        return 0xff;
+
+    if (vga->sr[4] & 0x08)
+        return ref->vram[offset];
+
+    if (vga->gr[5] & 0x10) {
+        plane = (vga->gr[4] & 2) | (offset & 1);
+        return ref->vram[((offset & ~1) << 1) | plane];
+    }
+
+    memcpy(&ref->latch, &ref->vram[offset << 2], sizeof(ref->latch));
+
+    if (!(vga->gr[5] & 0x08))
+        return (ref->latch >> (vga->gr[4] * 8)) & 0xff;
+
+    tmp = (ref->latch ^ bench_vga_mask16(vga->gr[2])) &
+          bench_vga_mask16(vga->gr[7]);
+    tmp |= tmp >> 16;
+    tmp |= tmp >> 8;
+
+    return (~tmp) & 0xff;
+}
+
+static void
+bench_vga_ref_writeb(bench_vga_ref_t *ref, const vga_t *vga, uint64_t addr,
+                     uint8_t val)
+{
+    int64_t offset = bench_vga_ref_offset(vga, addr);
+    uint32_t write_val, bit_mask, write_mask, tmp;
+    uint8_t plane, b;
+
+    if (offset < 0)
+        return;
+
+    if ((vga->sr[4] & 0x08) || (vga->gr[5] & 0x10)) {
+        if (vga->sr[4] & 0x08) {
+            plane = offset & 3;
+        } else {
+            plane = (vga->gr[4] & 2) | (offset & 1);
+            offset = ((offset & ~1) << 1) | plane;
+        }
+
+        if (vga->sr[2] & (1 << plane)) {
+            ref->vram[offset] = val;
+            ref->dirty[offset >> TARGET_PAGE_SHIFT] = 1;
+            ref->plane_updated |= 1 << plane;
+        }
+        return;
+    }
+
+    b = vga->gr[3] & 7;
+    write_val = val;
+
+    switch (vga->gr[5] & 3) {
+    case 0:
+        write_val = ((write_val >> b) | (write_val << (8 - b))) & 0xff;
+        write_val |= write_val << 8;
+        write_val |= write_val << 16;
+        write_val = (write_val & ~bench_vga_mask16(vga->gr[1])) |
+                    (bench_vga_mask16(vga->gr[0]) &
+                     bench_vga_mask16(vga->gr[1]));
+        bit_mask = vga->gr[8];
+        break;
+    case 1:
+        write_val = ref->latch;
+        goto write;
+    case 2:
+        write_val = bench_vga_mask16(write_val & 0x0f);
+        bit_mask = vga->gr[8];
+        break;
+    default:
+        write_val = (write_val >> b) | (write_val << (8 - b));
+        bit_mask = vga->gr[8] & write_val;
+        write_val = bench_vga_mask16(vga->gr[0]);
+        break;
+    }
+
+    switch (vga->gr[3] >> 3) {
+    case 1:
+        write_val &= ref->latch;
+        break;
+    case 2:
+        write_val |= ref->latch;
+        break;
+    case 3:
+        write_val ^= ref->latch;
+        break;
+    default:
+        break;
+    }
+
+    bit_mask |= bit_mask << 8;
+    bit_mask |= bit_mask << 16;
+    write_val = (write_val & bit_mask) | (ref->latch & ~bit_mask);
+
+write:
+    ref->plane_updated |= vga->sr[2];
+    write_mask = bench_vga_mask16(vga->sr[2]);
+
+    memcpy(&tmp, &ref->vram[offset << 2], sizeof(tmp));
+    tmp = (tmp & ~write_mask) | (write_val & write_mask);
+    memcpy(&ref->vram[offset << 2], &tmp, sizeof(tmp));
+    ref->dirty[(offset << 2) >> TARGET_PAGE_SHIFT] = 1;
+}
+
+/*
+ * Apply an ioreq to the model the way demu dispatched it before REP
+ * runs were handed to devices whole: element by element, each split
+ * into ascending byte accesses. guest holds guest memory from base.
+ * Returns the data of a non-ptr read.
+ */
+static uint64_t
+bench_vga_ref_ioreq(bench_vga_ref_t *ref, const vga_t *vga,
+                    const ioreq_t *ioreq, uint8_t *guest, uint64_t base)
+{
+    int64_t step = ioreq->df ? -(int64_t)ioreq->size : ioreq->size;
+    uint64_t data = ioreq->data;
+    uint32_t i, j;
+
+    for (i = 0; i < ioreq->count; i++) {
+        uint64_t addr = ioreq->addr + (int64_t)i * step;
+        uint8_t *val = (uint8_t *)&data;
+
+        if (ioreq->data_is_ptr)
+            val = &guest[ioreq->data - base + (int64_t)i * step];
+
+        for (j = 0; j < ioreq->size; j++) {
+            if (ioreq->dir == IOREQ_READ)
+                val[j] = bench_vga_ref_readb(ref, vga, addr + j);
+            else
+                bench_vga_ref_writeb(ref, vga, addr + j, val[j]);
+        }
+    }
+
+    return data;
+}
+
+/* Build a random VGA memory ioreq that stays inside the window */
+static void
+bench_vga_ioreq(bench_trace_t *trace)
+{
+    uint32_t size = 1 << (random() % 3);
+    uint32_t count;
+    uint64_t len, addr;
+    int64_t start;
+    uint8_t dir = (random() & 1) ? IOREQ_READ : IOREQ_WRITE;
+    int df = random() & 1;
+    int ptr = random() & 1;
+    ioreq_t *ioreq;
+
+    switch (random() % 4) {
+    case 0:
+    case 1:
+        count = 1;
+        break;
+    case 2:
+        count = 1 + (random() % 64);
+        break;
+    default:
+        /* Long enough to need more than one REP buffer */
+        count = 1 + (random() % 2048);
+        break;
+    }
+
+    len = (uint64_t)size * count;
+
+    /* Half the runs straddle a boundary of the memory map modes */
+    if (random() & 1)
+        start = random() % 0x20000;
+    else
+        start = (random() % 5) * 0x8000 - (random() % (len + 1));
+
+    if (start > (int64_t)(0x20000 - len))
+        start = 0x20000 - len;
+    if (start < 0)
+        start = 0;
+
+    addr = 0xa0000 + start;
+    if (df)
+        addr += len - size;
+
+    bench_add(trace, IOREQ_TYPE_COPY, dir, addr, size, count,
+              ptr ? XEN_STUB_SCRATCH_ADDRESS + (XEN_STUB_SCRATCH_SIZE / 2) +
+                    (random() % 0x2000) - 0x1000 :
+                    ((uint64_t)random() << 32) | random(), ptr);
+
+    ioreq = &trace->ioreq[trace->nr - 1];
+    ioreq->df = df;
+}
+
+static unsigned int
+bench_check_vga(unsigned int trials)
+{
+    vga_t *vga = device_get_vga();
+    uint8_t *vram = demu_get_vram();
+    uint8_t *scratch = xen_stub_scratch();
+    uint8_t *mid, *expect;
+    bench_vga_ref_t *ref;
+    bench_trace_t trace;
+    unsigned int trial, failed = 0;
+
+    ref = calloc(1, sizeof(*ref));
+    expect = malloc(BENCH_CHECK_SPAN * 2);
+    if (ref == NULL || expect == NULL || scratch == NULL)
+        err(1, "bench_check_vga");
+
+    mid = scratch + (XEN_STUB_SCRATCH_SIZE / 2) - BENCH_CHECK_SPAN;
+    memset(&trace, 0, sizeof(trace));
+    memcpy(ref->vram, vram, BENCH_CHECK_VGA_VRAM);
+
+    srandom(1);
+
+    for (trial = 0; trial < trials; trial++) {
+        ioreq_t ioreq, *issued;
+        uint64_t data, mask;
+        xen_pfn_t pfn;
+        unsigned int i;
+        uint8_t mode = random() % 3;
+        int ok = 1;
+
+        /* 0: chain-4, 1: odd/even, 2: planar; registers through the ports */
+        trace.nr = 0;
+        bench_outb(&trace, 0x3c4, 0x02);
+        bench_outb(&trace, 0x3c5, (random() & 1) ? 0x0f : random());
+        bench_outb(&trace, 0x3c4, 0x04);
+        bench_outb(&trace, 0x3c5,
+                   (random() & ~0x08) | ((mode == 0) ? 0x08 : 0));
+        for (i = 0; i <= 8; i++) {
+            uint8_t val = random();
+
+            if (i == 5)
+                val = (val & ~0x10) | ((mode == 1) ? 0x10 : 0);
+
+            bench_outb(&trace, 0x3ce, i);
+            bench_outb(&trace, 0x3cf, val);
+        }
+        for (i = 0; i < trace.nr; i++)
+            demu_bench_handle_ioreq(&trace.ioreq[i]);
+
+        vga->latch = ((uint32_t)random() << 16) ^ random();
+        vga->bank_offset = (random() % 8) << 16;
+
+        vga->plane_updated = 0;
+
+        ref->latch = vga->latch;
+        ref->plane_updated = 0;
+        memset(ref->dirty, 0, sizeof(ref->dirty));
+        demu_clear_vram_dirty_map();
+
+        for (i = 0; i < BENCH_CHECK_SPAN * 2; i++)
+            mid[i] = random();
+        memcpy(expect, mid, BENCH_CHECK_SPAN * 2);
+
+        trace.nr = 0;
+        bench_vga_ioreq(&trace);
+        issued = &trace.ioreq[0];
+        ioreq = *issued;
+
+        data = bench_vga_ref_ioreq(ref, vga, &ioreq, expect,
+                                   XEN_STUB_SCRATCH_ADDRESS +
+                                   (mid - scratch));
+        demu_bench_handle_ioreq(issued);
+
+        mask = (ioreq.size < 8) ? (1ull << (ioreq.size * 8)) - 1 : ~0ull;
+
+        if (memcmp(vram, ref->vram, BENCH_CHECK_VGA_VRAM) != 0 ||
+            memcmp(mid, expect, BENCH_CHECK_SPAN * 2) != 0 ||
+            vga->latch != ref->latch ||
+            vga->plane_updated != ref->plane_updated)
+            ok = 0;
+
+        if (ioreq.dir == IOREQ_READ && !ioreq.data_is_ptr &&
+            (issued->data & mask) != (data & mask))
+            ok = 0;
+
+        for (pfn = 0; pfn < sizeof(ref->dirty); pfn++)
+            if (ref->dirty[pfn] && !demu_vram_get_page_dirty(pfn))
+                ok = 0;
+
+        if (ok)
+            continue;
+
+        if (failed++ < 8)
+            fprintf(stderr, "check-vga: trial %u: %s 0x%" PRIx64
+                    " size %u count %u df %u%s sr2 %02x sr4 %02x gr"
+                    " %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
+                    trial, (ioreq.dir == IOREQ_READ) ? "read" : "write",
+                    ioreq.addr, ioreq.size, ioreq.count, ioreq.df,
+                    ioreq.data_is_ptr ? " ptr" : "", vga->sr[2], vga->sr[4],
+                    vga->gr[0], vga->gr[1], vga->gr[2], vga->gr[3],
+                    vga->gr[4], vga->gr[5], vga->gr[6], vga->gr[7],
+                    vga->gr[8]);
+
+        /* Carry on from demu's state */
+        memcpy(ref->vram, vram, BENCH_CHECK_VGA_VRAM);
+    }
+
+    printf("check-%-10s %10u trials %10u mismatches\n", "vga", trials,
+           failed);
+
+    free(trace.ioreq);
+    free(expect);
+    free(ref);
+
+    return failed;
+}
+
+/*
+ * Equivalence check for coalescing on the buffered ring: a random mix of
+ * window stores, DAC loads and register writes that change the memory
+ * mode between runs must leave VRAM and the VGA state exactly as it is
+ * when the same writes are issued one ioreq at a time.
+ */
+#define BENCH_CHECK_BUFFERED_TRIALS 32
+#define BENCH_CHECK_BUFFERED_NR     4096
+
+static void
+bench_trace_buffered_mix(bench_trace_t *trace, unsigned int nr)
+{
+    uint64_t addr = 0xa0000;
+    uint32_t size = 1;
+    unsigned int i, n;
+
+    trace->name = "check-buffered";
+    trace->buffered = 1;
+
+    while (trace->nr < nr) {
+        switch (random() % 8) {
+        case 0:
+            bench_outb(trace, 0x3c4, (random() & 1) ? 0x02 : 0x04);
+            bench_outb(trace, 0x3c5, random());
+            break;
+        case 1:
+            bench_outb(trace, 0x3ce, random() % 9);
+            bench_outb(trace, 0x3cf, random());
+            break;
+        case 2:
+            bench_outb(trace, 0x3c8, random());
+            /* FALLTHRU */
+        case 3:
+            n = random() % 48;
+            for (i = 0; i < n; i++)
+                bench_outb(trace, 0x3c9, random() & 0x3f);
+            break;
+        default:
+            /* A run of stores, often carrying on from the last one */
+            if (random() & 1) {
+                size = 1 << (random() % 3);
+                addr = 0xa0000 + ((random() % 0x20000) & ~(size - 1));
+            }
+
+            n = 1 + (random() % 600);
+            for (i = 0; i < n; i++) {
+                if (addr + size > 0xc0000)
+                    addr = 0xa0000;
+
+                bench_add(trace, IOREQ_TYPE_COPY, IOREQ_WRITE, addr, size,
+                          1, random(), 0);
+                addr += size;
+            }
+            break;
+        }
+    }
+}
+
+static unsigned int
+bench_check_buffered(unsigned int trials)
+{
+    vga_t *vga = device_get_vga();
+    uint8_t *vram = demu_get_vram();
+    uint8_t *saved_vram, *coalesced_vram;
+    vga_t saved, coalesced;
+    bench_trace_t trace;
+    unsigned int trial, failed = 0;
+
+    saved_vram = malloc(BENCH_CHECK_VGA_VRAM);
+    coalesced_vram = malloc(BENCH_CHECK_VGA_VRAM);
+    if (saved_vram == NULL || coalesced_vram == NULL)
+        err(1, "bench_check_buffered");
+
+    memset(&trace, 0, sizeof(trace));
+
+    srandom(2);
+
+    for (trial = 0; trial < trials; trial++) {
+        buf_ioreq_t *buf_ioreq;
+        unsigned int i;
+
+        trace.nr = 0;
+        bench_trace_buffered_mix(&trace, BENCH_CHECK_BUFFERED_NR);
+        buf_ioreq = bench_trace_buffer(&trace);
+
+        memcpy(&saved, vga, sizeof(saved));
+        memcpy(saved_vram, vram, BENCH_CHECK_VGA_VRAM);
+
+        demu_bench_handle_buffered(buf_ioreq, trace.nr);
+
+        memcpy(&coalesced, vga, sizeof(coalesced));
+        memcpy(coalesced_vram, vram, BENCH_CHECK_VGA_VRAM);
+
+        memcpy(vga, &saved, sizeof(saved));
+        memcpy(vram, saved_vram, BENCH_CHECK_VGA_VRAM);
+
+        for (i = 0; i < trace.nr; i++)
+            demu_bench_handle_ioreq(&trace.ioreq[i]);
+
+        if (memcmp(vga, &coalesced, sizeof(coalesced)) != 0 ||
+            memcmp(vram, coalesced_vram, BENCH_CHECK_VGA_VRAM) != 0) {
+            if (failed < 8)
+                fprintf(stderr, "check-buffered: trial %u: %s differs\n",
+                        trial,
+                        (memcmp(vga, &coalesced, sizeof(coalesced)) != 0) ?
+                        "VGA state" : "VRAM");
+            failed++;
+        }
+
+        free(buf_ioreq);
+    }
+
+    printf("check-%-10s %10u trials %10u mismatches\n", "buffered", trials,
+           failed);
+
+    free(trace.ioreq);
+    free(coalesced_vram);
+    free(saved_vram);
+
+    return failed;
+}
+
+#define BENCH_CHECK_PORTS_TRIALS    2000
+
+/*
+ * A 16-bit OUT to a VGA port must leave the device as the two byte OUTs
+ * it stands for would, including the paired index/data ports that the
+ * device decodes in one step.
+ */
+static unsigned int
+bench_check_ports(unsigned int trials)
+{
+    static const uint16_t port[] = {
+        0x3c4, 0x3ce, 0x3b4, 0x3d4, 0x3c0, 0x3c7, 0x3c8
+    };
+    vga_t *vga = device_get_vga();
+    vga_t saved, split;
+    bench_trace_t trace;
+    unsigned int trial, failed = 0;
+
+    memset(&trace, 0, sizeof(trace));
+
+    srandom(3);
+
+    for (trial = 0; trial < trials; trial++) {
+        uint16_t addr = port[random() % (sizeof(port) / sizeof(port[0]))];
+        uint16_t val = random();
+
+        vga->msr = (vga->msr & ~MSR_COLOR_EMULATION) |
+                   ((random() & 1) ? MSR_COLOR_EMULATION : 0);
+        vga->cr[0x11] = random();
+        memcpy(&saved, vga, sizeof(saved));
+
+        trace.nr = 0;
+        bench_outb(&trace, addr, val & 0xff);
+        bench_outb(&trace, addr + 1, val >> 8);
+        demu_bench_handle_ioreq(&trace.ioreq[0]);
+        demu_bench_handle_ioreq(&trace.ioreq[1]);
+        memcpy(&split, vga, sizeof(split));
+
+        memcpy(vga, &saved, sizeof(saved));
+
+        trace.nr = 0;
+        bench_add(&trace, IOREQ_TYPE_PIO, IOREQ_WRITE, addr, 2, 1, val, 0);
+        demu_bench_handle_ioreq(&trace.ioreq[0]);
+
+        if (memcmp(vga, &split, sizeof(split)) != 0) {
+            if (failed < 8)
+                fprintf(stderr, "check-ports: trial %u: outw 0x%x, 0x%04x "
+                        "differs\n", trial, addr, val);
+            failed++;
+        }
+    }
+
+    printf("check-%-10s %10u trials %10u mismatches\n", "ports", trials,
+           failed);
+
+    free(trace.ioreq);
+
+    return failed;
+}
+
+/* A minimal config space, so scans exercise the PCI dispatch path */
+static uint8_t bench_pci_config[256] = {
+    0xde, 0x10, 0xf8, 0x13,     /* vendor, device */
+    0x07, 0x00, 0x10, 0x00,     /* command, status */
+    0xa1, 0x00, 0x00, 0x03,     /* revision, class: VGA */
+};
+
+static uint8_t
+bench_pci_readb(void *priv, uint64_t addr)
+{
+    return bench_pci_config[addr & 0xff];
+}
+
+static uint16_t
+bench_pci_readw(void *priv, uint64_t addr)
+{
+    uint16_t val;
+
+    memcpy(&val, &bench_pci_config[addr & 0xfe], sizeof(val));
+    return val;
+}
+
+static uint32_t
+bench_pci_readl(void *priv, uint64_t addr)
+{
+    uint32_t val;
+
+    memcpy(&val, &bench_pci_config[addr & 0xfc], sizeof(val));
+    return val;
+}
+
+static void
+bench_pci_writeb(void *priv, uint64_t addr, uint8_t val)
+{
+}
+
+static void
+bench_pci_writew(void *priv, uint64_t addr, uint16_t val)
+{
+}
+
+static void
+bench_pci_writel(void *priv, uint64_t addr, uint32_t val)
+{
+}
+
+static const io_ops_t bench_pci_ops = {
+    .readb = bench_pci_readb,
+    .readw = bench_pci_readw,
+    .readl = bench_pci_readl,
+    .writeb = bench_pci_writeb,
+    .writew = bench_pci_writew,
+    .writel = bench_pci_writel
+};
+
+int main(int argc, char **argv)
+{
+    bench_trace_t trace[16];
+    bench_trace_t mode;
+    unsigned int nr_traces = 0;
+    const char *config = BENCH_CONFIG;
+    unsigned int rounds = BENCH_ROUNDS;
+    unsigned int pages;
+    unsigned int i;
+    int status = 0;
+    int c;
+
+    memset(trace, 0, sizeof(trace));
+
+    while ((c = getopt(argc, argv, "c:n:f:")) != -1) {
+        switch (c) {
+        case 'c':
+            config = optarg;
+            break;
+
+        case 'n':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'f':
+            if (nr_traces == sizeof(trace) / sizeof(trace[0]))
+                errx(1, "too many traces");
+            if (bench_trace_load(&trace[nr_traces++], optarg) < 0)
+                err(1, "%s", optarg);
+            break;
+
+        default:
+            errx(1, "usage: %s [-c config] [-n rounds] [-f trace]...",
+                 argv[0]);
+        }
+    }
+
+    if (rounds == 0)
+        rounds = 1;
+
+    if (demu_bench_initialize(BENCH_DOMID, BENCH_DEVICE, config) < 0)
+        errx(1, "demu initialization failed");
+
+    if (demu_register_pci_config_space(&bench_pci_ops, NULL) < 0)
+        errx(1, "demu_register_pci_config_space failed");
+
+    if (nr_traces == 0) {
+        bench_trace_pci_scan(&trace[nr_traces++]);
+        bench_trace_mode_set(&trace[nr_traces++]);
+        bench_trace_text_scroll(&trace[nr_traces++]);
+        bench_trace_banked_fill(&trace[nr_traces++]);
+        bench_trace_buffered_text(&trace[nr_traces++]);
+        bench_trace_buffered_palette(&trace[nr_traces++]);
+    }
+
+    for (i = 0; i < nr_traces; i++)
+        bench_replay(&trace[i], rounds);
+
+    /* Leave the device in the benchmark graphics mode for the refreshes */
+    memset(&mode, 0, sizeof(mode));
+    bench_trace_mode_set(&mode);
+    for (i = 0; i < mode.nr; i++)
+        demu_bench_handle_ioreq(&mode.ioreq[i]);
+    free(mode.ioreq);
+
+    pages = (BENCH_XRES * BENCH_YRES * (BENCH_BPP / 8)) >> TARGET_PAGE_SHIFT;
+
+    /* Settle the first full frame, then time steady state patterns */
+    (void) surface_refresh(1);
+    bench_refresh("idle", 0, 1, rounds);
+    bench_refresh("cursor", 1, 1, rounds);
+    bench_refresh("sparse", pages / 64, 64, rounds);
+    bench_refresh("full", pages, 1, rounds / 10 + 1);
+
+    if (bench_check_vga(BENCH_CHECK_VGA_TRIALS) != 0)
+        status = 1;
+    if (bench_check_ports(BENCH_CHECK_PORTS_TRIALS) != 0)
+        status = 1;
+    if (bench_check_buffered(BENCH_CHECK_BUFFERED_TRIALS) != 0)
+        status = 1;
+
+    for (i = 0; i < nr_traces; i++)
+        free(trace[i].ioreq);
+
+    demu_bench_teardown();
+    return status;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-tab-always-indent: nil
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-basic-indent: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2017, Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef  _BENCH_H
+#define  _BENCH_H
+
+#include <stdint.h>
+
+#include <xenctrl.h>
+#include <xen/hvm/ioreq.h>
+
+/* demu.c, built with DEMU_BENCH */
+int     demu_bench_initialize(domid_t domid, unsigned int device,
+                              const char *config);
+void    demu_bench_handle_ioreq(ioreq_t *ioreq);
+void    demu_bench_handle_buffered(const buf_ioreq_t *buf_ioreq,
+                                   unsigned int nr);
+void    demu_bench_teardown(void);
+
+/* xen-stub.c: mark guest pages dirty for xc_hvm_track_dirty_vram() */
+void    xen_stub_set_dirty(xen_pfn_t pfn, unsigned long count);
+
+/* xen-stub.c: guest physical address of scratch RAM for REP ioreqs */
+#define XEN_STUB_SCRATCH_ADDRESS    0x00100000
+#define XEN_STUB_SCRATCH_SIZE       0x00100000
+
+/* xen-stub.c: the scratch RAM as the harness sees it, or NULL */
+uint8_t *xen_stub_scratch(void);
+
+#endif  /* _BENCH_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-tab-always-indent: nil
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-basic-indent: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2017, Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * A stand-in for libxenctrl and libxenstore, enough for demu to
+ * initialize and emulate without a hypervisor.
+ *
+ * Guest memory is a sparse file covering the guest's physical address
+ * space, so every foreign mapping of a pfn sees the same page, as it
+ * would under Xen. Populating memory is free (pages read as zero until
+ * written), relocation and page pinning are not modelled, and no event
+ * channel ever fires: the harness calls into the ioreq path itself.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenstore.h>
+
+#include "log.h"
+#include "demu.h"
+#include "control.h"
+#include "bench.h"
+
+#define STUB_GUEST_PAGES    (1ul << 20)     /* 4G of guest physical space */
+#define STUB_IOREQ_PFN      0xfeff0
+#define STUB_BUFIOREQ_PFN   0xfeff1
+
+#define BITS_PER_LONG       (sizeof(unsigned long) * 8)
+
+struct stub_evtchn {
+    int             fd;
+    evtchn_port_t   next_port;
+};
+
+static int stub_xch;
+static int stub_xsh;
+static int stub_mem_fd = -1;
+static unsigned long stub_dirty[STUB_GUEST_PAGES / BITS_PER_LONG];
+
+void
+xen_stub_set_dirty(xen_pfn_t pfn, unsigned long count)
+{
+    while (count-- != 0 && pfn < STUB_GUEST_PAGES) {
+        stub_dirty[pfn / BITS_PER_LONG] |= 1ul << (pfn % BITS_PER_LONG);
+        pfn++;
+    }
+}
+
+uint8_t *
+xen_stub_scratch(void)
+{
+    static uint8_t *scratch;
+    void *ptr;
+
+    if (scratch != NULL)
+        return scratch;
+
+    ptr = mmap(NULL, XEN_STUB_SCRATCH_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, stub_mem_fd, XEN_STUB_SCRATCH_ADDRESS);
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    scratch = ptr;
+    return scratch;
+}
+
+xc_interface *
+xc_interface_open(xentoollog_logger *logger,
+                  xentoollog_logger *dombuild_logger,
+                  unsigned open_flags)
+{
+    char path[] = "/dev/shm/vgpu-bench.XXXXXX";
+
+    stub_mem_fd = mkstemp(path);
+    if (stub_mem_fd < 0)
+        goto fail1;
+
+    (void) unlink(path);
+
+    if (ftruncate(stub_mem_fd, (off_t)STUB_GUEST_PAGES * XC_PAGE_SIZE) < 0)
+        goto fail2;
+
+    return (xc_interface *)&stub_xch;
+
+fail2:
+    ERR("fail2");
+
+    (void) close(stub_mem_fd);
+    stub_mem_fd = -1;
+
+fail1:
+    ERR("fail1: %s", strerror(errno));
+
+    return NULL;
+}
+
+int
+xc_interface_close(xc_interface *xch)
+{
+    (void) close(stub_mem_fd);
+    stub_mem_fd = -1;
+
+    return 0;
+}
+
+void *
+xc_map_foreign_pages(xc_interface *xch, uint32_t dom, int prot,
+                     const xen_pfn_t *arr, int num)
+{
+    uint8_t *base;
+    int i, n;
+
+    base = mmap(NULL, (size_t)num * XC_PAGE_SIZE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    /* Map each run of consecutive pfns with one mmap() */
+    for (i = 0; i < num; i += n) {
+        if (arr[i] >= STUB_GUEST_PAGES) {
+            errno = EINVAL;
+            goto fail1;
+        }
+
+        for (n = 1; i + n < num && arr[i + n] == arr[i] + n; n++)
+            ;
+
+        if (mmap(base + (size_t)i * XC_PAGE_SIZE, (size_t)n * XC_PAGE_SIZE,
+                 prot, MAP_SHARED | MAP_FIXED, stub_mem_fd,
+                 (off_t)arr[i] * XC_PAGE_SIZE) == MAP_FAILED)
+            goto fail1;
+    }
+
+    return base;
+
+fail1:
+    ERR("fail1: %s", strerror(errno));
+
+    (void) munmap(base, (size_t)num * XC_PAGE_SIZE);
+    return NULL;
+}
+
+void *
+xc_map_foreign_range(xc_interface *xch, uint32_t dom, int size, int prot,
+                     unsigned long mfn)
+{
+    xen_pfn_t pfn[size / XC_PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < size / XC_PAGE_SIZE; i++)
+        pfn[i] = mfn + i;
+
+    return xc_map_foreign_pages(xch, dom, prot, pfn, size / XC_PAGE_SIZE);
+}
+
+int
+xc_domain_getinfo(xc_interface *xch, uint32_t first_domid,
+                  unsigned int max_doms, xc_dominfo_t *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->domid = first_domid;
+
+    return 1;
+}
+
+int
+xc_domain_maximum_gpfn(xc_interface *xch, domid_t domid, xen_pfn_t *gpfns)
+{
+    *gpfns = STUB_GUEST_PAGES - 1;
+
+    return 0;
+}
+
+/* The bench has no GPU, hence no locality */
+int
+xc_pcitopoinfo(xc_interface *xch, unsigned num_devs,
+               physdev_pci_device_t *devs, uint32_t *nodes)
+{
+    unsigned int i;
+
+    for (i = 0; i < num_devs; i++)
+        nodes[i] = XEN_INVALID_NODE_ID;
+
+    return 0;
+}
+
+int
+xc_domain_populate_physmap_exact(xc_interface *xch, uint32_t domid,
+                                 unsigned long nr_extents,
+                                 unsigned int extent_order,
+                                 unsigned int mem_flags,
+                                 xen_pfn_t *extent_start)
+{
+    return 0;
+}
+
+int
+xc_domain_add_to_physmap(xc_interface *xch, uint32_t domid,
+                         unsigned int space, unsigned long idx,
+                         xen_pfn_t gpfn)
+{
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int
+xc_domain_add_to_physmap_batch(xc_interface *xch, domid_t domid,
+                               domid_t foreign_domid, unsigned int space,
+                               unsigned int size, xen_ulong_t *idxs,
+                               xen_pfn_t *gfpns, int *errs)
+{
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int
+xc_domain_memory_mapping(xc_interface *xch, uint32_t domid,
+                         unsigned long first_gfn, unsigned long first_mfn,
+                         unsigned long nr_mfns, uint32_t add_mapping)
+{
+    return 0;
+}
+
+int
+xc_domain_iomem_permission(xc_interface *xch, uint32_t domid,
+                           unsigned long first_mfn, unsigned long nr_mfns,
+                           uint8_t allow_access)
+{
+    return 0;
+}
+
+int
+xc_iommu_op(xc_interface *xch, struct pv_iommu_op *ops, unsigned int count)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+xc_hvm_param_get(xc_interface *handle, domid_t dom, uint32_t param,
+                 uint64_t *value)
+{
+    *value = (param == HVM_PARAM_NR_IOREQ_SERVER_PAGES) ? 8 : 0;
+
+    return 0;
+}
+
+int
+xc_hvm_create_ioreq_server(xc_interface *xch, domid_t domid,
+                           int handle_bufioreq, ioservid_t *id)
+{
+    *id = 1;
+
+    return 0;
+}
+
+int
+xc_hvm_get_ioreq_server_info(xc_interface *xch, domid_t domid,
+                             ioservid_t id, xen_pfn_t *ioreq_pfn,
+                             xen_pfn_t *bufioreq_pfn,
+                             evtchn_port_t *bufioreq_port)
+{
+    if (ioreq_pfn != NULL)
+        *ioreq_pfn = STUB_IOREQ_PFN;
+    if (bufioreq_pfn != NULL)
+        *bufioreq_pfn = STUB_BUFIOREQ_PFN;
+    if (bufioreq_port != NULL)
+        *bufioreq_port = 1;
+
+    return 0;
+}
+
+int
+xc_hvm_set_ioreq_server_state(xc_interface *xch, domid_t domid,
+                              ioservid_t id, int enabled)
+{
+    return 0;
+}
+
+int
+xc_hvm_destroy_ioreq_server(xc_interface *xch, domid_t domid, ioservid_t id)
+{
+    return 0;
+}
+
+int
+xc_hvm_map_io_range_to_ioreq_server(xc_interface *xch, domid_t domid,
+                                    ioservid_t id, int is_mmio,
+                                    uint64_t start, uint64_t end)
+{
+    return 0;
+}
+
+int
+xc_hvm_unmap_io_range_from_ioreq_server(xc_interface *xch, domid_t domid,
+                                        ioservid_t id, int is_mmio,
+                                        uint64_t start, uint64_t end)
+{
+    return 0;
+}
+
+int
+xc_hvm_map_pcidev_to_ioreq_server(xc_interface *xch, domid_t domid,
+                                  ioservid_t id, uint16_t segment,
+                                  uint8_t bus, uint8_t device,
+                                  uint8_t function)
+{
+    return 0;
+}
+
+int
+xc_hvm_unmap_pcidev_from_ioreq_server(xc_interface *xch, domid_t domid,
+                                      ioservid_t id, uint16_t segment,
+                                      uint8_t bus, uint8_t device,
+                                      uint8_t function)
+{
+    return 0;
+}
+
+int
+xc_hvm_modified_memory(xc_interface *xch, domid_t dom, uint64_t first_pfn,
+                       uint64_t nr)
+{
+    return 0;
+}
+
+/* Hand back, and clear, the pages marked by xen_stub_set_dirty() */
+int
+xc_hvm_track_dirty_vram(xc_interface *xch, domid_t dom, uint64_t first_pfn,
+                        uint64_t nr, unsigned long *bitmap)
+{
+    uint64_t i;
+
+    if (bitmap == NULL)
+        return 0;
+
+    memset(bitmap, 0, ((nr + BITS_PER_LONG - 1) / BITS_PER_LONG) *
+           sizeof(unsigned long));
+
+    for (i = 0; i < nr && first_pfn + i < STUB_GUEST_PAGES; i++) {
+        xen_pfn_t pfn = first_pfn + i;
+        unsigned long *word = &stub_dirty[pfn / BITS_PER_LONG];
+        unsigned long bit = 1ul << (pfn % BITS_PER_LONG);
+
+        if (*word & bit) {
+            *word &= ~bit;
+            bitmap[i / BITS_PER_LONG] |= 1ul << (i % BITS_PER_LONG);
+        }
+    }
+
+    return 0;
+}
+
+int
+xc_hvm_inject_msi(xc_interface *xch, domid_t dom, uint64_t addr,
+                  uint32_t data)
+{
+    return 0;
+}
+
+int
+xc_hvm_set_pci_intx_level(xc_interface *xch, domid_t dom, uint8_t domain,
+                          uint8_t bus, uint8_t device, uint8_t intx,
+                          unsigned int level)
+{
+    return 0;
+}
+
+xc_evtchn *
+xc_evtchn_open(xentoollog_logger *logger, unsigned open_flags)
+{
+    struct stub_evtchn *xce;
+
+    xce = calloc(1, sizeof(*xce));
+    if (xce == NULL)
+        return NULL;
+
+    xce->fd = eventfd(0, EFD_NONBLOCK);
+    if (xce->fd < 0) {
+        free(xce);
+        return NULL;
+    }
+
+    xce->next_port = 1;
+
+    return (xc_evtchn *)xce;
+}
+
+int
+xc_evtchn_close(xc_evtchn *xce)
+{
+    struct stub_evtchn *stub = (struct stub_evtchn *)xce;
+
+    (void) close(stub->fd);
+    free(stub);
+
+    return 0;
+}
+
+int
+xc_evtchn_fd(xc_evtchn *xce)
+{
+    return ((struct stub_evtchn *)xce)->fd;
+}
+
+evtchn_port_or_error_t
+xc_evtchn_bind_interdomain(xc_evtchn *xce, int domid,
+                           evtchn_port_t remote_port)
+{
+    return ((struct stub_evtchn *)xce)->next_port++;
+}
+
+int
+xc_evtchn_unbind(xc_evtchn *xce, evtchn_port_t port)
+{
+    return 0;
+}
+
+int
+xc_evtchn_notify(xc_evtchn *xce, evtchn_port_t port)
+{
+    return 0;
+}
+
+evtchn_port_or_error_t
+xc_evtchn_pending(xc_evtchn *xce)
+{
+    errno = EAGAIN;
+    return -1;
+}
+
+int
+xc_evtchn_unmask(xc_evtchn *xce, evtchn_port_t port)
+{
+    return 0;
+}
+
+struct xs_handle *
+xs_open(unsigned long flags)
+{
+    return (struct xs_handle *)&stub_xsh;
+}
+
+void
+xs_close(struct xs_handle *xsh)
+{
+}
+
+bool
+xs_write(struct xs_handle *h, xs_transaction_t t, const char *path,
+         const void *data, unsigned int len)
+{
+    return true;
+}
+
+bool
+xs_rm(struct xs_handle *h, xs_transaction_t t, const char *path)
+{
+    return true;
+}
+
+/* control.c is not linked: there is no toolstack to report to */
+void
+send_migrate_progress(uint64_t sent, uint64_t remaining,
+                      uint64_t raw, uint64_t wire)
+{
+}
+
+void
+report_resume_done(enum emp_migration_status status)
+{
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-tab-always-indent: nil
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-basic-indent: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -47,6 +47,7 @@
 
 #include "log.h"
 #include "control.h"
+#include "event.h"
 
 #include <vmiop-env.h>
 
@@ -73,8 +74,14 @@ static sem_t sem_stopped;
 struct emu_client progress_cli;
 struct emu_client initiator_cli;
 
-void send_migrate_progress(uint64_t sent, uint64_t remaining)
+void send_migrate_progress(uint64_t sent, uint64_t remaining,
+                           uint64_t raw, uint64_t wire)
 {
+    if (raw != wire)
+        INFO("Migration stream %" PRIu64 " bytes raw, %" PRIu64
+             " on the wire (%" PRIu64 "%%)", raw, wire,
+             raw ? (wire * 100) / raw : 0);
+
     if (progress_cli.num >= 0)
         emp_send_event_migrate_progress(progress_cli, sent / 4096,
                                         remaining / 4096, -1);
@@ -386,6 +393,57 @@ struct command_actions demu_actions[] = {
     {cmd_set_args,         &do_not_supported,   0}
 };
 
+static struct emp_sock_inf *control_inf;
+static event_loop_t *control_loop;
+static fd_set control_fds;
+static int control_nfds;
+
+static void demu_control_event(int fd, void *priv);
+
+/*
+ * libempserver only exposes its fds (listener and clients) through
+ * emp_select_fdset(), and that set can only change while it is handling
+ * one of them. Re-register the set after each time it runs, since a
+ * closed client fd may have been reused by a new one.
+ */
+static void demu_control_event_sync(void)
+{
+    int fd;
+
+    for (fd = 0; fd < control_nfds; fd++)
+        if (FD_ISSET(fd, &control_fds))
+            event_loop_remove(control_loop, fd);
+
+    FD_ZERO(&control_fds);
+    control_nfds = emp_select_fdset(control_inf, &control_fds, NULL) + 1;
+
+    for (fd = 0; fd < control_nfds; fd++)
+        if (FD_ISSET(fd, &control_fds))
+            (void) event_loop_add(control_loop, fd, demu_control_event,
+                                  NULL);
+}
+
+static void demu_control_event(int fd, void *priv)
+{
+    fd_set rfds;
+
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+
+    (void) emp_select_fdread(control_inf, &rfds, 1);
+
+    demu_control_event_sync();
+}
+
+void demu_control_event_add(event_loop_t *loop, struct emp_sock_inf *inf)
+{
+    control_loop = loop;
+    control_inf = inf;
+    control_nfds = 0;
+
+    demu_control_event_sync();
+}
+
 int demu_control_sock_init(struct emp_sock_inf **inf)
 {
     runstate.paused = 0;
@@ -29,8 +29,12 @@
 
 #include <libempserver.h>
 
+#include "event.h"
+
 int demu_control_sock_init(struct emp_sock_inf **inf);
 int demu_control_sock_close(struct emp_sock_inf **inf);
-void send_migrate_progress(uint64_t sent, uint64_t remaining);
+void demu_control_event_add(event_loop_t *loop, struct emp_sock_inf *inf);
+void send_migrate_progress(uint64_t sent, uint64_t remaining,
+                           uint64_t raw, uint64_t wire);
 void report_resume_done(enum emp_migration_status status);
 
@@ -60,9 +60,14 @@
 #include <sys/prctl.h>
 #include <sys/resource.h>
 #include <aio.h>
+
+#ifdef DEMU_LZ4
+#include <lz4.h>
+#endif
 #include <pthread.h>
 
 #include <locale.h>
+#include <malloc.h>
 
 #include <xenctrl.h>
 #include <xenstore.h>
@@ -73,8 +78,11 @@
 #include "demu.h"
 #include "device.h"
 #include "mapcache.h"
+#include "numa.h"
 #include "surface.h"
 #include "control.h"
+#include "event.h"
+#include "trace.h"
 
 #include <vmiop-env.h>
 #include <vmiop-vga-int.h>
@@ -106,6 +114,10 @@ enum {
     DEMU_OPT_DEVICE,
     DEMU_OPT_RESUME,
     DEMU_OPT_SUSPEND,
+    DEMU_OPT_IOREQ_THREADS,
+    DEMU_OPT_IOREQ_CPUS,
+    DEMU_OPT_MAIN_CPUS,
+    DEMU_OPT_PLUGIN_CPUS,
     DEMU_NR_OPTS
 };
 
@@ -117,6 +129,10 @@ static struct option demu_option[] = {
     {"device", 1, NULL, 0},
     {"resume", 0, NULL, 0},
     {"suspend", 1, NULL, 0},
+    {"ioreq-threads", 1, NULL, 0},
+    {"ioreq-cpus", 1, NULL, 0},
+    {"main-cpus", 1, NULL, 0},
+    {"plugin-cpus", 1, NULL, 0},
     {NULL, 0, NULL, 0}
 };
 
@@ -128,6 +144,10 @@ static const char *demu_option_text[] = {
     "<device_id>",
     "",
     "<ignored>",
+    "<worker thread count>",
+    "<cpu list>",
+    "<cpu list>",
+    "<cpu list>",
     NULL
 };
 
@@ -155,6 +175,7 @@ typedef enum {
     DEMU_SEQ_VMIOP_ENV_INITIALIZED,
     DEMU_SEQ_VMIOP_VGA_INITIALIZED,
     DEMU_SEQ_VMIOP_PLUGINS_REGISTERED,
+    DEMU_SEQ_MAPCACHE_INITIALIZED,
     DEMU_SEQ_SERVER_REGISTERED,
     DEMU_SEQ_SHARED_IOPAGE_MAPPED,
     DEMU_SEQ_BUFFERED_IOPAGE_MAPPED,
@@ -165,11 +186,20 @@ typedef enum {
     DEMU_SEQ_VRAM_MAPPED,
     DEMU_SEQ_SOCKET_CREATED,
     DEMU_SEQ_SURFACE_INITIALIZED,
+    DEMU_SEQ_IOREQ_WORKERS_STARTED,
     DEMU_SEQ_INITIALIZED,
     DEMU_NR_SEQS
 } demu_seq_t;
 
 
+typedef uint64_t (*demu_space_read_t)(demu_space_t *space, uint64_t addr);
+typedef void (*demu_space_write_t)(demu_space_t *space, uint64_t addr,
+                                   uint64_t val);
+
+/*
+ * read[] and write[] hold the handler for each access size (1, 2, 4 and
+ * 8 bytes), resolved from the io_ops_t when the space is registered.
+ */
 struct demu_space {
     demu_space_t *next;
     uint64_t start;
@@ -177,8 +207,84 @@ struct demu_space {
     const io_ops_t *ops;
     void *priv;
     int io_init;
+    demu_space_read_t read[4];
+    demu_space_write_t write[4];
+};
+
+/*
+ * An index is an immutable snapshot of the spaces of one type, sorted by
+ * start address. Registering or deregistering a space builds a new index
+ * and publishes it in place of the old one. last is the space most
+ * recently found, tried first since consecutive ioreqs tend to hit the
+ * same device; it only ever points into the same index.
+ */
+typedef struct demu_space_index demu_space_index_t;
+
+struct demu_space_index {
+    demu_space_index_t *next;
+    demu_space_t *last;
+    unsigned int nr;
+    demu_space_t *space[];
+};
+
+/*
+ * Spaces of each type are kept on a list (in registration order, newest
+ * first) and in the current index. The list and the choice of index
+ * change under demu_registry.lock; lookups take no lock at all.
+ */
+typedef struct demu_space_set {
+    demu_space_t *head;
+    demu_space_index_t *index;
+
+    uint64_t lookups;
+    uint64_t last_hits;
+    uint64_t probes;
+} demu_space_set_t;
+
+/*
+ * Lookups, and the accesses through the spaces they return, are made
+ * between demu_space_read_begin() and demu_space_read_end(). A space or
+ * index that has been replaced is put on a retired list rather than
+ * freed, and the lists are only freed when no reader is active: a reader
+ * that starts after that can only find the current index.
+ *
+ * Each thread marks itself active in a reader slot of its own, claimed
+ * on its first read and given back when it exits, so the vCPU workers
+ * never write a shared cache line on the ioreq path. Threads that find
+ * every slot owned are counted in overflow instead.
+ */
+#define DEMU_REGISTRY_READERS   64
+
+typedef struct demu_registry_reader {
+    unsigned int owned;
+    unsigned int active;
+} __attribute__((aligned(64))) demu_registry_reader_t;
+
+static struct demu_registry {
+    pthread_mutex_t lock;
+    demu_registry_reader_t reader[DEMU_REGISTRY_READERS];
+    unsigned int overflow;
+    unsigned int retired;
+    demu_space_t *retired_space;
+    demu_space_index_t *retired_index;
+} demu_registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
 };
 
+/*
+ * An ioreq worker services the synchronous ioreqs of a group of vCPUs
+ * (vCPU i belongs to worker i % ioreq_threads) on its own thread, using
+ * its own event channel handle. Buffered ioreqs stay on the main loop.
+ */
+typedef struct demu_ioreq_worker {
+    unsigned int index;
+    xc_evtchn *xceh;
+    int cpu;
+    int stop_fd[2];
+    pthread_t thread;
+    int running;
+} demu_ioreq_worker_t;
+
 typedef struct demu {
     demu_seq_t seq;
     xc_interface *xch;
@@ -192,25 +298,51 @@ typedef struct demu {
     char config[MAXPATHLEN];
     char *suspend_file;
     ioservid_t ioservid;
-    timer_t timer_id;
+    int timer_fd;
+    event_loop_t *loop;
     uint8_t *vram;
     uint64_t vram_addr;
     unsigned long vram_dirty_map[(VRAM_ACTUAL_SIZE >> TARGET_PAGE_SHIFT) /
                                  (sizeof(unsigned long) * 8)];
+    unsigned long vram_track_map[(VRAM_ACTUAL_SIZE >> TARGET_PAGE_SHIFT) /
+                                 (sizeof(unsigned long) * 8)];
     shared_iopage_t *shared_iopage;
     buffered_iopage_t *buffered_iopage;
     evtchn_port_t bufioreq_local_port;
     evtchn_port_t *ioreq_local_port;
-    demu_space_t *memory;
-    demu_space_t *port;
-    demu_space_t *pci_config;
+    unsigned int ioreq_threads;
+    demu_ioreq_worker_t *ioreq_worker;
+    int *ioreq_cpu;
+    unsigned int ioreq_ncpus;
+    cpu_set_t ioreq_cpuset;
+    int ioreq_cpuset_valid;
+    cpu_set_t main_cpuset;
+    int main_cpuset_valid;
+    cpu_set_t plugin_cpuset;
+    int plugin_cpuset_valid;
+    demu_space_set_t memory;
+    demu_space_set_t port;
+    demu_space_set_t pci_config;
     int io_up;
     vmiop_handle_t presentation_handle;
     in_port_t sport;
     int sfd;
-    unsigned int scount;
+    uint64_t console_deadline;
     int console_active;
     int full_update;
+    unsigned int console_min_period;
+    unsigned int console_max_period;
+    unsigned int console_period;
+    uint64_t console_frames;
+    uint64_t console_skipped;
+    uint64_t console_published_frames;
+    uint64_t console_published_skipped;
+    uint64_t console_publish_deadline;
+    unsigned int bufioreq_spin_us;
+    uint64_t bufioreq_entries;
+    uint64_t bufioreq_runs;
+    uint64_t bufioreq_spin_hits;
+    int footprint;
 
     statefile_section_t statefile_sec;
     int statefile_mode;
@@ -220,9 +352,38 @@ typedef struct demu {
     int migrate_abort;
 
     struct emp_sock_inf *cs_inf;
+
+    uint64_t seq_last;
+    uint64_t seq_us[DEMU_NR_SEQS];
+    const char *seq_name[DEMU_NR_SEQS];
+
+    pthread_t vram_thread;
+    pthread_mutex_t vram_load_lock;
+    int vram_loading;
+    uint8_t *vram_loaded;
+    uint64_t vram_map_us;
+    uint64_t vram_zero_us;
 } demu_t;
 
-static demu_t demu_state;
+static demu_t demu_state = {
+    .vram_load_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int demu_vram_load_wait(void);
+static int demu_ioreq_workers_start(void);
+static void demu_ioreq_workers_stop(void);
+static int demu_compress_flush(void);
+static void demu_footprint_trim(void);
+
+/* Monotonic time in microseconds */
+static uint64_t demu_now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 #define P2ROUNDUP(_x, _a) -(-(_x) & -(_a))
 #define CONST_MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
@@ -263,9 +424,22 @@ const char xenstore_vram_str[] = "/vm-data/vram";
 const char xenstore_pid_str[] = "/vgpu-pid";
 const char xenstore_status_str[] = "/vgpu/state";
 const char xenstore_error_str[] = "/vgpu/error-code";
+const char xenstore_console_str[] = "/vgpu/console-frames";
+const char xenstore_migrate_stats_str[] = "/vgpu/migrate-stats";
+const char xenstore_migrate_converged_str[] = "/vgpu/migrate-converged";
+const char xenstore_startup_str[] = "/vgpu/startup-us";
+const char xenstore_placement_str[] = "/vgpu/placement";
+const char xenstore_memory_str[] = "/vgpu/memory";
 
 const size_t keysize = sizeof(xenstore_base_str) + sizeof("XXXXX") +
-                       CONST_MAX(sizeof(xenstore_vram_str), sizeof(xenstore_error_str));
+                       CONST_MAX(sizeof(xenstore_vram_str),
+                                 CONST_MAX(sizeof(xenstore_error_str),
+                                 CONST_MAX(sizeof(xenstore_console_str),
+                                 CONST_MAX(sizeof(xenstore_migrate_stats_str),
+                                 CONST_MAX(sizeof(xenstore_migrate_converged_str),
+                                 CONST_MAX(sizeof(xenstore_startup_str),
+                                 CONST_MAX(sizeof(xenstore_placement_str),
+                                   sizeof(xenstore_memory_str))))))));
 
 void gen_key(char *target, const char *key)
 {
@@ -305,57 +479,268 @@ static void __set_error(char errorcode[], enum dec_code dc)
     set_demu_status("error");
 }
 
-static int do_write(void *buffer, size_t count)
+#define MAX_REC_SIZE (1024 * 8)
+#define MAX_REC_DATA_SIZE (MAX_REC_SIZE - sizeof(struct record_header))
+
+#define DEMU_WRITE_DEPTH_DEFAULT    8
+#define DEMU_WRITE_DEPTH_MAX        64
+
+#define DEMU_COMPRESS_QUEUE         4
+
+#define DEMU_RECORD_POOL_MAX    (DEMU_WRITE_DEPTH_MAX + DEMU_COMPRESS_QUEUE + 2)
+
+/*
+ * The migration writer keeps up to 'depth' aio writes in flight and
+ * retires them in submission order. In file mode every write carries its
+ * own offset; in socket mode the requests all target one descriptor,
+ * which glibc services in the order they were queued, so the stream
+ * stays ordered.
+ *
+ * Records are built in place in a pool of MAX_REC_SIZE buffers, set up
+ * by demu_init_migrate() and released by demu_migrate_cleanup(). It is
+ * sized to cover the aio ring, the compression queue, the record the
+ * worker is compressing and the one being filled, so the pipeline does
+ * not have to stall on it, and comes from numa_alloc() so that it is on
+ * the GPU's node. Any buffer handed to do_write() that is not
+ * from the pool must come from malloc() and is freed once written.
+ */
+static struct demu_writer_s {
+    pthread_mutex_t lock;
+    unsigned int depth;
+    unsigned int head;
+    unsigned int inflight;
+    struct aiocb cb[DEMU_WRITE_DEPTH_MAX];
+    uint64_t wait_us;
+
+    uint8_t *pool;
+    unsigned int pool_size;
+    unsigned int nr_free;
+    void *free[DEMU_RECORD_POOL_MAX];
+    int pool_orphaned;
+} demu_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .depth = DEMU_WRITE_DEPTH_DEFAULT,
+};
+
+static void demu_writer_pool_destroy(void)
 {
-    int fd = demu_state.statefile_fd;
-    struct aiocb new_cb = {
-        .aio_fildes = fd,
-        .aio_buf = buffer,
-        .aio_nbytes = count,
-    };
-    static struct aiocb current_cb;
+    numa_free(demu_writer.pool, demu_writer.pool_size * MAX_REC_SIZE);
+    demu_writer.pool = NULL;
+    demu_writer.pool_size = 0;
+    demu_writer.nr_free = 0;
+    demu_writer.pool_orphaned = 0;
+}
+
+static int demu_writer_pool_create(void)
+{
+    unsigned int i;
+
+    demu_writer.pool_size = demu_writer.depth + DEMU_COMPRESS_QUEUE + 2;
+    demu_writer.pool = numa_alloc(demu_writer.pool_size * MAX_REC_SIZE);
+    if (!demu_writer.pool) {
+        demu_writer.pool_size = 0;
+        return -1;
+    }
+
+    for (i = 0; i < demu_writer.pool_size; i++)
+        demu_writer.free[i] = demu_writer.pool + i * MAX_REC_SIZE;
+
+    demu_writer.nr_free = demu_writer.pool_size;
+    demu_writer.pool_orphaned = 0;
+
+    return 0;
+}
+
+/* Called with the writer lock held */
+static void demu_writer_release(void *buffer)
+{
+    uint8_t *p = buffer;
+
+    if (demu_writer.pool &&
+        p >= demu_writer.pool &&
+        p < demu_writer.pool + demu_writer.pool_size * MAX_REC_SIZE) {
+        demu_writer.free[demu_writer.nr_free++] = p;
+
+        if (demu_writer.pool_orphaned &&
+            demu_writer.nr_free == demu_writer.pool_size)
+            demu_writer_pool_destroy();
+
+        return;
+    }
+
+    free(buffer);
+}
+
+/* Called with the writer lock held */
+static int demu_writer_retire(void)
+{
+    struct aiocb *cb = &demu_writer.cb[demu_writer.head];
+    const struct aiocb *cbs[1] = { cb };
+    size_t nbytes = cb->aio_nbytes;
+    uint64_t start = demu_now();
     ssize_t r;
 
-    if (current_cb.aio_fildes == fd) {
-        const struct aiocb *cbs[1] = { &current_cb };
+    r = aio_suspend(cbs, 1, NULL);
+    demu_writer.wait_us += demu_now() - start;
+    if (r < 0)
+        return r;
 
-        r = aio_suspend(cbs, 1, NULL);
-        if (r < 0)
-            return r;
+    r = aio_return(cb);
 
-        r = aio_return(&current_cb);
+    demu_writer_release((void *)cb->aio_buf);
+    memset(cb, 0, sizeof(*cb));
+
+    demu_writer.head = (demu_writer.head + 1) % demu_writer.depth;
+    demu_writer.inflight--;
+
+    if (r < 0)
+        return r;
+
+    if (r != nbytes)
+        return -1;
+
+    return 0;
+}
+
+/* Called with the writer lock held */
+static int demu_writer_drain(void)
+{
+    int r;
+
+    while (demu_writer.inflight != 0) {
+        r = demu_writer_retire();
         if (r < 0)
             return r;
+    }
 
-        if (r != current_cb.aio_nbytes) {
-            r = -1;
-            return r;
+    return 0;
+}
+
+static void demu_writer_abandon(void)
+{
+    vmiope_lock_acquire(&demu_writer.lock);
+
+    if (demu_writer.inflight != 0) {
+        (void) aio_cancel(demu_state.statefile_fd, NULL);
+
+        while (demu_writer.inflight != 0)
+            (void) demu_writer_retire();
+    }
+
+    /*
+     * If the migration thread still holds a record the pool is released
+     * when that record comes back.
+     */
+    if (demu_writer.pool) {
+        if (demu_writer.nr_free == demu_writer.pool_size)
+            demu_writer_pool_destroy();
+        else
+            demu_writer.pool_orphaned = 1;
+    }
+
+    pthread_mutex_unlock(&demu_writer.lock);
+}
+
+static void demu_writer_set_depth(unsigned int depth)
+{
+    if (depth == 0)
+        depth = DEMU_WRITE_DEPTH_DEFAULT;
+    if (depth > DEMU_WRITE_DEPTH_MAX)
+        depth = DEMU_WRITE_DEPTH_MAX;
+
+    vmiope_lock_acquire(&demu_writer.lock);
+    demu_writer.depth = depth;
+    pthread_mutex_unlock(&demu_writer.lock);
+}
+
+/*
+ * Take a MAX_REC_SIZE record buffer from the pool, retiring the oldest
+ * write if they are all in flight. Falls back to malloc() if there is no
+ * pool.
+ */
+struct demu_record *demu_record_get(void)
+{
+    void *buffer = NULL;
+
+    vmiope_lock_acquire(&demu_writer.lock);
+
+    if (demu_writer.pool && !demu_writer.pool_orphaned) {
+        while (demu_writer.nr_free == 0 && demu_writer.inflight != 0) {
+            if (demu_writer_retire() < 0)
+                goto done;
         }
 
-        free((void *)current_cb.aio_buf);
-        memset(&current_cb, 0, sizeof(current_cb));
+        if (demu_writer.nr_free != 0)
+            buffer = demu_writer.free[--demu_writer.nr_free];
     }
 
-    if (count == 0)
-        return 0;
+    if (!buffer)
+        buffer = malloc(MAX_REC_SIZE);
+
+done:
+    pthread_mutex_unlock(&demu_writer.lock);
+
+    return buffer;
+}
+
+static void demu_record_put(struct demu_record *record)
+{
+    vmiope_lock_acquire(&demu_writer.lock);
+    demu_writer_release(record);
+    pthread_mutex_unlock(&demu_writer.lock);
+}
+
+static int do_write(void *buffer, size_t count)
+{
+    struct aiocb *cb;
+    ssize_t r;
 
+    vmiope_lock_acquire(&demu_writer.lock);
+
+    if (count == 0) {
+        r = demu_writer_drain();
+        goto done;
+    }
+
+    if (demu_writer.inflight == demu_writer.depth) {
+        r = demu_writer_retire();
+        if (r < 0)
+            goto fail;
+    }
+
+    r = -1;
     if (demu_state.migrate_abort)
-        return -1;
+        goto fail;
+
+    cb = &demu_writer.cb[(demu_writer.head + demu_writer.inflight) %
+                         demu_writer.depth];
 
+    cb->aio_fildes = demu_state.statefile_fd;
+    cb->aio_buf = buffer;
+    cb->aio_nbytes = count;
     if (demu_state.statefile_offset >= 0)
-        new_cb.aio_offset = demu_state.statefile_offset;
+        cb->aio_offset = demu_state.statefile_offset;
 
-    current_cb = new_cb;
+    r = aio_write(cb);
+    if (r < 0) {
+        memset(cb, 0, sizeof(*cb));
+        goto fail;
+    }
 
-    r = aio_write(&current_cb);
-    if (r < 0)
-        return r;
+    demu_writer.inflight++;
 
     if (demu_state.statefile_offset >= 0)
-        demu_state.statefile_offset = current_cb.aio_offset +
-            current_cb.aio_nbytes;
+        demu_state.statefile_offset += count;
 
-    return 0;
+    goto done;
+
+fail:
+    demu_writer_release(buffer);
+
+done:
+    pthread_mutex_unlock(&demu_writer.lock);
+
+    return r;
 }
 
 static int do_read(int fd, void *buffer, size_t count)
@@ -389,12 +774,14 @@ static int write_header()
     void *header;
     char *buf;
 
-    header = calloc(1, size);
+    header = demu_record_get();
     buf = header;
 
     if (!header)
         return -1;
 
+    memset(buf, 0, size);
+
     memcpy(buf, &demu_ident, sizeof(demu_ident));
     buf += sizeof(demu_ident);
 
@@ -414,16 +801,22 @@ static int write_footer()
     struct demu_record *record;
     int r;
 
-    record = calloc(1, sizeof(*record));
+    record = demu_record_get();
     if (!record)
         return -1;
 
+    memset(record, 0, sizeof(*record));
+
     record->header = header;
 
     r = write_record(record);
     if (r)
         return r;
 
+    r = demu_compress_flush();
+    if (r)
+        return r;
+
     return do_write(NULL, 0); /* flush */
 }
 
@@ -480,17 +873,38 @@ static void closestate(void)
         ERR("state not ready to close");
 }
 
-#define MAX_REC_SIZE (1024 * 8)
-#define MAX_REC_DATA_SIZE (MAX_REC_SIZE - sizeof(struct record_header))
+static struct sent_stats_s {
+    uint64_t sent;
+    uint64_t remaining;
+    pthread_mutex_t lock;
+
+    uint64_t total_sent;
+    uint64_t times_sent;
+    uint64_t rtotal_sent;
+    uint64_t rtimes_sent;
+
+    /* record payload before and after compression */
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+} sent_stats;
 
 char padding[] = "Padding";
 
-int write_record(struct demu_record *rec)
+static int write_record_raw(struct demu_record *rec)
 {
     int byte;
     int i = 0;
     uint32_t padded =
         P2ROUNDUP(rec->header.length + sizeof(struct record_header), 8);
+    uint32_t raw = rec->header.length;
+
+    if (rec->header.type & DEMU_RECORD_COMPRESSED)
+        memcpy(&raw, rec->c_data, sizeof(raw));
+
+    vmiope_lock_acquire(&sent_stats.lock);
+    sent_stats.raw_bytes += raw;
+    sent_stats.wire_bytes += rec->header.length;
+    pthread_mutex_unlock(&sent_stats.lock);
 
     for (byte = rec->header.length;
          byte < padded - sizeof(struct record_header);
@@ -501,6 +915,198 @@ int write_record(struct demu_record *rec)
     return do_write(rec, padded);
 }
 
+#define DEMU_COMPRESS_MIN       512
+
+/*
+ * When compression is enabled every record goes through a single worker
+ * thread, so the stream keeps the order in which records were produced
+ * while LZ4 runs alongside the next vmiope_read_device_buffer(). Only
+ * vmiope records are compressed, and only when that makes them smaller.
+ * A compressed record has DEMU_RECORD_COMPRESSED set in its type and its
+ * payload starts with the uncompressed length.
+ */
+static struct demu_compress_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int level;
+    int running;
+    int stop;
+    int busy;
+    int error;
+    unsigned int head;
+    unsigned int count;
+    struct demu_record *queue[DEMU_COMPRESS_QUEUE];
+} demu_compress = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int demu_compress_record(struct demu_record *rec)
+{
+#ifdef DEMU_LZ4
+    struct demu_record *out;
+    uint32_t raw = rec->header.length;
+    int n;
+
+    if (rec->header.type != demu_state_vmiope || raw < DEMU_COMPRESS_MIN)
+        return write_record_raw(rec);
+
+    out = demu_record_get();
+    if (!out)
+        return write_record_raw(rec);
+
+    n = LZ4_compress_fast((const char *)rec->c_data,
+                          (char *)out->c_data + sizeof(raw), raw,
+                          MAX_REC_DATA_SIZE - sizeof(raw),
+                          demu_compress.level);
+    if (n <= 0 || n + sizeof(raw) >= raw) {
+        demu_record_put(out);
+        return write_record_raw(rec);
+    }
+
+    out->header = rec->header;
+    out->header.type |= DEMU_RECORD_COMPRESSED;
+    out->header.length = n + sizeof(raw);
+    memcpy(out->c_data, &raw, sizeof(raw));
+
+    demu_record_put(rec);
+    return write_record_raw(out);
+#else
+    return write_record_raw(rec);
+#endif
+}
+
+static void *demu_compress_thread(void *arg)
+{
+    struct demu_record *rec;
+    int r;
+
+    vmiope_lock_acquire(&demu_compress.lock);
+
+    for (;;) {
+        while (demu_compress.count == 0 && !demu_compress.stop)
+            pthread_cond_wait(&demu_compress.cond, &demu_compress.lock);
+
+        if (demu_compress.count == 0)
+            break;
+
+        rec = demu_compress.queue[demu_compress.head];
+        demu_compress.head = (demu_compress.head + 1) % DEMU_COMPRESS_QUEUE;
+        demu_compress.count--;
+        demu_compress.busy = 1;
+        pthread_mutex_unlock(&demu_compress.lock);
+
+        r = demu_compress_record(rec);
+
+        vmiope_lock_acquire(&demu_compress.lock);
+        demu_compress.busy = 0;
+        if (r < 0 && !demu_compress.error)
+            demu_compress.error = errno ? errno : EIO;
+        pthread_cond_broadcast(&demu_compress.cond);
+    }
+
+    pthread_mutex_unlock(&demu_compress.lock);
+
+    return NULL;
+}
+
+static void demu_compress_start(void)
+{
+    if (demu_compress.level == 0)
+        return;
+
+    demu_compress.head = 0;
+    demu_compress.count = 0;
+    demu_compress.busy = 0;
+    demu_compress.error = 0;
+    demu_compress.stop = 0;
+
+    if (pthread_create(&demu_compress.thread, NULL, demu_compress_thread,
+                       NULL)) {
+        ERRN("pthread_create");
+        ERR("sending uncompressed records");
+        return;
+    }
+
+    vmiope_lock_acquire(&demu_compress.lock);
+    demu_compress.running = 1;
+    pthread_mutex_unlock(&demu_compress.lock);
+
+    INFO("Compressing vmiope records (LZ4 acceleration %d)",
+         demu_compress.level);
+}
+
+static void demu_compress_stop(void)
+{
+    vmiope_lock_acquire(&demu_compress.lock);
+    if (!demu_compress.running) {
+        pthread_mutex_unlock(&demu_compress.lock);
+        return;
+    }
+
+    demu_compress.running = 0;
+    demu_compress.stop = 1;
+    pthread_cond_broadcast(&demu_compress.cond);
+    pthread_mutex_unlock(&demu_compress.lock);
+
+    pthread_join(demu_compress.thread, NULL);
+}
+
+/* Wait for the worker to write out everything queued so far */
+static int demu_compress_flush(void)
+{
+    int r = 0;
+
+    vmiope_lock_acquire(&demu_compress.lock);
+
+    while (demu_compress.count != 0 || demu_compress.busy)
+        pthread_cond_wait(&demu_compress.cond, &demu_compress.lock);
+
+    if (demu_compress.error) {
+        errno = demu_compress.error;
+        r = -1;
+    }
+
+    pthread_mutex_unlock(&demu_compress.lock);
+
+    return r;
+}
+
+int write_record(struct demu_record *rec)
+{
+    int r = 0;
+
+    vmiope_lock_acquire(&demu_compress.lock);
+
+    if (!demu_compress.running) {
+        pthread_mutex_unlock(&demu_compress.lock);
+        return write_record_raw(rec);
+    }
+
+    while (demu_compress.count == DEMU_COMPRESS_QUEUE &&
+           !demu_compress.error)
+        pthread_cond_wait(&demu_compress.cond, &demu_compress.lock);
+
+    if (demu_compress.error) {
+        errno = demu_compress.error;
+        r = -1;
+        pthread_mutex_unlock(&demu_compress.lock);
+
+        demu_record_put(rec);
+        return r;
+    }
+
+    demu_compress.queue[(demu_compress.head + demu_compress.count) %
+                        DEMU_COMPRESS_QUEUE] = rec;
+    demu_compress.count++;
+    pthread_cond_broadcast(&demu_compress.cond);
+
+    pthread_mutex_unlock(&demu_compress.lock);
+
+    return r;
+}
+
 static int demu_state_dirty = 1;
 
 static int demu_checksend_demustate()
@@ -515,12 +1121,14 @@ static int demu_checksend_demustate()
     if (!demu_state_dirty)
         return 0;
 
-    record = calloc(1, sizeof(*record));
+    record = demu_record_get();
     if (!record) {
         demu_state_dirty = 0;
         return -1;
     }
 
+    memset(record, 0, sizeof(*record));
+
     record->header = header;
 
     r = write_record(record);
@@ -544,22 +1152,11 @@ static int demu_read_demustate(struct demu_record *rec)
     return 0;
 }
 
-static struct sent_stats_s {
-    uint64_t sent;
-    uint64_t remaining;
-    pthread_mutex_t lock;
+int get_sent_stats(uint64_t * sent, uint64_t * remaining, int reset)
+{
+    int r;
 
-    uint64_t total_sent;
-    uint64_t times_sent;
-    uint64_t rtotal_sent;
-    uint64_t rtimes_sent;
-} sent_stats;
-
-int get_sent_stats(uint64_t * sent, uint64_t * remaining, int reset)
-{
-    int r;
-
-    r = pthread_mutex_lock(&sent_stats.lock);
+    r = vmiope_lock_acquire(&sent_stats.lock);
     if (r)
         return r;
 
@@ -576,6 +1173,141 @@ int get_sent_stats(uint64_t * sent, uint64_t * remaining, int reset)
     return 0;
 }
 
+#define DEMU_MIGRATE_PASS_PERIOD    1000000
+#define DEMU_MIGRATE_DOWNTIME       300000
+#define DEMU_MIGRATE_STALL_PASSES   3
+
+/*
+ * The plugin does its own pre-copy, so a "pass" here is a sampling
+ * interval of the vmiope stream. It ends after migratePassPeriod
+ * microseconds, or when the plugin reports that the phase is done.
+ * The stream has converged once the remaining bytes could be sent
+ * within migrateDowntime, or once they stop shrinking for a few passes.
+ */
+static struct demu_migrate_stats_s {
+    unsigned int period_us;
+    unsigned int downtime_us;
+    unsigned int pass;
+    uint64_t start_us;
+    uint64_t bytes;
+    uint64_t wait_us;
+    uint64_t remaining;
+    unsigned int stalled;
+    int converged;
+} demu_migrate_stats = {
+    .period_us = DEMU_MIGRATE_PASS_PERIOD,
+    .downtime_us = DEMU_MIGRATE_DOWNTIME,
+};
+
+static void demu_migrate_stats_write(const char *str, const char *value)
+{
+    char key[keysize];
+
+    gen_key(key, str);
+
+    if (!xs_write(demu_state.xsh, 0, key, value, strlen(value)))
+        ERRN("xs_write");
+}
+
+static void demu_migrate_stats_reset(void)
+{
+    vmiope_lock_acquire(&demu_writer.lock);
+    demu_migrate_stats.wait_us = demu_writer.wait_us;
+    pthread_mutex_unlock(&demu_writer.lock);
+
+    demu_migrate_stats.pass = 0;
+    demu_migrate_stats.start_us = demu_now();
+    demu_migrate_stats.bytes = 0;
+    demu_migrate_stats.remaining = UINT64_MAX;
+    demu_migrate_stats.stalled = 0;
+    demu_migrate_stats.converged = 0;
+
+    demu_migrate_stats_write(xenstore_migrate_converged_str, "0");
+}
+
+static void demu_migrate_stats_pass(uint64_t remaining, uint64_t total)
+{
+    uint64_t now = demu_now();
+    uint64_t wall = now - demu_migrate_stats.start_us;
+    uint64_t rate = 0;
+    uint64_t downtime = UINT64_MAX;
+    uint64_t wait;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+    int64_t trend = 0;
+    char value[21 * 7 + 1];
+
+    vmiope_lock_acquire(&demu_writer.lock);
+    wait = demu_writer.wait_us - demu_migrate_stats.wait_us;
+    demu_migrate_stats.wait_us = demu_writer.wait_us;
+    pthread_mutex_unlock(&demu_writer.lock);
+
+    if (wall != 0)
+        rate = (demu_migrate_stats.bytes * 1000000) / wall;
+    if (rate != 0)
+        downtime = (remaining * 1000000) / rate;
+    if (demu_migrate_stats.remaining != UINT64_MAX)
+        trend = (int64_t)(remaining - demu_migrate_stats.remaining);
+
+    demu_migrate_stats.pass++;
+
+    INFO("Migrate pass %u: %" PRIu64 " bytes in %" PRIu64 "us (%" PRIu64
+         " KiB/s), remaining %" PRIu64 " (%+" PRId64 "), "
+         "est. downtime %" PRIu64 "us, aio wait %" PRIu64 "us",
+         demu_migrate_stats.pass, demu_migrate_stats.bytes, wall,
+         rate / 1024, remaining, trend, downtime, wait);
+
+    (void) snprintf(value, sizeof(value),
+                    "%u %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                    " %" PRIu64 " %" PRIu64, demu_migrate_stats.pass,
+                    demu_migrate_stats.bytes, wall, rate, remaining,
+                    downtime, wait);
+    demu_migrate_stats_write(xenstore_migrate_stats_str, value);
+
+    if (demu_migrate_stats.remaining != UINT64_MAX &&
+        remaining >= demu_migrate_stats.remaining)
+        demu_migrate_stats.stalled++;
+    else
+        demu_migrate_stats.stalled = 0;
+
+    if (!demu_migrate_stats.converged &&
+        (downtime <= demu_migrate_stats.downtime_us ||
+         demu_migrate_stats.stalled >= DEMU_MIGRATE_STALL_PASSES)) {
+        demu_migrate_stats.converged = 1;
+
+        INFO("Migration converged after pass %u (%s)",
+             demu_migrate_stats.pass,
+             (downtime <= demu_migrate_stats.downtime_us) ?
+             "downtime target" : "remaining stalled");
+
+        (void) snprintf(value, sizeof(value), "%u",
+                        demu_migrate_stats.pass);
+        demu_migrate_stats_write(xenstore_migrate_converged_str, value);
+    }
+
+    vmiope_lock_acquire(&sent_stats.lock);
+    raw_bytes = sent_stats.raw_bytes;
+    wire_bytes = sent_stats.wire_bytes;
+    pthread_mutex_unlock(&sent_stats.lock);
+
+    send_migrate_progress(total, remaining, raw_bytes, wire_bytes);
+
+    demu_migrate_stats.start_us = now;
+    demu_migrate_stats.bytes = 0;
+    demu_migrate_stats.remaining = remaining;
+}
+
+static void demu_migrate_stats_account(uint64_t written, uint64_t remaining,
+                                       uint64_t total)
+{
+    demu_migrate_stats.bytes += written;
+
+    if (written == 0 ||
+        demu_now() - demu_migrate_stats.start_us >=
+        demu_migrate_stats.period_us)
+        demu_migrate_stats_pass(remaining, total);
+}
+
 static int do_vmiop_dump(void)
 {
     vmiop_error_t v_r;
@@ -586,13 +1318,15 @@ static int do_vmiop_dump(void)
     struct demu_record *record;
     uint64_t bytes_remaining;
     uint64_t bytes_written;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
 
     if (demu_state.migrate_abort) {
         ERR("Abort");
         return -1;
     }
 
-    record = malloc(MAX_REC_SIZE);
+    record = demu_record_get();
     if (!record) {
             ERR("Failed to allocate record buffer");
             return -1;
@@ -608,12 +1342,12 @@ static int do_vmiop_dump(void)
 
     if (v_r) {
         ERR("vmiope_read_device_buffer returned error %d", v_r);
-        free(record);
+        demu_record_put(record);
         errno = EINVAL;
         return -1;
     }
 
-    pthread_mutex_lock(&sent_stats.lock);
+    vmiope_lock_acquire(&sent_stats.lock);
     sent_stats.sent += bytes_written;
     sent_stats.remaining = bytes_remaining;
     pthread_mutex_unlock(&sent_stats.lock);
@@ -622,12 +1356,22 @@ static int do_vmiop_dump(void)
     sent_stats.rtotal_sent += bytes_written;
     sent_stats.rtimes_sent++;
 
+    demu_migrate_stats_account(bytes_written, bytes_remaining,
+                               sent_stats.total_sent +
+                               sent_stats.rtotal_sent);
+
     if ((sent_stats.rtotal_sent >= 50000000)
             || (sent_stats.rtimes_sent >= 10000)) {
         sent_stats.total_sent += sent_stats.rtotal_sent;
         sent_stats.times_sent += sent_stats.rtimes_sent;
 
-        send_migrate_progress(sent_stats.total_sent, bytes_remaining);
+        vmiope_lock_acquire(&sent_stats.lock);
+        raw_bytes = sent_stats.raw_bytes;
+        wire_bytes = sent_stats.wire_bytes;
+        pthread_mutex_unlock(&sent_stats.lock);
+
+        send_migrate_progress(sent_stats.total_sent, bytes_remaining,
+                              raw_bytes, wire_bytes);
 
         INFO("Bytes written %" PRIu64 " (+%" PRIu64 ") over %" PRIu64
              " (+%" PRIu64 ") writes", sent_stats.total_sent,
@@ -643,7 +1387,7 @@ static int do_vmiop_dump(void)
         return r ? -1 : 1;
     }
 
-    free(record);
+    demu_record_put(record);
 
     /* Finished, now show some stats */
     INFO("Bytes written %" PRIu64 " over %" PRIu64 " writes",
@@ -651,6 +1395,11 @@ static int do_vmiop_dump(void)
          sent_stats.times_sent + sent_stats.rtimes_sent);
     INFO("Bytes written %d.  All done for this phase.", bytes_written);
 
+    vmiope_lock_acquire(&sent_stats.lock);
+    INFO("Record bytes %" PRIu64 " raw, %" PRIu64 " on the wire",
+         sent_stats.raw_bytes, sent_stats.wire_bytes);
+    pthread_mutex_unlock(&sent_stats.lock);
+
     sent_stats.rtimes_sent = 0;
     sent_stats.rtotal_sent = 0;
 
@@ -709,6 +1458,9 @@ int demu_start_migrate(void)
 
     demu_state.migrate_abort = 0;
 
+    demu_compress_start();
+    demu_migrate_stats_reset();
+
     INFO("About to migrate fd = %d (%s)", fd,
          (demu_state.statefile_offset >= 0) ? "file" : "socket");
 
@@ -723,9 +1475,12 @@ int demu_start_migrate(void)
 
 void demu_migrate_cleanup(void)
 {
+    demu_compress_stop();
+    demu_writer_abandon();
     closestate();
 
     demu_state.migrate_abort = 0;
+    demu_footprint_trim();
 
     INFO("Migration all cleaned up.");
 }
@@ -756,6 +1511,7 @@ int demu_finish_migrate(void)
 
 int demu_migrate(void)
 {
+    uint64_t start;
     int r;
 
     if (demu_state.statefile_mode != SEC_W_OPENED) {
@@ -763,6 +1519,8 @@ int demu_migrate(void)
         return -1;
     }
 
+    (void) demu_flush_guest_dirty_pages();
+
     if ((r = demu_checksend_demustate()) < 0) {
         ERR("Failed to write demustate. %s",
             (r == -1) ? strerror(errno) : "");
@@ -775,7 +1533,11 @@ int demu_migrate(void)
         return r;
     }
 
-    if ((r = do_vmiop_dump()) < 0) {
+    start = trace_begin(TRACE_VMIOP_DUMP);
+    r = do_vmiop_dump();
+    trace_end(TRACE_VMIOP_DUMP, start);
+
+    if (r < 0) {
         ERR("Failed to write vmiop state. %s",
             (r == -1) ? strerror(errno) : "");
         return r;
@@ -792,9 +1554,11 @@ int demu_init_migrate(int fd)
     }
 
     /* initialise stats */
-    pthread_mutex_lock(&sent_stats.lock);
+    vmiope_lock_acquire(&sent_stats.lock);
     sent_stats.sent = 0;
     sent_stats.remaining = UINT64_MAX;
+    sent_stats.raw_bytes = 0;
+    sent_stats.wire_bytes = 0;
     pthread_mutex_unlock(&sent_stats.lock);
 
     sent_stats.rtotal_sent = 0;
@@ -803,6 +1567,11 @@ int demu_init_migrate(int fd)
     sent_stats.total_sent = 0;
     sent_stats.times_sent = 0;
 
+    vmiope_lock_acquire(&demu_writer.lock);
+    if (!demu_writer.pool && demu_writer_pool_create() < 0)
+        ERR("Failed to allocate record pool, falling back to malloc");
+    pthread_mutex_unlock(&demu_writer.lock);
+
     demu_state.statefile_fd = fd;
     demu_state.statefile_mode = SEC_CLOSED;
     /*demu_state.statefile_sec = statefile_top; */
@@ -868,8 +1637,44 @@ int process_record(struct demu_record *rec)
     return ((r > 0) ? 0 : r);
 }
 
+static int demu_decompress_record(struct demu_record *rec, const void *data)
+{
+#ifdef DEMU_LZ4
+    uint32_t raw;
+    int n;
+
+    rec->header.type &= ~DEMU_RECORD_COMPRESSED;
+
+    if (rec->header.length < sizeof(raw)) {
+        ERR("compressed record too short");
+        return -1;
+    }
+
+    memcpy(&raw, data, sizeof(raw));
+    if (raw > MAX_REC_DATA_SIZE) {
+        ERR("compressed record expands too far (%u)", raw);
+        return -1;
+    }
+
+    n = LZ4_decompress_safe((const char *)data + sizeof(raw),
+                            (char *)rec->c_data,
+                            rec->header.length - sizeof(raw), raw);
+    if (n != raw) {
+        ERR("failed to decompress record (%d/%u)", n, raw);
+        return -1;
+    }
+
+    rec->header.length = raw;
+    return 0;
+#else
+    ERR("compressed record, but built without LZ4 support");
+    return -1;
+#endif
+}
+
 int read_record(int fd, struct demu_record *rec)
 {
+    static uint8_t compressed[MAX_REC_SIZE];
     uint32_t padded;
     int r;
 
@@ -888,6 +1693,14 @@ int read_record(int fd, struct demu_record *rec)
 
     padded -= sizeof(rec->header);
 
+    if (rec->header.type & DEMU_RECORD_COMPRESSED) {
+        r = do_read(fd, compressed, padded);
+        if (r)
+            return -1;
+
+        return demu_decompress_record(rec, compressed);
+    }
+
     r = do_read(fd, &rec->c_data, padded);
     if (r)
         return -1;
@@ -895,41 +1708,168 @@ int read_record(int fd, struct demu_record *rec)
     return 0;
 }
 
-static int readstate(int fd)
+#define DEMU_RESTORE_RING   16
+
+/*
+ * During restore a reader thread fills a ring of record buffers ahead of
+ * process_record(), so stream latency overlaps with the plugin applying
+ * the previous records.
+ */
+static struct demu_restore_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    uint8_t *ring;
+    unsigned int head;
+    unsigned int count;
+    int eof;
+    int stop;
+
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t read_us;   /* reader in read_record() */
+    uint64_t stall_us;  /* reader waiting for a free buffer */
+    uint64_t wait_us;   /* consumer waiting for a record */
+    uint64_t apply_us;  /* consumer in process_record() */
+} demu_restore = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+#define RESTORE_SLOT(_i) \
+    ((struct demu_record *)(demu_restore.ring + \
+                            ((_i) % DEMU_RESTORE_RING) * MAX_REC_SIZE))
+
+static void *demu_restore_thread(void *arg)
 {
     struct demu_record *rec;
+    uint64_t start;
     int r;
-    int done = 0;
 
-    void *buffer = malloc(MAX_REC_SIZE);
-    rec = buffer;
+    vmiope_lock_acquire(&demu_restore.lock);
+
+    for (;;) {
+        start = demu_now();
+        while (demu_restore.count == DEMU_RESTORE_RING && !demu_restore.stop)
+            pthread_cond_wait(&demu_restore.cond, &demu_restore.lock);
+        demu_restore.stall_us += demu_now() - start;
+
+        if (demu_restore.stop)
+            break;
+
+        rec = RESTORE_SLOT(demu_restore.head + demu_restore.count);
+        pthread_mutex_unlock(&demu_restore.lock);
+
+        start = demu_now();
+        r = read_record(demu_restore.fd, rec);
+
+        vmiope_lock_acquire(&demu_restore.lock);
+        demu_restore.read_us += demu_now() - start;
+
+        if (r)
+            break;
+
+        demu_restore.count++;
+        demu_restore.records++;
+        demu_restore.bytes += sizeof(rec->header) + rec->header.length;
+        pthread_cond_broadcast(&demu_restore.cond);
+
+        if (rec->header.type == demu_state_close)
+            break;
+    }
+
+    demu_restore.eof = 1;
+    pthread_cond_broadcast(&demu_restore.cond);
+    pthread_mutex_unlock(&demu_restore.lock);
+
+    return NULL;
+}
+
+static int readstate(int fd)
+{
+    struct demu_record *rec;
+    pthread_t thread;
+    uint64_t start;
+    int done = 0;
 
-    if (buffer == NULL) {
+    demu_restore.ring = numa_alloc(DEMU_RESTORE_RING * MAX_REC_SIZE);
+    if (demu_restore.ring == NULL) {
         ERR("No memory!");
         return -1;
     }
 
+    demu_restore.fd = fd;
+    demu_restore.head = 0;
+    demu_restore.count = 0;
+    demu_restore.eof = 0;
+    demu_restore.stop = 0;
+
+    if (pthread_create(&thread, NULL, demu_restore_thread, NULL)) {
+        ERRN("pthread_create");
+        numa_free(demu_restore.ring, DEMU_RESTORE_RING * MAX_REC_SIZE);
+        demu_restore.ring = NULL;
+        return -1;
+    }
+
     do {
-        r = read_record(fd, rec);
-        if (r)
+        vmiope_lock_acquire(&demu_restore.lock);
+
+        start = demu_now();
+        while (demu_restore.count == 0 && !demu_restore.eof)
+            pthread_cond_wait(&demu_restore.cond, &demu_restore.lock);
+        demu_restore.wait_us += demu_now() - start;
+
+        if (demu_restore.count == 0) {
+            pthread_mutex_unlock(&demu_restore.lock);
             done = -1;
-        else
-            done = process_record(rec);
+            break;
+        }
+
+        rec = RESTORE_SLOT(demu_restore.head);
+        pthread_mutex_unlock(&demu_restore.lock);
+
+        start = demu_now();
+        done = process_record(rec);
+
+        vmiope_lock_acquire(&demu_restore.lock);
+        demu_restore.apply_us += demu_now() - start;
+        demu_restore.head = (demu_restore.head + 1) % DEMU_RESTORE_RING;
+        demu_restore.count--;
+        pthread_cond_broadcast(&demu_restore.cond);
+        pthread_mutex_unlock(&demu_restore.lock);
     } while (done == 0);
 
+    vmiope_lock_acquire(&demu_restore.lock);
+    demu_restore.stop = 1;
+    pthread_cond_broadcast(&demu_restore.cond);
+    pthread_mutex_unlock(&demu_restore.lock);
+
+    /* The reader may still be blocked on the stream if we bailed early */
+    if (done < 0)
+        (void) shutdown(fd, SHUT_RD);
+
+    pthread_join(thread, NULL);
+
     INFO("Reading state finished on %s",
          (done == 1) ? "Success" : "Failure");
 
-    free(buffer);
+    numa_free(demu_restore.ring, DEMU_RESTORE_RING * MAX_REC_SIZE);
+    demu_restore.ring = NULL;
+
     return ((done > 0) ? 0 : done);
 }
 
+/*
+ * Called from the restore command. The wakeup makes sure the wait below
+ * sees the new state even if the command was not dispatched from it.
+ */
 int demu_trigger_resume(void)
 {
     if (demu_resuming != set_to_resume)
         return -1;
 
     demu_resuming = resume_when_ready;
+    event_loop_wakeup(demu_state.loop);
     return 0;
 }
 
@@ -938,24 +1878,11 @@ static int listen_and_wait_to_resume(void)
     int rc;
 
     while (demu_resuming < resume_when_ready) {
-        fd_set rfds;
-        fd_set wfds;
-        fd_set xfds;
-        int nfds;
-
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&xfds);
-
-        nfds = emp_select_fdset(demu_state.cs_inf, &rfds, NULL);
-        nfds++;
-        rc = select(nfds, &rfds, &wfds, &xfds, NULL);
-
-        if (rc < 0 && errno != EINTR)
+        rc = event_loop_wait(demu_state.loop, -1);
+        if (rc < 0)
             break;
 
-        if (rc > 0)
-            rc = emp_select_fdread(demu_state.cs_inf, &rfds, rc);
+        event_loop_dispatch(demu_state.loop, rc);
     }
     return ((demu_resuming == resume_when_ready) ? 0 : -1);
 }
@@ -964,6 +1891,7 @@ int demu_get_state()
 {
     int fd = -1;
     int r = -1;
+    uint64_t start = 0;
 
     INFO("Waiting for start prompt");
 
@@ -982,8 +1910,16 @@ int demu_get_state()
     if (demu_read_header(fd))
         goto error;
 
+    start = demu_now();
     r = readstate(fd);
 
+    INFO("Restored %" PRIu64 " records (%" PRIu64 " bytes) in %" PRIu64
+         "us: read %" PRIu64 "us (stalled %" PRIu64 "us), "
+         "read wait %" PRIu64 "us, apply %" PRIu64 "us",
+         demu_restore.records, demu_restore.bytes, demu_now() - start,
+         demu_restore.read_us, demu_restore.stall_us,
+         demu_restore.wait_us, demu_restore.apply_us);
+
 error:
     closestate();
     report_resume_done((r) ? migration_failed : migration_success);
@@ -1001,11 +1937,16 @@ void *demu_map_guest_pages(xen_pfn_t pfn[], int count, int read_only,
     void *ptr;
 
     if (populate) {
+        unsigned int mem_flags = 0;
         int rc;
 
+        /* Guest memory demu populates is for the GPU's use */
+        if (numa_xen_node() >= 0)
+            mem_flags = XENMEMF_node(numa_xen_node());
+
         rc = xc_domain_populate_physmap_exact(demu_state.xch,
                                               demu_state.domid, count, 0,
-                                              0, pfn);
+                                              mem_flags, pfn);
         if (rc < 0) {
             ERRN("xc_domain_populate_physmap_exact");
             return NULL;
@@ -1050,57 +1991,223 @@ void *demu_map_guest_range(uint64_t addr, uint64_t size, int read_only,
     return ptr;
 }
 
+#define DEMU_RELOCATE_BATCH 256
+
 int demu_relocate_guest_range(uint64_t old, uint64_t new, uint64_t size)
 {
-    int i, n;
+    xen_ulong_t idx[DEMU_RELOCATE_BATCH];
+    xen_pfn_t pfn[DEMU_RELOCATE_BATCH];
+    int err[DEMU_RELOCATE_BATCH];
+    static int batch = 1;
+    int i, j, n, count;
     int rc;
 
     size = P2ROUNDUP(size, TARGET_PAGE_SIZE);
 
     n = size >> TARGET_PAGE_SHIFT;
 
-    for (i = 0; i < n; i++) {
-        unsigned long idx = (old >> TARGET_PAGE_SHIFT) + i;
-        xen_pfn_t pfn = (new >> TARGET_PAGE_SHIFT) + i;
+    for (i = 0; i < n; i += count) {
+        count = n - i;
+        if (count > DEMU_RELOCATE_BATCH)
+            count = DEMU_RELOCATE_BATCH;
 
-        rc = xc_domain_add_to_physmap(demu_state.xch, demu_state.domid,
-                                      XENMAPSPACE_gmfn, idx, pfn);
-        if (rc < 0)
-            goto fail1;
+        for (j = 0; j < count; j++) {
+            idx[j] = (old >> TARGET_PAGE_SHIFT) + i + j;
+            pfn[j] = (new >> TARGET_PAGE_SHIFT) + i + j;
+        }
+
+        if (batch) {
+            rc = xc_domain_add_to_physmap_batch(demu_state.xch,
+                                                demu_state.domid,
+                                                demu_state.domid,
+                                                XENMAPSPACE_gmfn, count,
+                                                idx, pfn, err);
+            if (rc < 0 && (errno == ENOSYS || errno == EOPNOTSUPP)) {
+                INFO("no batched physmap, relocating page by page");
+                batch = 0;
+            } else if (rc < 0) {
+                goto fail1;
+            } else {
+                for (j = 0; j < count; j++) {
+                    if (err[j] != 0) {
+                        errno = -err[j];
+                        goto fail2;
+                    }
+                }
+                continue;
+            }
+        }
 
+        for (j = 0; j < count; j++) {
+            rc = xc_domain_add_to_physmap(demu_state.xch, demu_state.domid,
+                                          XENMAPSPACE_gmfn, idx[j], pfn[j]);
+            if (rc < 0)
+                goto fail1;
+        }
     }
 
     return 0;
 
+fail2:
+    ERR("fail2");
+
 fail1:
     ERR("fail1: %s", strerror(errno));
 
     return -1;
 }
 
-void demu_set_guest_dirty_page(xen_pfn_t pfn)
+/*
+ * Pages dirtied by emulation are accumulated as ranges, merging each new
+ * range into the last one where they touch, and are only reported to Xen
+ * by demu_flush_guest_dirty_pages(). That happens before an ioreq is
+ * completed, at the end of each buffered ioreq batch, before each
+ * migration pass and before returning from demu_set_guest_dirty_pages(),
+ * so pages are always reported before anything can depend on it.
+ */
+#define DIRTY_ACC_SIZE  64
+
+static struct dirty_acc_s {
+    pthread_mutex_t lock;
+    unsigned int nr;
+    struct pages range[DIRTY_ACC_SIZE];
+} dirty_acc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int dirty_range_cmp(const void *a, const void *b)
+{
+    const struct pages *ra = a;
+    const struct pages *rb = b;
+
+    if (ra->first_gfn < rb->first_gfn)
+        return -1;
+    return (ra->first_gfn > rb->first_gfn) ? 1 : 0;
+}
+
+static int __demu_flush_guest_dirty_pages(void)
+{
+    struct pages *range = dirty_acc.range;
+    unsigned int i, n;
+    int rc = 0;
+
+    if (dirty_acc.nr == 0)
+        return 0;
+
+    qsort(range, dirty_acc.nr, sizeof(*range), dirty_range_cmp);
+
+    for (i = 1, n = 0; i < dirty_acc.nr; i++) {
+        uint64_t end = range[n].first_gfn + range[n].count;
+
+        if (range[i].first_gfn <= end) {
+            if (range[i].first_gfn + range[i].count > end)
+                range[n].count = range[i].first_gfn + range[i].count -
+                    range[n].first_gfn;
+        } else {
+            range[++n] = range[i];
+        }
+    }
+
+    for (i = 0; i <= n; i++) {
+        int r;
+
+        r = xc_hvm_modified_memory(demu_state.xch, demu_state.domid,
+                                   range[i].first_gfn, range[i].count);
+        if (r < 0) {
+            ERR("xc_hvm_modified_memory returned %d", r);
+            rc = r;
+        }
+    }
+
+    dirty_acc.nr = 0;
+    return rc;
+}
+
+static int __demu_add_guest_dirty_pages(xen_pfn_t first, uint64_t count)
+{
+    int rc = 0;
+
+    if (dirty_acc.nr != 0) {
+        struct pages *last = &dirty_acc.range[dirty_acc.nr - 1];
+        uint64_t end = last->first_gfn + last->count;
+
+        if (first <= end && first + count >= last->first_gfn) {
+            if (first + count > end)
+                end = first + count;
+            if (first < last->first_gfn)
+                last->first_gfn = first;
+
+            last->count = end - last->first_gfn;
+            return 0;
+        }
+    }
+
+    if (dirty_acc.nr == DIRTY_ACC_SIZE)
+        rc = __demu_flush_guest_dirty_pages();
+
+    dirty_acc.range[dirty_acc.nr].first_gfn = first;
+    dirty_acc.range[dirty_acc.nr].count = count;
+    dirty_acc.nr++;
+
+    return rc;
+}
+
+int demu_flush_guest_dirty_pages(void)
 {
     int rc;
 
-    rc = xc_hvm_modified_memory(demu_state.xch, demu_state.domid, pfn, 1);
-    if (rc < 0)
-        ERR("xc_hvm_modified_memory returned %d", rc);
+    vmiope_lock_acquire(&dirty_acc.lock);
+    rc = __demu_flush_guest_dirty_pages();
+    pthread_mutex_unlock(&dirty_acc.lock);
+
+    return rc;
+}
+
+void demu_set_guest_dirty_page(xen_pfn_t pfn)
+{
+    vmiope_lock_acquire(&dirty_acc.lock);
+    (void) __demu_add_guest_dirty_pages(pfn, 1);
+    pthread_mutex_unlock(&dirty_acc.lock);
+}
+
+void demu_set_guest_dirty_range(uint64_t addr, uint64_t size)
+{
+    xen_pfn_t first, last;
+
+    if (size == 0)
+        return;
+
+    first = addr >> TARGET_PAGE_SHIFT;
+    last = (addr + size - 1) >> TARGET_PAGE_SHIFT;
+
+    vmiope_lock_acquire(&dirty_acc.lock);
+    (void) __demu_add_guest_dirty_pages(first, last - first + 1);
+    pthread_mutex_unlock(&dirty_acc.lock);
 }
 
 int
 demu_set_guest_dirty_pages(uint64_t count, const struct pages *page_list)
 {
     uint64_t i;
-    int r;
+    int r = 0;
+
+    vmiope_lock_acquire(&dirty_acc.lock);
 
     for (i = 0; i < count; i++) {
-        r = xc_hvm_modified_memory(demu_state.xch, demu_state.domid,
-                                   page_list[i].first_gfn,
-                                   page_list[i].count);
-        if (r < 0)
-            return r;
+        if (page_list[i].count == 0)
+            continue;
+
+        if (__demu_add_guest_dirty_pages(page_list[i].first_gfn,
+                                         page_list[i].count) < 0)
+            r = -1;
     }
-    return 0;
+
+    if (__demu_flush_guest_dirty_pages() < 0)
+        r = -1;
+
+    pthread_mutex_unlock(&dirty_acc.lock);
+
+    return r;
 }
 
 int demu_set_guest_pages(xen_pfn_t gfn, xen_pfn_t mfn, int count, int add)
@@ -1182,65 +2289,542 @@ demu_translate_guest_pages(xen_pfn_t pfn_array[], xen_pfn_t mfn_array[],
     return 0;
 }
 
-int demu_release_guest_pages(xen_pfn_t mfn[], int count)
+/*
+ * Translation of the guest VRAM (less the communication page at the top)
+ * shared by everything that hands mfns to the vGPU plugin. The table is
+ * built on first use, and each user takes a reference. The cached
+ * reference is dropped when the BAR moves, and the IOMMU mappings are
+ * released once the last user has finished with the old table.
+ */
+#define DEMU_VRAM_TABLE_PAGES \
+    ((VRAM_RESERVED_SIZE - TARGET_PAGE_SIZE) >> TARGET_PAGE_SHIFT)
+
+typedef struct demu_vram_table {
+    unsigned int refs;
+    xen_pfn_t mfn[DEMU_VRAM_TABLE_PAGES];
+} demu_vram_table_t;
+
+static struct demu_vram_table_s {
+    pthread_mutex_t lock;
+    demu_vram_table_t *table;
+} demu_vram_table = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static demu_vram_table_t *demu_vram_table_build(void)
 {
-    struct pv_iommu_op *ops;
+    demu_vram_table_t *table;
+    xen_pfn_t *pfn;
     int i;
     int rc;
 
-    ops = alloca(sizeof(*ops) * count);
-    memset(ops, 0, sizeof(*ops) * count);
+    table = malloc(sizeof(*table));
+    if (table == NULL)
+        goto fail1;
 
-    for (i = 0; i < count; i++) {
-        ops[i].subop_id = IOMMUOP_unmap_foreign_page;
-        ops[i].u.unmap_foreign_page.bfn = mfn[i];
-        ops[i].u.unmap_foreign_page.ioserver = demu_state.ioservid;
-    }
+    /* The plugins can ask for the table while they are initialized */
+    if (demu_vram_load_wait() < 0)
+        goto fail2;
 
-    rc = xc_iommu_op(demu_state.xch, ops, count);
-    if (rc < 0) {
-        ERRN("xc_iommu_op");
-        return rc;
-    }
+    /* Translate into the table itself, then overwrite with the mfns */
+    pfn = table->mfn;
+    for (i = 0; i < DEMU_VRAM_TABLE_PAGES; i++)
+        pfn[i] = (demu_state.vram_addr >> TARGET_PAGE_SHIFT) + i;
 
-    /* Unmaps are always be successful so no need to check status. */
+    rc = demu_translate_guest_pages(pfn, table->mfn, DEMU_VRAM_TABLE_PAGES);
+    if (rc < 0)
+        goto fail2;
 
-    return 0;
-}
+    table->refs = 1;
 
-static demu_space_t *demu_find_space(demu_space_t * head, uint64_t addr)
-{
-    demu_space_t *space;
+    DBG("%" PRIx64 ": %d pages", demu_state.vram_addr,
+        DEMU_VRAM_TABLE_PAGES);
+
+    return table;
+
+fail2:
+    ERR("fail2");
+
+    free(table);
 
-    for (space = head; space != NULL; space = space->next)
-        if (addr >= space->start && addr <= space->end)
-            return space;
+fail1:
+    ERR("fail1");
 
     return NULL;
 }
 
-demu_space_t *demu_find_pci_config_space(uint8_t bdf)
+/* Called with the table lock held */
+static void __demu_vram_table_put(demu_vram_table_t *table)
 {
-    return demu_find_space(demu_state.pci_config, bdf);
+    if (--table->refs != 0)
+        return;
+
+    (void) demu_release_guest_pages(table->mfn, DEMU_VRAM_TABLE_PAGES);
+    free(table);
 }
 
-demu_space_t *demu_find_port_space(uint64_t addr)
+const xen_pfn_t *demu_vram_table_get(int *count)
 {
-    return demu_find_space(demu_state.port, addr);
+    demu_vram_table_t *table;
+
+    pthread_mutex_lock(&demu_vram_table.lock);
+
+    if (demu_vram_table.table == NULL)
+        demu_vram_table.table = demu_vram_table_build();
+
+    table = demu_vram_table.table;
+    if (table != NULL)
+        table->refs++;
+
+    pthread_mutex_unlock(&demu_vram_table.lock);
+
+    if (table == NULL)
+        return NULL;
+
+    *count = DEMU_VRAM_TABLE_PAGES;
+    return table->mfn;
 }
 
-demu_space_t *demu_find_memory_space(uint64_t addr)
+void demu_vram_table_put(const xen_pfn_t *mfn)
+{
+    demu_vram_table_t *table;
+
+    table = (demu_vram_table_t *)((uint8_t *)mfn -
+                                  offsetof(demu_vram_table_t, mfn));
+
+    pthread_mutex_lock(&demu_vram_table.lock);
+    __demu_vram_table_put(table);
+    pthread_mutex_unlock(&demu_vram_table.lock);
+}
+
+void demu_vram_table_invalidate(void)
 {
-    return demu_find_space(demu_state.memory, addr);
+    pthread_mutex_lock(&demu_vram_table.lock);
+
+    if (demu_vram_table.table != NULL) {
+        __demu_vram_table_put(demu_vram_table.table);
+        demu_vram_table.table = NULL;
+    }
+
+    pthread_mutex_unlock(&demu_vram_table.lock);
+}
+
+int demu_release_guest_pages(xen_pfn_t mfn[], int count)
+{
+    struct pv_iommu_op *ops;
+    int i;
+    int rc;
+
+    ops = alloca(sizeof(*ops) * count);
+    memset(ops, 0, sizeof(*ops) * count);
+
+    for (i = 0; i < count; i++) {
+        ops[i].subop_id = IOMMUOP_unmap_foreign_page;
+        ops[i].u.unmap_foreign_page.bfn = mfn[i];
+        ops[i].u.unmap_foreign_page.ioserver = demu_state.ioservid;
+    }
+
+    rc = xc_iommu_op(demu_state.xch, ops, count);
+    if (rc < 0) {
+        ERRN("xc_iommu_op");
+        return rc;
+    }
+
+    /* Unmaps are always be successful so no need to check status. */
+
+    return 0;
 }
 
+/*
+ * Lookups run concurrently, and a locked add per lookup would cost more
+ * than the lookup itself, so the statistics may lose the odd count.
+ */
+#define DEMU_SPACE_STAT_ADD(_stat, _n)                               \
+    __atomic_store_n(&(_stat),                                       \
+                     __atomic_load_n(&(_stat), __ATOMIC_RELAXED) + (_n), \
+                     __ATOMIC_RELAXED)
+
+/* Index of the last space starting at or below addr, or -1 */
 static int
-demu_register_space(demu_space_t ** headp, uint64_t start, uint64_t end,
+demu_space_index_find(demu_space_set_t * set,
+                      const demu_space_index_t * index, uint64_t addr)
+{
+    int lo = 0;
+    int hi = (int) index->nr - 1;
+    int found = -1;
+    uint64_t probes = 0;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        probes++;
+
+        if (index->space[mid]->start <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    DEMU_SPACE_STAT_ADD(set->probes, probes);
+    return found;
+}
+
+static demu_space_t *demu_find_space(demu_space_set_t * set, uint64_t addr)
+{
+    demu_space_index_t *index;
+    demu_space_t *space;
+    int i;
+
+    DEMU_SPACE_STAT_ADD(set->lookups, 1);
+
+    index = __atomic_load_n(&set->index, __ATOMIC_ACQUIRE);
+    if (index == NULL)
+        return NULL;
+
+    space = __atomic_load_n(&index->last, __ATOMIC_RELAXED);
+    if (space != NULL && addr >= space->start && addr <= space->end) {
+        DEMU_SPACE_STAT_ADD(set->last_hits, 1);
+        return space;
+    }
+
+    i = demu_space_index_find(set, index, addr);
+    if (i < 0)
+        return NULL;
+
+    space = index->space[i];
+    if (addr > space->end)
+        return NULL;
+
+    __atomic_store_n(&index->last, space, __ATOMIC_RELAXED);
+    return space;
+}
+
+/* Free what has been retired, if nothing can still be using it */
+static void demu_registry_reclaim(void)
+{
+    demu_space_index_t *index;
+    demu_space_t *space;
+    unsigned int i;
+
+    /* Pairs with the fence in demu_space_read_begin() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&demu_registry.overflow, __ATOMIC_ACQUIRE) != 0)
+        return;
+
+    for (i = 0; i < DEMU_REGISTRY_READERS; i++)
+        if (__atomic_load_n(&demu_registry.reader[i].active,
+                            __ATOMIC_ACQUIRE) != 0)
+            return;
+
+    while ((space = demu_registry.retired_space) != NULL) {
+        demu_registry.retired_space = space->next;
+        free(space);
+    }
+
+    while ((index = demu_registry.retired_index) != NULL) {
+        demu_registry.retired_index = index->next;
+        free(index);
+    }
+
+    __atomic_store_n(&demu_registry.retired, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * The calling thread's reader slot, and how deeply its reads are nested
+ * (a VGA port access made by a plugin on the ioreq path reads again).
+ */
+static __thread demu_registry_reader_t *demu_space_reader;
+static __thread unsigned int demu_space_read_depth;
+static __thread int demu_space_reader_full;
+static pthread_key_t demu_space_reader_key;
+static pthread_once_t demu_space_reader_once = PTHREAD_ONCE_INIT;
+
+static void demu_space_reader_release(void *arg)
+{
+    demu_registry_reader_t *reader = arg;
+
+    __atomic_store_n(&reader->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void demu_space_reader_key_create(void)
+{
+    if (pthread_key_create(&demu_space_reader_key,
+                           demu_space_reader_release) != 0)
+        ERR("pthread_key_create");
+}
+
+/* Take the first reader slot with no owner */
+static demu_registry_reader_t *demu_space_reader_claim(void)
+{
+    unsigned int i;
+
+    if (demu_space_reader_full)
+        return NULL;
+
+    (void) pthread_once(&demu_space_reader_once,
+                        demu_space_reader_key_create);
+
+    for (i = 0; i < DEMU_REGISTRY_READERS; i++) {
+        demu_registry_reader_t *reader = &demu_registry.reader[i];
+        unsigned int free = 0;
+
+        if (__atomic_compare_exchange_n(&reader->owned, &free, 1, 0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            demu_space_reader = reader;
+            (void) pthread_setspecific(demu_space_reader_key, reader);
+            return reader;
+        }
+    }
+
+    demu_space_reader_full = 1;
+    return NULL;
+}
+
+void demu_space_read_begin(void)
+{
+    demu_registry_reader_t *reader;
+
+    if (demu_space_read_depth++ != 0)
+        return;
+
+    reader = demu_space_reader;
+    if (reader == NULL && (reader = demu_space_reader_claim()) == NULL) {
+        __atomic_fetch_add(&demu_registry.overflow, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    /*
+     * The slot must be seen active before the index is loaded, or
+     * demu_registry_reclaim(), which checks the slots after an index has
+     * been replaced, could free the old index as it is found. A locked
+     * exchange on the thread's own line orders the store before the load
+     * (like the fence there) more cheaply than a fence does.
+     */
+    (void) __atomic_exchange_n(&reader->active, 1, __ATOMIC_SEQ_CST);
+}
+
+void demu_space_read_end(void)
+{
+    demu_registry_reader_t *reader = demu_space_reader;
+
+    if (--demu_space_read_depth != 0)
+        return;
+
+    if (reader != NULL)
+        __atomic_store_n(&reader->active, 0, __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_sub(&demu_registry.overflow, 1, __ATOMIC_RELEASE);
+
+    /*
+     * A retirement missed here is picked up by a later read, or by the
+     * next registry change. Don't wait for a lock another reader (or a
+     * registration) already holds.
+     */
+    if (__atomic_load_n(&demu_registry.retired, __ATOMIC_RELAXED) == 0 ||
+        pthread_mutex_trylock(&demu_registry.lock) != 0)
+        return;
+
+    demu_registry_reclaim();
+    pthread_mutex_unlock(&demu_registry.lock);
+}
+
+/* Publish a new index for set, retiring the old one. Registry locked. */
+static void
+demu_space_index_replace(demu_space_set_t * set, demu_space_index_t * index)
+{
+    demu_space_index_t *old = set->index;
+
+    __atomic_store_n(&set->index, index, __ATOMIC_RELEASE);
+
+    if (old != NULL) {
+        old->next = demu_registry.retired_index;
+        demu_registry.retired_index = old;
+        __atomic_store_n(&demu_registry.retired, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void demu_space_set_stats(const char *name, demu_space_set_t * set)
+{
+    INFO("%s: %u spaces, %" PRIu64 " lookups, %" PRIu64 " last hits, "
+         "%" PRIu64 " probes", name,
+         (set->index != NULL) ? set->index->nr : 0, set->lookups,
+         set->last_hits, set->probes);
+}
+
+/* Free whatever is still registered, at teardown */
+static void demu_space_set_release(demu_space_set_t * set)
+{
+    demu_space_t *space;
+
+    while ((space = set->head) != NULL) {
+        set->head = space->next;
+        free(space);
+    }
+
+    free(set->index);
+    set->index = NULL;
+}
+
+/* Free whatever is still retired, at teardown when there are no readers */
+static void demu_registry_release(void)
+{
+    assert(demu_registry.overflow == 0);
+    demu_registry_reclaim();
+}
+
+demu_space_t *demu_find_pci_config_space(uint8_t bdf)
+{
+    return demu_find_space(&demu_state.pci_config, bdf);
+}
+
+demu_space_t *demu_find_port_space(uint64_t addr)
+{
+    return demu_find_space(&demu_state.port, addr);
+}
+
+demu_space_t *demu_find_memory_space(uint64_t addr)
+{
+    return demu_find_space(&demu_state.memory, addr);
+}
+
+/*
+ * Access handlers, one per combination of access size and the widest
+ * io_ops_t handler available for it. Wider accesses are split into
+ * little-endian pieces.
+ */
+static uint64_t demu_space_read_none(demu_space_t * space, uint64_t addr)
+{
+    return ~0ull;
+}
+
+static void
+demu_space_write_none(demu_space_t * space, uint64_t addr, uint64_t val)
+{
+}
+
+#define DEMU_SPACE_READ(_name, _fn, _size, _count)                         \
+    static uint64_t _name(demu_space_t * space, uint64_t addr)             \
+    {                                                                      \
+        uint64_t val = 0;                                                  \
+        int i;                                                             \
+                                                                           \
+        for (i = 0; i < (_count); i++)                                     \
+            val |= (uint64_t) space->ops->_fn(space->priv,                 \
+                                              addr + (i * (_size)))        \
+                << (i * 8 * (_size));                                      \
+                                                                           \
+        return val;                                                        \
+    }
+
+#define DEMU_SPACE_WRITE(_name, _fn, _size, _count)                        \
+    static void _name(demu_space_t * space, uint64_t addr, uint64_t val)   \
+    {                                                                      \
+        int i;                                                             \
+                                                                           \
+        for (i = 0; i < (_count); i++)                                     \
+            space->ops->_fn(space->priv, addr + (i * (_size)),             \
+                            val >> (i * 8 * (_size)));                     \
+    }
+
+DEMU_SPACE_READ(demu_space_readb, readb, 1, 1)
+DEMU_SPACE_READ(demu_space_readw_b, readb, 1, 2)
+DEMU_SPACE_READ(demu_space_readl_b, readb, 1, 4)
+DEMU_SPACE_READ(demu_space_readq_b, readb, 1, 8)
+DEMU_SPACE_READ(demu_space_readw, readw, 2, 1)
+DEMU_SPACE_READ(demu_space_readl_w, readw, 2, 2)
+DEMU_SPACE_READ(demu_space_readq_w, readw, 2, 4)
+DEMU_SPACE_READ(demu_space_readl, readl, 4, 1)
+DEMU_SPACE_READ(demu_space_readq_l, readl, 4, 2)
+
+DEMU_SPACE_WRITE(demu_space_writeb, writeb, 1, 1)
+DEMU_SPACE_WRITE(demu_space_writew_b, writeb, 1, 2)
+DEMU_SPACE_WRITE(demu_space_writel_b, writeb, 1, 4)
+DEMU_SPACE_WRITE(demu_space_writeq_b, writeb, 1, 8)
+DEMU_SPACE_WRITE(demu_space_writew, writew, 2, 1)
+DEMU_SPACE_WRITE(demu_space_writel_w, writew, 2, 2)
+DEMU_SPACE_WRITE(demu_space_writeq_w, writew, 2, 4)
+DEMU_SPACE_WRITE(demu_space_writel, writel, 4, 1)
+DEMU_SPACE_WRITE(demu_space_writeq_l, writel, 4, 2)
+
+static void demu_space_resolve(demu_space_t * space)
+{
+    const io_ops_t *ops = space->ops;
+
+    space->read[0] = (ops->readb != NULL) ?
+        demu_space_readb : demu_space_read_none;
+
+    if (ops->readw != NULL)
+        space->read[1] = demu_space_readw;
+    else
+        space->read[1] = (ops->readb != NULL) ?
+            demu_space_readw_b : demu_space_read_none;
+
+    if (ops->readl != NULL) {
+        space->read[2] = demu_space_readl;
+        space->read[3] = demu_space_readq_l;
+    } else if (ops->readw != NULL) {
+        space->read[2] = demu_space_readl_w;
+        space->read[3] = demu_space_readq_w;
+    } else if (ops->readb != NULL) {
+        space->read[2] = demu_space_readl_b;
+        space->read[3] = demu_space_readq_b;
+    } else {
+        space->read[2] = demu_space_read_none;
+        space->read[3] = demu_space_read_none;
+    }
+
+    space->write[0] = (ops->writeb != NULL) ?
+        demu_space_writeb : demu_space_write_none;
+
+    if (ops->writew != NULL)
+        space->write[1] = demu_space_writew;
+    else
+        space->write[1] = (ops->writeb != NULL) ?
+            demu_space_writew_b : demu_space_write_none;
+
+    if (ops->writel != NULL) {
+        space->write[2] = demu_space_writel;
+        space->write[3] = demu_space_writeq_l;
+    } else if (ops->writew != NULL) {
+        space->write[2] = demu_space_writel_w;
+        space->write[3] = demu_space_writeq_w;
+    } else if (ops->writeb != NULL) {
+        space->write[2] = demu_space_writel_b;
+        space->write[3] = demu_space_writeq_b;
+    } else {
+        space->write[2] = demu_space_write_none;
+        space->write[3] = demu_space_write_none;
+    }
+}
+
+static demu_space_t *
+demu_register_space(demu_space_set_t * set, uint64_t start, uint64_t end,
                     const io_ops_t * ops, void *priv)
 {
+    demu_space_index_t *old, *index;
     demu_space_t *space;
+    unsigned int nr;
+    int i;
+
+    vmiope_lock_acquire(&demu_registry.lock);
 
-    if (demu_find_space(*headp, start) || demu_find_space(*headp, end))
+    old = set->index;
+    nr = (old != NULL) ? old->nr : 0;
+
+    /* The new space must fit between its neighbours */
+    i = (old != NULL) ? demu_space_index_find(set, old, end) : -1;
+    if (i >= 0 && old->space[i]->end >= start) {
+        errno = EEXIST;
+        goto fail1;
+    }
+
+    index = malloc(sizeof(demu_space_index_t) +
+                   sizeof(demu_space_t *) * (nr + 1));
+    if (index == NULL)
         goto fail1;
 
     space = malloc(sizeof(demu_space_t));
@@ -1252,46 +2836,113 @@ demu_register_space(demu_space_t ** headp, uint64_t start, uint64_t end,
     space->ops = ops;
     space->priv = priv;
     space->io_init = 0;
+    demu_space_resolve(space);
 
-    space->next = *headp;
-    *headp = space;
+    space->next = set->head;
+    set->head = space;
 
-    return 0;
+    i++;
+    if (old != NULL) {
+        memcpy(&index->space[0], &old->space[0],
+               sizeof(demu_space_t *) * i);
+        memcpy(&index->space[i + 1], &old->space[i],
+               sizeof(demu_space_t *) * (nr - i));
+    }
+    index->space[i] = space;
+    index->nr = nr + 1;
+    index->last = NULL;
+
+    demu_space_index_replace(set, index);
+    demu_registry_reclaim();
+
+    pthread_mutex_unlock(&demu_registry.lock);
+
+    return space;
 
 fail2:
     ERR("fail2");
 
+    free(index);
+
 fail1:
+    pthread_mutex_unlock(&demu_registry.lock);
+
     ERR("fail1: %s", strerror(errno));
 
-    return -1;
+    return NULL;
 }
 
-static void
-demu_deregister_space(demu_space_t ** headp, uint64_t start,
+/*
+ * Remove the space that covers start (which must be where it starts).
+ * Returns the space's io_init, or -1 if there is none.
+ */
+static int
+demu_deregister_space(demu_space_set_t * set, uint64_t start,
                       uint64_t * endp)
 {
+    demu_space_index_t *old, *index = NULL;
     demu_space_t **spacep;
     demu_space_t *space;
+    int io_init;
+    int i;
 
-    spacep = headp;
-    while ((space = *spacep) != NULL) {
-        if (start == space->start) {
-            *spacep = space->next;
+    vmiope_lock_acquire(&demu_registry.lock);
 
-            if (endp != NULL)
-                *endp = space->end;
+    old = set->index;
 
-            free(space);
-            return;
-        }
-        spacep = &(space->next);
+    i = (old != NULL) ? demu_space_index_find(set, old, start) : -1;
+    if (i < 0 || start > old->space[i]->end)
+        goto fail1;
+
+    space = old->space[i];
+    assert(space->start == start);
+
+    /* An index that would be empty is freed rather than replaced */
+    if (old->nr > 1) {
+        index = malloc(sizeof(demu_space_index_t) +
+                       sizeof(demu_space_t *) * (old->nr - 1));
+        if (index == NULL)
+            goto fail2;
+
+        memcpy(&index->space[0], &old->space[0],
+               sizeof(demu_space_t *) * i);
+        memcpy(&index->space[i], &old->space[i + 1],
+               sizeof(demu_space_t *) * (old->nr - i - 1));
+        index->nr = old->nr - 1;
+        index->last = NULL;
     }
-    assert(false);
+
+    demu_space_index_replace(set, index);
+
+    spacep = &set->head;
+    while (*spacep != space)
+        spacep = &(*spacep)->next;
+    *spacep = space->next;
+
+    if (endp != NULL)
+        *endp = space->end;
+    io_init = space->io_init;
+
+    space->next = demu_registry.retired_space;
+    demu_registry.retired_space = space;
+    demu_registry_reclaim();
+
+    pthread_mutex_unlock(&demu_registry.lock);
+
+    return io_init;
+
+fail2:
+    ERR("fail2");
+
+fail1:
+    pthread_mutex_unlock(&demu_registry.lock);
+
+    return -1;
 }
 
 int demu_register_pci_config_space(const io_ops_t * ops, void *priv)
 {
+    demu_space_t *space;
     uint64_t sbdf;
     int rc;
 
@@ -1302,9 +2953,9 @@ int demu_register_pci_config_space(const io_ops_t * ops, void *priv)
         PCI_SBDF(0, demu_state.bus, demu_state.device,
                  demu_state.function);
 
-    rc = demu_register_space(&demu_state.pci_config, sbdf, sbdf, ops,
-                             priv);
-    if (rc < 0)
+    space = demu_register_space(&demu_state.pci_config, sbdf, sbdf, ops,
+                                priv);
+    if (space == NULL)
         goto fail1;
 
     if (demu_state.io_up) {
@@ -1317,7 +2968,7 @@ int demu_register_pci_config_space(const io_ops_t * ops, void *priv)
         if (rc < 0)
             goto fail2;
 
-        demu_state.pci_config->io_init = 1;
+        space->io_init = 1;
     }
 
     return 0;
@@ -1338,12 +2989,13 @@ demu_register_port_space(uint64_t start, uint64_t size,
                          const io_ops_t * ops, void *priv)
 {
     uint64_t end = start + size - 1;
+    demu_space_t *space;
     int rc;
 
     DBG("%" PRIx64 " - %" PRIx64 "", start, end);
 
-    rc = demu_register_space(&demu_state.port, start, end, ops, priv);
-    if (rc < 0)
+    space = demu_register_space(&demu_state.port, start, end, ops, priv);
+    if (space == NULL)
         goto fail1;
 
     if (demu_state.io_up) {
@@ -1353,7 +3005,7 @@ demu_register_port_space(uint64_t start, uint64_t size,
                 start, end);
         if (rc < 0)
             goto fail2;
-        demu_state.port->io_init = 1;
+        space->io_init = 1;
     }
 
     return 0;
@@ -1374,12 +3026,13 @@ demu_register_memory_space(uint64_t start, uint64_t size,
                            const io_ops_t * ops, void *priv)
 {
     uint64_t end = start + size - 1;
+    demu_space_t *space;
     int rc;
 
     DBG("%" PRIx64 " - %" PRIx64 "", start, end);
 
-    rc = demu_register_space(&demu_state.memory, start, end, ops, priv);
-    if (rc < 0)
+    space = demu_register_space(&demu_state.memory, start, end, ops, priv);
+    if (space == NULL)
         goto fail1;
 
     if (demu_state.io_up) {
@@ -1389,7 +3042,7 @@ demu_register_memory_space(uint64_t start, uint64_t size,
                 start, end);
         if (rc < 0)
             goto fail2;
-        demu_state.memory->io_init = 1;
+        space->io_init = 1;
     }
 
     return 0;
@@ -1420,23 +3073,15 @@ void demu_set_pci_intx(int line, int level)
 void demu_deregister_pci_config_space(void)
 {
     uint64_t sbdf;
-    demu_space_t *space;
     int io_init;
 
-
-
     sbdf =
         PCI_SBDF(0, demu_state.bus, demu_state.device,
                  demu_state.function);
 
-    space = demu_find_space(demu_state.pci_config, sbdf);
-    if (!space)
-        return;
-    io_init = space->io_init;
-
-    demu_deregister_space(&demu_state.pci_config, sbdf, NULL);
+    io_init = demu_deregister_space(&demu_state.pci_config, sbdf, NULL);
 
-    if (io_init)
+    if (io_init > 0)
         xc_hvm_unmap_pcidev_from_ioreq_server(demu_state.xch,
                                               demu_state.domid,
                                               demu_state.ioservid, 0,
@@ -1448,15 +3093,11 @@ void demu_deregister_pci_config_space(void)
 void demu_deregister_port_space(uint64_t start)
 {
     uint64_t end;
-    demu_space_t *space;
     int io_init;
 
-    space = demu_find_space(demu_state.port, start);
-    if (!space)
+    io_init = demu_deregister_space(&demu_state.port, start, &end);
+    if (io_init < 0)
         return;
-    io_init = space->io_init;
-
-    demu_deregister_space(&demu_state.port, start, &end);
 
     DBG("%" PRIx64 " - %" PRIx64 "", start, end);
 
@@ -1470,15 +3111,11 @@ void demu_deregister_port_space(uint64_t start)
 void demu_deregister_memory_space(uint64_t start)
 {
     uint64_t end;
-    demu_space_t *space;
     int io_init;
 
-    space = demu_find_space(demu_state.memory, start);
-    if (!space)
+    io_init = demu_deregister_space(&demu_state.memory, start, &end);
+    if (io_init < 0)
         return;
-    io_init = space->io_init;
-
-    demu_deregister_space(&demu_state.memory, start, &end);
 
     DBG("%" PRIx64 " - %" PRIx64 "", start, end);
 
@@ -1489,196 +3126,271 @@ void demu_deregister_memory_space(uint64_t start)
                                                 start, end);
 }
 
-#define DEMU_IO_READ(_fn, _priv, _addr, _size, _count, _val)        \
-    do {                                                            \
-        int             _i = 0;                                     \
-        unsigned int    _shift = 0;                                 \
-                                                                    \
-        (_val) = 0;                                                 \
-        for (_i = 0; _i < (_count); _i++)                           \
-        {                                                           \
-            (_val) |= (uint64_t)(_fn)((_priv), (_addr)) << _shift;  \
-            _shift += 8 * (_size);                                  \
-            (_addr) += (_size);                                     \
-        }                                                           \
-    } while (false)
+/* Access sizes 1, 2, 4 and 8 map to handler slots 0 - 3 */
+static inline int demu_io_size_index(uint64_t size)
+{
+    if (size == 0 || size > 8 || (size & (size - 1)) != 0)
+        return -1;
+
+    return __builtin_ctzll(size);
+}
 
 uint64_t demu_io_read(demu_space_t * space, uint64_t addr, uint64_t size)
 {
-    uint64_t val = ~0ull;
+    int i = demu_io_size_index(size);
 
-    switch (size) {
-    case 1:
-        val = space->ops->readb(space->priv, addr);
-        break;
+    if (i < 0)
+        return ~0ull;
 
-    case 2:
-        if (space->ops->readw == NULL)
-            DEMU_IO_READ(space->ops->readb, space->priv, addr, 1, 2, val);
-        else
-            DEMU_IO_READ(space->ops->readw, space->priv, addr, 2, 1, val);
-        break;
+    return space->read[i](space, addr);
+}
 
-    case 4:
-        if (space->ops->readl == NULL) {
-            if (space->ops->readw == NULL)
-                DEMU_IO_READ(space->ops->readb, space->priv, addr, 1, 4,
-                             val);
-            else
-                DEMU_IO_READ(space->ops->readw, space->priv, addr, 2, 2,
-                             val);
-        } else {
-            DEMU_IO_READ(space->ops->readl, space->priv, addr, 4, 1, val);
-        }
-        break;
+void
+demu_io_write(demu_space_t * space, uint64_t addr, uint64_t size,
+              uint64_t val)
+{
+    int i = demu_io_size_index(size);
 
-    case 8:
-        if (space->ops->readl == NULL) {
-            if (space->ops->readw == NULL)
-                DEMU_IO_READ(space->ops->readb, space->priv, addr, 1, 8,
-                             val);
-            else
-                DEMU_IO_READ(space->ops->readw, space->priv, addr, 2, 4,
-                             val);
-        } else {
-            DEMU_IO_READ(space->ops->readl, space->priv, addr, 4, 2, val);
-        }
-        break;
+    if (i < 0)
+        return;
 
-    default:
-        break;
+    space->write[i](space, addr, val);
+}
+
+static void
+demu_io_read_rep(demu_space_t * space, uint64_t addr, uint64_t size,
+                 int64_t step, uint32_t count, uint8_t * buf)
+{
+    uint32_t i;
+
+    if (space->ops->readrep != NULL) {
+        space->ops->readrep(space->priv, addr, size, step, count, buf);
+        return;
     }
 
-    return val;
-}
+    for (i = 0; i < count; i++) {
+        uint64_t data = demu_io_read(space, addr, size);
 
-#define DEMU_IO_WRITE(_fn, _priv, _addr, _size, _count, _val)   \
-    do {                                                        \
-        int             _i = 0;                                 \
-        unsigned int    _shift = 0;                             \
-                                                                \
-        for (_i = 0; _i < (_count); _i++)                       \
-        {                                                       \
-            (_fn)((_priv), (_addr), (_val) >> _shift);          \
-            _shift += 8 * (_size);                              \
-            (_addr) += (_size);                                 \
-        }                                                       \
-    } while (false)
+        memcpy(buf + (i * size), &data, size);
+        addr += step;
+    }
+}
 
-void
-demu_io_write(demu_space_t * space, uint64_t addr, uint64_t size,
-              uint64_t val)
+static void
+demu_io_write_rep(demu_space_t * space, uint64_t addr, uint64_t size,
+                  int64_t step, uint32_t count, const uint8_t * buf)
 {
-    switch (size) {
-    case 1:
-        space->ops->writeb(space->priv, addr, val);
-        break;
-
-    case 2:
-        if (space->ops->writew == NULL)
-            DEMU_IO_WRITE(space->ops->writeb, space->priv, addr, 1, 2,
-                          val);
-        else
-            DEMU_IO_WRITE(space->ops->writew, space->priv, addr, 2, 1,
-                          val);
-        break;
+    uint32_t i;
 
-    case 4:
-        if (space->ops->writel == NULL) {
-            if (space->ops->writew == NULL)
-                DEMU_IO_WRITE(space->ops->writeb, space->priv, addr, 1, 4,
-                              val);
-            else
-                DEMU_IO_WRITE(space->ops->writew, space->priv, addr, 2, 2,
-                              val);
-        } else {
-            DEMU_IO_WRITE(space->ops->writel, space->priv, addr, 4, 1,
-                          val);
-        }
-        break;
+    if (space->ops->writerep != NULL) {
+        space->ops->writerep(space->priv, addr, size, step, count, buf);
+        return;
+    }
 
-    case 8:
-        if (space->ops->writel == NULL) {
-            if (space->ops->writew == NULL)
-                DEMU_IO_WRITE(space->ops->writeb, space->priv, addr, 1, 8,
-                              val);
-            else
-                DEMU_IO_WRITE(space->ops->writew, space->priv, addr, 2, 4,
-                              val);
-        } else {
-            DEMU_IO_WRITE(space->ops->writel, space->priv, addr, 4, 2,
-                          val);
-        }
-        break;
+    for (i = 0; i < count; i++) {
+        uint64_t data = 0;
 
-    default:
-        break;
+        memcpy(&data, buf + (i * size), size);
+        demu_io_write(space, addr, size, data);
+        addr += step;
     }
 }
 
+/* Copies may cross page (or mapcache chunk) boundaries */
 static inline void
 __copy_to_guest_memory(uint64_t addr, uint64_t size, uint8_t * src)
 {
-    uint8_t *dst = mapcache_lookup(addr);
+    uint64_t done = 0;
 
-    assert(((addr + size - 1) >> TARGET_PAGE_SHIFT) ==
-           (addr >> TARGET_PAGE_SHIFT));
+    while (done < size) {
+        uint64_t len;
+        uint8_t *dst = mapcache_lookup_span(addr + done, &len);
 
-    if (dst == NULL)
-        goto fail1;
+        if (dst == NULL)
+            goto fail1;
+
+        if (len > size - done)
+            len = size - done;
+
+        memcpy(dst, src + done, len);
+        done += len;
+    }
 
-    memcpy(dst, src, size);
-    demu_set_guest_dirty_page(addr >> TARGET_PAGE_SHIFT);
+    demu_set_guest_dirty_range(addr, size);
     return;
 
 fail1:
     ERR("fail1");
+
+    demu_set_guest_dirty_range(addr, done);
 }
 
 static inline void
 __copy_from_guest_memory(uint64_t addr, uint64_t size, uint8_t * dst)
 {
-    uint8_t *src = mapcache_lookup(addr);
+    uint64_t done = 0;
 
-    assert(((addr + size - 1) >> TARGET_PAGE_SHIFT) ==
-           (addr >> TARGET_PAGE_SHIFT));
+    while (done < size) {
+        uint64_t len;
+        uint8_t *src = mapcache_lookup_span(addr + done, &len);
 
-    if (src == NULL)
-        goto fail1;
+        if (src == NULL)
+            goto fail1;
+
+        if (len > size - done)
+            len = size - done;
 
-    memcpy(dst, src, size);
+        memcpy(dst + done, src, len);
+        done += len;
+    }
     return;
 
 fail1:
     ERR("fail1");
 
-    memset(dst, 0xff, size);
+    memset(dst + done, 0xff, size - done);
+}
+
+/* Scratch space for a batch of REP accesses that can't go direct */
+#define DEMU_REP_BUFFER_SIZE    TARGET_PAGE_SIZE
+
+/*
+ * Upper bound on bufioreqSpinUs. Spinning holds the monitor, so a vCPU
+ * worker's synchronous ioreq can wait this long behind it.
+ */
+#define DEMU_BUFIOREQ_SPIN_MAX  50
+
+/*
+ * Handle a REP INS/OUTS/MOVS ioreq (data_is_ptr). With the direction
+ * flag clear the guest buffer is ascending, so each contiguously mapped
+ * span of it is handed to the device in one go. Descending buffers go
+ * through a bounce buffer. Either way the touched guest range is marked
+ * dirty once.
+ */
+static void
+demu_handle_io_ptr(demu_space_t * space, ioreq_t * ioreq, int is_mmio)
+{
+    uint8_t buf[DEMU_REP_BUFFER_SIZE];
+    uint64_t size = ioreq->size;
+    int64_t step;
+    uint32_t i;
+
+    step = is_mmio ? (ioreq->df ? -(int64_t)size : (int64_t)size) : 0;
+
+    for (i = 0; i < ioreq->count;) {
+        uint32_t n = ioreq->count - i;
+        uint64_t len = 0;
+        uint8_t *ptr = NULL;
+
+        if (!ioreq->df) {
+            uint64_t gaddr = ioreq->data + (i * size);
+
+            ptr = mapcache_lookup_span(gaddr, &len);
+            if (n > len / size)
+                n = len / size;
+        }
+
+        if (ptr != NULL && n != 0) {
+            if (ioreq->dir == IOREQ_READ)
+                demu_io_read_rep(space, ioreq->addr, size, step, n, ptr);
+            else
+                demu_io_write_rep(space, ioreq->addr, size, step, n, ptr);
+        } else {
+            uint32_t j;
+
+            n = ioreq->count - i;
+            if (n > DEMU_REP_BUFFER_SIZE / size)
+                n = DEMU_REP_BUFFER_SIZE / size;
+
+            if (ioreq->dir == IOREQ_READ) {
+                demu_io_read_rep(space, ioreq->addr, size, step, n, buf);
+
+                for (j = 0; j < n; j++) {
+                    uint64_t gaddr = ioreq->data +
+                        ((ioreq->df ? -1 : 1) * (int64_t)((i + j) * size));
+
+                    __copy_to_guest_memory(gaddr, size, buf + (j * size));
+                }
+            } else {
+                for (j = 0; j < n; j++) {
+                    uint64_t gaddr = ioreq->data +
+                        ((ioreq->df ? -1 : 1) * (int64_t)((i + j) * size));
+
+                    __copy_from_guest_memory(gaddr, size, buf + (j * size));
+                }
+
+                demu_io_write_rep(space, ioreq->addr, size, step, n, buf);
+            }
+        }
+
+        if (is_mmio)
+            ioreq->addr += step * n;
+        i += n;
+    }
+
+    if (ioreq->dir == IOREQ_READ && !ioreq->df)
+        demu_set_guest_dirty_range(ioreq->data, ioreq->count * size);
 }
 
+/*
+ * A REP STOS to MMIO writes the same value count times; hand it to the
+ * device in batches.
+ */
+static void
+demu_handle_io_fill(demu_space_t * space, ioreq_t * ioreq)
+{
+    uint8_t buf[DEMU_REP_BUFFER_SIZE];
+    uint64_t size = ioreq->size;
+    int64_t step;
+    uint32_t i, n;
+
+    step = ioreq->df ? -(int64_t)size : (int64_t)size;
+
+    n = ioreq->count;
+    if (n > DEMU_REP_BUFFER_SIZE / size)
+        n = DEMU_REP_BUFFER_SIZE / size;
+
+    for (i = 0; i < n; i++)
+        memcpy(buf + (i * size), &ioreq->data, size);
+
+    for (i = 0; i < ioreq->count; i += n) {
+        if (n > ioreq->count - i)
+            n = ioreq->count - i;
+
+        demu_io_write_rep(space, ioreq->addr, size, step, n, buf);
+        ioreq->addr += step * n;
+    }
+}
+
+/*
+ * Spaces marked unlocked are emulated without the monitor, unless the
+ * data has to go through the mapcache.
+ */
 static void
 demu_handle_io(demu_space_t * space, ioreq_t * ioreq, int is_mmio)
 {
+    vmiop_bool_t in_monitor = vmiop_true;
+
     if (space == NULL)
         goto fail1;
 
-    if (ioreq->dir == IOREQ_READ) {
+    if (ioreq->size == 0 || ioreq->size > sizeof(uint64_t))
+        goto fail2;
+
+    if (!space->ops->unlocked || ioreq->data_is_ptr)
+        vmiope_enter_monitor(&in_monitor);
+
+    if (ioreq->data_is_ptr) {
+        demu_handle_io_ptr(space, ioreq, is_mmio);
+    } else if (ioreq->dir == IOREQ_WRITE && ioreq->count > 1 && is_mmio) {
+        demu_handle_io_fill(space, ioreq);
+    } else if (ioreq->dir == IOREQ_READ) {
         int i, sign;
 
         sign = ioreq->df ? -1 : 1;
 
         for (i = 0; i < ioreq->count; i++) {
-            if (!ioreq->data_is_ptr) {
-                ioreq->data =
-                    demu_io_read(space, ioreq->addr, ioreq->size);
-            } else {
-                uint64_t data;
-
-                data = demu_io_read(space, ioreq->addr, ioreq->size);
-
-                __copy_to_guest_memory(ioreq->data +
-                                       (sign * i * ioreq->size),
-                                       ioreq->size, (uint8_t *) & data);
-            }
+            ioreq->data = demu_io_read(space, ioreq->addr, ioreq->size);
 
             if (is_mmio)
                 ioreq->addr += sign * ioreq->size;
@@ -1689,33 +3401,52 @@ demu_handle_io(demu_space_t * space, ioreq_t * ioreq, int is_mmio)
         sign = ioreq->df ? -1 : 1;
 
         for (i = 0; i < ioreq->count; i++) {
-            if (!ioreq->data_is_ptr) {
-                demu_io_write(space, ioreq->addr, ioreq->size,
-                              ioreq->data);
-            } else {
-                uint64_t data;
-
-                __copy_from_guest_memory(ioreq->data +
-                                         (sign * i * ioreq->size),
-                                         ioreq->size, (uint8_t *) & data);
-
-                demu_io_write(space, ioreq->addr, ioreq->size, data);
-            }
+            demu_io_write(space, ioreq->addr, ioreq->size, ioreq->data);
 
             if (is_mmio)
                 ioreq->addr += sign * ioreq->size;
         }
     }
 
+    if (!in_monitor)
+        vmiope_leave_monitor(NULL);
+
     return;
 
+fail2:
+    ERR("fail2: bad size %u", ioreq->size);
+
 fail1:
     ERR("fail1");
 }
 
+static trace_point_t demu_ioreq_trace_point(uint8_t type)
+{
+    switch (type) {
+    case IOREQ_TYPE_PIO:
+        return TRACE_IOREQ_PIO;
+    case IOREQ_TYPE_COPY:
+        return TRACE_IOREQ_COPY;
+    case IOREQ_TYPE_PCI_CONFIG:
+        return TRACE_IOREQ_PCI_CONFIG;
+    case IOREQ_TYPE_INVALIDATE:
+        return TRACE_IOREQ_INVALIDATE;
+    default:
+        return TRACE_IOREQ_OTHER;
+    }
+}
+
 static void demu_handle_ioreq(ioreq_t * ioreq)
 {
     demu_space_t *space;
+    vmiop_bool_t in_monitor;
+    trace_point_t point;
+    uint64_t start;
+
+    point = demu_ioreq_trace_point(ioreq->type);
+    start = trace_begin(point);
+
+    demu_space_read_begin();
 
     switch (ioreq->type) {
     case IOREQ_TYPE_PIO:
@@ -1743,78 +3474,100 @@ static void demu_handle_ioreq(ioreq_t * ioreq)
         break;
 
     case IOREQ_TYPE_INVALIDATE:
+        vmiope_enter_monitor(&in_monitor);
         mapcache_invalidate();
+        if (!in_monitor)
+            vmiope_leave_monitor(NULL);
         break;
 
     default:
         ERR("UNKNOWN (%02x)", ioreq->type);
         break;
     }
+
+    demu_space_read_end();
+
+    trace_end(point, start);
 }
 
 static int demu_timer_create(void)
 {
     DBG_V("Create timer");
-    int pfd[2];
-    int flags;
-    timer_t tid;
-    struct sigevent sigev;
+    int fd;
 
-    memset(pfd, 0, sizeof(pfd));
-    if (pipe(pfd) < 0)
+    fd = event_timer_create();
+    if (fd < 0)
         goto fail1;
 
-    flags = fcntl(pfd[0], F_GETFL);
-    fcntl(pfd[0], F_SETFL, flags | O_NONBLOCK);
+    demu_state.timer_fd = fd;
 
-    flags = fcntl(pfd[1], F_GETFL);
-    fcntl(pfd[1], F_SETFL, flags | O_NONBLOCK);
+    return fd;
 
-    sigev.sigev_notify = SIGEV_SIGNAL;
-    sigev.sigev_signo = SIGRTMIN;
-    sigev.sigev_value.sival_int = pfd[1];
+fail1:
+    ERR("fail1");
 
-    if (timer_create(CLOCK_MONOTONIC, &sigev, &tid) < 0)
-        goto fail2;
+    return -1;
+}
+
+static void demu_timer_destroy(void)
+{
+    DBG_V("Destroy timer");
+    close(demu_state.timer_fd);
+    demu_state.timer_fd = -1;
+}
 
-    demu_state.timer_id = tid;
+/*
+ * Export the frame counters as "<produced> <skipped>". Each write is a
+ * xenstore transaction, so unless forced they are published at most
+ * once per CONSOLE_PUBLISH_PERIOD, and only when they have changed.
+ */
+static void demu_console_publish(int force)
+{
+    char key[keysize];
+    char value[sizeof("XXXXXXXXXXXXXXXXXXXX XXXXXXXXXXXXXXXXXXXX")];
+    uint64_t now = demu_now();
 
-    return pfd[0];
+    if (demu_state.console_frames == demu_state.console_published_frames &&
+        demu_state.console_skipped == demu_state.console_published_skipped)
+        return;
 
-fail2:
-    ERR("fail2");
+    if (!force && now < demu_state.console_publish_deadline)
+        return;
 
-    close(pfd[1]);
-    close(pfd[0]);
+    demu_state.console_published_frames = demu_state.console_frames;
+    demu_state.console_published_skipped = demu_state.console_skipped;
+    demu_state.console_publish_deadline = now + CONSOLE_PUBLISH_PERIOD;
 
-fail1:
-    ERR("fail1: %s", strerror(errno));
+    gen_key(key, xenstore_console_str);
+    (void) snprintf(value, sizeof(value), "%"PRIu64" %"PRIu64,
+                    demu_state.console_frames, demu_state.console_skipped);
 
-    return -1;
+    if (!xs_write(demu_state.xsh, 0, key, value, strlen(value)))
+        ERRN("xs_write");
 }
 
-static void demu_timer_destroy(void)
+static int demu_console_set_period(unsigned int period)
 {
-    DBG_V("Destroy timer");
-    timer_delete(demu_state.timer_id);
+    if (period == demu_state.console_period)
+        return 0;
+
+    if (event_timer_set(demu_state.timer_fd, period) < 0)
+        return -1;
+
+    DBG_V("console period %u", period);
+    demu_state.console_period = period;
+
+    return 0;
 }
 
 int demu_console_start(void)
 {
 
     DBG_V("console_start");
-    time_t s;
-    long ns;
-    struct itimerspec it;
     vmiop_error_t error_code;
 
-    s = CONSOLE_REFRESH_PERIOD / 1000000;
-    ns = (CONSOLE_REFRESH_PERIOD - (s * 1000000)) * 1000;
-
-    it.it_interval.tv_sec = it.it_value.tv_sec = s;
-    it.it_interval.tv_nsec = it.it_value.tv_nsec = ns;
-
-    if (timer_settime(demu_state.timer_id, 0, &it, NULL) < 0)
+    demu_state.console_period = 0;
+    if (demu_console_set_period(demu_state.console_min_period) < 0)
         goto fail1;
 
     demu_state.console_active = 1;
@@ -1840,7 +3593,6 @@ fail1:
 static int demu_console_stop(void)
 {
     DBG_V("console_stop");
-    struct itimerspec it;
     vmiop_error_t error_code;
 
     error_code = vmiope_set_vnc_console_state(&vmiop_presentation,
@@ -1851,11 +3603,14 @@ static int demu_console_stop(void)
         ERR("vmiope_set_vnc_console_state failed");
 
     demu_state.console_active = 0;
+    demu_console_publish(1);
 
-    it.it_interval.tv_sec = it.it_value.tv_sec = 0;
-    it.it_interval.tv_nsec = it.it_value.tv_nsec = 0;
+    if (demu_state.footprint) {
+        surface_release();
+        demu_footprint_trim();
+    }
 
-    if (timer_settime(demu_state.timer_id, 0, &it, NULL) < 0)
+    if (demu_console_set_period(0) < 0)
         goto fail1;
 
     INFO("done");
@@ -1875,16 +3630,28 @@ static void demu_console_refresh(void)
     if (!demu_state.console_active)
         return;
 
-    if (vmiop_vga_in_VGA_state()) {
-        surface_refresh(demu_state.full_update);
-        demu_state.full_update = 0;
-    }
+    if (vmiop_vga_in_VGA_state() &&
+            surface_refresh(demu_state.full_update)) {
+        demu_state.console_frames++;
+
+        /* Activity: go straight back to the fast rate */
+        (void) demu_console_set_period(demu_state.console_min_period);
+    } else {
+        unsigned int period = demu_state.console_period * 2;
+
+        demu_state.console_skipped++;
 
-    assert(demu_state.scount > 0);
-    demu_state.scount--;
+        /* Idle: back off towards the slow rate */
+        if (period > demu_state.console_max_period)
+            period = demu_state.console_max_period;
+        (void) demu_console_set_period(period);
+    }
+    demu_state.full_update = 0;
 
-    if (demu_state.scount == 0)
+    if (demu_now() >= demu_state.console_deadline)
         demu_console_stop();
+    else
+        demu_console_publish(0);
 }
 
 static int demu_socket_create(void)
@@ -1950,10 +3717,13 @@ static void demu_socket_read(void)
 
     n = recvfrom(demu_state.sfd, &buf, 1, MSG_DONTWAIT, &client, &socklen);
     if (n == 1)
-        demu_state.scount = 5000000 / CONSOLE_REFRESH_PERIOD;
+        demu_state.console_deadline = demu_now() +
+            CONSOLE_KEEPALIVE_PERIOD;
 
     if (!demu_state.console_active)
         demu_console_start();
+    else
+        (void) demu_console_set_period(demu_state.console_min_period);
 }
 
 static void demu_socket_destroy(void)
@@ -1965,6 +3735,8 @@ static void demu_socket_destroy(void)
 
 static void __demu_seq_next(demu_seq_t seq, char *seq_str)
 {
+    uint64_t now;
+
     assert(demu_state.seq < DEMU_SEQ_INITIALIZED);
     ++demu_state.seq;
 
@@ -1974,7 +3746,11 @@ static void __demu_seq_next(demu_seq_t seq, char *seq_str)
     }
 
     seq_str += strlen("DEMU_SEQ_");
-    DBG("> %s", seq_str);
+    now = demu_now();
+    demu_state.seq_us[seq] = now - demu_state.seq_last;
+    demu_state.seq_name[seq] = seq_str;
+    demu_state.seq_last = now;
+    DBG("> %s (%" PRIu64 " us)", seq_str, demu_state.seq_us[seq]);
 
     switch (seq) {
     case DEMU_SEQ_SERVER_REGISTERED:
@@ -2002,15 +3778,240 @@ static void __demu_seq_next(demu_seq_t seq, char *seq_str)
 
         break;
     }
+    case DEMU_SEQ_IOREQ_WORKERS_STARTED:
+        DBG("%u ioreq workers", demu_state.ioreq_threads);
+        break;
+
     default:
         break;
     }
 }
 
+/*
+ * Populating, mapping and clearing the VRAM is the longest hypervisor
+ * step of a fresh start. It only needs the domain and the (fixed)
+ * reserved VRAM address, so it is done on its own thread while plugins
+ * are loaded and the ioreq server is set up, and collected at the
+ * VRAM_MAPPED stage. The plugins can call back into demu while they are
+ * initialized, so everything that reads the VRAM mapping, translates
+ * the VRAM or moves it (demu_get_vram(), demu_vram_table_build() and
+ * demu_set_vram_addr()) collects it first with demu_vram_load_wait().
+ */
+static void *demu_vram_load_thread(void *arg)
+{
+    uint64_t start;
+    uint8_t *vram;
+
+    (void) arg;
+
+    start = demu_now();
+    vram = demu_map_guest_range(demu_state.vram_addr, VRAM_RESERVED_SIZE,
+                                0, 1);
+    demu_state.vram_map_us = demu_now() - start;
+
+    if (vram != NULL) {
+        start = demu_now();
+        memset(vram, 0, VRAM_RESERVED_SIZE);
+        demu_state.vram_zero_us = demu_now() - start;
+    }
+
+    demu_state.vram_loaded = vram;
+    return NULL;
+}
+
+static int demu_vram_load_start(void)
+{
+    int rc;
+
+    demu_state.vram_loaded = NULL;
+
+    rc = pthread_create(&demu_state.vram_thread, NULL,
+                        demu_vram_load_thread, NULL);
+    if (rc != 0) {
+        errno = rc;
+        goto fail1;
+    }
+
+    demu_state.vram_loading = 1;
+    return 0;
+
+fail1:
+    ERR("fail1");
+
+    return -1;
+}
+
+/*
+ * Collect the VRAM mapped by demu_vram_load_thread(), if one was started.
+ * This may be called from any thread; the first caller joins the load
+ * thread and the others wait for it on the lock.
+ */
+static int demu_vram_load_wait(void)
+{
+    int rc = 0;
+
+    if (!__atomic_load_n(&demu_state.vram_loading, __ATOMIC_ACQUIRE))
+        return 0;
+
+    pthread_mutex_lock(&demu_state.vram_load_lock);
+
+    if (demu_state.vram_loading) {
+        (void) pthread_join(demu_state.vram_thread, NULL);
+
+        demu_state.vram = demu_state.vram_loaded;
+        __atomic_store_n(&demu_state.vram_loading, 0, __ATOMIC_RELEASE);
+    }
+
+    if (demu_state.vram == NULL)
+        rc = -1;
+
+    pthread_mutex_unlock(&demu_state.vram_load_lock);
+
+    return rc;
+}
+
+/*
+ * Publish how long each initialization stage took, as a list of
+ * "STAGE:us" pairs followed by the VRAM map and clear times (which
+ * overlap the stages when the VRAM is loaded in the background) and
+ * the total.
+ */
+static void demu_startup_publish(uint64_t start)
+{
+    char key[keysize];
+    char value[1024];
+    size_t len = 0;
+    int i;
+
+    for (i = DEMU_SEQ_UNINITIALIZED + 1; i < DEMU_NR_SEQS &&
+             len < sizeof(value); i++) {
+        if (demu_state.seq_name[i] == NULL)
+            continue;
+
+        len += snprintf(value + len, sizeof(value) - len, "%s:%" PRIu64 " ",
+                        demu_state.seq_name[i], demu_state.seq_us[i]);
+    }
+
+    if (len < sizeof(value))
+        len += snprintf(value + len, sizeof(value) - len,
+                        "vram-map:%" PRIu64 " vram-zero:%" PRIu64
+                        " total:%" PRIu64,
+                        demu_state.vram_map_us, demu_state.vram_zero_us,
+                        demu_state.seq_last - start);
+    if (len >= sizeof(value))
+        len = sizeof(value) - 1;
+
+    INFO("startup: %s", value);
+
+    gen_key(key, xenstore_startup_str);
+    if (!xs_write(demu_state.xsh, 0, key, value, len))
+        ERRN("xs_write startup");
+}
+
+/*
+ * Footprint mode is for hosts packed with small VMs: a smaller mapcache
+ * by default, fewer malloc arenas, and state that is only needed by the
+ * console or a migration is given back once they are done with it.
+ */
+#define DEMU_FOOTPRINT_MAPCACHE_ENTRIES     64
+#define DEMU_FOOTPRINT_MAPCACHE_CHUNK_PAGES 4
+#define DEMU_FOOTPRINT_ARENAS               2
+
+static void demu_footprint_trim(void)
+{
+    if (!demu_state.footprint)
+        return;
+
+    vmiope_buffer_trim();
+    (void) malloc_trim(0);
+}
+
+/*
+ * Memory use as "rss:<kB> anon:<kB> file:<kB> shmem:<kB>" from the
+ * kernel, followed by what each subsystem holds, also in kB.
+ */
+static size_t demu_memory_format(char *value, size_t size)
+{
+    static const char *field[] = { "VmRSS:", "RssAnon:", "RssFile:",
+                                   "RssShmem:" };
+    static const char *name[] = { "rss", "anon", "file", "shmem" };
+    unsigned long kb[4] = { 0 };
+    vmiope_buffer_stats_t buffers;
+    size_t surface, text, table, mapped, migrate, vram;
+    char line[128];
+    size_t len;
+    FILE *f;
+    int i;
+
+    f = fopen("/proc/self/status", "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL)
+            for (i = 0; i < 4; i++)
+                if (strncmp(line, field[i], strlen(field[i])) == 0)
+                    kb[i] = strtoul(line + strlen(field[i]), NULL, 10);
+        fclose(f);
+    }
+
+    vram = (demu_state.vram != NULL) ? VRAM_RESERVED_SIZE : 0;
+    surface_get_memory(&surface, &text);
+    mapcache_get_memory(&table, &mapped);
+    vmiope_buffer_get_stats(&buffers);
+
+    vmiope_lock_acquire(&demu_writer.lock);
+    migrate = (size_t)demu_writer.pool_size * MAX_REC_SIZE;
+    pthread_mutex_unlock(&demu_writer.lock);
+
+    vmiope_lock_acquire(&demu_restore.lock);
+    if (demu_restore.ring != NULL)
+        migrate += DEMU_RESTORE_RING * MAX_REC_SIZE;
+    pthread_mutex_unlock(&demu_restore.lock);
+
+    len = 0;
+    for (i = 0; i < 4 && len < size; i++)
+        len += snprintf(value + len, size - len, "%s:%lu ", name[i], kb[i]);
+
+    if (len < size)
+        len += snprintf(value + len, size - len,
+                        "vram:%zu surface:%zu text:%zu mapcache:%zu"
+                        " mapped:%zu migrate:%zu buffers:%" PRIu64,
+                        vram >> 10, surface >> 10, text >> 10, table >> 10,
+                        mapped >> 10, migrate >> 10,
+                        buffers.cached_bytes >> 10);
+    if (len >= size)
+        len = size - 1;
+
+    return len;
+}
+
+static void demu_memory_publish(void)
+{
+    char key[keysize];
+    char value[512];
+    size_t len;
+
+    len = demu_memory_format(value, sizeof(value));
+
+    INFO("memory: %s", value);
+
+    gen_key(key, xenstore_memory_str);
+    if (!xs_write(demu_state.xsh, 0, key, value, len))
+        ERRN("xs_write memory");
+}
+
+/* Event channel handle on which vCPU i's ioreq port is bound */
+static xc_evtchn *demu_ioreq_evtchn(unsigned int i)
+{
+    if (demu_state.ioreq_threads == 0)
+        return demu_state.xceh;
+
+    return demu_state.ioreq_worker[i % demu_state.ioreq_threads].xceh;
+}
+
 static void demu_teardown(void)
 {
     if (demu_state.seq == DEMU_SEQ_INITIALIZED) {
         char key[keysize];
+        char value[512];
 
         gen_key(key, xenstore_pid_str);
         xs_rm(demu_state.xsh, 0, key);
@@ -2018,12 +4019,37 @@ static void demu_teardown(void)
         gen_key(key, xenstore_vram_str);
         xs_rm(demu_state.xsh, 0, key);
 
+        gen_key(key, xenstore_startup_str);
+        xs_rm(demu_state.xsh, 0, key);
+
+        gen_key(key, xenstore_placement_str);
+        xs_rm(demu_state.xsh, 0, key);
+
+        gen_key(key, xenstore_memory_str);
+        xs_rm(demu_state.xsh, 0, key);
+
+        (void) demu_memory_format(value, sizeof(value));
+        INFO("memory: %s", value);
+
+        demu_space_set_stats("pci_config", &demu_state.pci_config);
+        demu_space_set_stats("port", &demu_state.port);
+        demu_space_set_stats("memory", &demu_state.memory);
+        INFO("bufioreq: %" PRIu64 " entries, %" PRIu64 " runs, %" PRIu64
+             " spin hits", demu_state.bufioreq_entries,
+             demu_state.bufioreq_runs, demu_state.bufioreq_spin_hits);
+
 
         xs_rm(demu_state.xsh, 0, key);
 
         DBG("<INITIALIZED");
     }
 
+    if (demu_state.seq >= DEMU_SEQ_IOREQ_WORKERS_STARTED) {
+        DBG("<IOREQ_WORKERS_STARTED");
+
+        demu_ioreq_workers_stop();
+    }
+
     if (demu_state.seq >= DEMU_SEQ_SURFACE_INITIALIZED) {
         DBG("<SURFACE_INITIALIZED");
 
@@ -2036,6 +4062,12 @@ static void demu_teardown(void)
         demu_socket_destroy();
     }
 
+    if (demu_state.seq >= DEMU_SEQ_MAPCACHE_INITIALIZED) {
+        DBG("<MAPCACHE_INITIALIZED");
+
+        mapcache_teardown();
+    }
+
     if (demu_state.seq >= DEMU_SEQ_VMIOP_PLUGINS_REGISTERED) {
         DBG("<VMIOP_PLUGINS_REGISTERED");
     }
@@ -2052,6 +4084,11 @@ static void demu_teardown(void)
         vmiope_shutdown();
     }
 
+    demu_space_set_release(&demu_state.pci_config);
+    demu_space_set_release(&demu_state.port);
+    demu_space_set_release(&demu_state.memory);
+    demu_registry_release();
+
     if (demu_state.seq >= DEMU_SEQ_PORTS_BOUND) {
         DBG("<EVTCHN_PORTS_BOUND");
     }
@@ -2066,8 +4103,8 @@ static void demu_teardown(void)
 
             port = demu_state.ioreq_local_port[i];
 
-            if (port >= 0)
-                (void) xc_evtchn_unbind(demu_state.xceh, port);
+            if (port >= 0 && demu_ioreq_evtchn(i) != NULL)
+                (void) xc_evtchn_unbind(demu_ioreq_evtchn(i), port);
 
             if (i == 0) {
                 port = demu_state.bufioreq_local_port;
@@ -2077,12 +4114,18 @@ static void demu_teardown(void)
             }
         }
 
+        for (i = 0; i < demu_state.ioreq_threads; i++) {
+            if (demu_state.ioreq_worker[i].xceh != NULL)
+                xc_evtchn_close(demu_state.ioreq_worker[i].xceh);
+        }
+
         xc_evtchn_close(demu_state.xceh);
     }
 
     if (demu_state.seq >= DEMU_SEQ_PORT_ARRAY_ALLOCATED) {
         DBG("<PORT_ARRAY_ALLOCATED");
 
+        free(demu_state.ioreq_worker);
         free(demu_state.ioreq_local_port);
     }
 
@@ -2112,10 +4155,14 @@ static void demu_teardown(void)
         DBG("<SERVER_REGISTERED");
     }
 
-    if (demu_state.seq >= DEMU_SEQ_VRAM_MAPPED) {
+    /* initialization may have failed with the VRAM still loading */
+    (void) demu_vram_load_wait();
+
+    if (demu_state.vram != NULL) {
         DBG("<VRAM_MAPPED");
 
         munmap(demu_state.vram, VRAM_RESERVED_SIZE);
+        demu_state.vram = NULL;
     }
 
     if (demu_state.seq >= DEMU_SEQ_XS_OPEN &&
@@ -2135,6 +4182,13 @@ static void demu_teardown(void)
 
         xs_close(demu_state.xsh);
     }
+
+    free(demu_state.ioreq_cpu);
+    demu_state.ioreq_cpu = NULL;
+    demu_state.ioreq_ncpus = 0;
+
+    trace_teardown();
+
     demu_state.seq = DEMU_SEQ_UNINITIALIZED;
 }
 
@@ -2170,24 +4224,28 @@ static void demu_sighup(int num)
 
 static struct sigaction sigusr1_handler;
 
+/*
+ * SIGUSR1 asks for a memory report, which the main loop publishes. The
+ * signal may be taken by any thread that does not block it (plugin
+ * threads included), so the handler also wakes the main loop rather than
+ * leaving the report until its next event. Writing to the wakeup eventfd
+ * is async-signal-safe.
+ */
+static volatile sig_atomic_t demu_memory_report;
+
 static void demu_sigusr1(int num)
 {
     DBG("%s", strsignal(num));
+    demu_memory_report = 1;
 
-    sigaction(SIGUSR1, &sigusr1_handler, NULL);
-}
-
-static struct sigaction sigrt_handler;
+    if (demu_state.loop != NULL) {
+        int saved_errno = errno;
 
-static void demu_sigrt(int num, siginfo_t * si, void *arg)
-{
-    int tfd;
-    char buf = 'T';
-
-    sigaction(SIGRTMIN, &sigrt_handler, NULL);
+        event_loop_wakeup(demu_state.loop);
+        errno = saved_errno;
+    }
 
-    tfd = (int) si->si_value.sival_int;
-    write(tfd, &buf, 1);
+    sigaction(SIGUSR1, &sigusr1_handler, NULL);
 }
 
 static struct sigaction sigseg_handler;
@@ -2308,6 +4366,26 @@ int init_io()
     for (i = 0; i < demu_state.vcpus; i++)
         demu_state.ioreq_local_port[i] = -1;
 
+    if (demu_state.ioreq_threads != 0) {
+        demu_state.ioreq_worker = calloc(demu_state.ioreq_threads,
+                                         sizeof(demu_ioreq_worker_t));
+        if (demu_state.ioreq_worker == NULL) {
+            ERRN("ioreq_worker calloc");
+            free(demu_state.ioreq_local_port);
+            SET_ERROR(dec_nomem);
+            return -1;
+        }
+
+        for (i = 0; i < demu_state.ioreq_threads; i++) {
+            demu_ioreq_worker_t *worker = &demu_state.ioreq_worker[i];
+
+            worker->index = i;
+            worker->cpu = (demu_state.ioreq_ncpus != 0) ?
+                demu_state.ioreq_cpu[i % demu_state.ioreq_ncpus] : -1;
+            worker->stop_fd[0] = worker->stop_fd[1] = -1;
+        }
+    }
+
     demu_seq_next(DEMU_SEQ_PORT_ARRAY_ALLOCATED);
 
     demu_state.xceh = xc_evtchn_open(NULL, 0);
@@ -2319,14 +4397,23 @@ int init_io()
 
     demu_seq_next(DEMU_SEQ_EVTCHN_OPEN);
 
+    for (i = 0; i < demu_state.ioreq_threads; i++) {
+        demu_state.ioreq_worker[i].xceh = xc_evtchn_open(NULL, 0);
+        if (demu_state.ioreq_worker[i].xceh == NULL) {
+            ERRN("xc_evtchn_open (worker)");
+            SET_ERROR(dec_libxc);
+            return -1;
+        }
+    }
+
     for (i = 0; i < demu_state.vcpus; i++) {
         evtchn_port_t ioreq_port =
             demu_state.shared_iopage->vcpu_ioreq[i].vp_eport;
 
         DBG("VCPU%d evtchn %d", i, ioreq_port);
 
-        rc = xc_evtchn_bind_interdomain(demu_state.xceh, demu_state.domid,
-                                        ioreq_port);
+        rc = xc_evtchn_bind_interdomain(demu_ioreq_evtchn(i),
+                                        demu_state.domid, ioreq_port);
         if (rc < 0) {
             ERR("xc_evtchn_bind_interdomain failed with %d", rc);
             SET_ERROR(dec_libxc);
@@ -2364,7 +4451,10 @@ int enable_io()
 
     demu_state.io_up = 1;
 
-    for (space = demu_state.pci_config; space != NULL; space = space->next) {
+    vmiope_lock_acquire(&demu_registry.lock);
+
+    for (space = demu_state.pci_config.head; space != NULL;
+         space = space->next) {
         if (space->io_init == 0) {
             rc = xc_hvm_map_pcidev_to_ioreq_server(demu_state.xch,
                                                    demu_state.domid,
@@ -2374,13 +4464,14 @@ int enable_io()
                                                    demu_state.function);
             if (rc < 0) {
                 ERR("xc_hvm_map_pcidev_to_ioreq_server failed, %d", rc);
-                return -1;
+                goto fail1;
             }
             space->io_init = 1;
         }
     }
 
-    for (space = demu_state.memory; space != NULL; space = space->next) {
+    for (space = demu_state.memory.head; space != NULL;
+         space = space->next) {
         if (space->io_init == 0) {
             rc = xc_hvm_map_io_range_to_ioreq_server(demu_state.xch,
                     demu_state.domid,
@@ -2389,13 +4480,14 @@ int enable_io()
                     space->end);
             if (rc < 0) {
                 ERR("xc_hvm_map_io_range_to_ioreq_server failed with  memory, %d", rc);
-                return -1;
+                goto fail1;
             }
             space->io_init = 1;
         }
     }
 
-    for (space = demu_state.port; space != NULL; space = space->next) {
+    for (space = demu_state.port.head; space != NULL;
+         space = space->next) {
         if (space->io_init == 0) {
             rc = xc_hvm_map_io_range_to_ioreq_server(demu_state.xch,
                     demu_state.domid,
@@ -2404,27 +4496,178 @@ int enable_io()
                     space->end);
             if (rc < 0) {
                 ERR("xc_hvm_map_io_range_to_ioreq_server failed with port, %d", rc);
-                return -1;
+                goto fail1;
             }
             space->io_init = 1;
         }
     }
+    pthread_mutex_unlock(&demu_registry.lock);
+
+    return 0;
+
+fail1:
+    pthread_mutex_unlock(&demu_registry.lock);
+
+    return -1;
+}
+
+
+/* Parse a cpu list such as "0,2,4-7" into an array of cpu numbers */
+static int demu_parse_cpu_list(const char *str, int **cpup,
+                               unsigned int *countp)
+{
+    cpu_set_t set;
+    int *cpu;
+    unsigned int count = 0;
+    int i;
+
+    if (numa_parse_cpus(str, &set) < 0)
+        return -1;
+
+    cpu = malloc(sizeof(int) * CPU_COUNT(&set));
+    if (cpu == NULL)
+        return -1;
+
+    for (i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &set))
+            cpu[count++] = i;
+
+    *cpup = cpu;
+    *countp = count;
+    return 0;
+}
+
+/*
+ * Place demu near the GPU. Unless given explicitly, the main loop, the
+ * ioreq workers and plugin threads all run on the CPUs local to the
+ * GPU's node, as far as dom0 knows them; ioreq workers given a list are
+ * each pinned to one CPU of it, as before. Threads demu creates later
+ * inherit the main loop's CPUs. This has to happen before the plugins
+ * are loaded for their threads and allocations to follow.
+ */
+static int demu_placement_initialize(const char *gpu, const char *main_cpus,
+                                     const char *plugin_cpus)
+{
+    cpu_set_t local;
+    int have_local;
+    int rc;
+
+    if (numa_initialize(demu_state.xch, gpu) < 0)
+        ERR("GPU locality unknown, threads and memory are not placed");
+
+    have_local = (numa_local_cpus(&local) == 0);
+
+    if (main_cpus != NULL) {
+        if (numa_parse_cpus(main_cpus, &demu_state.main_cpuset) < 0)
+            goto fail1;
+        demu_state.main_cpuset_valid = 1;
+    } else if (have_local) {
+        demu_state.main_cpuset = local;
+        demu_state.main_cpuset_valid = 1;
+    }
+
+    if (plugin_cpus != NULL) {
+        if (numa_parse_cpus(plugin_cpus, &demu_state.plugin_cpuset) < 0)
+            goto fail2;
+        demu_state.plugin_cpuset_valid = 1;
+    } else if (have_local) {
+        demu_state.plugin_cpuset = local;
+        demu_state.plugin_cpuset_valid = 1;
+    }
+
+    if (demu_state.ioreq_ncpus == 0 && have_local) {
+        demu_state.ioreq_cpuset = local;
+        demu_state.ioreq_cpuset_valid = 1;
+    }
+
+    if (demu_state.main_cpuset_valid) {
+        rc = pthread_setaffinity_np(pthread_self(),
+                                    sizeof(demu_state.main_cpuset),
+                                    &demu_state.main_cpuset);
+        if (rc != 0)
+            ERR("failed to bind main loop: %s", strerror(rc));
+    }
+
+    if (demu_state.plugin_cpuset_valid)
+        vmiope_set_thread_affinity(&demu_state.plugin_cpuset);
+
     return 0;
+
+fail2:
+    ERR("fail2: bad plugin cpu list '%s'", plugin_cpus);
+    return -1;
+
+fail1:
+    ERR("fail1: bad main cpu list '%s'", main_cpus);
+    return -1;
 }
 
+/* Export placement as "node:<n> xen-node:<n> main:<cpus> ..." */
+static void demu_placement_publish(void)
+{
+    char key[keysize];
+    char value[1024];
+    char cpus[3][256];
+    size_t len;
+
+    strcpy(cpus[0], "-");
+    if (demu_state.main_cpuset_valid)
+        numa_format_cpus(&demu_state.main_cpuset, cpus[0], sizeof(cpus[0]));
+
+    strcpy(cpus[1], "-");
+    if (demu_state.ioreq_ncpus != 0) {
+        cpu_set_t set;
+        unsigned int i;
+
+        CPU_ZERO(&set);
+        for (i = 0; i < demu_state.ioreq_ncpus; i++)
+            CPU_SET(demu_state.ioreq_cpu[i], &set);
+
+        numa_format_cpus(&set, cpus[1], sizeof(cpus[1]));
+    } else if (demu_state.ioreq_cpuset_valid) {
+        numa_format_cpus(&demu_state.ioreq_cpuset, cpus[1], sizeof(cpus[1]));
+    }
+
+    strcpy(cpus[2], "-");
+    if (demu_state.plugin_cpuset_valid)
+        numa_format_cpus(&demu_state.plugin_cpuset, cpus[2],
+                         sizeof(cpus[2]));
+
+    len = snprintf(value, sizeof(value),
+                   "node:%d xen-node:%d main:%s ioreq:%s plugin:%s",
+                   numa_node(), numa_xen_node(), cpus[0], cpus[1], cpus[2]);
+    if (len >= sizeof(value))
+        len = sizeof(value) - 1;
+
+    INFO("placement: %s", value);
+
+    gen_key(key, xenstore_placement_str);
+    if (!xs_write(demu_state.xsh, 0, key, value, len))
+        ERRN("xs_write placement");
+}
 
 static int
 demu_initialize(domid_t domid, unsigned int vcpus,
                 unsigned int bus, unsigned int device,
                 unsigned int function, const char *gpu,
-                const char *config)
+                const char *config, unsigned int ioreq_threads,
+                const char *ioreq_cpus, const char *main_cpus,
+                const char *plugin_cpus)
 {
     int rc;
     vmiop_error_t error_code;
     vmiop_handle_t handle;
     xc_dominfo_t dominfo;
+    unsigned int entries;
+    unsigned int chunk_pages;
+    int tile_hash;
+    uint64_t spin_us;
     char key[keysize];
     char value[sizeof("XXXXXXXXXXXXXXXX")];
+    uint64_t start;
+
+    start = demu_now();
+    demu_state.seq_last = start;
 
     demu_state.domid = domid;
     demu_state.vcpus = vcpus;
@@ -2436,8 +4679,26 @@ demu_initialize(domid_t domid, unsigned int vcpus,
     demu_state.statefile_mode = SEC_NOTREADY;
     demu_state.io_up = 0;
 
+    if (ioreq_threads > vcpus)
+        ioreq_threads = vcpus;
+    demu_state.ioreq_threads = ioreq_threads;
+
+    if (ioreq_cpus != NULL &&
+        demu_parse_cpu_list(ioreq_cpus, &demu_state.ioreq_cpu,
+                            &demu_state.ioreq_ncpus) < 0) {
+        ERR("Bad ioreq cpu list '%s'", ioreq_cpus);
+        return -1;
+    }
+
     pthread_mutex_init(&sent_stats.lock, NULL);
 
+    vmiope_lock_profile_register("space", &demu_registry.lock);
+    vmiope_lock_profile_register("dirty", &dirty_acc.lock);
+    vmiope_lock_profile_register("writer", &demu_writer.lock);
+    vmiope_lock_profile_register("compress", &demu_compress.lock);
+    vmiope_lock_profile_register("sent-stats", &sent_stats.lock);
+    vmiope_lock_profile_register("restore", &demu_restore.lock);
+
     (void) snprintf(demu_state.config, sizeof(demu_state.config),
                     "%s,gpu-pci-id=%s", config, gpu);
 
@@ -2469,6 +4730,14 @@ demu_initialize(domid_t domid, unsigned int vcpus,
 
     demu_seq_next(DEMU_SEQ_XC_OPEN);
 
+    rc = demu_placement_initialize(gpu, main_cpus, plugin_cpus);
+    if (rc < 0) {
+        SET_ERROR(dec_internal);
+        return -1;
+    }
+
+    demu_placement_publish();
+
     rc = xc_domain_getinfo(demu_state.xch, demu_state.domid, 1, &dominfo);
     if (rc < 0 || dominfo.domid != demu_state.domid) {
         ERR("xc_domain_getinfo failed with %d", rc);
@@ -2488,6 +4757,21 @@ demu_initialize(domid_t domid, unsigned int vcpus,
 
     demu_seq_next(DEMU_SEQ_VMIOP_ENV_INITIALIZED);
 
+    /*
+     * A fresh VRAM is at the reserved address, so it can be loaded now.
+     * (This must follow vmiope_initialize(), which samples the guest's
+     * maximum gpfn before the VRAM extends it.) On resume the address
+     * comes from the saved state, and the pages already exist.
+     */
+    if (!demu_resuming) {
+        rc = demu_vram_load_start();
+        if (rc < 0) {
+            ERR("demu_vram_load_start failed with %d", rc);
+            SET_ERROR(dec_internal);
+            return -1;
+        }
+    }
+
     error_code = vmiop_vga_init();
     if (error_code != vmiop_success) {
         ERR("vmiop_vga_init failed with %d", error_code);
@@ -2515,6 +4799,12 @@ demu_initialize(domid_t domid, unsigned int vcpus,
 
     INFO("PLUGIN CONFIG: %s", demu_state.config);
 
+    /*
+     * The plugins are loaded and initialized while the VRAM may still be
+     * loading. The VRAM entry points they can call (demu_get_vram(),
+     * demu_vram_table_get() and demu_set_vram_addr()) wait for the load
+     * themselves, so this overlap needs no wait here.
+     */
     error_code = vmiope_process_configuration(demu_state.config);
     if (error_code != vmiop_success) {
         ERR("vmiope_process_configuration failed with %d", error_code);
@@ -2522,11 +4812,64 @@ demu_initialize(domid_t domid, unsigned int vcpus,
         return -1;
     }
 
+    entries = vmiope_config_get_long(0, "mapcacheEntries");
+    chunk_pages = vmiope_config_get_long(0, "mapcacheChunkPages");
+    tile_hash = vmiope_config_get_long(0, "consoleTileHash");
+    demu_state.console_min_period =
+        vmiope_config_get_long(CONSOLE_REFRESH_PERIOD, "consoleMinPeriod");
+    demu_state.console_max_period =
+        vmiope_config_get_long(CONSOLE_IDLE_PERIOD, "consoleMaxPeriod");
+    if (demu_state.console_min_period == 0)
+        demu_state.console_min_period = CONSOLE_REFRESH_PERIOD;
+    if (demu_state.console_max_period < demu_state.console_min_period)
+        demu_state.console_max_period = demu_state.console_min_period;
+    demu_writer_set_depth(vmiope_config_get_long(DEMU_WRITE_DEPTH_DEFAULT,
+                                                 "migrateWriteDepth"));
+    demu_compress.level = vmiope_config_get_long(0, "migrateCompress");
+    demu_migrate_stats.period_us =
+        vmiope_config_get_long(DEMU_MIGRATE_PASS_PERIOD, "migratePassPeriod");
+    demu_migrate_stats.downtime_us =
+        vmiope_config_get_long(DEMU_MIGRATE_DOWNTIME, "migrateDowntime");
+    spin_us = vmiope_config_get_long(0, "bufioreqSpinUs");
+    if (spin_us > DEMU_BUFIOREQ_SPIN_MAX) {
+        INFO("bufioreqSpinUs %" PRIu64 " capped at %d", spin_us,
+             DEMU_BUFIOREQ_SPIN_MAX);
+        spin_us = DEMU_BUFIOREQ_SPIN_MAX;
+    }
+    demu_state.bufioreq_spin_us = spin_us;
+    demu_state.footprint = vmiope_config_get_long(0, "lowFootprint");
+    if (demu_state.footprint) {
+        if (entries == 0)
+            entries = DEMU_FOOTPRINT_MAPCACHE_ENTRIES;
+        if (chunk_pages == 0)
+            chunk_pages = DEMU_FOOTPRINT_MAPCACHE_CHUNK_PAGES;
+        (void) mallopt(M_ARENA_MAX, DEMU_FOOTPRINT_ARENAS);
+        INFO("low footprint mode");
+    }
+    if (vmiope_config_get_long(0, "traceEnable") &&
+        trace_initialize(domid) < 0)
+        ERR("trace_initialize failed, continuing without tracing");
+#ifndef DEMU_LZ4
+    if (demu_compress.level) {
+        ERR("migrateCompress set, but built without LZ4 support");
+        demu_compress.level = 0;
+    }
+#endif
+
     vmiope_leave_monitor(NULL);
 
 
     demu_seq_next(DEMU_SEQ_VMIOP_PLUGINS_REGISTERED);
 
+    rc = mapcache_initialize(entries, chunk_pages);
+    if (rc < 0) {
+        ERR("mapcache_initialize failed with %d", rc);
+        SET_ERROR(dec_nomem);
+        return -1;
+    }
+
+    demu_seq_next(DEMU_SEQ_MAPCACHE_INITIALIZED);
+
     if (demu_resuming) {
         set_demu_status("resuming");
         if (demu_get_state()) {
@@ -2538,6 +4881,11 @@ demu_initialize(domid_t domid, unsigned int vcpus,
         DBG("Device state loaded");
     }
 
+    /*
+     * Setting up the ioreq server only maps the registered MMIO and port
+     * ranges to it and never touches the VRAM, and no ioreq is handled
+     * until the workers start, past the VRAM_MAPPED stage.
+     */
     if (init_io()) {
         ERR("Failed to init IO");
         return -1;
@@ -2555,18 +4903,23 @@ demu_initialize(domid_t domid, unsigned int vcpus,
 
     vmiope_enter_monitor(NULL);
 
-    demu_state.vram = demu_map_guest_range(demu_state.vram_addr,
-                                           VRAM_RESERVED_SIZE,
-                                           0, demu_resuming ? 0 : 1);
+    if (demu_resuming) {
+        uint64_t map_start = demu_now();
+
+        demu_state.vram = demu_map_guest_range(demu_state.vram_addr,
+                                               VRAM_RESERVED_SIZE,
+                                               0, 0);
+        demu_state.vram_map_us = demu_now() - map_start;
+    } else {
+        (void) demu_vram_load_wait();
+    }
+
     if (demu_state.vram == NULL) {
         ERRN("vram demu_map_guest_range");
         SET_ERROR(dec_libxc);
         return -1;
     }
 
-    if (!demu_resuming)
-        memset(demu_state.vram, 0, VRAM_RESERVED_SIZE);
-
     /* resuming stage is over */
     demu_resuming = not_resuming;
 
@@ -2581,7 +4934,7 @@ demu_initialize(domid_t domid, unsigned int vcpus,
 
     demu_seq_next(DEMU_SEQ_SOCKET_CREATED);
 
-    rc = surface_initialize();
+    rc = surface_initialize(tile_hash, demu_state.footprint);
     if (rc < 0) {
         ERR("surface_initialize failed with %d", rc);
         return -1;
@@ -2597,8 +4950,18 @@ demu_initialize(domid_t domid, unsigned int vcpus,
         return -1;
     }
 
+    rc = demu_ioreq_workers_start();
+    if (rc < 0) {
+        ERR("demu_ioreq_workers_start failed with %d", rc);
+        SET_ERROR(dec_internal);
+        return -1;
+    }
+    demu_seq_next(DEMU_SEQ_IOREQ_WORKERS_STARTED);
+
     demu_seq_next(DEMU_SEQ_INITIALIZED);
 
+    demu_startup_publish(start);
+    demu_memory_publish();
     set_demu_status("running");
 
     assert(demu_state.seq == DEMU_SEQ_INITIALIZED);
@@ -2607,6 +4970,8 @@ demu_initialize(domid_t domid, unsigned int vcpus,
 
 uint8_t *demu_get_vram(void)
 {
+    (void) demu_vram_load_wait();
+
     return demu_state.vram;
 }
 
@@ -2616,6 +4981,9 @@ void demu_set_vram_addr(uint64_t vram_addr)
 
     DBG("%" PRIx64 " -> %" PRIx64 "", demu_state.vram_addr, vram_addr);
 
+    /* Don't move the range while the load thread is populating it */
+    (void) demu_vram_load_wait();
+
     if (demu_resuming)
         demu_state.vram_addr = vram_addr;
 
@@ -2629,6 +4997,7 @@ void demu_set_vram_addr(uint64_t vram_addr)
         goto fail1;
 
     demu_state.vram_addr = vram_addr;
+    demu_vram_table_invalidate();
 
     (void) xc_hvm_track_dirty_vram(demu_state.xch, demu_state.domid,
                                    vram_addr >> TARGET_PAGE_SHIFT,
@@ -2648,24 +5017,91 @@ uint64_t demu_get_vram_addr(void)
     return demu_state.vram_addr;
 }
 
-void demu_sync_vram_dirty_map(void)
+#define ARRAY_SIZE(_a) (sizeof (_a) / sizeof ((_a)[0]))
+
+#define DEMU_VRAM_PAGES (VRAM_ACTUAL_SIZE >> TARGET_PAGE_SHIFT)
+#define BITS_PER_LONG   (sizeof(unsigned long) * 8)
+
+/* Returns non-zero if any page is now marked dirty */
+int demu_sync_vram_dirty_map(void)
 {
     xen_pfn_t pfn = demu_state.vram_addr >> TARGET_PAGE_SHIFT;
-    const unsigned int n = VRAM_ACTUAL_SIZE >> TARGET_PAGE_SHIFT;
-    unsigned long map[n / (sizeof(unsigned long) * 8)];
+    unsigned long *map = demu_state.vram_track_map;
+    unsigned long any = 0;
     unsigned int i;
     int rc;
 
     rc = xc_hvm_track_dirty_vram(demu_state.xch, demu_state.domid,
-                                 pfn, n, map);
+                                 pfn, DEMU_VRAM_PAGES, map);
     if (rc < 0)
-        memset(map, 0xff, n / 8);
+        memset(map, 0xff, DEMU_VRAM_PAGES / 8);
 
-    for (i = 0; i < n / (sizeof(unsigned long) * 8); i++)
+    for (i = 0; i < ARRAY_SIZE(demu_state.vram_dirty_map); i++) {
         demu_state.vram_dirty_map[i] |= map[i];
+        any |= demu_state.vram_dirty_map[i];
+    }
+
+    return !!any;
 }
 
-#define ARRAY_SIZE(_a) (sizeof (_a) / sizeof ((_a)[0]))
+int demu_vram_any_dirty(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(demu_state.vram_dirty_map); i++)
+        if (demu_state.vram_dirty_map[i] != 0)
+            return 1;
+
+    return 0;
+}
+
+/*
+ * Find the first run of dirty pages in [start, end). On success the run
+ * is returned as [*first, *last) and the result is non-zero.
+ */
+int demu_vram_next_dirty_run(xen_pfn_t start, xen_pfn_t end,
+                             xen_pfn_t *first, xen_pfn_t *last)
+{
+    const unsigned long *map = demu_state.vram_dirty_map;
+    unsigned long bits;
+    xen_pfn_t sel;
+
+    if (end > DEMU_VRAM_PAGES)
+        end = DEMU_VRAM_PAGES;
+
+    if (start >= end)
+        return 0;
+
+    sel = start / BITS_PER_LONG;
+    bits = map[sel] & (~0ul << (start % BITS_PER_LONG));
+    while (bits == 0) {
+        if (++sel * BITS_PER_LONG >= end)
+            return 0;
+
+        bits = map[sel];
+    }
+
+    start = sel * BITS_PER_LONG + __builtin_ctzl(bits);
+    if (start >= end)
+        return 0;
+
+    *first = start;
+
+    bits = ~map[sel] & (~0ul << (start % BITS_PER_LONG));
+    while (bits == 0) {
+        if (++sel * BITS_PER_LONG >= end) {
+            *last = end;
+            return 1;
+        }
+
+        bits = ~map[sel];
+    }
+
+    start = sel * BITS_PER_LONG + __builtin_ctzl(bits);
+    *last = (start < end) ? start : end;
+
+    return 1;
+}
 
 int demu_vram_get_page_dirty(xen_pfn_t pfn)
 {
@@ -2690,18 +5126,134 @@ void demu_vram_set_page_dirty(xen_pfn_t pfn)
 
 void demu_clear_vram_dirty_map(void)
 {
-    const unsigned int n = VRAM_ACTUAL_SIZE >> TARGET_PAGE_SHIFT;
+    memset(demu_state.vram_dirty_map, 0, DEMU_VRAM_PAGES / 8);
+}
+
+/*
+ * Buffered ioreqs are posted writes, and VGA emulation sees long runs of
+ * them to consecutive addresses (or to one port). Consecutive writes of
+ * the same type and size that hit the same space are gathered here and
+ * handed to the space as a single REP access.
+ */
+typedef struct demu_buffered_run {
+    uint8_t         type;
+    uint64_t        addr;
+    uint64_t        size;
+    uint32_t        count;
+    demu_space_t    *space;
+    uint8_t         buf[DEMU_REP_BUFFER_SIZE];
+} demu_buffered_run_t;
+
+static void demu_buffered_run_flush(demu_buffered_run_t *run)
+{
+    trace_point_t point;
+    uint64_t start;
+
+    if (run->count == 0)
+        return;
+
+    point = demu_ioreq_trace_point(run->type);
+    start = trace_begin(point);
+
+    demu_io_write_rep(run->space, run->addr, run->size,
+                      (run->type == IOREQ_TYPE_COPY) ? run->size : 0,
+                      run->count, run->buf);
+
+    trace_end(point, start);
+
+    demu_state.bufioreq_runs++;
+    run->count = 0;
+}
+
+/* Returns 1 if the write was added to the run, 0 if it must go alone */
+static int demu_buffered_run_add(demu_buffered_run_t *run, ioreq_t *ioreq)
+{
+    uint64_t next;
+
+    if (ioreq->dir != IOREQ_WRITE ||
+        (ioreq->type != IOREQ_TYPE_COPY && ioreq->type != IOREQ_TYPE_PIO))
+        return 0;
+
+    if (run->count != 0) {
+        next = (run->type == IOREQ_TYPE_COPY) ?
+               run->addr + (run->count * run->size) : run->addr;
+
+        /* The whole access has to fall within the run's space */
+        if (ioreq->type == run->type && ioreq->size == run->size &&
+            ioreq->addr == next &&
+            ioreq->addr + ioreq->size - 1 <= run->space->end &&
+            (run->count + 1) * run->size <= sizeof(run->buf))
+            goto append;
+
+        demu_buffered_run_flush(run);
+    }
+
+    run->space = (ioreq->type == IOREQ_TYPE_COPY) ?
+                 demu_find_memory_space(ioreq->addr) :
+                 demu_find_port_space(ioreq->addr);
+    if (run->space == NULL ||
+        ioreq->addr + ioreq->size - 1 > run->space->end)
+        return 0;
+
+    run->type = ioreq->type;
+    run->addr = ioreq->addr;
+    run->size = ioreq->size;
+
+append:
+    memcpy(run->buf + (run->count * run->size), &ioreq->data, run->size);
+    run->count++;
+
+    return 1;
+}
+
+/*
+ * With bufioreqSpinUs set, keep polling an empty ring for that long
+ * before going back to the event channel: a guest streaming writes
+ * usually refills it sooner than a notification round trip would take.
+ * The monitor is held throughout, so the budget should stay small.
+ */
+static int demu_buffered_iopage_spin(void)
+{
+    uint64_t deadline;
+
+    if (demu_state.bufioreq_spin_us == 0)
+        return 0;
+
+    deadline = demu_now() + demu_state.bufioreq_spin_us;
+
+    do {
+        if (demu_state.buffered_iopage->read_pointer !=
+            demu_state.buffered_iopage->write_pointer) {
+            demu_state.bufioreq_spin_hits++;
+            return 1;
+        }
+
+        __builtin_ia32_pause();
+    } while (demu_now() < deadline);
 
-    memset(demu_state.vram_dirty_map, 0, n / 8);
+    return 0;
 }
 
+/*
+ * The ring and the run are only touched under the monitor, which also
+ * keeps buffered ioreqs in order with the synchronous ones that follow
+ * them. The read section keeps run.space valid until it is flushed.
+ */
 static void demu_poll_buffered_iopage(void)
 {
+    static demu_buffered_run_t run;    /* empty between calls */
+    vmiop_bool_t in_monitor;
+    uint64_t start = 0;
+    int busy = 0;
+
     DBG_V("demu_poll_buffered_iopages");
 
     if (demu_state.seq != DEMU_SEQ_INITIALIZED)
         return;
 
+    vmiope_enter_monitor(&in_monitor);
+    demu_space_read_begin();
+
     for (;;) {
         unsigned int read_pointer;
         unsigned int write_pointer;
@@ -2710,8 +5262,18 @@ static void demu_poll_buffered_iopage(void)
         write_pointer = demu_state.buffered_iopage->write_pointer;
         mb();
 
-        if (read_pointer == write_pointer)
+        if (read_pointer == write_pointer) {
+            if (busy && demu_buffered_iopage_spin())
+                continue;
+
             break;
+        }
+
+        /* Only polls that find work are traced */
+        if (!busy) {
+            start = trace_begin(TRACE_BUFFERED_POLL);
+            busy = 1;
+        }
 
         while (read_pointer != write_pointer) {
             unsigned int slot;
@@ -2743,16 +5305,33 @@ static void demu_poll_buffered_iopage(void)
                 read_pointer++;
             }
 
-            demu_handle_ioreq(&ioreq);
-            mb();
+            demu_state.bufioreq_entries++;
+
+            if (!demu_buffered_run_add(&run, &ioreq)) {
+                demu_buffered_run_flush(&run);
+                demu_handle_ioreq(&ioreq);
+            }
         }
 
+        /* Slots are only released once everything read is emulated */
+        demu_buffered_run_flush(&run);
+        mb();
+
         demu_state.buffered_iopage->read_pointer = read_pointer;
         mb();
     }
+
+    demu_space_read_end();
+    if (!in_monitor)
+        vmiope_leave_monitor(NULL);
+
+    (void) demu_flush_guest_dirty_pages();
+
+    if (busy)
+        trace_end(TRACE_BUFFERED_POLL, start);
 }
 
-static void demu_poll_shared_iopage(unsigned int i)
+static void demu_poll_shared_iopage(xc_evtchn *xceh, unsigned int i)
 {
     ioreq_t *ioreq;
 
@@ -2765,12 +5344,13 @@ static void demu_poll_shared_iopage(unsigned int i)
     ioreq->state = STATE_IOREQ_INPROCESS;
 
     demu_handle_ioreq(ioreq);
+    (void) demu_flush_guest_dirty_pages();
     mb();
 
     ioreq->state = STATE_IORESP_READY;
     mb();
 
-    xc_evtchn_notify(demu_state.xceh, demu_state.ioreq_local_port[i]);
+    xc_evtchn_notify(xceh, demu_state.ioreq_local_port[i]);
 }
 
 static void demu_poll_iopages(void)
@@ -2792,12 +5372,179 @@ static void demu_poll_iopages(void)
         for (i = 0; i < demu_state.vcpus; i++) {
             if (port == demu_state.ioreq_local_port[i]) {
                 xc_evtchn_unmask(demu_state.xceh, port);
-                demu_poll_shared_iopage(i);
+                demu_poll_shared_iopage(demu_state.xceh, i);
             }
         }
     }
 }
 
+static void *demu_ioreq_worker_run(void *arg)
+{
+    demu_ioreq_worker_t *worker = arg;
+    struct pollfd pfd[2];
+    sigset_t block;
+
+    /* Signals are handled by the main thread */
+    sigfillset(&block);
+    sigdelset(&block, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &block, NULL);
+
+    pfd[0].fd = xc_evtchn_fd(worker->xceh);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = worker->stop_fd[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        evtchn_port_t port;
+        unsigned int i;
+        int rc;
+
+        rc = poll(pfd, 2, -1);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+
+            ERRN("poll");
+            break;
+        }
+
+        if (pfd[1].revents != 0)
+            break;
+
+        if ((pfd[0].revents & POLLIN) == 0)
+            continue;
+
+        port = xc_evtchn_pending(worker->xceh);
+        if (port < 0)
+            continue;
+
+        xc_evtchn_unmask(worker->xceh, port);
+
+        for (i = worker->index; i < demu_state.vcpus;
+             i += demu_state.ioreq_threads) {
+            if (port != demu_state.ioreq_local_port[i])
+                continue;
+
+            /*
+             * Dispatch takes the monitor only for demu's own device
+             * emulation, so ioreqs for plugin regions from different
+             * vCPUs run in parallel. Buffered ioreqs issued ahead of
+             * this one are drained first to keep them ordered.
+             */
+            demu_poll_buffered_iopage();
+            demu_poll_shared_iopage(worker->xceh, i);
+        }
+    }
+
+    return NULL;
+}
+
+static int demu_ioreq_worker_start(demu_ioreq_worker_t *worker)
+{
+    int rc;
+
+    if (pipe(worker->stop_fd) < 0) {
+        ERRN("pipe");
+        goto fail1;
+    }
+
+    rc = pthread_create(&worker->thread, NULL, demu_ioreq_worker_run,
+                        worker);
+    if (rc != 0) {
+        errno = rc;
+        ERRN("pthread_create");
+        goto fail2;
+    }
+
+    worker->running = 1;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpuset;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(worker->cpu, &cpuset);
+
+        rc = pthread_setaffinity_np(worker->thread, sizeof(cpuset),
+                                    &cpuset);
+        if (rc != 0)
+            ERR("worker %u: failed to bind to cpu %d: %s",
+                worker->index, worker->cpu, strerror(rc));
+    } else if (demu_state.ioreq_cpuset_valid) {
+        rc = pthread_setaffinity_np(worker->thread,
+                                    sizeof(demu_state.ioreq_cpuset),
+                                    &demu_state.ioreq_cpuset);
+        if (rc != 0)
+            ERR("worker %u: failed to bind to local cpus: %s",
+                worker->index, strerror(rc));
+    }
+
+    INFO("ioreq worker %u started (cpu %d)", worker->index, worker->cpu);
+
+    return 0;
+
+fail2:
+    ERR("fail2");
+
+    close(worker->stop_fd[0]);
+    close(worker->stop_fd[1]);
+    worker->stop_fd[0] = worker->stop_fd[1] = -1;
+
+fail1:
+    ERR("fail1");
+
+    return -1;
+}
+
+static int demu_ioreq_workers_start(void)
+{
+    int i;
+
+    for (i = 0; i < demu_state.ioreq_threads; i++) {
+        if (demu_ioreq_worker_start(&demu_state.ioreq_worker[i]) < 0)
+            goto fail1;
+    }
+
+    return 0;
+
+fail1:
+    ERR("fail1");
+
+    demu_ioreq_workers_stop();
+
+    return -1;
+}
+
+static void demu_ioreq_workers_stop(void)
+{
+    vmiop_bool_t in_monitor;
+    int i;
+
+    /*
+     * A worker may be waiting for the monitor, so it must be released
+     * while the workers are joined.
+     */
+    vmiope_leave_monitor(&in_monitor);
+
+    for (i = 0; i < demu_state.ioreq_threads; i++) {
+        demu_ioreq_worker_t *worker = &demu_state.ioreq_worker[i];
+        char buf = 'Q';
+
+        if (!worker->running)
+            continue;
+
+        (void) write(worker->stop_fd[1], &buf, 1);
+        pthread_join(worker->thread, NULL);
+        worker->running = 0;
+
+        close(worker->stop_fd[0]);
+        close(worker->stop_fd[1]);
+        worker->stop_fd[0] = worker->stop_fd[1] = -1;
+    }
+
+    if (in_monitor)
+        vmiope_enter_monitor(NULL);
+}
+
 #define MAX_SPAM     6
 #define MAX_SPAM_LEN 80
 
@@ -2878,20 +5625,18 @@ void demu_log(int priority, const char *prefix, const char *fmt, ...)
 #define DEMU_DEVICE     11
 
 
-static int max(int a, int b, int c, int d)
-{
-    int m1 = (a > b) ? a : b;
-    int m2 = (c > d) ? c : d;
-    return (m1 > m2) ? m1 : m2;
-}
-
 struct demu_args {
     domid_t domid;
     unsigned int vcpus;
     unsigned int device;
 
+    unsigned int ioreq_threads;
+
     char *gpu_str;
     char *config_str;
+    char *ioreq_cpus_str;
+    char *main_cpus_str;
+    char *plugin_cpus_str;
 };
 
 void get_uint_arg(unsigned int *val, char **strval, char *arg, int *err,
@@ -2917,12 +5662,17 @@ int process_args(int argc, char **argv, char **envp, struct demu_args *a)
     char *domain_str = NULL;
     char *vcpus_str = NULL;
     char *device_str = NULL;
+    char *ioreq_threads_str = NULL;
 
     int index;
     int badargs = 0;
 
     a->gpu_str = NULL;
     a->config_str = NULL;
+    a->ioreq_threads = 0;
+    a->ioreq_cpus_str = NULL;
+    a->main_cpus_str = NULL;
+    a->plugin_cpus_str = NULL;
 
     prog = basename(argv[0]);
 
@@ -2966,6 +5716,23 @@ int process_args(int argc, char **argv, char **envp, struct demu_args *a)
             INFO("Suspend arg ignored");
             break;
 
+        case DEMU_OPT_IOREQ_THREADS:
+            get_uint_arg(&a->ioreq_threads, &ioreq_threads_str, optarg,
+                         &badargs, "ioreq-threads");
+            break;
+
+        case DEMU_OPT_IOREQ_CPUS:
+            a->ioreq_cpus_str = optarg;
+            break;
+
+        case DEMU_OPT_MAIN_CPUS:
+            a->main_cpus_str = optarg;
+            break;
+
+        case DEMU_OPT_PLUGIN_CPUS:
+            a->plugin_cpus_str = optarg;
+            break;
+
         default:
             assert(false);
             break;
@@ -3023,16 +5790,10 @@ void set_sigactions(void)
     sigaction(SIGUSR1, &sigusr1_handler, NULL);
     sigdelset(&block, SIGUSR1);
 
-    memset(&sigrt_handler, 0, sizeof(struct sigaction));
-    sigrt_handler.sa_flags = SA_SIGINFO;
-    sigrt_handler.sa_sigaction = demu_sigrt;
-
-    sigaction(SIGRTMIN, &sigrt_handler, NULL);
-    sigdelset(&block, SIGRTMIN);
-
     sigprocmask(SIG_BLOCK, &block, NULL);
 }
 
+#ifndef DEMU_BENCH
 static void emp_log(enum emp_log_level level, const char *msg)
 {
     int syslog_level;
@@ -3062,6 +5823,34 @@ static void emp_log(enum emp_log_level level, const char *msg)
     demu_log(syslog_level, "libempserver", "%s", msg);
 }
 
+/* Dispatch takes the monitor where it is needed, as in the workers */
+static void demu_evtchn_event(int fd, void *priv)
+{
+    vmiope_leave_monitor(NULL);
+    demu_poll_iopages();
+    vmiope_enter_monitor(NULL);
+}
+
+static void demu_timer_event(int fd, void *priv)
+{
+    /* Expirations missed while busy are coalesced into one refresh */
+    if (event_timer_read(fd) != 0) {
+        demu_console_refresh();
+
+        if (trace_enabled) {
+            mapcache_stats_t stats;
+
+            mapcache_get_stats(&stats);
+            trace_set_mapcache(&stats);
+        }
+    }
+}
+
+static void demu_socket_event(int fd, void *priv)
+{
+    demu_socket_read();
+}
+
 int main(int argc, char **argv, char **envp)
 {
     struct demu_args args;
@@ -3098,7 +5887,7 @@ int main(int argc, char **argv, char **envp)
     INFO("working directory: %s", dir);
     if (chdir(dir) < 0) {
         INFO("Could not change into %s", dir);
-        goto fail2;
+        goto fail1;
     }
 
     rlim.rlim_cur = rlim.rlim_max = 64 * 1024 * 1024;
@@ -3108,12 +5897,21 @@ int main(int argc, char **argv, char **envp)
     set_sigactions();
 
     if (demu_control_sock_init(&demu_state.cs_inf))
-        goto fail3;
+        goto fail1;
+
+    demu_state.loop = event_loop_create();
+    if (demu_state.loop == NULL)
+        goto fail2;
+
+    demu_control_event_add(demu_state.loop, demu_state.cs_inf);
 
     rc = demu_initialize(args.domid, args.vcpus, 0, args.device, 0,
-                         args.gpu_str, args.config_str);
+                         args.gpu_str, args.config_str,
+                         args.ioreq_threads, args.ioreq_cpus_str,
+                         args.main_cpus_str, args.plugin_cpus_str);
+    /* demu_teardown() also undoes a partial initialization */
     if (rc < 0)
-        goto fail4;
+        goto fail3;
 
     evtchn_fd = xc_evtchn_fd(demu_state.xceh);
     assert(evtchn_fd > 0);
@@ -3124,77 +5922,102 @@ int main(int argc, char **argv, char **envp)
     timer_fd = demu_timer_create();
     if (timer_fd < 0) {
         SET_ERROR(dec_internal);
-        goto fail5;
+        goto fail3;
+    }
+
+    if (event_loop_add(demu_state.loop, evtchn_fd, demu_evtchn_event,
+                       NULL) < 0 ||
+        event_loop_add(demu_state.loop, timer_fd, demu_timer_event,
+                       NULL) < 0 ||
+        event_loop_add(demu_state.loop, refresh_sock_fd, demu_socket_event,
+                       NULL) < 0) {
+        SET_ERROR(dec_internal);
+        goto fail4;
     }
 
     /* Main Loop */
     for (;;) {
-        fd_set rfds;
-        fd_set wfds;
-        fd_set xfds;
-        int nfds;
-        struct timeval tv;
+        vmiope_leave_monitor(NULL);
+        rc = event_loop_wait(demu_state.loop, 10000);
+        vmiope_enter_monitor(NULL);
 
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&xfds);
+        if (rc < 0)
+            break;
 
-        FD_SET(evtchn_fd, &rfds);
-        FD_SET(refresh_sock_fd, &rfds);
-        FD_SET(timer_fd, &rfds);
+        event_loop_dispatch(demu_state.loop, rc);
 
-        tv.tv_sec = 10;
-        tv.tv_usec = 0;
+        if (demu_memory_report) {
+            demu_memory_report = 0;
+            demu_memory_publish();
+        }
+    }
 
-        nfds = emp_select_fdset(demu_state.cs_inf, &rfds, NULL);
+fail4:
+    demu_timer_destroy();
 
-        nfds = max(nfds, evtchn_fd, refresh_sock_fd, timer_fd) + 1;
+fail3:
+    demu_teardown();
+    event_loop_destroy(demu_state.loop);
 
-        vmiope_leave_monitor(NULL);
-        rc = select(nfds, &rfds, &wfds, &xfds, &tv);
-        vmiope_enter_monitor(NULL);
+fail2:
+    demu_control_sock_close(&demu_state.cs_inf);
 
-        if (rc < 0 && errno != EINTR)
-            break;
+fail1:
+    return 1;
+}
 
-        if (rc > 0) {
-            if (FD_ISSET(evtchn_fd, &rfds)) {
+#else   /* DEMU_BENCH */
 
-                demu_poll_iopages();
-                rc--;
-            }
-            if (FD_ISSET(timer_fd, &rfds)) {
-                char buf;
+/*
+ * Entry points for the benchmark harness (bench/), which links demu
+ * against a stub Xen backend in place of main() and feeds ioreqs
+ * straight into the dispatch path.
+ */
+int demu_bench_initialize(domid_t domid, unsigned int device,
+                          const char *config)
+{
+    /* Errors to the terminal; debug chatter would swamp the timings */
+    openlog("vgpu-bench", LOG_PID | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
 
-                read(timer_fd, &buf, 1);
-                demu_console_refresh();
-                rc--;
-            }
-            if (FD_ISSET(refresh_sock_fd, &rfds)) {
-                demu_socket_read();
-                rc--;
-            }
+    return demu_initialize(domid, 1, 0, device, 0, "0000:00:00.0",
+                           config, 0, NULL, NULL, NULL);
+}
+
+void demu_bench_handle_ioreq(ioreq_t *ioreq)
+{
+    demu_handle_ioreq(ioreq);
+    (void) demu_flush_guest_dirty_pages();
+}
 
-            if (rc > 0)
-                rc = emp_select_fdread(demu_state.cs_inf, &rfds, rc);
+/* Post entries to the buffered ring as Xen would, then drain it */
+void demu_bench_handle_buffered(const buf_ioreq_t *buf_ioreq,
+                                unsigned int nr)
+{
+    buffered_iopage_t *page = demu_state.buffered_iopage;
+    unsigned int i;
 
-            if (rc > 0)
-                DBG("Warning: expected to find %d more fcs.", rc);
-        }
+    for (i = 0; i < nr; i++) {
+        if (page->write_pointer - page->read_pointer ==
+            IOREQ_BUFFER_SLOT_NUM)
+            demu_poll_buffered_iopage();
+
+        page->buf_ioreq[page->write_pointer % IOREQ_BUFFER_SLOT_NUM] =
+            buf_ioreq[i];
+        mb();
+        page->write_pointer++;
     }
 
-    demu_timer_destroy();
+    demu_poll_buffered_iopage();
+}
 
-fail5:
-fail4:
+void demu_bench_teardown(void)
+{
     demu_teardown();
-    demu_control_sock_close(&demu_state.cs_inf);
-fail3:
-fail2:
-fail1:
-    return 1;
 }
 
+#endif  /* DEMU_BENCH */
+
 /*
  * Local variables:
  * mode: C
@@ -51,7 +51,9 @@ void    *demu_map_guest_pages(xen_pfn_t pfn[], int count, int read_only, int pop
 void    *demu_map_guest_range(uint64_t addr, uint64_t size, int read_only, int populate);
 
 void    demu_set_guest_dirty_page(xen_pfn_t pfn);
+void    demu_set_guest_dirty_range(uint64_t addr, uint64_t size);
 int     demu_set_guest_dirty_pages(uint64_t count, const struct pages page_list[]);
+int     demu_flush_guest_dirty_pages(void);
 
 int     demu_set_guest_pages(xen_pfn_t gfn, xen_pfn_t mfn, int count, int add);
 
@@ -59,6 +61,10 @@ int     demu_maximum_guest_pages(void);
 int     demu_translate_guest_pages(xen_pfn_t pfn[], xen_pfn_t mfn[], int count);
 int     demu_release_guest_pages(xen_pfn_t mfn[], int count);
 
+const xen_pfn_t *demu_vram_table_get(int *count);
+void    demu_vram_table_put(const xen_pfn_t *mfn);
+void    demu_vram_table_invalidate(void);
+
 #define VRAM_RESERVED_ADDRESS   0xff000000
 #define VRAM_RESERVED_SIZE      0x01000000
 #define VRAM_ACTUAL_SIZE        0x00400000
@@ -68,7 +74,10 @@ uint8_t     *demu_get_vram(void);
 void        demu_set_vram_addr(uint64_t);
 uint64_t    demu_get_vram_addr(void);
 
-void    demu_sync_vram_dirty_map(void);
+int     demu_sync_vram_dirty_map(void);
+int     demu_vram_any_dirty(void);
+int     demu_vram_next_dirty_run(xen_pfn_t start, xen_pfn_t end,
+                                 xen_pfn_t *first, xen_pfn_t *last);
 int     demu_vram_get_page_dirty(xen_pfn_t pfn);
 void    demu_vram_set_page_dirty(xen_pfn_t pfn);
 void    demu_clear_vram_dirty_map(void);
@@ -82,6 +91,23 @@ typedef struct io_ops {
     void            (*writeb)(void *priv, uint64_t addr, uint8_t val);
     void            (*writew)(void *priv, uint64_t addr, uint16_t val);
     void            (*writel)(void *priv, uint64_t addr, uint32_t val);
+
+    /*
+     * Optional REP handlers: perform count accesses of size bytes, moving
+     * addr by step (0 for ports) after each, with the data for access i
+     * at buf + (i * size).
+     */
+    void            (*readrep)(void *priv, uint64_t addr, uint64_t size,
+                               int64_t step, uint32_t count, uint8_t *buf);
+    void            (*writerep)(void *priv, uint64_t addr, uint64_t size,
+                                int64_t step, uint32_t count,
+                                const uint8_t *buf);
+
+    /*
+     * Set if the handlers serialize themselves, so that ioreqs for the
+     * space can be dispatched without holding the monitor.
+     */
+    int             unlocked;
 } io_ops_t;
 
 int     demu_register_pci_config_space(const io_ops_t *ops, void *priv);
@@ -93,6 +119,14 @@ int     demu_register_memory_space(uint64_t start, uint64_t size,
 void    demu_inject_msi(uint64_t addr, uint32_t data);
 void    demu_set_pci_intx(int line, int level);
 
+/*
+ * A space found by demu_find_*() stays valid, even if it is deregistered,
+ * until the demu_space_read_end() matching the demu_space_read_begin()
+ * that preceded the lookup. Reads may nest within a thread.
+ */
+void    demu_space_read_begin(void);
+void    demu_space_read_end(void);
+
 demu_space_t    *demu_find_pci_config_space(uint8_t bdf);
 demu_space_t    *demu_find_port_space(uint64_t addr);
 demu_space_t    *demu_find_memory_space(uint64_t addr);
@@ -139,6 +173,12 @@ struct record_header {
     };
 };
 
+/*
+ * Set in record_header.type when the payload is LZ4 compressed. The
+ * payload then starts with the uncompressed length as a uint32_t.
+ */
+#define DEMU_RECORD_COMPRESSED  0x8000
+
 struct demu_record {
     struct record_header header;
     union {
@@ -147,6 +187,7 @@ struct demu_record {
     };
 };
 
+struct demu_record *demu_record_get(void);
 int write_record(struct demu_record *rec);
 int get_sent_stats(uint64_t* sent, uint64_t* remaining,int reset);
 
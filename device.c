@@ -204,50 +204,47 @@ int dump_vga()
     vga_t *s = &device_state.vga;
 
     if (vga_part1_dirty) {
-        struct VGA_1_sf sf1;
-        struct demu_record *record;
+        struct VGA_1_sf *sf1;
 
-        memset(&sf1, 0, sizeof(sf1));
-        sf1.hdr.type = demu_state_vga;
-        sf1.hdr.stype = 1;
-        sf1.hdr.length = VGA_1_s_all_size;
+        /* Built in place, write_record() takes the buffer */
+        sf1 = (struct VGA_1_sf *)demu_record_get();
+        if (!sf1)
+            return -1;
+
+        memset(sf1, 0, sizeof(*sf1));
+        sf1->hdr.type = demu_state_vga;
+        sf1->hdr.stype = 1;
+        sf1->hdr.length = VGA_1_s_all_size;
 
         /* lock */
-        memcpy(&sf1.s1, &s->latch,    sizeof(struct VGA_1_s1));
-        memcpy(&sf1.s2, &s->gr_index, sizeof(struct VGA_1_s2));
-        memcpy(&sf1.s3, &s->ar_index, sizeof(struct VGA_1_s3));
-        memcpy(&sf1.s4, &s->bank_offset, sizeof(struct VGA_1_s4));
+        memcpy(&sf1->s1, &s->latch,    sizeof(struct VGA_1_s1));
+        memcpy(&sf1->s2, &s->gr_index, sizeof(struct VGA_1_s2));
+        memcpy(&sf1->s3, &s->ar_index, sizeof(struct VGA_1_s3));
+        memcpy(&sf1->s4, &s->bank_offset, sizeof(struct VGA_1_s4));
         /* unlock */
 
-        record = malloc(sizeof(sf1));
-        if (!record)
-            return -1;
-
-        memcpy(record, &sf1, sizeof(sf1));
-        r = write_record(record);
+        r = write_record((struct demu_record *)sf1);
 
         vga_part1_dirty = 0;
     }
 
     if ((r>=0) && vga_part2_dirty) {
-        struct VGA_2_sf sf2;
-        struct demu_record *record;
+        struct VGA_2_sf *sf2;
+
+        sf2 = (struct VGA_2_sf *)demu_record_get();
+        if (!sf2)
+            return -1;
 
-        memset(&sf2, 0, sizeof(sf2));
-        sf2.hdr.type = demu_state_vga;
-        sf2.hdr.stype = 2;
-        sf2.hdr.length = sizeof(sf2.s);
+        memset(sf2, 0, sizeof(*sf2));
+        sf2->hdr.type = demu_state_vga;
+        sf2->hdr.stype = 2;
+        sf2->hdr.length = sizeof(sf2->s);
 
         /* lock*/
-        memcpy(&sf2.s, s->palette, sizeof(sf2.s));
+        memcpy(&sf2->s, s->palette, sizeof(sf2->s));
         /* unlock */
 
-        record = malloc(sizeof(sf2));
-        if (!record)
-            return -1;
-
-        memcpy(record, &sf2, sizeof(sf2));
-        r = write_record(record);
+        r = write_record((struct demu_record *)sf2);
 
         vga_part2_dirty = 0;
     }
@@ -577,6 +574,31 @@ device_vga_port_readb(void *priv, uint64_t addr)
     return val;
 }
 
+static void
+device_vga_cr_write(vga_t *vga, uint8_t val)
+{
+    /* handle CR0-7 protection */
+    if ((vga->cr[0x11] & 0x80) && vga->cr_index <= 7) {
+        /* can always write bit 4 of CR7 */
+        if (vga->cr_index == 7)
+            vga->cr[7] = (vga->cr[7] & ~0x10) | (val & 0x10);
+        return;
+    }
+    switch(vga->cr_index) {
+    case 0x01: /* horizontal display end */
+    case 0x07:
+    case 0x09:
+    case 0x0c:
+    case 0x0d:
+    case 0x12: /* vertical display end */
+        vga->cr[vga->cr_index] = val;
+        break;
+    default:
+        vga->cr[vga->cr_index] = val;
+        break;
+    }
+}
+
 static void
 device_vga_port_writeb(void *priv, uint64_t addr, uint8_t val)
 {
@@ -669,27 +691,7 @@ device_vga_port_writeb(void *priv, uint64_t addr, uint8_t val)
         break;
     case 0x3b5:
     case 0x3d5:
-        /* handle CR0-7 protection */
-        if ((vga->cr[0x11] & 0x80) && vga->cr_index <= 7) {
-            /* can always write bit 4 of CR7 */
-            if (vga->cr_index == 7)
-                vga->cr[7] = (vga->cr[7] & ~0x10) | (val & 0x10);
-            return;
-        }
-        switch(vga->cr_index) {
-        case 0x01: /* horizontal display end */
-        case 0x07:
-        case 0x09:
-        case 0x0c:
-        case 0x0d:
-        case 0x12: /* vertical display end */
-            vga->cr[vga->cr_index] = val;
-            break;
-        default:
-            vga->cr[vga->cr_index] = val;
-            break;
-        }
-
+        device_vga_cr_write(vga, val);
         break;
     case 0x3ba:
     case 0x3da:
@@ -698,9 +700,90 @@ device_vga_port_writeb(void *priv, uint64_t addr, uint8_t val)
     }
 }
 
+/*
+ * Wide reads have no paired meaning worth decoding, and some byte reads
+ * have side effects (0x3da resets the attribute flip-flop), so they are
+ * made a byte at a time.
+ */
+static uint16_t
+device_vga_port_readw(void *priv, uint64_t addr)
+{
+    return device_vga_port_readb(priv, addr) |
+        (device_vga_port_readb(priv, addr + 1) << 8);
+}
+
+/*
+ * Guests commonly program the sequencer, graphics and CRT controllers
+ * with a single 16-bit OUT carrying the index in the low byte and the
+ * data in the high byte. Decode those in one step; other ports have no
+ * paired meaning and are split into byte writes.
+ */
+static void
+device_vga_port_writew(void *priv, uint64_t addr, uint16_t val)
+{
+    vga_t   *vga = &device_state.vga;
+    uint8_t index = val & 0xff;
+    uint8_t data = val >> 8;
+
+    assert(priv == NULL);
+
+    switch(addr) {
+    case 0x3c4:
+        vga->sr_index = index & 7;
+        vga->sr[vga->sr_index] = data & __sr_mask[vga->sr_index];
+        break;
+    case 0x3ce:
+        vga->gr_index = index & 0x0f;
+        vga->gr[vga->gr_index] = data & __gr_mask[vga->gr_index];
+        break;
+    case 0x3b4:
+        if (vga->msr & MSR_COLOR_EMULATION)
+            return;
+
+        vga->cr_index = index;
+        device_vga_cr_write(vga, data);
+        break;
+    case 0x3d4:
+        if (!(vga->msr & MSR_COLOR_EMULATION))
+            return;
+
+        vga->cr_index = index;
+        device_vga_cr_write(vga, data);
+        break;
+    default:
+        device_vga_port_writeb(priv, addr, index);
+        device_vga_port_writeb(priv, addr + 1, data);
+        return;
+    }
+
+#if  DEBUG_VGA_PORT
+    DBG("[0x%"PRIx64"] = 0x%04x", addr, val);
+#endif
+
+    vga_part1_dirty = 1;
+}
+
+static uint32_t
+device_vga_port_readl(void *priv, uint64_t addr)
+{
+    return device_vga_port_readw(priv, addr) |
+        ((uint32_t)device_vga_port_readw(priv, addr + 2) << 16);
+}
+
+static void
+device_vga_port_writel(void *priv, uint64_t addr, uint32_t val)
+{
+    device_vga_port_writew(priv, addr, val);
+    device_vga_port_writew(priv, addr + 2, val >> 16);
+}
+
 static io_ops_t device_vga_port_ops  = {
     .readb = device_vga_port_readb,
-    .writeb = device_vga_port_writeb
+    .readw = device_vga_port_readw,
+    .readl = device_vga_port_readl,
+    .writeb = device_vga_port_writeb,
+    .writew = device_vga_port_writew,
+    .writel = device_vga_port_writel
 };
 
 static void
@@ -711,235 +794,434 @@ __copy_from_vram(uint64_t addr, uint8_t *dst, uint64_t size)
     memcpy(dst, &vram[addr], size);
 }
 
-static uint8_t
-device_vga_memory_readb(void *priv, uint64_t addr)
+static void
+__set_vram_dirty(uint64_t addr, uint64_t size)
 {
-    vga_t   *vga = &device_state.vga;
-    uint8_t memory_map_mode;
-    uint8_t plane;
-    uint8_t val;
+    xen_pfn_t pfn;
 
-    assert(priv == NULL);
+    for (pfn = addr >> TARGET_PAGE_SHIFT;
+         pfn <= (addr + size - 1) >> TARGET_PAGE_SHIFT;
+         pfn++)
+        demu_vram_set_page_dirty(pfn);
+}
+
+static void
+__copy_to_vram(const uint8_t *src, uint64_t addr, uint64_t size)
+{
+    uint8_t *vram = demu_get_vram();
+
+    memcpy(&vram[addr], src, size);
+    __set_vram_dirty(addr, size);
+}
+
+/*
+ * Convert an address in the 0xa0000 window to a VGA memory offset, or
+ * -1 if the current memory map mode does not decode it. *len is set to
+ * the number of bytes from addr that map linearly from the offset (1 if
+ * addr is not decoded).
+ */
+static int64_t
+device_vga_memory_offset(vga_t *vga, uint64_t addr, uint64_t *len)
+{
+    uint8_t memory_map_mode;
 
-    /* convert to VGA memory offset */
     memory_map_mode = (vga->gr[6] >> 2) & 3;
     addr &= 0x1ffff;
+    *len = 1;
 
     switch(memory_map_mode) {
     case 0:
+        *len = 0x20000 - addr;
         break;
     case 1:
         if (addr >= 0x10000)
-            return 0xff;
+            return -1;
+        *len = 0x10000 - addr;
         addr += vga->bank_offset;
         break;
     case 2:
         addr -= 0x10000;
         if (addr >= 0x8000)
-            return 0xff;
+            return -1;
+        *len = 0x8000 - addr;
         break;
     default:
     case 3:
         addr -= 0x18000;
         if (addr >= 0x8000)
-            return 0xff;
+            return -1;
+        *len = 0x8000 - addr;
         break;
     }
 
+    return addr;
+}
+
+/* Read len bytes of VGA memory from offset, all in the current mode */
+static void
+device_vga_memory_read_span(vga_t *vga, uint64_t offset, uint8_t *buf,
+                            uint64_t len)
+{
+    uint8_t *vram = demu_get_vram();
+    uint8_t plane;
+    uint64_t i;
+
     if (vga->sr[4] & 0x08) {
         /* chain 4 mode : simplest access */
-        __copy_from_vram(addr, &val, 1);
+        __copy_from_vram(offset, buf, len);
     } else if (vga->gr[5] & 0x10) {
         /* odd/even mode (aka text mode mapping) */
-        plane = (vga->gr[4] & 2) | (addr & 1);
-        __copy_from_vram(((addr & ~1) << 1) | plane, &val, 1);
-    } else {
-        /* standard VGA latched access */
-        __copy_from_vram(addr << 2, (uint8_t *)&vga->latch, 4);
+        for (i = 0; i < len; i++) {
+            uint64_t addr = offset + i;
 
+            plane = (vga->gr[4] & 2) | (addr & 1);
+            buf[i] = vram[((addr & ~1) << 1) | plane];
+        }
+    } else {
+        /* standard VGA latched access, a dword of the four planes each */
         vga_part1_dirty = 1;
 
-        if (!(vga->gr[5] & 0x08)) {
-            /* read mode 0 */
-            plane = vga->gr[4];
-            val = GET_PLANE(vga->latch, plane);
-        } else {
-            uint32_t    tmp;
-            /* read mode 1 */
-            tmp = (vga->latch ^ mask16[vga->gr[2]]) & mask16[vga->gr[7]];
-            tmp |= tmp >> 16;
-            tmp |= tmp >> 8;
-            val = (~tmp) & 0xff;
+        for (i = 0; i < len; i++) {
+            __copy_from_vram((offset + i) << 2, (uint8_t *)&vga->latch, 4);
+
+            if (!(vga->gr[5] & 0x08)) {
+                /* read mode 0 */
+                plane = vga->gr[4];
+                buf[i] = GET_PLANE(vga->latch, plane);
+            } else {
+                uint32_t    tmp;
+                /* read mode 1 */
+                tmp = (vga->latch ^ mask16[vga->gr[2]]) & mask16[vga->gr[7]];
+                tmp |= tmp >> 16;
+                tmp |= tmp >> 8;
+                buf[i] = (~tmp) & 0xff;
+            }
         }
     }
-
-    return val;
 }
 
+/* Write len bytes of VGA memory at offset, all in the current mode */
 static void
-__copy_to_vram(uint8_t *src, uint64_t addr, uint64_t size)
+device_vga_memory_write_span(vga_t *vga, uint64_t offset, const uint8_t *buf,
+                             uint64_t len)
 {
     uint8_t *vram = demu_get_vram();
-
-    memcpy(&vram[addr], src, size);
-    demu_vram_set_page_dirty(addr >> TARGET_PAGE_SHIFT);
-}
-
-static void
-device_vga_memory_writeb(void *priv, uint64_t addr, uint8_t val)
-{
-    vga_t   *vga = &device_state.vga;
-    uint8_t memory_map_mode;
     uint8_t plane;
     uint8_t mask;
-
-    assert(priv == NULL);
-
-#if  DEBUG_VGA_MEMORY
-    DBG("[0x%"PRIx64"] = 0x%02x", addr, val);
-#endif
-
-    /* convert to VGA memory offset */
-    memory_map_mode = (vga->gr[6] >> 2) & 3;
-    addr &= 0x1ffff;
-
-    switch(memory_map_mode) {
-    case 0:
-        break;
-    case 1:
-        if (addr >= 0x10000)
-            return;
-        addr += vga->bank_offset;
-        break;
-    case 2:
-        addr -= 0x10000;
-        if (addr >= 0x8000)
-            return;
-        break;
-    default:
-    case 3:
-        addr -= 0x18000;
-        if (addr >= 0x8000)
-            return;
-        break;
-    }
+    uint8_t updated = 0;
+    uint64_t i;
 
     if (vga->sr[4] & 0x08) {
         /* chain 4 mode : simplest access */
-        plane = addr & 3;
-        mask = (1 << plane);
-        if (vga->sr[2] & mask) {
-            __copy_to_vram(&val, addr, 1);
-#if  DEBUG_VGA_MEMORY
-            DBG("chain4: [0x%"PRIx64"] val=0x%02x", addr, val);
-#endif
-            vga->plane_updated |= mask; /* only used to detect font change */
+        if ((vga->sr[2] & 0x0f) == 0x0f) {
+            __copy_to_vram(buf, offset, len);
+
+            for (i = 0; i < len && i < 4; i++)
+                updated |= 1 << ((offset + i) & 3);
+        } else {
+            for (i = 0; i < len; i++) {
+                plane = (offset + i) & 3;
+                mask = (1 << plane);
+                if (vga->sr[2] & mask) {
+                    vram[offset + i] = buf[i];
+                    updated |= mask;
+                }
+            }
 
+            if (updated != 0)
+                __set_vram_dirty(offset, len);
         }
+#if  DEBUG_VGA_MEMORY
+        DBG("chain4: [0x%"PRIx64"] len=%"PRIu64, offset, len);
+#endif
     } else if (vga->gr[5] & 0x10) {
         /* odd/even mode (aka text mode mapping) */
-        plane = (vga->gr[4] & 2) | (addr & 1);
-        mask = (1 << plane);
-        if (vga->sr[2] & mask) {
-            addr = ((addr & ~1) << 1) | plane;
-            __copy_to_vram(&val, addr, 1);
+        for (i = 0; i < len; i++) {
+            uint64_t addr = offset + i;
+
+            plane = (vga->gr[4] & 2) | (addr & 1);
+            mask = (1 << plane);
+            if (vga->sr[2] & mask) {
+                addr = ((addr & ~1) << 1) | plane;
+                vram[addr] = buf[i];
 #if  DEBUG_VGA_MEMORY
-            DBG("odd/even: [0x%"PRIx64"] val=0x%02x", addr, val);
+                DBG("odd/even: [0x%"PRIx64"] val=0x%02x", addr, buf[i]);
 #endif
-            vga->plane_updated |= mask; /* only used to detect font change */
+                updated |= mask;
+            }
         }
+
+        if (updated != 0)
+            __set_vram_dirty((offset & ~1) << 1,
+                             (((offset + len - 1) & ~1) << 1) + 4 -
+                             ((offset & ~1) << 1));
     } else {
         uint8_t     write_mode;
         uint8_t     func_select;
         uint8_t     b;
         uint32_t    write_mask;
-        uint32_t    bit_mask;
+        uint32_t    bit_mask = 0;
         uint32_t    set_mask;
-        uint32_t    write_val;
-        uint32_t    tmp;
-
-        write_val = val;
+        uint32_t    *latched;
 
-        /* standard VGA latched access */
+        /*
+         * standard VGA latched access: each byte is a dword across the
+         * four planes; the mode registers are fixed for the span.
+         */
         write_mode = vga->gr[5] & 3;
-        switch(write_mode) {
-        default:
-        case 0:
-            /* rotate */
-            b = vga->gr[3] & 7;
-            write_val = ((write_val >> b) | (write_val << (8 - b))) & 0xff;
-            write_val |= write_val << 8;
-            write_val |= write_val << 16;
-
-            /* apply set/reset mask */
-            set_mask = mask16[vga->gr[1]];
-            write_val = (write_val & ~set_mask) | (mask16[vga->gr[0]] & set_mask);
-            bit_mask = vga->gr[8];
-            break;
-        case 1:
-            write_val = vga->latch;
-            goto do_write;
-        case 2:
-            write_val = mask16[write_val & 0x0f];
-            bit_mask = vga->gr[8];
-            break;
-        case 3:
-            /* rotate */
-            b = vga->gr[3] & 7;
-            write_val = (write_val >> b) | (write_val << (8 - b));
-
-            bit_mask = vga->gr[8] & write_val;
-            write_val = mask16[vga->gr[0]];
-            break;
-        }
-
-        /* apply logical operation */
         func_select = vga->gr[3] >> 3;
-        switch(func_select) {
-        case 0:
-        default:
-            /* nothing to do */
-            break;
-        case 1:
-            /* and */
-            write_val &= vga->latch;
-            break;
-        case 2:
-            /* or */
-            write_val |= vga->latch;
-            break;
-        case 3:
-            /* xor */
-            write_val ^= vga->latch;
-            break;
-        }
-
-        /* apply bit mask */
-        bit_mask |= bit_mask << 8;
-        bit_mask |= bit_mask << 16;
-        write_val = (write_val & bit_mask) | (vga->latch & ~bit_mask);
+        b = vga->gr[3] & 7;
+        set_mask = mask16[vga->gr[1]];
 
-do_write:
         /* mask data according to sr[2] */
         mask = vga->sr[2];
-        vga->plane_updated |= mask; /* only used to detect font change */
+        updated = mask;
         write_mask = mask16[mask];
 
-        __copy_from_vram(addr << 2, (uint8_t *)&tmp, 4);
-        tmp &= ~write_mask;
-        tmp |= write_val & write_mask;
-        __copy_to_vram((uint8_t *)&tmp, addr << 2, 4);
+        latched = (uint32_t *)&vram[offset << 2];
+
+        for (i = 0; i < len; i++) {
+            uint32_t    write_val = buf[i];
+
+            switch(write_mode) {
+            default:
+            case 0:
+                /* rotate */
+                write_val = ((write_val >> b) | (write_val << (8 - b))) & 0xff;
+                write_val |= write_val << 8;
+                write_val |= write_val << 16;
+
+                /* apply set/reset mask */
+                write_val = (write_val & ~set_mask) |
+                            (mask16[vga->gr[0]] & set_mask);
+                bit_mask = vga->gr[8];
+                break;
+            case 1:
+                write_val = vga->latch;
+                goto do_write;
+            case 2:
+                write_val = mask16[write_val & 0x0f];
+                bit_mask = vga->gr[8];
+                break;
+            case 3:
+                /* rotate */
+                write_val = (write_val >> b) | (write_val << (8 - b));
+
+                bit_mask = vga->gr[8] & write_val;
+                write_val = mask16[vga->gr[0]];
+                break;
+            }
+
+            /* apply logical operation */
+            switch(func_select) {
+            case 0:
+            default:
+                /* nothing to do */
+                break;
+            case 1:
+                /* and */
+                write_val &= vga->latch;
+                break;
+            case 2:
+                /* or */
+                write_val |= vga->latch;
+                break;
+            case 3:
+                /* xor */
+                write_val ^= vga->latch;
+                break;
+            }
+
+            /* apply bit mask */
+            bit_mask |= bit_mask << 8;
+            bit_mask |= bit_mask << 16;
+            write_val = (write_val & bit_mask) | (vga->latch & ~bit_mask);
+
+do_write:
+            latched[i] = (latched[i] & ~write_mask) | (write_val & write_mask);
+
+#if  DEBUG_VGA_MEMORY
+            DBG("latch: [0x%"PRIx64"] val=0x%08x", (offset + i) << 2,
+                latched[i]);
+#endif
+        }
+
+        __set_vram_dirty(offset << 2, len << 2);
+    }
+
+    vga->plane_updated |= updated; /* only used to detect font change */
+}
+
+/*
+ * Guest accesses to the window arrive at any width and as REP runs.
+ * Split them only where the memory map mode stops decoding linearly,
+ * so each span is translated and dirtied once rather than per byte.
+ */
+static void
+device_vga_memory_read(vga_t *vga, uint64_t addr, uint8_t *buf, uint64_t len)
+{
+    while (len != 0) {
+        int64_t offset;
+        uint64_t n;
+
+        offset = device_vga_memory_offset(vga, addr, &n);
+        if (n > len)
+            n = len;
+
+        if (offset >= 0)
+            device_vga_memory_read_span(vga, offset, buf, n);
+        else
+            memset(buf, 0xff, n);
+
+        addr += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void
+device_vga_memory_write(vga_t *vga, uint64_t addr, const uint8_t *buf,
+                        uint64_t len)
+{
+    while (len != 0) {
+        int64_t offset;
+        uint64_t n;
+
+        offset = device_vga_memory_offset(vga, addr, &n);
+        if (n > len)
+            n = len;
+
+        if (offset >= 0)
+            device_vga_memory_write_span(vga, offset, buf, n);
+
+        addr += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+static uint8_t
+device_vga_memory_readb(void *priv, uint64_t addr)
+{
+    vga_t   *vga = &device_state.vga;
+    uint8_t val;
+
+    assert(priv == NULL);
+
+    device_vga_memory_read(vga, addr, &val, sizeof(val));
+
+    return val;
+}
+
+static uint16_t
+device_vga_memory_readw(void *priv, uint64_t addr)
+{
+    vga_t   *vga = &device_state.vga;
+    uint16_t val;
+
+    assert(priv == NULL);
+
+    device_vga_memory_read(vga, addr, (uint8_t *)&val, sizeof(val));
+
+    return val;
+}
+
+static uint32_t
+device_vga_memory_readl(void *priv, uint64_t addr)
+{
+    vga_t   *vga = &device_state.vga;
+    uint32_t val;
+
+    assert(priv == NULL);
+
+    device_vga_memory_read(vga, addr, (uint8_t *)&val, sizeof(val));
+
+    return val;
+}
+
+static void
+device_vga_memory_readrep(void *priv, uint64_t addr, uint64_t size,
+                          int64_t step, uint32_t count, uint8_t *buf)
+{
+    vga_t   *vga = &device_state.vga;
+    uint32_t i;
+
+    assert(priv == NULL);
+
+    if (step == (int64_t)size) {
+        device_vga_memory_read(vga, addr, buf, size * count);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        device_vga_memory_read(vga, addr, buf + (i * size), size);
+        addr += step;
+    }
+}
+
+static void
+device_vga_memory_writeb(void *priv, uint64_t addr, uint8_t val)
+{
+    vga_t   *vga = &device_state.vga;
+
+    assert(priv == NULL);
 
 #if  DEBUG_VGA_MEMORY
-        DBG("latch: [0x%"PRIx64"] val=0x%08x", addr << 2, tmp);
+    DBG("[0x%"PRIx64"] = 0x%02x", addr, val);
 #endif
 
+    device_vga_memory_write(vga, addr, &val, sizeof(val));
+}
+
+static void
+device_vga_memory_writew(void *priv, uint64_t addr, uint16_t val)
+{
+    vga_t   *vga = &device_state.vga;
+
+    assert(priv == NULL);
+
+    device_vga_memory_write(vga, addr, (uint8_t *)&val, sizeof(val));
+}
+
+static void
+device_vga_memory_writel(void *priv, uint64_t addr, uint32_t val)
+{
+    vga_t   *vga = &device_state.vga;
+
+    assert(priv == NULL);
+
+    device_vga_memory_write(vga, addr, (uint8_t *)&val, sizeof(val));
+}
+
+static void
+device_vga_memory_writerep(void *priv, uint64_t addr, uint64_t size,
+                           int64_t step, uint32_t count, const uint8_t *buf)
+{
+    vga_t   *vga = &device_state.vga;
+    uint32_t i;
+
+    assert(priv == NULL);
+
+    if (step == (int64_t)size) {
+        device_vga_memory_write(vga, addr, buf, size * count);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        device_vga_memory_write(vga, addr, buf + (i * size), size);
+        addr += step;
     }
 }
 
 static io_ops_t device_vga_memory_ops = {
     .readb = device_vga_memory_readb,
-    .writeb = device_vga_memory_writeb
+    .readw = device_vga_memory_readw,
+    .readl = device_vga_memory_readl,
+    .writeb = device_vga_memory_writeb,
+    .writew = device_vga_memory_writew,
+    .writel = device_vga_memory_writel,
+    .readrep = device_vga_memory_readrep,
+    .writerep = device_vga_memory_writerep
 };
 
 static uint16_t
@@ -1205,9 +1487,55 @@ device_vbe_port_writew(void *priv, uint64_t addr, uint16_t val)
     }
 }
 
+/*
+ * A 32-bit access at the index port carries the index in the low word
+ * and the data in the high word.
+ */
+static uint32_t
+device_vbe_port_readl(void *priv, uint64_t addr)
+{
+    uint32_t val;
+
+    assert(priv == NULL);
+
+    switch (addr) {
+    case 0x1ce:
+    case 0xff80:
+        val = device_vbe_index_read(priv);
+        val |= (uint32_t)device_vbe_data_read(priv) << 16;
+        break;
+
+    default:
+        val = device_vbe_port_readw(priv, addr);
+        break;
+    }
+
+    return val;
+}
+
+static void
+device_vbe_port_writel(void *priv, uint64_t addr, uint32_t val)
+{
+    assert(priv == NULL);
+
+    switch (addr) {
+    case 0x1ce:
+    case 0xff80:
+        device_vbe_index_write(priv, val);
+        device_vbe_data_write(priv, val >> 16);
+        break;
+
+    default:
+        device_vbe_port_writew(priv, addr, val);
+        break;
+    }
+}
+
 static io_ops_t device_vbe_port_ops = {
     .readw = device_vbe_port_readw,
-    .writew = device_vbe_port_writew
+    .readl = device_vbe_port_readl,
+    .writew = device_vbe_port_writew,
+    .writel = device_vbe_port_writel
 };
 
 static int
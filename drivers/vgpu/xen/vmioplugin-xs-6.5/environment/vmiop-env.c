@@ -82,9 +82,7 @@
 #include <syslog.h>
 
 #include <demu.h>
-
-/* List of VRAM mfn */
-extern xen_pfn_t vram_mfn[];
+#include <trace.h>
 
 static vmiop_plugin_t *vmiop_plugin;
 
@@ -242,6 +240,22 @@ vmiope_handle_free(vmiop_handle_t handle)
 #define VMIOPE_OBJECT_TABLE_BLOCK 128
 /*!< number of objects per table record */
 
+#define VMIOPE_HANDLE_INDEX_BITS 20
+/*!< bits of a handle holding the table index (plus one) */
+
+#define VMIOPE_HANDLE_INDEX_MASK ((1u << VMIOPE_HANDLE_INDEX_BITS) - 1)
+/*!< mask for the table index in a handle */
+
+#define VMIOPE_HANDLE_GENERATION_MASK \
+    ((1u << (32 - VMIOPE_HANDLE_INDEX_BITS)) - 1)
+/*!< mask for the slot generation in a handle */
+
+#define VMIOPE_OBJECT_TABLE_MAX_INDEX VMIOPE_HANDLE_INDEX_MASK
+/*!< limit on index values, so that index + 1 fits in a handle */
+
+#define VMIOPE_OBJECT_TABLE_NO_FREE ((uint32_t) (~0u))
+/*!< end of the free list */
+
 typedef struct vmiope_object_table_s *vmiope_object_table_ref_t;
 /*!< reference to an object table block */
 
@@ -251,21 +265,26 @@ typedef uint64_t vmiope_object_table_element_t[1];
 /**
  * Multi-level table block index by handle.
  *
- * A multi-level table is formed of a linked list of
- * fixed-size blocks (arrays) of objects, indexed by the handle
- * number.  Allocating a handle may use an existing slot or, if
- * all slots are active, allocate a new block.  This header
- * is present in every block, and is wrapped by the object-specific
- * block which contains the objects.
+ * A multi-level table is formed of a directory of fixed-size
+ * blocks (arrays) of objects, indexed by the handle number.
+ * A handle holds the table index plus one in its low
+ * VMIOPE_HANDLE_INDEX_BITS, and the generation of the slot above
+ * that, so a handle left over from a released object no longer
+ * resolves once its slot is reused.  Released slots are kept on a
+ * free list, and a new block is only added when that list is empty.
+ * This header is present in every block, and is wrapped by the
+ * object-specific block which contains the objects.
  *
- * Locking is the responsibility of the caller of the access routines.
- * A lookup does not require locking, as the space is never freed.
+ * Locking is the responsibility of the caller of the lookup routines.
+ * A lookup does not require locking, as the space is never freed:
+ * blocks never move, and a directory is not freed when it is replaced
+ * by a larger one.  Allocation and release take the table lock.
  */
 
 typedef struct vmiope_object_table_s {
-    vmiope_object_table_ref_t next; /*!< next in list */
     vmiop_handle_t base_handle;     /*!< first handle in block */
-    uint32_t num_free;          /*!< number of free objects */
+    uint16_t generation[VMIOPE_OBJECT_TABLE_BLOCK]; /*!< slot generations */
+    uint32_t next_free[VMIOPE_OBJECT_TABLE_BLOCK];  /*!< free list links */
     vmiope_object_table_element_t element;  /*!< dummy element for alignment */
 } vmiope_object_table_t;
 
@@ -287,8 +306,12 @@ typedef vmiop_bool_t
  */
 
 typedef struct vmiope_object_table_defn_s {
-    vmiope_object_table_ref_t head;     /*!< head of table list */
+    vmiope_object_table_ref_t *blocks;  /*!< directory of table blocks */
+    uint32_t num_blocks;            /*!< blocks in the directory */
+    uint32_t max_blocks;            /*!< size of the directory */
     uint32_t table_limit;           /*!< limit on index values */
+    uint32_t free_head;             /*!< first free index */
+    pthread_mutex_t lock;           /*!< lock for allocation and release */
     vmiope_object_is_free_t is_free;    /*!< callback to test if free */
     uint32_t element_size;          /*!< size of array of one element */
 } vmiope_object_table_defn_t;
@@ -311,6 +334,49 @@ vmiope_index_to_object(vmiope_object_table_ref_t table_p,
                      (table_index * element_size)));
 }
 
+/**
+ * Convert table index to the block holding it.
+ *
+ * @param[in] table_defn        Reference to table definition
+ * @param[in] table_index       Index in the table
+ * @returns Reference to block, or NULL if out of range
+ */
+
+static inline vmiope_object_table_ref_t
+vmiope_index_to_block(vmiope_object_table_defn_t *table_defn,
+                      uint32_t table_index)
+{
+    uint32_t block = table_index / VMIOPE_OBJECT_TABLE_BLOCK;
+
+    /* pairs with the release store in vmiope_grow_object_table() */
+    if (block >= __atomic_load_n(&table_defn->num_blocks,
+                                 __ATOMIC_ACQUIRE)) {
+        return(NULL);
+    }
+    return(table_defn->blocks[block]);
+}
+
+/**
+ * Build the handle for a table index from its current generation.
+ *
+ * @param[in] table_p           Reference to object table block
+ * @param[in] table_index       Index in the table
+ * @returns Handle
+ */
+
+static inline vmiop_handle_t
+vmiope_index_to_handle(vmiope_object_table_ref_t table_p,
+                       uint32_t table_index)
+{
+    uint32_t generation = 
+        table_p->generation[table_index % VMIOPE_OBJECT_TABLE_BLOCK];
+
+    return((vmiop_handle_t)
+           (((generation & VMIOPE_HANDLE_GENERATION_MASK) <<
+             VMIOPE_HANDLE_INDEX_BITS) |
+            (table_index + 1)));
+}
+
 /**
  * Convert handle to object reference
  *
@@ -324,6 +390,7 @@ vmiope_handle_to_object(vmiope_object_table_defn_t *table_defn,
                         vmiop_handle_t handle)
 {
     vmiope_object_table_t *table_p;
+    uint32_t table_index;
     void *object_p;
 
     if (table_defn == NULL || 
@@ -331,26 +398,25 @@ vmiope_handle_to_object(vmiope_object_table_defn_t *table_defn,
         return(NULL);
     }
 
-    handle--;
-    for (table_p = table_defn->head;
-         table_p != NULL;
-         table_p = table_p->next) {
-        if (handle < table_p->base_handle) {
-            return(NULL);
-        }
-        if (handle < 
-            (table_p->base_handle + VMIOPE_OBJECT_TABLE_BLOCK)) {
-            object_p = vmiope_index_to_object(table_p,
-                                              (handle - table_p->base_handle),
-                                              table_defn->element_size);
-            if (object_p == NULL ||
-                table_defn->is_free(object_p)) {
-                return(NULL);
-            }
-            return(object_p);
-        }
+    table_index = (handle & VMIOPE_HANDLE_INDEX_MASK);
+    if (table_index == 0) {
+        return(NULL);
     }
-    return(NULL);
+    table_index--;
+
+    table_p = vmiope_index_to_block(table_defn, table_index);
+    if (table_p == NULL ||
+        vmiope_index_to_handle(table_p, table_index) != handle) {
+        return(NULL);
+    }
+
+    object_p = vmiope_index_to_object(table_p,
+                                      (table_index - table_p->base_handle),
+                                      table_defn->element_size);
+    if (table_defn->is_free(object_p)) {
+        return(NULL);
+    }
+    return(object_p);
 }
 
 #define VMIOPE_INVALID_INDEX ((uint32_t) (~0u))
@@ -396,26 +462,97 @@ vmiope_object_to_handle(vmiope_object_table_defn_t *table_defn,
 {
     vmiope_object_table_t *table_p;
     uint32_t element_index;
+    uint32_t block;
+    uint32_t num_blocks;
 
     if (object_p == NULL) {
         return(VMIOP_HANDLE_NULL);
     }
 
-    for (table_p = table_defn->head;
-         table_p != NULL;
-         table_p = table_p->next) {
+    num_blocks = __atomic_load_n(&table_defn->num_blocks, __ATOMIC_ACQUIRE);
+    for (block = 0; block < num_blocks; block++) {
+        table_p = table_defn->blocks[block];
         element_index = vmiope_object_to_index(table_p,
                                                object_p,
                                                table_defn->element_size);
         if (element_index != VMIOPE_INVALID_INDEX) {
-            return(table_p->base_handle +
-                   element_index +
-                   1);
+            return(vmiope_index_to_handle(table_p,
+                                          (table_p->base_handle +
+                                           element_index)));
         }
     }
     return(VMIOP_HANDLE_NULL);
 }
 
+/**
+ * Add a block to a table, growing the directory if it is full.
+ *
+ * Called with the table lock held.
+ *
+ * @param[in] table_defn            Reference to table definition.
+ * @returns Reference to the new block, or NULL if out of memory
+ *          or out of handles.
+ */
+
+static vmiope_object_table_ref_t
+vmiope_grow_object_table(vmiope_object_table_defn_t *table_defn)
+{
+    vmiope_object_table_t *new_object_table;
+    vmiope_object_table_ref_t *blocks;
+    uint32_t max_blocks;
+    uint32_t i;
+
+    if (table_defn->table_limit + VMIOPE_OBJECT_TABLE_BLOCK >
+        VMIOPE_OBJECT_TABLE_MAX_INDEX) {
+        return(NULL);
+    }
+
+    if (table_defn->num_blocks == table_defn->max_blocks) {
+        max_blocks = (table_defn->max_blocks == 0) ?
+            8 : (table_defn->max_blocks * 2);
+        blocks = calloc(max_blocks, sizeof(*blocks));
+        if (blocks == NULL) {
+            return(NULL);
+        }
+        if (table_defn->blocks != NULL) {
+            memcpy(blocks, table_defn->blocks, 
+                   table_defn->num_blocks * sizeof(*blocks));
+        }
+        /*
+         * The old directory is not freed, as a lock-free lookup may
+         * still be reading it.
+         */
+        __atomic_store_n(&table_defn->blocks, blocks, __ATOMIC_RELEASE);
+        table_defn->max_blocks = max_blocks;
+    }
+
+    new_object_table = (vmiope_object_table_t *) calloc((sizeof(vmiope_object_table_t) +
+                                                         ((table_defn->element_size *
+                                                           VMIOPE_OBJECT_TABLE_BLOCK) -
+                                                          sizeof(vmiope_object_table_element_t))),
+                                                        1);
+    if (new_object_table == NULL) {
+        return(NULL);
+    }
+
+    new_object_table->base_handle = table_defn->table_limit;
+
+    /* thread the new slots onto the free list, lowest first */
+    for (i = 0; i < VMIOPE_OBJECT_TABLE_BLOCK; i++) {
+        new_object_table->next_free[i] = 
+            (i + 1 < VMIOPE_OBJECT_TABLE_BLOCK) ?
+            (new_object_table->base_handle + i + 1) : table_defn->free_head;
+    }
+    table_defn->free_head = new_object_table->base_handle;
+    table_defn->table_limit += VMIOPE_OBJECT_TABLE_BLOCK;
+
+    table_defn->blocks[table_defn->num_blocks] = new_object_table;
+    __atomic_store_n(&table_defn->num_blocks, table_defn->num_blocks + 1,
+                     __ATOMIC_RELEASE);
+
+    return(new_object_table);
+}
+
 /**
  * Allocate object from table and return handle and object reference.
  *
@@ -435,8 +572,7 @@ vmiope_allocate_table_element(vmiope_object_table_defn_t *table_defn,
                               vmiop_handle_t *handle_p,
                               void **object_p)
 {
-    vmiop_handle_t handle;
-    vmiope_object_table_t *new_object_table;
+    uint32_t table_index;
     void *new_object;
     vmiope_object_table_t *table_p;
 
@@ -448,63 +584,85 @@ vmiope_allocate_table_element(vmiope_object_table_defn_t *table_defn,
         return(vmiop_error_inval);
     }
 
-    for (table_p = table_defn->head;
-         table_p != NULL;
-         table_p = table_p->next) {
-        for (handle = 0;
-             handle < VMIOPE_OBJECT_TABLE_BLOCK;
-             handle++) {
-            new_object = vmiope_index_to_object(table_p,
-                                                handle,
-                                                table_defn->element_size);
-            if (table_defn->is_free(new_object)) {
-                handle += table_p->base_handle;
-                goto alloc_entry;
+    (void) pthread_mutex_lock(&table_defn->lock);
+
+    for (;;) {
+        if (table_defn->free_head == VMIOPE_OBJECT_TABLE_NO_FREE &&
+            vmiope_grow_object_table(table_defn) == NULL) {
+            (void) pthread_mutex_unlock(&table_defn->lock);
+            *handle_p = VMIOP_HANDLE_NULL;
+            if (object_p != NULL) {
+                *object_p = NULL;
             }
+            return(vmiop_error_resource);
         }
-    }
-    new_object_table = (vmiope_object_table_t *) calloc((sizeof(vmiope_object_table_t) +
-                                                         ((table_defn->element_size *
-                                                           VMIOPE_OBJECT_TABLE_BLOCK) -
-                                                          sizeof(vmiope_object_table_element_t))),
-                                                        1);
-    if (new_object_table == NULL) {
-        *handle_p = VMIOP_HANDLE_NULL;
-        if (object_p != NULL) {
-            *object_p = NULL;
-        }
-        return(vmiop_error_resource);
-    }
 
-    new_object_table->base_handle = table_defn->table_limit;
-    table_defn->table_limit += VMIOPE_OBJECT_TABLE_BLOCK;
+        table_index = table_defn->free_head;
+        table_p = table_defn->blocks[table_index / VMIOPE_OBJECT_TABLE_BLOCK];
+        table_defn->free_head = 
+            table_p->next_free[table_index % VMIOPE_OBJECT_TABLE_BLOCK];
 
-    if (table_defn->head == NULL) {
-        table_defn->head = new_object_table;
-    } else {
-        for (table_p = table_defn->head;
-             ;
-             table_p = table_p->next) {
-            if (table_p->next == NULL) {
-                table_p->next = new_object_table;
-                break;
-            }
+        new_object = vmiope_index_to_object(table_p,
+                                            (table_index - table_p->base_handle),
+                                            table_defn->element_size);
+
+        /* a slot which is never released stays off the list */
+        if (table_defn->is_free(new_object)) {
+            break;
         }
     }
-    new_object = ((void *) new_object_table->element);
-    handle = new_object_table->base_handle;
- alloc_entry:
+
     (void) memset((void *) new_object,
                   (int) 0,
                   (size_t) table_defn->element_size);
-    handle++;
-    *handle_p = handle;
+
+    (void) pthread_mutex_unlock(&table_defn->lock);
+
+    *handle_p = vmiope_index_to_handle(table_p, table_index);
     if (object_p != NULL) {
         *object_p = new_object;
     }
     return(vmiop_success);
 }
 
+/**
+ * Return a released object to its table.
+ *
+ * The caller must already have marked the object free.  Its slot
+ * moves to a new generation, so existing handles for it no longer
+ * resolve, and it is reused by a later allocation.
+ *
+ * @param[in] table_defn            Reference to table definition.
+ * @param[in] handle                Handle of the released element.
+ */
+
+static void
+vmiope_release_table_element(vmiope_object_table_defn_t *table_defn,
+                             vmiop_handle_t handle)
+{
+    vmiope_object_table_t *table_p;
+    uint32_t table_index;
+
+    table_index = (handle & VMIOPE_HANDLE_INDEX_MASK);
+    if (table_index == 0) {
+        return;
+    }
+    table_index--;
+
+    (void) pthread_mutex_lock(&table_defn->lock);
+
+    table_p = vmiope_index_to_block(table_defn, table_index);
+    if (table_p != NULL &&
+        vmiope_index_to_handle(table_p, table_index) == handle) {
+        table_p->generation[table_index % VMIOPE_OBJECT_TABLE_BLOCK]++;
+        table_p->next_free[table_index % VMIOPE_OBJECT_TABLE_BLOCK] = 
+            table_defn->free_head;
+        table_defn->free_head = table_index;
+    }
+
+    (void) pthread_mutex_unlock(&table_defn->lock);
+}
+
 /*
  * memory allocation
  */
@@ -750,11 +908,172 @@ vmiop_paged_memory_free(void *alloc_addr,
 static pthread_mutex_t vmiope_monitor_lock = PTHREAD_MUTEX_INITIALIZER;
 /*!< lock for qemu monitor */
 
-static vmiop_bool_t vmiope_monitor_held = vmiop_false;
-/*!< set true when monitor held (except briefly when entering or leaving) */
+static __thread vmiop_bool_t vmiope_monitor_mine = vmiop_false;
+/*!< set true while this thread holds the monitor */
+
+/*
+ * Lock order.
+ *
+ * 1. The monitor.  It covers demu device emulation, the mapcache and
+ *    the buffered ioreq ring, and is dropped around every plugin
+ *    callback.  Spaces whose io_ops_t is marked unlocked (the plugin
+ *    regions) are dispatched without it.
+ * 2. The surface lock (surface.c).  Taken under the monitor by the
+ *    console refresh, or without it by the presentation plugin; it
+ *    never takes the monitor.
+ * 3. The vmiop-env subsystem locks (mapping_lock, region_lock,
+ *    thread_lock).  vmiope_enter_lock() leaves the monitor before
+ *    taking one, and vmiope_leave_lock() releases it before the
+ *    monitor is re-entered, so they never nest with the monitor.
+ * 4. Object table locks, message buffer cache locks, demu's I/O space
+ *    registry lock (lookups take no lock), its dirty range
+ *    accumulator, and its migration locks (record writer,
+ *    compression queue, sent stats, restore queue).  These are
+ *    leaves: nothing else is locked and no vmiope call is made while
+ *    one is held.
+ */
+
+#ifdef VMIOPE_LOCK_PROFILE
+
+/**
+ * Contention statistics for one lock.
+ *
+ * Updated by the thread that has just acquired the lock, so the
+ * lock itself protects them.
+ */
+
+typedef struct vmiope_lock_profile_s {
+    const char *name;           /*!< lock name for the report */
+    pthread_mutex_t *lock_p;    /*!< lock being profiled */
+    uint64_t acquired;          /*!< times acquired */
+    uint64_t contended;         /*!< times found already held */
+    uint64_t wait_ns;           /*!< total time waiting */
+    uint64_t max_wait_ns;       /*!< longest wait */
+} vmiope_lock_profile_t;
+
+static pthread_mutex_t vmiope_monitor_lock;
+static pthread_mutex_t mapping_lock;
+static pthread_mutex_t region_lock;
+static pthread_mutex_t thread_lock;
+
+#define VMIOPE_LOCK_PROFILE_MAX 16
+/*!< maximum number of locks profiled */
+
+static vmiope_lock_profile_t vmiope_lock_profile[VMIOPE_LOCK_PROFILE_MAX] = {
+    { .name = "monitor", .lock_p = &vmiope_monitor_lock },
+    { .name = "mapping", .lock_p = &mapping_lock },
+    { .name = "region", .lock_p = &region_lock },
+    { .name = "thread", .lock_p = &thread_lock },
+};
 
-static pthread_t vmiope_monitor_holder;
-/*!< pthread ID of thread holding the monitor */
+static unsigned int vmiope_lock_profile_nr = 4;
+/*!< entries in use, published after the entry is filled in */
+
+static pthread_mutex_t vmiope_lock_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+/*!< serializes registration; not itself profiled */
+
+static inline uint64_t
+vmiope_lock_profile_now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(((uint64_t) ts.tv_sec * 1000000000ull) + ts.tv_nsec);
+}
+
+void
+vmiope_lock_profile_register(const char *name,
+                             pthread_mutex_t *lock_p)
+{
+    unsigned int nr;
+
+    (void) pthread_mutex_lock(&vmiope_lock_profile_lock);
+    nr = vmiope_lock_profile_nr;
+    if (nr == VMIOPE_LOCK_PROFILE_MAX) {
+        (void) pthread_mutex_unlock(&vmiope_lock_profile_lock);
+        vmiop_log(vmiop_log_notice,
+                  "vmiop-env: lock %s not profiled: table full", name);
+        return;
+    }
+    vmiope_lock_profile[nr].name = name;
+    vmiope_lock_profile[nr].lock_p = lock_p;
+    __atomic_store_n(&vmiope_lock_profile_nr, nr + 1, __ATOMIC_RELEASE);
+    (void) pthread_mutex_unlock(&vmiope_lock_profile_lock);
+}
+
+int
+vmiope_lock_acquire(pthread_mutex_t *lock_p)
+{
+    vmiope_lock_profile_t *profile = NULL;
+    uint64_t start, wait_ns;
+    unsigned int i, nr;
+    int rc;
+
+    nr = __atomic_load_n(&vmiope_lock_profile_nr, __ATOMIC_ACQUIRE);
+    for (i = 0; i < nr; i++) {
+        if (vmiope_lock_profile[i].lock_p == lock_p) {
+            profile = &vmiope_lock_profile[i];
+            break;
+        }
+    }
+
+    if (pthread_mutex_trylock(lock_p) == 0) {
+        if (profile != NULL) {
+            profile->acquired++;
+        }
+        return(0);
+    }
+
+    start = vmiope_lock_profile_now();
+    rc = pthread_mutex_lock(lock_p);
+    if (rc != 0 || profile == NULL) {
+        return(rc);
+    }
+
+    wait_ns = vmiope_lock_profile_now() - start;
+    profile->acquired++;
+    profile->contended++;
+    profile->wait_ns += wait_ns;
+    if (wait_ns > profile->max_wait_ns) {
+        profile->max_wait_ns = wait_ns;
+    }
+    return(0);
+}
+
+void
+vmiope_lock_profile_report(void)
+{
+    vmiope_lock_profile_t *profile;
+    unsigned int i, nr;
+
+    nr = __atomic_load_n(&vmiope_lock_profile_nr, __ATOMIC_ACQUIRE);
+    for (i = 0; i < nr; i++) {
+        profile = &vmiope_lock_profile[i];
+        vmiop_log(vmiop_log_notice,
+                  "vmiop-env: lock %s: %llu acquired, %llu contended, "
+                  "wait %llu us total, %llu us max",
+                  profile->name,
+                  (unsigned long long) profile->acquired,
+                  (unsigned long long) profile->contended,
+                  (unsigned long long) (profile->wait_ns / 1000),
+                  (unsigned long long) (profile->max_wait_ns / 1000));
+    }
+}
+
+#else
+
+void
+vmiope_lock_profile_register(const char *name,
+                             pthread_mutex_t *lock_p)
+{
+}
+
+void
+vmiope_lock_profile_report(void)
+{
+}
+
+#endif /* VMIOPE_LOCK_PROFILE */
 
 /**
  * Enter vmioplugin monitor for qemu.
@@ -781,15 +1100,13 @@ static pthread_t vmiope_monitor_holder;
 void
 vmiope_enter_monitor(vmiop_bool_t *in_monitor)
 {
-    if (vmiope_monitor_held &&
-        vmiope_monitor_holder == pthread_self()) {
+    if (vmiope_monitor_mine) {
         if (in_monitor != NULL) {
             *in_monitor = vmiop_true;
         }
     } else {
-        pthread_mutex_lock(&vmiope_monitor_lock);
-        vmiope_monitor_holder = pthread_self();
-        vmiope_monitor_held = vmiop_true;
+        (void) vmiope_lock_acquire(&vmiope_monitor_lock);
+        vmiope_monitor_mine = vmiop_true;
         if (in_monitor != NULL) {
             *in_monitor = vmiop_false;
         }
@@ -808,9 +1125,8 @@ vmiope_enter_monitor(vmiop_bool_t *in_monitor)
 void
 vmiope_leave_monitor(vmiop_bool_t *in_monitor)
 {
-    if (vmiope_monitor_held &&
-        vmiope_monitor_holder == pthread_self()) {
-        vmiope_monitor_held = vmiop_false;
+    if (vmiope_monitor_mine) {
+        vmiope_monitor_mine = vmiop_false;
         (void) pthread_mutex_unlock(&vmiope_monitor_lock);
         if (in_monitor != NULL) {
             *in_monitor = vmiop_true;
@@ -838,7 +1154,7 @@ vmiope_enter_lock(vmiop_bool_t *in_monitor,
                   pthread_mutex_t *lock_p)
 {
     vmiope_leave_monitor(in_monitor);
-    if (pthread_mutex_lock(lock_p) != 0) {
+    if (vmiope_lock_acquire(lock_p) != 0) {
         if (*in_monitor) {
             vmiope_enter_monitor(NULL);
         }
@@ -1068,12 +1384,14 @@ vmiope_config_read(vmiope_emul_device_t *emd,
     uint16_t data_value_w;
     uint8_t data_value_b;
     vmiop_bool_t in_monitor;
+    uint64_t start;
 
     if (emd == NULL ||
         address >= 256) {
         return(0xfffffffful);
     }
     vmiope_leave_monitor(&in_monitor);
+    start = trace_begin(TRACE_PLUGIN_CALLBACK);
     switch (len) {
     case 1:
         error_code = emd->callback(emd->private_object,
@@ -1111,6 +1429,7 @@ vmiope_config_read(vmiope_emul_device_t *emd,
         break;
     }
 
+    trace_end(TRACE_PLUGIN_CALLBACK, start);
     if (in_monitor) {
         vmiope_enter_monitor(NULL);
     }
@@ -1175,6 +1494,7 @@ vmiope_config_write(vmiope_emul_device_t *emd,
     uint16_t data_value_w;
     uint8_t data_value_b;
     vmiop_bool_t in_monitor;
+    uint64_t start;
 
     if (emd == NULL ||
         address >= 256) {
@@ -1182,6 +1502,7 @@ vmiope_config_write(vmiope_emul_device_t *emd,
     }
 
     vmiope_leave_monitor(&in_monitor);
+    start = trace_begin(TRACE_PLUGIN_CALLBACK);
     switch (len) {
     case 1:
         data_value_b = val;
@@ -1218,6 +1539,7 @@ vmiope_config_write(vmiope_emul_device_t *emd,
         break;
     }
 
+    trace_end(TRACE_PLUGIN_CALLBACK, start);
     if (in_monitor) {
         vmiope_enter_monitor(NULL);
     }
@@ -1253,7 +1575,8 @@ static io_ops_t vmiope_config_ops = {
     .readl = vmiope_config_readl,
     .writeb = vmiope_config_writeb,
     .writew = vmiope_config_writew,
-    .writel = vmiope_config_writel
+    .writel = vmiope_config_writel,
+    .unlocked = 1
 };
 
 /**
@@ -1512,8 +1835,10 @@ vmiope_mapping_is_free(void *object_p)
  */
 
 static vmiope_object_table_defn_t mapping_table = {
-    .head = NULL,
+    .blocks = NULL,
     .table_limit = 0,
+    .free_head = VMIOPE_OBJECT_TABLE_NO_FREE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
     .is_free = vmiope_mapping_is_free,
     .element_size = sizeof(vmiope_mapping_array_t)
 };
@@ -1613,6 +1938,7 @@ vmiop_map_guest_memory(const vmiop_emul_addr_t range_base,
     if (mapping->local_address == MAP_FAILED) {
         mapping->local_address = NULL;
         mapping->range_length = 0;
+        vmiope_release_table_element(&mapping_table, *handle_p);
         return(vmiop_error_inval);
     }
 
@@ -1719,6 +2045,7 @@ vmiop_map_guest_memory_pages(unsigned long *pfn_list,
     if (mapping->local_address == NULL) {
         mapping->local_address = MAP_FAILED;
         mapping->range_length = 0;
+        vmiope_release_table_element(&mapping_table, *handle_p);
         return(vmiop_error_inval);
     }
     *local_address_p = mapping->local_address;
@@ -1760,6 +2087,7 @@ vmiop_unmap_guest_memory(const vmiop_handle_t handle)
 
         mapping->local_address = NULL;
         mapping->range_length = 0;
+        vmiope_release_table_element(&mapping_table, handle);
     }
                   
     vmiope_leave_lock(in_monitor,
@@ -1811,8 +2139,10 @@ vmiope_region_is_free(void *object_p)
  */
 
 static vmiope_object_table_defn_t region_table = {
-    .head = NULL,
+    .blocks = NULL,
     .table_limit = 0,
+    .free_head = VMIOPE_OBJECT_TABLE_NO_FREE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
     .is_free = vmiope_region_is_free,
     .element_size = sizeof(vmiope_region_array_t)
 };
@@ -1837,6 +2167,67 @@ vmiope_handle_to_region(vmiop_handle_t handle)
  * ioport emulation routines
  */
 
+/**
+ * Pass a guest access to a region on to its plugin.
+ *
+ * A thread dispatching an unlocked space (see io_ops_t) does not
+ * hold the monitor and calls the plugin directly; otherwise the
+ * monitor is left around the callback.
+ *
+ * @param[in] region        Reference to vmiope_region_t object
+ * @param[in] emul_op       Read or write
+ * @param[in] address_space Address space accessed
+ * @param[in] addr          Address in target memory
+ * @param[in] data_length   Length of access
+ * @param[in,out] data_p    Reference to data, filled with ones if
+ *                          a read finds no callback
+ */
+
+static inline void
+vmiope_region_access(vmiope_region_t *region,
+                     vmiop_emul_op_t emul_op,
+                     vmiop_emul_space_t address_space,
+                     uint64_t addr,
+                     vmiop_emul_length_t data_length,
+                     void *data_p)
+{
+    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
+    vmiop_bool_t in_monitor = vmiope_monitor_mine;
+    uint64_t start;
+
+    if (in_monitor) {
+        vmiope_leave_monitor(NULL);
+    }
+    start = trace_begin(TRACE_PLUGIN_CALLBACK);
+    if (region->callback) {
+        (void) region->callback(region->private_object,
+                                emul_op,
+                                address_space,
+                                addr,
+                                data_length,
+                                data_p,
+                                &cacheable);
+    }
+    else {
+        vmiop_log(vmiop_log_error,
+                  "%s: vmiop-env:map-only region access!"
+                  "OP: %s, addr: 0x%lx, length: %lu"
+                  "Region{address_space=0x%x, range_base=0x%lx, range_length=0x%lx}",
+                  __FUNCTION__,
+                  (emul_op == vmiop_emul_op_read) ? "read" : "write",
+                  addr, data_length,
+                  region->address_space, region->range_base, region->range_length);
+
+        if (emul_op == vmiop_emul_op_read) {
+            memset(data_p, 0xff, data_length);
+        }
+    }
+    trace_end(TRACE_PLUGIN_CALLBACK, start);
+    if (in_monitor) {
+        vmiope_enter_monitor(NULL);
+    }
+}
+
 /**
  * Read ioport byte
  *
@@ -1851,20 +2242,10 @@ vmiope_ioport_readb(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint8_t data_value;
-    vmiop_emul_state_t cacheable;
-    vmiop_bool_t in_monitor;
 
-    vmiope_leave_monitor(&in_monitor);
-    (void) region->callback(region->private_object,
-                            vmiop_emul_op_read,
-                            vmiop_emul_space_io,
-                            addr,
-                            sizeof(data_value),
-                            (void *) &data_value,
-                            &cacheable);
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_read, vmiop_emul_space_io,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
     return(data_value);
 }
 
@@ -1882,20 +2263,10 @@ vmiope_ioport_readw(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint16_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
-    vmiope_leave_monitor(&in_monitor);
-    (void) region->callback(region->private_object,
-                            vmiop_emul_op_read,
-                            vmiop_emul_space_io,
-                            addr,
-                            sizeof(data_value),
-                            (void *) &data_value,
-                            &cacheable);
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_read, vmiop_emul_space_io,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 #ifdef TARGET_WORDS_BIGENDIAN
     data_value = htons(data_value);
 #endif
@@ -1916,20 +2287,10 @@ vmiope_ioport_readl(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint32_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
-    vmiope_leave_monitor(&in_monitor);
-    (void) region->callback(region->private_object,
-                            vmiop_emul_op_read,
-                            vmiop_emul_space_io,
-                            addr,
-                            sizeof(data_value),
-                            (void *) &data_value,
-                            &cacheable);
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_read, vmiop_emul_space_io,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 #ifdef TARGET_WORDS_BIGENDIAN
     data_value = htonl(data_value);
 #endif
@@ -1951,21 +2312,11 @@ vmiope_ioport_writeb(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint8_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
     data_value = mem_value;
-    vmiope_leave_monitor(&in_monitor);
-    (void) region->callback(region->private_object,
-                            vmiop_emul_op_write,
-                            vmiop_emul_space_io,
-                            addr,
-                            sizeof(data_value),
-                            (void *) &data_value,
-                            &cacheable);
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_write, vmiop_emul_space_io,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 }
 
 /**
@@ -1983,25 +2334,15 @@ vmiope_ioport_writew(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint16_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
 #ifdef TARGET_WORDS_BIGENDIAN
     data_value = ntohs(mem_value);
 #else
     data_value = mem_value;
 #endif
-    vmiope_leave_monitor(&in_monitor);
-    (void) region->callback(region->private_object,
-                            vmiop_emul_op_write,
-                            vmiop_emul_space_io,
-                            addr,
-                            sizeof(data_value),
-                            (void *) &data_value,
-                            &cacheable);
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_write, vmiop_emul_space_io,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 }
 
 /**
@@ -2019,25 +2360,15 @@ vmiope_ioport_writel(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint32_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
 #ifdef TARGET_WORDS_BIGENDIAN
     data_value = ntohl(mem_value);
 #else
     data_value = mem_value;
 #endif
-    vmiope_leave_monitor(&in_monitor);
-    (void) region->callback(region->private_object,
-                            vmiop_emul_op_write,
-                            vmiop_emul_space_io,
-                            addr,
-                            sizeof(data_value),
-                            (void *) &data_value,
-                            &cacheable);
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_write, vmiop_emul_space_io,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 }
 
 static io_ops_t vmiope_ioport_ops = {
@@ -2046,7 +2377,8 @@ static io_ops_t vmiope_ioport_ops = {
     .readl = vmiope_ioport_readl,
     .writeb = vmiope_ioport_writeb,
     .writew = vmiope_ioport_writew,
-    .writel = vmiope_ioport_writel
+    .writel = vmiope_ioport_writel,
+    .unlocked = 1
 };
 
 
@@ -2068,32 +2400,10 @@ vmiope_mmio_readb(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint8_t data_value;
-    vmiop_emul_state_t cacheable;
-    vmiop_bool_t in_monitor;
 
-    vmiope_leave_monitor(&in_monitor);
-    if (region->callback) {
-        (void) region->callback(region->private_object,
-                                vmiop_emul_op_read,
-                                vmiop_emul_space_mmio,
-                                addr,
-                                sizeof(data_value),
-                                (void *) &data_value,
-                                &cacheable);
-    }
-    else {
-        vmiop_log(vmiop_log_error,
-                  "%s: vmiop-env:map-only region access!"
-                  "OP: read, addr: 0x%x"
-                  "Region{address_space=0x%x, range_base=0x%lx, range_length=0x%lx}",
-                  __FUNCTION__, addr,
-                  region->address_space, region->range_base, region->range_length);
-
-        data_value = -1;
-    }
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_read, vmiop_emul_space_mmio,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
     return(data_value);
 }
 
@@ -2111,32 +2421,10 @@ vmiope_mmio_readw(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint16_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
-    vmiope_leave_monitor(&in_monitor);
-    if (region->callback) {
-        (void) region->callback(region->private_object,
-                                vmiop_emul_op_read,
-                                vmiop_emul_space_mmio,
-                                addr,
-                                sizeof(data_value),
-                                (void *) &data_value,
-                                &cacheable);
-    }
-    else {
-        vmiop_log(vmiop_log_error,
-                  "%s: vmiop-env:map-only region access!"
-                  "OP: read, addr: 0x%x"
-                  "Region{address_space=0x%x, range_base=0x%lx, range_length=0x%lx}",
-                  __FUNCTION__, addr,
-                  region->address_space, region->range_base, region->range_length);
-
-        data_value = -1;
-    }
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_read, vmiop_emul_space_mmio,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 #ifdef TARGET_WORDS_BIGENDIAN
     data_value = htons(data_value);
 #endif
@@ -2157,32 +2445,10 @@ vmiope_mmio_readl(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint32_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
-    
-    vmiope_leave_monitor(&in_monitor);
-    if (region->callback) {
-        (void) region->callback(region->private_object,
-                                vmiop_emul_op_read,
-                                vmiop_emul_space_mmio,
-                                addr,
-                                sizeof(data_value),
-                                (void *) &data_value,
-                                &cacheable);
-    }
-    else {
-        vmiop_log(vmiop_log_error,
-                  "%s: vmiop-env:map-only region access!"
-                  "OP: read, addr: 0x%x"
-                  "Region{address_space=0x%x, range_base=0x%lx, range_length=0x%lx}",
-                  __FUNCTION__, addr,
-                  region->address_space, region->range_base, region->range_length);
 
-        data_value = -1;
-    }
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_read, vmiop_emul_space_mmio,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 #ifdef TARGET_WORDS_BIGENDIAN
     data_value = htonl(data_value);
 #endif
@@ -2204,31 +2470,11 @@ vmiope_mmio_writeb(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint8_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
     data_value = mem_value;
-    vmiope_leave_monitor(&in_monitor);
-    if (region->callback) {
-        (void) region->callback(region->private_object,
-                                vmiop_emul_op_write,
-                                vmiop_emul_space_mmio,
-                                addr,
-                                sizeof(data_value),
-                                (void *) &data_value,
-                                &cacheable);
-    }
-    else {
-        vmiop_log(vmiop_log_error,
-                  "%s: vmiop-env:map-only region access!"
-                  "OP: write, addr: 0x%x, value=0x%x"
-                  "Region{address_space=0x%x, range_base=0x%lx, range_length=0x%lx}",
-                  __FUNCTION__, addr, mem_value,
-                  region->address_space, region->range_base, region->range_length);
-    }
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_write, vmiop_emul_space_mmio,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 }
 
 /**
@@ -2246,35 +2492,15 @@ vmiope_mmio_writew(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint16_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
 #ifdef TARGET_WORDS_BIGENDIAN
     data_value = ntohs(mem_value);
 #else
     data_value = mem_value;
 #endif
-    vmiope_leave_monitor(&in_monitor);
-    if (region->callback) {
-        (void) region->callback(region->private_object,
-                                vmiop_emul_op_write,
-                                vmiop_emul_space_mmio,
-                                addr,
-                                sizeof(data_value),
-                                (void *) &data_value,
-                                &cacheable);
-    }
-    else {
-        vmiop_log(vmiop_log_error,
-                  "%s: vmiop-env:map-only region access!"
-                  "OP: write, addr: 0x%x, value=0x%x"
-                  "Region{address_space=0x%x, range_base=0x%lx, range_length=0x%lx}",
-                  __FUNCTION__, addr, mem_value,
-                  region->address_space, region->range_base, region->range_length);
-    }
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_write, vmiop_emul_space_mmio,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 }
 
 /**
@@ -2292,35 +2518,15 @@ vmiope_mmio_writel(void *opaque,
 {
     vmiope_region_t *region = ((vmiope_region_t *) opaque);
     uint32_t data_value;
-    vmiop_emul_state_t cacheable = vmiop_emul_noncacheable;
-    vmiop_bool_t in_monitor;
 
 #ifdef TARGET_WORDS_BIGENDIAN
     data_value = ntohl(mem_value);
 #else
     data_value = mem_value;
 #endif
-    vmiope_leave_monitor(&in_monitor);
-    if (region->callback) {
-        (void) region->callback(region->private_object,
-                                vmiop_emul_op_write,
-                                vmiop_emul_space_mmio,
-                                addr,
-                                sizeof(data_value),
-                                (void *) &data_value,
-                                &cacheable);
-    }
-    else {
-        vmiop_log(vmiop_log_error,
-                  "%s: vmiop-env:map-only region access!"
-                  "OP: write, addr: 0x%x, value=0x%x"
-                  "Region{address_space=0x%x, range_base=0x%lx, range_length=0x%lx}",
-                  __FUNCTION__, addr, mem_value,
-                  region->address_space, region->range_base, region->range_length);
-    }
-    if (in_monitor) {
-        vmiope_enter_monitor(NULL);
-    }
+    vmiope_region_access(region, vmiop_emul_op_write, vmiop_emul_space_mmio,
+                         addr, sizeof(data_value),
+                         (void *) &data_value);
 }
 
 static io_ops_t vmiope_mmio_ops = {
@@ -2329,7 +2535,8 @@ static io_ops_t vmiope_mmio_ops = {
     .readl = vmiope_mmio_readl,
     .writeb = vmiope_mmio_writeb,
     .writew = vmiope_mmio_writew,
-    .writel = vmiope_mmio_writel
+    .writel = vmiope_mmio_writel,
+    .unlocked = 1
 };
 
 
@@ -3147,8 +3354,10 @@ vmiope_thread_is_free(void *thread_p)
 
 
 static vmiope_object_table_defn_t thread_table = {
-    .head = NULL,
+    .blocks = NULL,
     .table_limit = 0,
+    .free_head = VMIOPE_OBJECT_TABLE_NO_FREE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
     .is_free = vmiope_thread_is_free,
     .element_size = sizeof(vmiope_thread_array_t)
 }; /*!< definition of thread table */
@@ -3156,6 +3365,12 @@ static vmiope_object_table_defn_t thread_table = {
 static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
 /*!< lock for thread management */
 
+static cpu_set_t thread_cpuset;
+/*!< CPUs for new threads, under thread_lock */
+
+static vmiop_bool_t thread_cpuset_valid = vmiop_false;
+/*!< whether thread_cpuset applies */
+
 /**
  * Convert handle to thread reference
  *
@@ -3291,8 +3506,10 @@ vmiope_thread_event_is_free(void *event_p)
 }
 
 static vmiope_object_table_defn_t thread_event_table = {
-    .head = NULL,
+    .blocks = NULL,
     .table_limit = 0,
+    .free_head = VMIOPE_OBJECT_TABLE_NO_FREE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
     .is_free = vmiope_thread_event_is_free,
     .element_size = sizeof(vmiope_thread_event_array_t)
 }; /*!< definition of thread event table */
@@ -3369,6 +3586,7 @@ vmiope_find_free_thread_event_handle(vmiop_handle_t *handle_p,
         }
     }
     if (error_value != 0) {
+        vmiope_release_table_element(&thread_event_table, *handle_p);
         *handle_p = VMIOP_HANDLE_NULL;
         *event_p = NULL;
         return(vmiop_error_resource);
@@ -3409,16 +3627,28 @@ vmiop_thread_alloc(void *private_object,
 
     error_code = vmiope_find_free_thread_handle(&handle,&new_thread);
     if (error_code == vmiop_success) {
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        if (thread_cpuset_valid) {
+            (void) pthread_attr_setaffinity_np(&attr,
+                                               sizeof(thread_cpuset),
+                                               &thread_cpuset);
+        }
+
         new_thread->init_p = init_p;
         new_thread->private_object = private_object;
         if (pthread_create(&new_thread->pthread,
-                           NULL,
+                           &attr,
                            vmiope_thread_init,
                            (void *) new_thread) != 0) {
             new_thread->init_p = NULL;
+            vmiope_release_table_element(&thread_table, handle);
             handle = VMIOP_HANDLE_NULL;
             error_code = vmiop_error_resource;
         }
+
+        pthread_attr_destroy(&attr);
     }
 
     vmiope_leave_lock(in_monitor,
@@ -3428,6 +3658,34 @@ vmiop_thread_alloc(void *private_object,
     return(error_code);
 }
 
+/**
+ * Set the CPUs on which threads from vmiop_thread_alloc() start.
+ *
+ * @param[in] cpuset_p      Reference to the CPU set, or NULL for new
+ *                          threads to inherit the creator's affinity.
+ */
+
+void
+vmiope_set_thread_affinity(const cpu_set_t *cpuset_p)
+{
+    vmiop_bool_t in_monitor;
+
+    if (vmiope_enter_lock(&in_monitor,
+                          &thread_lock) != vmiop_success) {
+        return;
+    }
+
+    if (cpuset_p != NULL) {
+        thread_cpuset = *cpuset_p;
+        thread_cpuset_valid = vmiop_true;
+    } else {
+        thread_cpuset_valid = vmiop_false;
+    }
+
+    vmiope_leave_lock(in_monitor,
+                      &thread_lock);
+}
+
 /**
  * Join the thread.
  *
@@ -3518,6 +3776,7 @@ vmiope_lock_free_nolock(vmiop_handle_t handle)
 
     if (pthread_mutex_destroy(&new_event->u.mutex) == 0) {
         new_event->type = vmiope_tetype_unallocated;
+        vmiope_release_table_element(&thread_event_table, handle);
     }
 
     return(vmiop_success);
@@ -3695,6 +3954,7 @@ vmiop_spinlock_free(vmiop_handle_t handle)
     if (new_event != NULL &&
         pthread_spin_destroy(&new_event->u.spinlock) == 0) {
         new_event->type = vmiope_tetype_unallocated;
+        vmiope_release_table_element(&thread_event_table, handle);
     } else {
         error_code = vmiop_error_inval;
     }
@@ -4828,6 +5088,8 @@ vmiope_initialize(void)
     return(vmiop_success);
 }
 
+static void
+vmiope_buffer_cache_drain(void);
 
 /**
  * Shutdown the vmioplugin environment.
@@ -4849,6 +5111,7 @@ vmiope_shutdown(void)
     vmiop_plugin_ref_t plugin;
     vmiop_error_t fault_error_code = vmiop_success;
     vmiop_bool_t in_monitor;
+    vmiope_buffer_stats_t buffer_stats;
 
     while (vmiop_true) {
         error_code = vmiop_find_plugin(&handle,
@@ -4867,11 +5130,21 @@ vmiope_shutdown(void)
     }
 
     /* release the VRAM mfn */
-    if (vram_mfn[0] != 0) {
-        (void) demu_release_guest_pages(vram_mfn,
-                                        (VRAM_RESERVED_SIZE - TARGET_PAGE_SIZE)
-                                        >> TARGET_PAGE_SHIFT);
-    }
+    demu_vram_table_invalidate();
+
+    vmiope_lock_profile_report();
+
+    vmiope_buffer_get_stats(&buffer_stats);
+    vmiop_log(vmiop_log_notice,
+              "vmiop-env: message buffers: %llu allocated, %llu from cache, "
+              "%llu from heap (%llu oversize), %llu freed, %u cached",
+              (unsigned long long) buffer_stats.allocs,
+              (unsigned long long) buffer_stats.cache_hits,
+              (unsigned long long) buffer_stats.heap_allocs,
+              (unsigned long long) buffer_stats.oversize,
+              (unsigned long long) buffer_stats.frees,
+              buffer_stats.cached);
+    vmiope_buffer_cache_drain();
 
     return(vmiop_success);
 }
@@ -5550,6 +5823,149 @@ vmiope_validate_plugin_class(vmiop_plugin_class_t plugin_class)
            plugin_class <= vmiop_plugin_class_max);
 }
 
+/**
+ * Message buffer size classes.
+ *
+ * Buffers whose total allocation fits a class are rounded up to the
+ * class size and, when freed, kept on a per-class free list instead
+ * of being returned to the heap, so steady-state message traffic
+ * (display configuration, EDID and console state exchanges) does not
+ * touch the allocator.  Larger buffers are allocated and freed
+ * directly.  A cached buffer's first word links it into the list.
+ */
+
+#define VMIOPE_BUFFER_CLASSES      4
+#define VMIOPE_BUFFER_CACHE_DEPTH  32
+
+static const uint32_t vmiope_buffer_class_size[VMIOPE_BUFFER_CLASSES] = {
+    256, 1024, 4096, 16384
+};
+
+typedef struct vmiope_buffer_cache_s {
+    pthread_mutex_t lock;       /*!< leaf lock for the free list */
+    void *free_list;            /*!< cached buffers */
+    uint32_t cached;            /*!< length of free_list */
+} vmiope_buffer_cache_t;
+
+static vmiope_buffer_cache_t vmiope_buffer_cache[VMIOPE_BUFFER_CLASSES] = {
+    [0 ... VMIOPE_BUFFER_CLASSES - 1] = {
+        .lock = PTHREAD_MUTEX_INITIALIZER
+    }
+};
+
+static vmiope_buffer_stats_t vmiope_buffer_stats;
+
+/**
+ * Take a buffer of the given class from its free list.
+ *
+ * @param[in] class_index   Size class
+ * @returns Buffer, or NULL if the free list is empty
+ */
+
+static void *
+vmiope_buffer_cache_get(uint32_t class_index)
+{
+    vmiope_buffer_cache_t *cache = &vmiope_buffer_cache[class_index];
+    void *addr;
+
+    pthread_mutex_lock(&cache->lock);
+    addr = cache->free_list;
+    if (addr != NULL) {
+        cache->free_list = *((void **) addr);
+        cache->cached--;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return(addr);
+}
+
+/**
+ * Return a buffer to its class free list.
+ *
+ * @param[in] class_index   Size class
+ * @param[in] addr          Buffer
+ * @returns vmiop_true if cached, vmiop_false if the list is full
+ */
+
+static vmiop_bool_t
+vmiope_buffer_cache_put(uint32_t class_index,
+                        void *addr)
+{
+    vmiope_buffer_cache_t *cache = &vmiope_buffer_cache[class_index];
+    vmiop_bool_t cached = vmiop_false;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->cached < VMIOPE_BUFFER_CACHE_DEPTH) {
+        *((void **) addr) = cache->free_list;
+        cache->free_list = addr;
+        cache->cached++;
+        cached = vmiop_true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return(cached);
+}
+
+/**
+ * Release every cached message buffer back to the heap.
+ */
+
+static void
+vmiope_buffer_cache_drain(void)
+{
+    vmiope_buffer_cache_t *cache;
+    void *addr;
+    uint32_t i;
+
+    for (i = 0; i < VMIOPE_BUFFER_CLASSES; i++) {
+        cache = &vmiope_buffer_cache[i];
+
+        pthread_mutex_lock(&cache->lock);
+        while ((addr = cache->free_list) != NULL) {
+            cache->free_list = *((void **) addr);
+            (void) vmiop_memory_free_internal(addr,
+                                              vmiope_buffer_class_size[i]);
+        }
+        cache->cached = 0;
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+void
+vmiope_buffer_get_stats(vmiope_buffer_stats_t *stats_p)
+{
+    uint32_t i;
+
+    stats_p->allocs = __atomic_load_n(&vmiope_buffer_stats.allocs,
+                                      __ATOMIC_RELAXED);
+    stats_p->frees = __atomic_load_n(&vmiope_buffer_stats.frees,
+                                     __ATOMIC_RELAXED);
+    stats_p->cache_hits = __atomic_load_n(&vmiope_buffer_stats.cache_hits,
+                                          __ATOMIC_RELAXED);
+    stats_p->heap_allocs = __atomic_load_n(&vmiope_buffer_stats.heap_allocs,
+                                           __ATOMIC_RELAXED);
+    stats_p->heap_frees = __atomic_load_n(&vmiope_buffer_stats.heap_frees,
+                                          __ATOMIC_RELAXED);
+    stats_p->oversize = __atomic_load_n(&vmiope_buffer_stats.oversize,
+                                        __ATOMIC_RELAXED);
+
+    stats_p->cached = 0;
+    stats_p->cached_bytes = 0;
+    for (i = 0; i < VMIOPE_BUFFER_CLASSES; i++) {
+        pthread_mutex_lock(&vmiope_buffer_cache[i].lock);
+        stats_p->cached += vmiope_buffer_cache[i].cached;
+        stats_p->cached_bytes += (uint64_t) vmiope_buffer_cache[i].cached *
+                                 vmiope_buffer_class_size[i];
+        pthread_mutex_unlock(&vmiope_buffer_cache[i].lock);
+    }
+}
+
+void
+vmiope_buffer_trim(void)
+{
+    vmiope_buffer_cache_drain();
+}
+
 /**
  * Allocate a message buffer.
  *
@@ -5559,8 +5975,9 @@ vmiope_validate_plugin_class(vmiop_plugin_class_t plugin_class)
  * The implementation stores the total length of the allocation in the first
  * of two uint32_t items immediately following the vmiop_buffer_t and 
  * before the element array, which in turn is followed by the data area.
- * The second uint32_t is currently unused and set to zero, and is reserved
- * to the buffer allocator.   The first item in the element array is set to
+ * The second uint32_t is reserved to the buffer allocator, which records
+ * the size class of the allocation in it (zero if the buffer was too
+ * large for any class).  The first item in the element array is set to
  * point to the total data area allocated, if the element array has at least
  * one element.  No data area may be requested if the element array count is
  * zero.
@@ -5587,7 +6004,9 @@ vmiop_buffer_alloc(vmiop_buffer_ref_t *buf_p,
     vmiop_error_t error_code;
     vmiop_buffer_ref_t buf;
     vmiop_emul_length_t len;
+    vmiop_emul_length_t used;
     uint32_t *buf_count;
+    uint32_t class_index;
 
     if (buf_p == NULL) {
         return(vmiop_error_inval);
@@ -5600,22 +6019,48 @@ vmiop_buffer_alloc(vmiop_buffer_ref_t *buf_p,
         return(vmiop_error_inval);
     }
 
-    len = vmiope_round_up(sizeof(vmiop_buffer_t) +
-                          (2 * sizeof(uint32_t)) +
-                          (element_count * sizeof(vmiop_buffer_element_t)) +
-                          data_size,
-                          sizeof(uint64_t));
-    error_code = vmiop_memory_alloc_internal(len,
-                                             (void **) &buf,
-                                             vmiop_true);
-    if (error_code != vmiop_success) {
-        *buf_p = NULL;
-        return(error_code);
+    used = vmiope_round_up(sizeof(vmiop_buffer_t) +
+                           (2 * sizeof(uint32_t)) +
+                           (element_count * sizeof(vmiop_buffer_element_t)) +
+                           data_size,
+                           sizeof(uint64_t));
+
+    for (class_index = 0; class_index < VMIOPE_BUFFER_CLASSES; class_index++) {
+        if (used <= vmiope_buffer_class_size[class_index]) {
+            break;
+        }
+    }
+
+    buf = NULL;
+    if (class_index < VMIOPE_BUFFER_CLASSES) {
+        len = vmiope_buffer_class_size[class_index];
+        buf = vmiope_buffer_cache_get(class_index);
+        if (buf != NULL) {
+            __atomic_fetch_add(&vmiope_buffer_stats.cache_hits, 1,
+                               __ATOMIC_RELAXED);
+        }
+    } else {
+        len = used;
+        __atomic_fetch_add(&vmiope_buffer_stats.oversize, 1,
+                           __ATOMIC_RELAXED);
     }
 
+    if (buf == NULL) {
+        error_code = vmiop_memory_alloc_internal(len,
+                                                 (void **) &buf,
+                                                 vmiop_false);
+        if (error_code != vmiop_success) {
+            *buf_p = NULL;
+            return(error_code);
+        }
+        __atomic_fetch_add(&vmiope_buffer_stats.heap_allocs, 1,
+                           __ATOMIC_RELAXED);
+    }
+
+    /* only the part the caller can see needs clearing */
     (void) memset((void *) buf,
                   0,
-                  len - data_size);
+                  used);
     buf->source_class = source_class;
     buf->destination_class = destination_class;
     buf->release_p = vmiop_buffer_free;
@@ -5624,9 +6069,12 @@ vmiop_buffer_alloc(vmiop_buffer_ref_t *buf_p,
     buf_count = ((uint32_t *) (buf + 1));
     buf->element = (vmiop_buffer_element_t *) (buf_count + 2);
     buf_count[0] = len;
+    buf_count[1] = (class_index < VMIOPE_BUFFER_CLASSES) ? class_index + 1 : 0;
     buf->element[0].data_p = (void *) (buf->element + buf->count);
     buf->element[0].length = data_size;
 
+    __atomic_fetch_add(&vmiope_buffer_stats.allocs, 1, __ATOMIC_RELAXED);
+
     *buf_p = buf;
     return(vmiop_success);
 }
@@ -5635,7 +6083,8 @@ vmiop_buffer_alloc(vmiop_buffer_ref_t *buf_p,
  * Free a message buffer allocated via vmiop_buffer_alloc().
  *
  * Decrements the reference count and, if it goes to zero,
- * frees the buffer.
+ * returns the buffer to its size class free list, or frees it
+ * if the list is full or the buffer has no size class.
  *
  * @param[in] buf_p         Buffer reference
  * @returns Error code:
@@ -5648,22 +6097,33 @@ vmiop_error_t
 vmiop_buffer_free(vmiop_buffer_ref_t buf_p)
 {
     uint32_t *buf_count;
+    uint32_t class_index;
 
     if (buf_p == NULL ||
         buf_p->count == 0) {
         return(vmiop_error_inval);
     }
-    if (buf_p->references > 1) {
-        buf_p->references--; /* XXX -- make atomic */
-        return(vmiop_success);
-    }
     buf_count = ((uint32_t *) (buf_p + 1));
     if (buf_count[0] < 
         (sizeof(vmiop_buffer_t) +
          (2 * sizeof(uint32_t)) +
-         (buf_p->count * sizeof(vmiop_buffer_element_t)))) {
+         (buf_p->count * sizeof(vmiop_buffer_element_t))) ||
+        buf_count[1] > VMIOPE_BUFFER_CLASSES) {
         return(vmiop_error_inval);
     }
+    if (__atomic_sub_fetch(&buf_p->references, 1, __ATOMIC_ACQ_REL) != 0) {
+        return(vmiop_success);
+    }
+
+    __atomic_fetch_add(&vmiope_buffer_stats.frees, 1, __ATOMIC_RELAXED);
+
+    class_index = buf_count[1];
+    if (class_index != 0 &&
+        vmiope_buffer_cache_put(class_index - 1, (void *) buf_p)) {
+        return(vmiop_success);
+    }
+
+    __atomic_fetch_add(&vmiope_buffer_stats.heap_frees, 1, __ATOMIC_RELAXED);
     return(vmiop_memory_free_internal((void *) buf_p,
                                       buf_count[0]));
 }
@@ -5695,6 +6155,7 @@ vmiop_deliver_message(vmiop_handle_t handle,
     vmiope_entry_ref_t dest_entry;
     vmiop_error_t error_code;
     vmiop_bool_t in_monitor;
+    uint64_t start;
 
     vmiope_enter_monitor(&in_monitor);
 
@@ -5717,8 +6178,10 @@ vmiop_deliver_message(vmiop_handle_t handle,
     }
 
     vmiope_leave_monitor(NULL);
+    start = trace_begin(TRACE_PLUGIN_CALLBACK);
     error_code = dest_entry->plugin->put_message(dest_entry->handle,
                                                  buf_p);
+    trace_end(TRACE_PLUGIN_CALLBACK, start);
     if (in_monitor) {
         vmiope_enter_monitor(NULL);
     }
@@ -5893,6 +6356,109 @@ vmiope_buffer_apply(vmiop_buffer_ref_t buf,
     return(vmiop_success);
 }
 
+/**
+ * Apply function to message data in a buffer, an extent at a time.
+ *
+ * Like vmiope_buffer_apply(), but the function is called once for
+ * each run of whole units lying within a single buffer element.
+ * Only a unit straddling two elements is assembled in the
+ * temporary buffer, which must be at least unit_length long, and
+ * passed on its own.
+ *
+ * @param[in] buf       Reference to the buffer
+ * @param[in] data_offset Offset to data
+ * @param[in] data_length Length of data
+ * @param[in] unit_length Length of each unit of data
+ * @param[in] tbuf      Reference to temporary buffer
+ * @param[in] function_p Reference to function to apply
+ * @param[in] opaque    Opaque pointer to pass to function
+ * @returns Error code:
+ * -            vmiop_success   Data located
+ * -            vmiop_error_inval NULL pointer or
+ *                          data_length not
+ *                          a multiple of unit_length
+ */
+
+vmiop_error_t
+vmiope_buffer_apply_extent(vmiop_buffer_ref_t buf,
+                           uint32_t data_offset,
+                           uint32_t data_length,
+                           uint32_t unit_length,
+                           void *tbuf,
+                           vmiope_buffer_extent_function_t function_p,
+                           void *opaque)
+{
+    uint32_t ec;
+    vmiop_buffer_element_t *ep;
+    uint32_t len;
+    uint32_t n;
+    uint8_t *dp;
+    uint32_t uc;
+
+    if (buf == NULL ||
+        tbuf == NULL ||
+        function_p == NULL ||
+        unit_length == 0 ||
+        (data_length % unit_length) != 0) {
+        return(vmiop_error_inval);
+    }
+    uc = 0;
+    ec = buf->count;
+    ep = buf->element;
+    while (ec > 0 &&
+           data_length > 0) {
+        if (data_offset >= ep->length) {
+            data_offset -= ep->length;
+            ec--;
+            ep++;
+            continue;
+        }
+
+        dp = ((uint8_t *) (ep->data_p)) + data_offset;
+        len = (ep->length - data_offset);
+        if (data_length < len) {
+            len = data_length;
+        }
+        data_offset += len;
+        data_length -= len;
+
+        if (uc != 0) {
+            /* complete a unit started in the previous element */
+            n = (unit_length - uc);
+            if (len < n) {
+                n = len;
+            }
+            memcpy(((uint8_t *) tbuf) + uc, dp, n);
+            uc += n;
+            dp += n;
+            len -= n;
+            if (uc < unit_length) {
+                continue;
+            }
+            if (function_p(opaque, tbuf, 1)) {
+                return(vmiop_success);
+            }
+            uc = 0;
+        }
+
+        n = (len / unit_length);
+        if (n != 0) {
+            if (function_p(opaque, dp, n)) {
+                return(vmiop_success);
+            }
+            dp += (n * unit_length);
+            len -= (n * unit_length);
+        }
+
+        if (len != 0) {
+            /* unit continues in the next element */
+            memcpy(tbuf, dp, len);
+            uc = len;
+        }
+    }
+    return(vmiop_success);
+}
+
 /**
  * Get token from input string.
  *
@@ -6055,7 +6621,7 @@ vmiope_config_get_string(char *default_value,
  * @param[in] key             Configuration item key
  * @returns uint64_t          Value of the configuration item.
  */
-static uint64_t 
+uint64_t 
 vmiope_config_get_long(uint64_t default_value,
                        const char *key)
 {
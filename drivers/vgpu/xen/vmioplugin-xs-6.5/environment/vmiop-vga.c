@@ -227,6 +227,7 @@ vmiop_vga_ioport_access(uint8_t vnum,
     vmiop_bool_t in_monitor;
 
     vmiope_enter_monitor(&in_monitor);
+    demu_space_read_begin();
 
     space = demu_find_port_space(data_offset);
 
@@ -273,6 +274,7 @@ vmiop_vga_ioport_access(uint8_t vnum,
         break;
     }
 
+    demu_space_read_end();
     if (! in_monitor) {
         vmiope_leave_monitor(NULL);
     }
@@ -50,6 +50,8 @@
  */
 #define _VMIOP_ENV_H_
 
+#include <sched.h>
+#include <pthread.h>
 #include <vmioplugin.h>
 
 /**********************************************************************/
@@ -212,6 +214,21 @@ vmiope_set_search_path(char *path_p);
 extern vmiop_error_t
 vmiope_process_configuration(const char *pluginconfig);
 
+/**
+ * Get a configuration value as a long.
+ *
+ * Configuration items are those read by vmiope_process_configuration().
+ *
+ * @param[in] default_value   Value to return if configuration key is not
+ *                            found or is not numeric
+ * @param[in] key             Configuration item key
+ * @returns uint64_t          Value of the configuration item.
+ */
+
+extern uint64_t
+vmiope_config_get_long(uint64_t default_value,
+                       const char *key);
+
 #define VMIOPE_CONF_MAX_LINE 1024
 /*!< maximum length of a configuration file line */
 
@@ -258,6 +275,86 @@ vmiope_enter_monitor(vmiop_bool_t *in_monitor);
 extern void
 vmiope_leave_monitor(vmiop_bool_t *in_monitor);
 
+/**
+ * Acquire a lock, recording how long it took if the lock is profiled.
+ *
+ * @param[in,out] lock_p    Reference to lock to acquire
+ * @returns Result of pthread_mutex_lock()
+ */
+
+#ifdef VMIOPE_LOCK_PROFILE
+extern int
+vmiope_lock_acquire(pthread_mutex_t *lock_p);
+#else
+#define vmiope_lock_acquire(_lock_p) pthread_mutex_lock(_lock_p)
+#endif
+
+/**
+ * Add a lock outside vmiop-env to those profiled.
+ *
+ * Call before the lock is first taken with vmiope_lock_acquire().
+ * Does nothing unless built with VMIOPE_LOCK_PROFILE.
+ *
+ * @param[in] name          Lock name for the report
+ * @param[in] lock_p        Reference to lock
+ */
+
+extern void
+vmiope_lock_profile_register(const char *name,
+                             pthread_mutex_t *lock_p);
+
+/**
+ * Log wait statistics for the monitor, the vmiop-env locks and any
+ * locks registered with vmiope_lock_profile_register().
+ *
+ * Only reports anything when built with VMIOPE_LOCK_PROFILE.
+ */
+
+extern void
+vmiope_lock_profile_report(void);
+
+/**
+ * Message buffer allocation statistics.
+ */
+
+typedef struct vmiope_buffer_stats_s {
+    uint64_t allocs;            /*!< vmiop_buffer_alloc() calls satisfied */
+    uint64_t frees;             /*!< buffers whose last reference went */
+    uint64_t cache_hits;        /*!< allocations from a free list */
+    uint64_t heap_allocs;       /*!< allocations from the heap */
+    uint64_t heap_frees;        /*!< buffers returned to the heap */
+    uint64_t oversize;          /*!< allocations too large to cache */
+    uint32_t cached;            /*!< buffers currently on free lists */
+    uint64_t cached_bytes;      /*!< bytes held by those buffers */
+} vmiope_buffer_stats_t;
+
+/**
+ * Get message buffer allocation statistics.
+ *
+ * @param[out] stats_p      Reference to variable to receive the
+ *                          statistics.
+ */
+
+extern void
+vmiope_buffer_get_stats(vmiope_buffer_stats_t *stats_p);
+
+/**
+ * Return cached message buffers to the heap, e.g. when going idle.
+ */
+
+extern void
+vmiope_buffer_trim(void);
+
+/**
+ * Set the CPUs on which threads from vmiop_thread_alloc() start.
+ *
+ * @param[in] cpuset_p      Reference to the CPU set, or NULL for new
+ *                          threads to inherit the creator's affinity.
+ */
+
+extern void
+vmiope_set_thread_affinity(const cpu_set_t *cpuset_p);
+
 /**
  * Pixel type to pixel width in bits
  */
@@ -355,6 +452,57 @@ vmiope_buffer_apply(vmiop_buffer_ref_t buf,
                     vmiope_buffer_apply_function_t function_p,
                     void *opaque);
 
+/**
+ * Type of function to apply to an extent of a buffer.
+ *
+ * Used with vmiope_buffer_apply_extent().
+ *
+ * @param[in] opaque Pointer supplied by caller of
+ *                   vmiope_buffer_apply_extent().
+ * @param[in] data_p Data to be processed
+ * @param[in] count  Number of units at data_p
+ * @returns vmiop_bool_t:
+ * -            vmiop_true  Terminate loop early
+ * -            vmiop_false Continue processing
+ */
+
+typedef vmiop_bool_t
+(*vmiope_buffer_extent_function_t)(void *opaque,
+                                   const void *data_p,
+                                   uint32_t count);
+
+/**
+ * Apply function to message data in a buffer, an extent at a time.
+ *
+ * Like vmiope_buffer_apply(), but the function is called once for
+ * each run of whole units lying within a single buffer element.
+ * Only a unit straddling two elements is assembled in the
+ * temporary buffer, which must be at least unit_length long, and
+ * passed on its own.
+ *
+ * @param[in] buf       Reference to the buffer
+ * @param[in] data_offset Offset to data
+ * @param[in] data_length Length of data
+ * @param[in] unit_length Length of each unit of data
+ * @param[in] tbuf      Reference to temporary buffer
+ * @param[in] function_p Reference to function to apply
+ * @param[in] opaque    Opaque pointer to pass to function
+ * @returns Error code:
+ * -            vmiop_success   Data located
+ * -            vmiop_error_inval NULL pointer or
+ *                          data_length not
+ *                          a multiple of unit_length
+ */
+
+extern vmiop_error_t
+vmiope_buffer_apply_extent(vmiop_buffer_ref_t buf,
+                           uint32_t data_offset,
+                           uint32_t data_length,
+                           uint32_t unit_length,
+                           void *tbuf,
+                           vmiope_buffer_extent_function_t function_p,
+                           void *opaque);
+
 /**
  * Pull up message data into a buffer as needed.
  *
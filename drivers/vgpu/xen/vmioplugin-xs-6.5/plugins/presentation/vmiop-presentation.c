@@ -69,10 +69,6 @@
 #define VMIOPE_PRESENTATION_EDID_SIZE 256
 /*!< Maximum size of cached EDID */
 
-xen_pfn_t vram_mfn[(VRAM_RESERVED_SIZE - TARGET_PAGE_SIZE) >> TARGET_PAGE_SHIFT];
-/*!< List of VRAM mfn,
-     last page of VRAM used for demu-qemu communication is excluded */
-
 /**
  * Presentation state
  */
@@ -84,6 +80,7 @@ typedef struct vmiope_presentation_state_s {
     uint32_t sequence;      /*!< message sequence number */
     uint32_t edid_length;   /*!< valid length of EDID */
     uint8_t edid[VMIOPE_PRESENTATION_EDID_SIZE]; /*!< cached EDID */
+    const xen_pfn_t *vram_mfn; /*!< VRAM translation handed to the plugin */
 } vmiope_presentation_state_t;
 
 static vmiope_presentation_state_t vmiope_ps = 
@@ -232,6 +229,31 @@ void vmiope_pr_invalidate_display(void *opaque)
     /* nothing to do */
 }
 
+/**
+ * Colour component scaling tables, 5 and 6 bits to 8 bits.
+ *
+ * Filled in by vmiop_presentation_init().
+ */
+
+static uint8_t vmiope_pr_scale5[32];
+static uint8_t vmiope_pr_scale6[64];
+
+static void
+vmiope_pr_init_convert(void);
+
+static void
+vmiope_pr_init_scale(void)
+{
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        vmiope_pr_scale5[i] = (float)(i / 31.0f) * 0xFF;
+    }
+    for (i = 0; i < 64; i++) {
+        vmiope_pr_scale6[i] = (float)(i / 63.0f) * 0xFF;
+    }
+}
+
 /**
  * Initialization function, called when plugin is loaded,
  * before domain is started.
@@ -257,6 +279,8 @@ vmiop_presentation_init(vmiop_handle_t handle)
 
     vmiope_enter_monitor(&in_monitor);
     vmiope_ps.handle = handle;
+    vmiope_pr_init_scale();
+    vmiope_pr_init_convert();
 
     if (! in_monitor) {
         vmiope_leave_monitor(NULL);
@@ -279,6 +303,11 @@ vmiop_presentation_init(vmiop_handle_t handle)
 static vmiop_error_t 
 vmiop_presentation_shutdown(vmiop_handle_t handle)
 {
+    if (vmiope_ps.vram_mfn != NULL) {
+        demu_vram_table_put(vmiope_ps.vram_mfn);
+        vmiope_ps.vram_mfn = NULL;
+    }
+
     return(vmiop_success);
 }
 
@@ -381,85 +410,296 @@ vmiop_presentation_set_attribute(vmiop_handle_t handle,
 
 
 /**
- * Copy 32-bit pixel, change ARGB to RGBA
+ * Copy an extent of 32-bit pixels.
  *
  * Used by vmiop_presentation_put_message();
  *
  * @param[in] opaque Pointer supplied by caller of
- *                   vmiop_buffer_apply().
- * @param[in] data_p Data to be processed
+ *                   vmiope_buffer_apply_extent() - output buffer.
+ * @param[in] data_p Data to be processed - input buffer.
+ * @param[in] count  Number of pixels
  * @returns vmiop_bool_t:
  * -            vmiop_true  Terminate loop early
  * -            vmiop_false Continue processing
  */
 
-static vmiop_bool_t 
-vmiop_pt_pixel_copy_and_swap(void *opaque,
-                             void *data_p) 
+static vmiop_bool_t
+vmiop_pt_extent_copy_32(void *opaque,
+                        const void *data_p,
+                        uint32_t count)
 {
     uint8_t *dp;
-    int i;
 
     dp = *((uint8_t **) opaque);
-    *((uint8_t **) opaque) = (dp + 4);
-#ifdef nolonger
-    *dp++ = ((uint8_t *) data_p)[3];
-    for (i = 2;
-         i >= 0;
-         i--) {
-        *dp++ = ((uint8_t *) data_p)[i];
-    }
-#endif
-    for (i = 0;
-         i <= 3;
-         i++) {
-        *dp++ = ((uint8_t *) data_p)[i];
-    }
+    memcpy(dp, data_p, count * sizeof(uint32_t));
+    *((uint8_t **) opaque) = dp + (count * sizeof(uint32_t));
 
     return(vmiop_false);
 }
 
 /**
- * Copy 16-bit pixel to 32-bit pixel.
+ * Convert an extent of R5G6B5 pixels to 32-bit pixels.
  *
  * Used by vmiop_presentation_put_message();
  *
- * @param[in] opaque Pointer supplied by caller of vmiop_buffer_apply - output buffer.
+ * @param[in] opaque Pointer supplied by caller of
+ *                   vmiope_buffer_apply_extent() - output buffer.
  * @param[in] data_p Data to be processed - input buffer.
+ * @param[in] count  Number of pixels
  * @returns vmiop_bool_t:
  * -            vmiop_true  Terminate loop early
  * -            vmiop_false Continue processing
  */
 
 static vmiop_bool_t
-vmiop_pt_pixel_16_copy_to_32(void *opaque,
-                             void *data_p)
+vmiop_pt_extent_16_to_32(void *opaque,
+                         const void *data_p,
+                         uint32_t count)
 {
     uint32_t *outp;
-    uint8_t *inb;
-    uint8_t r = 0, g = 0, b = 0;
+    const uint8_t *inb;
+    uint32_t v;
 
     outp = *((uint32_t **) opaque);
-    inb  = (uint8_t *) data_p;
+    inb  = (const uint8_t *) data_p;
+
+    while (count-- > 0) {
+        v = inb[0] | (inb[1] << 8);
+        *outp++ = ((vmiope_pr_scale5[v >> 11] << 16) |
+                   (vmiope_pr_scale6[(v >> 5) & 0x3F] << 8) |
+                   vmiope_pr_scale5[v & 0x1F]);
+        inb += 2;
+    }
+    *((uint32_t **) opaque) = outp; // update caller's output buffer ptr
 
-    if (inb[0] || inb[1])
-    {
-        b = inb[0] & 0x1F;
-        b = (float)(b / 31.0f) * 0xFF;
+    return(vmiop_false);
+}
 
-        g = ((inb[0] >> 5) & 0x7) | ((inb[1] & 0x7) << 3);
-        g = (float)(g / 63.0f) * 0xFF;
+/**
+ * Convert an extent of X1R5G5B5 pixels to 32-bit pixels.
+ *
+ * Used by vmiop_presentation_put_message();
+ *
+ * @param[in] opaque Pointer supplied by caller of
+ *                   vmiope_buffer_apply_extent() - output buffer.
+ * @param[in] data_p Data to be processed - input buffer.
+ * @param[in] count  Number of pixels
+ * @returns vmiop_bool_t:
+ * -            vmiop_true  Terminate loop early
+ * -            vmiop_false Continue processing
+ */
 
-        r = inb[1] >> 3;
-        r = (float)(r / 31.0f) * 0xFF;
-    }
+static vmiop_bool_t
+vmiop_pt_extent_15_to_32(void *opaque,
+                         const void *data_p,
+                         uint32_t count)
+{
+    uint32_t *outp;
+    const uint8_t *inb;
+    uint32_t v;
 
-    *outp++ = (r << 16) | (g << 8) | b;
+    outp = *((uint32_t **) opaque);
+    inb  = (const uint8_t *) data_p;
+
+    while (count-- > 0) {
+        v = inb[0] | (inb[1] << 8);
+        *outp++ = ((vmiope_pr_scale5[(v >> 10) & 0x1F] << 16) |
+                   (vmiope_pr_scale5[(v >> 5) & 0x1F] << 8) |
+                   vmiope_pr_scale5[v & 0x1F]);
+        inb += 2;
+    }
     *((uint32_t **) opaque) = outp; // update caller's output buffer ptr
 
     return(vmiop_false);
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <emmintrin.h>
+
+/*
+ * Scale 8 5-bit or 6-bit components in 16-bit lanes to 8 bits, as
+ * floor(c * 255 / 31) and floor(c * 255 / 63), which is what the
+ * scaling tables hold.  The reciprocals are exact over those ranges.
+ */
+#define VMIOPE_PR_SCALE5(_c)                                        \
+    _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16((_c), c255),     \
+                                   _mm_set1_epi16(8457)), 2)
+#define VMIOPE_PR_SCALE6(_c)                                        \
+    _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16((_c), c255),     \
+                                   _mm_set1_epi16(8323)), 3)
+
+/**
+ * SSE2 version of vmiop_pt_extent_16_to_32(), 8 pixels at a time.
+ */
+
+__attribute__((target("sse2")))
+static vmiop_bool_t
+vmiop_pt_extent_16_to_32_sse2(void *opaque,
+                              const void *data_p,
+                              uint32_t count)
+{
+    const __m128i c255 = _mm_set1_epi16(0xFF);
+    const __m128i mask5 = _mm_set1_epi16(0x1F);
+    const __m128i mask6 = _mm_set1_epi16(0x3F);
+    uint8_t *outp;
+    const uint8_t *inb;
+    uint32_t n;
+
+    outp = *((uint8_t **) opaque);
+    inb  = (const uint8_t *) data_p;
+
+    for (n = count >> 3; n > 0; n--) {
+        __m128i v = _mm_loadu_si128((const __m128i *) inb);
+        __m128i r = VMIOPE_PR_SCALE5(_mm_srli_epi16(v, 11));
+        __m128i g = VMIOPE_PR_SCALE6(_mm_and_si128(_mm_srli_epi16(v, 5),
+                                                   mask6));
+        __m128i b = VMIOPE_PR_SCALE5(_mm_and_si128(v, mask5));
+        __m128i gb = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i *) outp, _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *) (outp + 16), _mm_unpackhi_epi16(gb, r));
+        inb += 16;
+        outp += 32;
+    }
+    *((uint8_t **) opaque) = outp;
+
+    return(vmiop_pt_extent_16_to_32(opaque, inb, count & 7));
+}
+
+/**
+ * SSE2 version of vmiop_pt_extent_15_to_32(), 8 pixels at a time.
+ */
+
+__attribute__((target("sse2")))
+static vmiop_bool_t
+vmiop_pt_extent_15_to_32_sse2(void *opaque,
+                              const void *data_p,
+                              uint32_t count)
+{
+    const __m128i c255 = _mm_set1_epi16(0xFF);
+    const __m128i mask5 = _mm_set1_epi16(0x1F);
+    uint8_t *outp;
+    const uint8_t *inb;
+    uint32_t n;
+
+    outp = *((uint8_t **) opaque);
+    inb  = (const uint8_t *) data_p;
+
+    for (n = count >> 3; n > 0; n--) {
+        __m128i v = _mm_loadu_si128((const __m128i *) inb);
+        __m128i r = VMIOPE_PR_SCALE5(_mm_and_si128(_mm_srli_epi16(v, 10),
+                                                   mask5));
+        __m128i g = VMIOPE_PR_SCALE5(_mm_and_si128(_mm_srli_epi16(v, 5),
+                                                   mask5));
+        __m128i b = VMIOPE_PR_SCALE5(_mm_and_si128(v, mask5));
+        __m128i gb = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i *) outp, _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *) (outp + 16), _mm_unpackhi_epi16(gb, r));
+        inb += 16;
+        outp += 32;
+    }
+    *((uint8_t **) opaque) = outp;
+
+    return(vmiop_pt_extent_15_to_32(opaque, inb, count & 7));
+}
+
+#undef VMIOPE_PR_SCALE6
+#undef VMIOPE_PR_SCALE5
+
+#endif /* __x86_64__ || __i386__ */
+
+static vmiope_buffer_extent_function_t vmiope_pr_extent_16_to_32 =
+    vmiop_pt_extent_16_to_32;
+static vmiope_buffer_extent_function_t vmiope_pr_extent_15_to_32 =
+    vmiop_pt_extent_15_to_32;
+
+#define VMIOPE_PR_CHECK_COUNT 509
+
+/**
+ * Check a vector converter against the table version, over every
+ * 16-bit input value and with an odd extent length so that the tail
+ * is covered too.
+ *
+ * @param[in] scalar        Reference converter
+ * @param[in] vector        Converter being checked
+ * @returns vmiop_true if the outputs match
+ */
+
+static vmiop_bool_t
+vmiope_pr_check_extent(vmiope_buffer_extent_function_t scalar,
+                       vmiope_buffer_extent_function_t vector)
+{
+    uint8_t src[VMIOPE_PR_CHECK_COUNT * 2 + 1];
+    uint32_t ref[VMIOPE_PR_CHECK_COUNT];
+    uint32_t out[VMIOPE_PR_CHECK_COUNT];
+    uint32_t base;
+    uint32_t count;
+    uint32_t i;
+    void *p;
+
+    for (base = 0; base < 0x10000; base += count) {
+        count = 0x10000 - base;
+        if (count > VMIOPE_PR_CHECK_COUNT) {
+            count = VMIOPE_PR_CHECK_COUNT;
+        }
+
+        /* Misaligned by a byte, as extents inside a message may be */
+        for (i = 0; i < count; i++) {
+            src[1 + i * 2] = (base + i) & 0xFF;
+            src[2 + i * 2] = (base + i) >> 8;
+        }
+
+        p = ref;
+        (void) scalar(&p, src + 1, count);
+        p = out;
+        (void) vector(&p, src + 1, count);
+
+        if (memcmp(ref, out, count * sizeof(uint32_t)) != 0 ||
+            p != (void *) (out + count)) {
+            return(vmiop_false);
+        }
+    }
+
+    return(vmiop_true);
+}
+
+#undef VMIOPE_PR_CHECK_COUNT
+
+/**
+ * Pick vector pixel converters where the CPU has them and they agree
+ * with the table versions.
+ */
+
+static void
+vmiope_pr_init_convert(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (! __builtin_cpu_supports("sse2")) {
+        return;
+    }
+
+    if (vmiope_pr_check_extent(vmiop_pt_extent_16_to_32,
+                               vmiop_pt_extent_16_to_32_sse2)) {
+        vmiope_pr_extent_16_to_32 = vmiop_pt_extent_16_to_32_sse2;
+    } else {
+        (void) vmiop_log(vmiop_log_error,
+                         "vmiop-presentation: sse2 565 converter mismatch, using tables");
+    }
+
+    if (vmiope_pr_check_extent(vmiop_pt_extent_15_to_32,
+                               vmiop_pt_extent_15_to_32_sse2)) {
+        vmiope_pr_extent_15_to_32 = vmiop_pt_extent_15_to_32_sse2;
+    } else {
+        (void) vmiop_log(vmiop_log_error,
+                         "vmiop-presentation: sse2 555 converter mismatch, using tables");
+    }
+#endif /* __x86_64__ || __i386__ */
+}
+
 /**
  * Check if the current configuration (VGA or hires) differs from the
  * configuration passed from an upstream module (i.e. vmiop-display.so)
@@ -482,6 +722,149 @@ vmiop_has_config_changed(vmiop_display_configuration_t *cur_cfg,
 }
 
 
+/**
+ * Copy the damaged regions of a frame into the surface.
+ *
+ * Only the pixels inside the rectangles are carried and copied.  If the
+ * display plugin rendered straight into the surface (VMIOP_DAMAGE_IN_PLACE)
+ * nothing is copied and the rectangles are simply reported.
+ *
+ * @param[in] buf_p         Reference to buffer being delivered
+ * @param[in] md            Display message header
+ * @returns Error code:
+ * -            vmiop_success:          No error
+ * -            vmiop_error_inval:      Malformed damage record or
+ *                                      pixel format mismatch
+ */
+
+static vmiop_error_t
+vmiope_pr_put_damage(vmiop_buffer_ref_t buf_p,
+                     vmiop_message_display_t *md)
+{
+    vmiop_error_t error_code;
+    vmiop_display_damage_t damage_buf;
+    vmiop_display_damage_t *damage;
+    vmiop_display_rect_t rects[VMIOP_DISPLAY_DAMAGE_MAX];
+    vmiop_display_rect_t *rp;
+    uint32_t surf_width, surf_height, surf_depth;
+    uint32_t offset, end, bpp, pitch, i, y;
+    uint8_t *surf_datap;
+    void *db;
+
+    offset = (sizeof(vmiop_message_display_t) +
+              sizeof(vmiop_display_configuration_t));
+    end = sizeof(vmiop_message_display_t) + md->content_length;
+
+    error_code = vmiope_buffer_pullup(buf_p,
+                                      offset,
+                                      sizeof(vmiop_display_damage_t),
+                                      &damage_buf,
+                                      (void **) &damage);
+    if (error_code != vmiop_success) {
+        return(error_code);
+    }
+    if (damage->count > VMIOP_DISPLAY_DAMAGE_MAX) {
+        return(vmiop_error_inval);
+    }
+    offset += sizeof(vmiop_display_damage_t);
+
+    if (damage->count != 0) {
+        error_code = vmiope_buffer_pullup(buf_p,
+                                          offset,
+                                          damage->count * sizeof(vmiop_display_rect_t),
+                                          rects,
+                                          &db);
+        if (error_code != vmiop_success) {
+            return(error_code);
+        }
+        if (db != rects) {
+            memcpy(rects, db, damage->count * sizeof(vmiop_display_rect_t));
+        }
+        offset += damage->count * sizeof(vmiop_display_rect_t);
+    }
+
+    surface_get_dimensions(&surf_width, &surf_height, &surf_depth);
+
+    for (i = 0; i < damage->count; i++) {
+        rp = &rects[i];
+        if (rp->x > vmiope_ps.cfg.width ||
+            rp->width > vmiope_ps.cfg.width - rp->x ||
+            rp->y > vmiope_ps.cfg.height ||
+            rp->height > vmiope_ps.cfg.height - rp->y) {
+            (void) vmiop_log(vmiop_log_error,
+                             "vmiop-presentation: damage rectangle %u out of range",
+                             i);
+            return(vmiop_error_inval);
+        }
+    }
+
+    if (! (damage->flags & VMIOP_DAMAGE_IN_PLACE)) {
+        if (vmiope_ps.cfg.ptype !=
+            vmiope_pixel_depth_bgr_to_type(surf_depth, 0)) {
+            (void) vmiop_log(vmiop_log_error,
+                             "vmiop-presentation: damage with pixel format conversion (cfg type %d) not supported",
+                             vmiope_ps.cfg.ptype);
+            return(vmiop_error_inval);
+        }
+
+        surf_datap = surface_get_buffer();
+        if (surf_datap == NULL) {
+            (void) vmiop_log(vmiop_log_error, "vmiop-presentation: surface data pointer is NULL");
+            return (vmiop_error_inval);
+        }
+
+        bpp = vmiope_pixel_depth[vmiope_ps.cfg.ptype];
+        pitch = vmiope_ps.cfg.pitch;
+
+        /* move the pixels, one rectangle row at a time */
+        for (i = 0; i < damage->count; i++) {
+            uint32_t row_length;
+            uint8_t *dp;
+
+            rp = &rects[i];
+            row_length = rp->width * bpp;
+            dp = surf_datap + (rp->y * pitch) + (rp->x * bpp);
+
+            if (row_length == 0) {
+                continue;
+            }
+
+            for (y = 0; y < rp->height; y++) {
+                if (offset + row_length > end) {
+                    (void) vmiop_log(vmiop_log_error,
+                                     "vmiop-presentation: damage pixels truncated");
+                    return(vmiop_error_inval);
+                }
+
+                error_code = vmiope_buffer_pullup(buf_p,
+                                                  offset,
+                                                  row_length,
+                                                  dp,
+                                                  &db);
+                if (error_code != vmiop_success) {
+                    return(error_code);
+                }
+                if ((db != NULL) && (db != dp)) {
+                    memcpy(dp, db, row_length);
+                }
+
+                offset += row_length;
+                dp += pitch;
+            }
+        }
+    }
+
+    /* display the new pixels; the surface has its own lock */
+    surface_update_begin();
+    for (i = 0; i < damage->count; i++) {
+        rp = &rects[i];
+        surface_update(rp->x, rp->y, rp->width, rp->height);
+    }
+    surface_update_end();
+
+    return(vmiop_success);
+}
+
 /**
  * Accept a message buffer.  The caller should have a hold
  * on the buffer ahead of the call, and not release the hold until after
@@ -504,7 +887,6 @@ vmiop_presentation_put_message(vmiop_handle_t handle,
 {
     vmiop_error_t error_code;
     vmiop_message_display_t *md;
-    vmiop_bool_t in_monitor;
 
     if (buf_p == NULL ||
         buf_p->count == 0 ||
@@ -539,6 +921,7 @@ vmiop_presentation_put_message(vmiop_handle_t handle,
         break;
 
     case vmiop_dt_frame:
+    case vmiop_dt_frame_damage:
     case vmiop_dt_set_configuration:
         if (md->display_number != vmiope_ps.cfg.vnum) {
             return(vmiop_error_not_found);
@@ -571,17 +954,12 @@ vmiop_presentation_put_message(vmiop_handle_t handle,
                 /* copy new configuration */
                 vmiope_ps.cfg = *dcfg;
 
-                vmiope_enter_monitor(&in_monitor);
                 surface_resize(0,
                                vmiope_ps.cfg.width * 32 / 8,
                                vmiope_ps.cfg.width,
                                vmiope_ps.cfg.height,
                                vmiope_pixel_width[vmiope_ps.cfg.ptype]);
 
-                if (! in_monitor) {
-                    vmiope_leave_monitor(NULL);
-                }
-
                 if (vmiope_ps.cfg.ptype == vmiop_pf_inval) {
                     /* plugin needs update, if initially was unset */
                     vmiope_ps.needs_upstream_update = vmiop_true;
@@ -589,61 +967,37 @@ vmiop_presentation_put_message(vmiop_handle_t handle,
             }
 
             if (md->type_code == vmiop_dt_set_configuration) {
-                xen_pfn_t    *pfn;
-                xen_pfn_t    *mfn;
-                int         i, num_pages, ret;
-                uint64_t    addr = demu_get_vram_addr();
+                const xen_pfn_t *mfn;
+                int num_pages;
 
                 ep = buf_p->element;
                 demu_page_list = (vmiop_page_list_t*)(((uint8_t *)
                             (ep->data_p)) + sizeof(vmiop_message_display_t));
-                num_pages = (VRAM_RESERVED_SIZE - TARGET_PAGE_SIZE) >> TARGET_PAGE_SHIFT;
-                mfn = malloc(sizeof (xen_pfn_t) * num_pages);
+
+                /* Shared MFN list for guest VRAM, rebuilt when the BAR moves */
+                mfn = demu_vram_table_get(&num_pages);
                 if (mfn == NULL) {
                     (void) vmiop_log(vmiop_log_error,
-                                     "vmiop-presentation: failed to allocate mfn array");
+                                     "vmiop-presentation: failed to translate VRAM");
                     return (vmiop_error_resource);
                 }
 
-                /* Find MFN for guest VRAM */
-                if (vram_mfn[0] == 0) {
-                    pfn = malloc(sizeof (xen_pfn_t) * num_pages);
-                    if (pfn == NULL) {
-                        (void) vmiop_log(vmiop_log_error,
-                                         "vmiop-presentation: failed to allocate pfn array");
-                        free(mfn);
-                        return (vmiop_error_resource);
-                    }
-                    for (i = 0; i < num_pages; i++)
-                        pfn[i] = (addr >> TARGET_PAGE_SHIFT) + i;
-
-                    ret = demu_translate_guest_pages(pfn, mfn, num_pages);
-                    if (ret != vmiop_success) {
-                        (void) vmiop_log(vmiop_log_error,
-                                         "vmiop-presentation: failed"
-                                         " demu_translate_guest_pages, ret = %d",
-                                         ret);
-                        demu_translate_guest_pages(pfn, mfn, 1);
-                        (void) vmiop_log(vmiop_log_error, "failed to translate even 1 page\n");
-
-                        free(pfn);
-                        free(mfn);
-                        return (vmiop_error_resource);
-                    }
-                    free(pfn);
-
-                    for (i = 0; i < num_pages; i++) {
-                        vram_mfn[i] = mfn[i];
-                    }
-                } else {
-                    for (i = 0; i < num_pages; i++) {
-                        mfn[i] = vram_mfn[i];
-                    }
+                if (vmiope_ps.vram_mfn != NULL) {
+                    demu_vram_table_put(vmiope_ps.vram_mfn);
                 }
+                vmiope_ps.vram_mfn = mfn;
+
                 demu_page_list->pte_array = (void*)mfn;
                 demu_page_list->num_pte = num_pages; 
             }
 
+            if (md->type_code == vmiop_dt_frame_damage) {
+                error_code = vmiope_pr_put_damage(buf_p, md);
+                if (error_code != vmiop_success) {
+                    return(error_code);
+                }
+            }
+
             if (md->type_code == vmiop_dt_frame) {
                 vmiop_pixel_format_t display_format;
                 uint32_t pixel_length_msg, pixel_length_cfg;
@@ -691,7 +1045,7 @@ vmiop_presentation_put_message(vmiop_handle_t handle,
                 } else {
                     uint32_t tbuf; /* temporary pixel buffer */
                     uint32_t input_pixel; /* length of input pixel */
-                    vmiope_buffer_apply_function_t funcp = NULL;
+                    vmiope_buffer_extent_function_t funcp = NULL;
 
                     (void) vmiop_log(vmiop_log_error,
                                      "vmiop-presentation: unexpected attempt at pixel format conversion (cfg type %d : msg type %d)",
@@ -699,15 +1053,18 @@ vmiop_presentation_put_message(vmiop_handle_t handle,
 
                     /* attempt input/output conversion */
                     if ((vmiope_ps.cfg.ptype == vmiop_pf_32) && (display_format == vmiop_pf_32_bgr)) {
-                        funcp = vmiop_pt_pixel_copy_and_swap;
+                        funcp = vmiop_pt_extent_copy_32;
                         input_pixel = sizeof(uint32_t);
                     } else if ((vmiope_ps.cfg.ptype == vmiop_pf_16) && (display_format == vmiop_pf_32)) {
-                        funcp = vmiop_pt_pixel_16_copy_to_32;
+                        funcp = vmiope_pr_extent_16_to_32;
+                        input_pixel = sizeof(uint16_t);
+                    } else if ((vmiope_ps.cfg.ptype == vmiop_pf_15) && (display_format == vmiop_pf_32)) {
+                        funcp = vmiope_pr_extent_15_to_32;
                         input_pixel = sizeof(uint16_t);
                     }
 
                     if (funcp != NULL) {
-                        error_code = vmiope_buffer_apply(buf_p,
+                        error_code = vmiope_buffer_apply_extent(buf_p,
                                                          (sizeof(vmiop_message_display_t) +
                                                          sizeof(vmiop_display_configuration_t)),
                                                          pixel_length_msg,
@@ -726,13 +1083,7 @@ vmiop_presentation_put_message(vmiop_handle_t handle,
                 }
 
                 /* display the new pixels */
-                vmiope_enter_monitor(&in_monitor);
-
                 surface_update(0, 0, surf_width, surf_height);
-
-                if (! in_monitor) {
-                    vmiope_leave_monitor(NULL);
-                }
             }
         }
         break;
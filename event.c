@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2017, Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "log.h"
+#include "event.h"
+
+#define EVENT_MAX_READY 16
+
+typedef struct event_handler {
+    event_fn_t  fn;
+    void        *priv;
+} event_handler_t;
+
+struct event_loop {
+    int                 epfd;
+    int                 wakeup_fd;
+    event_handler_t     *handler;
+    int                 nr_handlers;
+    struct epoll_event  ready[EVENT_MAX_READY];
+};
+
+static void
+event_loop_wakeup_read(int fd, void *priv)
+{
+    uint64_t val;
+
+    (void) read(fd, &val, sizeof(val));
+}
+
+event_loop_t *
+event_loop_create(void)
+{
+    event_loop_t *loop;
+
+    loop = calloc(1, sizeof(*loop));
+    if (loop == NULL)
+        goto fail1;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0)
+        goto fail2;
+
+    loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakeup_fd < 0)
+        goto fail3;
+
+    if (event_loop_add(loop, loop->wakeup_fd, event_loop_wakeup_read,
+                       NULL) < 0)
+        goto fail4;
+
+    return loop;
+
+fail4:
+    ERR("fail4");
+
+    close(loop->wakeup_fd);
+
+fail3:
+    ERR("fail3");
+
+    close(loop->epfd);
+
+fail2:
+    ERR("fail2");
+
+    free(loop->handler);
+    free(loop);
+
+fail1:
+    ERR("fail1: %s", strerror(errno));
+
+    return NULL;
+}
+
+void
+event_loop_destroy(event_loop_t *loop)
+{
+    if (loop == NULL)
+        return;
+
+    close(loop->wakeup_fd);
+    close(loop->epfd);
+    free(loop->handler);
+    free(loop);
+}
+
+/*
+ * Handlers are indexed by fd, so an event that is still queued for an
+ * fd removed by an earlier handler in the same batch is dropped rather
+ * than dispatched to freed state.
+ */
+int
+event_loop_add(event_loop_t *loop, int fd, event_fn_t fn, void *priv)
+{
+    struct epoll_event ev;
+
+    if (fd >= loop->nr_handlers) {
+        event_handler_t *handler;
+        int nr = (fd + 16) & ~15;
+
+        handler = realloc(loop->handler, sizeof(*handler) * nr);
+        if (handler == NULL)
+            goto fail1;
+
+        memset(&handler[loop->nr_handlers], 0,
+               sizeof(*handler) * (nr - loop->nr_handlers));
+
+        loop->handler = handler;
+        loop->nr_handlers = nr;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        goto fail1;
+
+    loop->handler[fd].fn = fn;
+    loop->handler[fd].priv = priv;
+
+    return 0;
+
+fail1:
+    ERR("fail1: %s", strerror(errno));
+
+    return -1;
+}
+
+void
+event_loop_remove(event_loop_t *loop, int fd)
+{
+    if (fd >= loop->nr_handlers || loop->handler[fd].fn == NULL)
+        return;
+
+    /* The fd may already be closed, in which case epoll dropped it */
+    (void) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    loop->handler[fd].fn = NULL;
+    loop->handler[fd].priv = NULL;
+}
+
+/*
+ * Wait for ready fds. The caller dispatches them separately so that it
+ * can drop any locks (e.g. the vmiope monitor) around the wait only.
+ */
+int
+event_loop_wait(event_loop_t *loop, int timeout_ms)
+{
+    int n;
+
+    n = epoll_wait(loop->epfd, loop->ready, EVENT_MAX_READY, timeout_ms);
+    if (n < 0 && errno == EINTR)
+        n = 0;
+
+    return n;
+}
+
+void
+event_loop_dispatch(event_loop_t *loop, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        int fd = loop->ready[i].data.fd;
+        event_handler_t *handler;
+
+        if (fd >= loop->nr_handlers)
+            continue;
+
+        handler = &loop->handler[fd];
+        if (handler->fn != NULL)
+            handler->fn(fd, handler->priv);
+    }
+}
+
+void
+event_loop_wakeup(event_loop_t *loop)
+{
+    uint64_t val = 1;
+
+    (void) write(loop->wakeup_fd, &val, sizeof(val));
+}
+
+int
+event_timer_create(void)
+{
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        ERR("timerfd_create: %s", strerror(errno));
+
+    return fd;
+}
+
+/* A period of zero disarms the timer */
+int
+event_timer_set(int fd, unsigned int period_us)
+{
+    struct itimerspec it;
+
+    it.it_interval.tv_sec = period_us / 1000000;
+    it.it_interval.tv_nsec = (period_us % 1000000) * 1000;
+    it.it_value = it.it_interval;
+
+    return timerfd_settime(fd, 0, &it, NULL);
+}
+
+/* Returns the number of expirations since the last read */
+uint64_t
+event_timer_read(int fd)
+{
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations))
+        return 0;
+
+    return expirations;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-tab-always-indent: nil
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-basic-indent: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
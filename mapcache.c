@@ -41,131 +41,278 @@
 
 #include "log.h"
 #include "demu.h"
+#include "mapcache.h"
+
+/*
+ * Guest memory is mapped in aligned chunks of mapcache_chunk_pages pages,
+ * so a guest buffer spanning several pages costs one foreign mapping.
+ * Chunks hash into buckets of MAPCACHE_WAYS entries each, and entries
+ * are replaced LRU within a bucket.
+ *
+ * If a whole chunk can't be mapped (e.g. it straddles a hole in the
+ * guest physmap) the entry falls back to mapping the single page. The
+ * bucket remembers the chunk, so later misses in it go straight to
+ * single pages rather than failing (and logging) the chunk map again.
+ *
+ * Invalidation unmaps everything, so that no mapping keeps pages the
+ * guest has given up pinned, and forgets the remembered holes.
+ */
 
 typedef struct mapcache_entry {
     uint8_t     *ptr;
     xen_pfn_t   pfn;
+    unsigned int count;
     uint64_t    epoch;
 } mapcache_entry_t;
 
-#define MAPCACHE_BUCKET_SHIFT   5
-#define MAPCACHE_BUCKET_SIZE    (1 << MAPCACHE_BUCKET_SHIFT)
+#define MAPCACHE_WAYS           4
 
-#define MAPCACHE_BUCKET_COUNT   32
+#define MAPCACHE_DEFAULT_ENTRIES        256
+#define MAPCACHE_DEFAULT_CHUNK_PAGES    16
+#define MAPCACHE_MAX_CHUNK_PAGES        256
 
-static mapcache_entry_t mapcache[MAPCACHE_BUCKET_SIZE *
-                                 MAPCACHE_BUCKET_COUNT];
+static mapcache_entry_t *mapcache;
+static xen_pfn_t *mapcache_hole;    /* per bucket: failed chunk + 1, or 0 */
+static unsigned int mapcache_bucket_count;
+static unsigned int mapcache_chunk_pages = 1;
 static uint64_t mapcache_epoch;
+static unsigned int mapcache_mapped;
+static mapcache_stats_t mapcache_stats;
 
-static inline uint8_t *
+static inline unsigned int
+__mapcache_bucket(xen_pfn_t chunk)
+{
+    return ((chunk * 0x9E3779B97F4A7C15ull) >> 32) &
+        (mapcache_bucket_count - 1);
+}
+
+static inline void
+__mapcache_unmap(mapcache_entry_t *entry)
+{
+    if (entry->ptr != NULL) {
+        munmap(entry->ptr, entry->count << TARGET_PAGE_SHIFT);
+        entry->ptr = NULL;
+        mapcache_mapped -= entry->count;
+    }
+    entry->count = 0;
+}
+
+static inline mapcache_entry_t *
 __mapcache_lookup(xen_pfn_t pfn)
 {
-    int     bucket;
-    int     i;
-    uint8_t *ptr;
+    xen_pfn_t   chunk = pfn / mapcache_chunk_pages;
+    mapcache_entry_t *bucket;
+    int         i;
 
-    bucket = pfn % MAPCACHE_BUCKET_COUNT;
+    bucket = &mapcache[__mapcache_bucket(chunk) * MAPCACHE_WAYS];
 
-    ptr = NULL;
-    for (i = 0; i < MAPCACHE_BUCKET_SIZE; i++) {
-        mapcache_entry_t *entry;
+    for (i = 0; i < MAPCACHE_WAYS; i++) {
+        mapcache_entry_t *entry = &bucket[i];
 
-        entry = &mapcache[(bucket * MAPCACHE_BUCKET_SIZE) + i];
+        if (entry->ptr == NULL ||
+            pfn < entry->pfn ||
+            pfn >= entry->pfn + entry->count)
+            continue;
 
-        if (entry->pfn == pfn) {
-            entry->epoch = mapcache_epoch++;
-            ptr = entry->ptr;
-        }
+        entry->epoch = mapcache_epoch++;
+        return entry;
     }
 
-    return ptr;
+    return NULL;
 }
 
 static inline void
 __mapcache_fault(xen_pfn_t pfn)
 {
-    int         bucket;
+    xen_pfn_t   chunk = pfn / mapcache_chunk_pages;
+    xen_pfn_t   pfns[MAPCACHE_MAX_CHUNK_PAGES];
+    unsigned int b = __mapcache_bucket(chunk);
+    mapcache_entry_t *bucket;
+    mapcache_entry_t *victim;
     int         i;
-    uint64_t    oldest_epoch;
 
-    DBG("%llx", (unsigned long long)pfn);
+    DBG_V("%llx", (unsigned long long)pfn);
 
-    bucket = pfn % MAPCACHE_BUCKET_COUNT;
+    bucket = &mapcache[b * MAPCACHE_WAYS];
 
-    oldest_epoch = mapcache_epoch;
-    for (i = 0; i < MAPCACHE_BUCKET_SIZE; i++) {
-        mapcache_entry_t *entry;
+    /* Prefer an empty slot, otherwise the least recently used */
+    victim = &bucket[0];
+    for (i = 0; i < MAPCACHE_WAYS; i++) {
+        mapcache_entry_t *entry = &bucket[i];
 
-        entry = &mapcache[(bucket * MAPCACHE_BUCKET_SIZE) + i];
+        if (entry->ptr == NULL) {
+            victim = entry;
+            break;
+        }
 
-        if (entry->epoch < oldest_epoch)
-            oldest_epoch = entry->epoch;
+        if (entry->epoch < victim->epoch)
+            victim = entry;
     }
 
-    for (i = 0; i < MAPCACHE_BUCKET_SIZE; i++) {
-        mapcache_entry_t *entry;
-
-        entry = &mapcache[(bucket * MAPCACHE_BUCKET_SIZE) + i];
-
-        if (entry->epoch != oldest_epoch)
-            continue;
+    if (victim->ptr != NULL) {
+        mapcache_stats.evictions++;
+        __mapcache_unmap(victim);
+    }
 
-        if (entry->ptr != NULL) {
-            munmap(entry->ptr, TARGET_PAGE_SIZE);
-            entry->ptr = NULL;
-        }
+    for (i = 0; i < mapcache_chunk_pages; i++)
+        pfns[i] = (chunk * mapcache_chunk_pages) + i;
 
-        entry->ptr = demu_map_guest_pages(&pfn, 1, 0, 0);
-        if (entry->ptr != NULL)
-            entry->pfn = pfn;
+    victim->ptr = NULL;
+    if (mapcache_chunk_pages > 1 && mapcache_hole[b] != chunk + 1) {
+        victim->ptr = demu_map_guest_pages(pfns, mapcache_chunk_pages,
+                                           0, 0);
+        if (victim->ptr == NULL)
+            mapcache_hole[b] = chunk + 1;
+    }
 
-        break;
+    if (victim->ptr != NULL) {
+        victim->pfn = pfns[0];
+        victim->count = mapcache_chunk_pages;
+    } else {
+        victim->ptr = demu_map_guest_pages(&pfn, 1, 0, 0);
+        victim->pfn = pfn;
+        victim->count = (victim->ptr != NULL) ? 1 : 0;
     }
+
+    mapcache_mapped += victim->count;
+    victim->epoch = mapcache_epoch++;
 }
 
+/*
+ * Returns a mapping of addr, and in *len the number of bytes that are
+ * contiguously mapped from there (up to the end of its chunk).
+ */
 uint8_t *
-mapcache_lookup(uint64_t addr)
+mapcache_lookup_span(uint64_t addr, uint64_t *len)
 {
     xen_pfn_t       pfn;
     unsigned int    offset;
+    mapcache_entry_t *entry;
     uint8_t         *ptr;
-    int             faulted;
 
     pfn = addr >> TARGET_PAGE_SHIFT;
     offset = addr & (TARGET_PAGE_SIZE - 1);
 
-    faulted = 0;
-again:
-    ptr = __mapcache_lookup(pfn);
-    if (ptr == NULL) {
-        if (!faulted) {
-            faulted = true;
-            __mapcache_fault(pfn);
-            goto again;
-        }
-        goto fail1;
+    entry = __mapcache_lookup(pfn);
+    if (entry != NULL) {
+        mapcache_stats.hits++;
+    } else {
+        mapcache_stats.misses++;
+
+        __mapcache_fault(pfn);
+
+        /* demu_map_guest_pages() has already logged the failure */
+        entry = __mapcache_lookup(pfn);
+        if (entry == NULL)
+            return NULL;
     }
 
-    ptr += offset;
+    ptr = entry->ptr + ((pfn - entry->pfn) << TARGET_PAGE_SHIFT) + offset;
+    if (len != NULL)
+        *len = ((entry->pfn + entry->count - pfn) << TARGET_PAGE_SHIFT) -
+            offset;
+
     return ptr;
+}
+
+uint8_t *
+mapcache_lookup(uint64_t addr)
+{
+    return mapcache_lookup_span(addr, NULL);
+}
+
+void
+mapcache_invalidate(void)
+{
+    int i;
+
+    for (i = 0; i < mapcache_bucket_count * MAPCACHE_WAYS; i++)
+        __mapcache_unmap(&mapcache[i]);
+
+    memset(mapcache_hole, 0, mapcache_bucket_count * sizeof(*mapcache_hole));
+    mapcache_stats.invalidations++;
+}
+
+void
+mapcache_get_stats(mapcache_stats_t *stats)
+{
+    *stats = mapcache_stats;
+}
+
+/* Bytes of entry table, and of guest memory currently mapped */
+void
+mapcache_get_memory(size_t *table, size_t *mapped)
+{
+    *table = mapcache_bucket_count * (MAPCACHE_WAYS * sizeof(*mapcache) +
+                                      sizeof(*mapcache_hole));
+    *mapped = (size_t)mapcache_mapped << TARGET_PAGE_SHIFT;
+}
+
+int
+mapcache_initialize(unsigned int entries, unsigned int chunk_pages)
+{
+    unsigned int bucket_count;
+
+    if (entries == 0)
+        entries = MAPCACHE_DEFAULT_ENTRIES;
+    if (chunk_pages == 0)
+        chunk_pages = MAPCACHE_DEFAULT_CHUNK_PAGES;
+
+    /* Both are rounded up to a power of 2 */
+    bucket_count = 1;
+    while (bucket_count * MAPCACHE_WAYS < entries)
+        bucket_count <<= 1;
+
+    mapcache_chunk_pages = 1;
+    while (mapcache_chunk_pages < chunk_pages &&
+           mapcache_chunk_pages < MAPCACHE_MAX_CHUNK_PAGES)
+        mapcache_chunk_pages <<= 1;
+
+    mapcache = calloc(bucket_count * MAPCACHE_WAYS, sizeof(*mapcache));
+    if (mapcache == NULL)
+        goto fail1;
+
+    mapcache_hole = calloc(bucket_count, sizeof(*mapcache_hole));
+    if (mapcache_hole == NULL)
+        goto fail2;
+
+    mapcache_bucket_count = bucket_count;
+    memset(&mapcache_stats, 0, sizeof(mapcache_stats));
+
+    INFO("%u entries of %u pages", bucket_count * MAPCACHE_WAYS,
+         mapcache_chunk_pages);
+
+    return 0;
+
+fail2:
+    ERR("fail2");
+
+    free(mapcache);
+    mapcache = NULL;
 
 fail1:
     ERR("fail1");
 
-    return NULL;
+    return -1;
 }
 
 void
-mapcache_invalidate(void)
+mapcache_teardown(void)
 {
     int i;
 
-    for (i = 0; i < MAPCACHE_BUCKET_SIZE * MAPCACHE_BUCKET_COUNT; i++) {
-        mapcache_entry_t *entry = &mapcache[i];
+    for (i = 0; i < mapcache_bucket_count * MAPCACHE_WAYS; i++)
+        __mapcache_unmap(&mapcache[i]);
 
-        if (entry->ptr != NULL) {
-            munmap(entry->ptr, TARGET_PAGE_SIZE);
-            entry->ptr = NULL;
-        }
-    }
+    INFO("hits %llu misses %llu evictions %llu invalidations %llu",
+         (unsigned long long)mapcache_stats.hits,
+         (unsigned long long)mapcache_stats.misses,
+         (unsigned long long)mapcache_stats.evictions,
+         (unsigned long long)mapcache_stats.invalidations);
+
+    free(mapcache_hole);
+    mapcache_hole = NULL;
+    free(mapcache);
+    mapcache = NULL;
+    mapcache_bucket_count = 0;
 }
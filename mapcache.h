@@ -30,8 +30,21 @@
 #ifndef  _MAPCACHE_H
 #define  _MAPCACHE_H
 
+typedef struct mapcache_stats {
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;
+    uint64_t    invalidations;
+} mapcache_stats_t;
+
+int     mapcache_initialize(unsigned int entries, unsigned int chunk_pages);
+void    mapcache_teardown(void);
+
 uint8_t *mapcache_lookup(uint64_t addr);
+uint8_t *mapcache_lookup_span(uint64_t addr, uint64_t *len);
 void    mapcache_invalidate(void);
+void    mapcache_get_stats(mapcache_stats_t *stats);
+void    mapcache_get_memory(size_t *table, size_t *mapped);
 
 #endif  /* _MAPCACHE_H */
 
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2017, Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <xenctrl.h>
+
+#include "log.h"
+#include "numa.h"
+
+static int numa_dom0_node = -1;
+static int numa_gpu_xen_node = -1;
+static cpu_set_t numa_cpus;
+static int numa_cpus_valid;
+
+/* Accepts "<seg>:<bus>:<dev>.<fn>" or "<bus>:<dev>.<fn>" */
+static int
+numa_parse_sbdf(const char *gpu, unsigned int *seg, unsigned int *bus,
+                unsigned int *dev, unsigned int *fn)
+{
+    char c;
+
+    if (sscanf(gpu, "%x:%x:%x.%x%c", seg, bus, dev, fn, &c) == 4)
+        return 0;
+
+    *seg = 0;
+    if (sscanf(gpu, "%x:%x.%x%c", bus, dev, fn, &c) == 3)
+        return 0;
+
+    return -1;
+}
+
+/* Read a line of a sysfs attribute of the device, without the newline */
+static int
+numa_read_attr(const char *dev, const char *attr, char *buf, size_t size)
+{
+    char path[64 + sizeof("/sys/bus/pci/devices/")];
+    FILE *f;
+    char *p;
+
+    (void) snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/%s",
+                    dev, attr);
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    p = fgets(buf, size, f);
+    fclose(f);
+
+    if (p == NULL)
+        return -1;
+
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+int
+numa_parse_cpus(const char *str, cpu_set_t *set)
+{
+    const char *p = str;
+
+    CPU_ZERO(set);
+
+    while (*p != '\0') {
+        char *end;
+        long first, last;
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            goto fail1;
+
+        last = first;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                goto fail1;
+
+            p = end;
+        }
+
+        while (first <= last)
+            CPU_SET(first++, set);
+
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            goto fail1;
+    }
+
+    if (CPU_COUNT(set) == 0)
+        goto fail1;
+
+    return 0;
+
+fail1:
+    errno = EINVAL;
+    return -1;
+}
+
+/* The inverse of numa_parse_cpus(), truncated to fit */
+void
+numa_format_cpus(const cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+    int first = -1;
+    int cpu;
+
+    buf[0] = '\0';
+
+    for (cpu = 0; cpu <= CPU_SETSIZE && len < size; cpu++) {
+        int isset = (cpu < CPU_SETSIZE) && CPU_ISSET(cpu, set);
+
+        if (isset && first < 0)
+            first = cpu;
+
+        if (isset || first < 0)
+            continue;
+
+        len += snprintf(buf + len, size - len, "%s%d", (len != 0) ? "," : "",
+                        first);
+        if (cpu - 1 > first && len < size)
+            len += snprintf(buf + len, size - len, "-%d", cpu - 1);
+
+        first = -1;
+    }
+}
+
+int
+numa_initialize(xc_interface *xch, const char *gpu)
+{
+    unsigned int seg, bus, dev, fn;
+    physdev_pci_device_t pci;
+    char name[sizeof("XXXX:XX:XX.X")];
+    char buf[1024];
+    uint32_t node;
+    int rc;
+
+    if (numa_parse_sbdf(gpu, &seg, &bus, &dev, &fn) < 0 ||
+        seg > 0xffff || bus > 0xff || dev > 0x1f || fn > 0x7) {
+        ERR("cannot parse gpu '%s' as a PCI address", gpu);
+        goto fail1;
+    }
+
+    (void) snprintf(name, sizeof(name), "%04x:%02x:%02x.%x", seg, bus, dev,
+                    fn);
+
+    if (numa_read_attr(name, "numa_node", buf, sizeof(buf)) == 0)
+        numa_dom0_node = strtol(buf, NULL, 10);
+
+    if (numa_dom0_node >= 0 &&
+        numa_read_attr(name, "local_cpulist", buf, sizeof(buf)) == 0 &&
+        numa_parse_cpus(buf, &numa_cpus) == 0)
+        numa_cpus_valid = 1;
+
+    pci.seg = seg;
+    pci.bus = bus;
+    pci.devfn = (dev << 3) | fn;
+
+    rc = xc_pcitopoinfo(xch, 1, &pci, &node);
+    if (rc == 0 && node != XEN_INVALID_NODE_ID)
+        numa_gpu_xen_node = node;
+    else if (rc < 0)
+        DBG("xc_pcitopoinfo: %s", strerror(errno));
+
+    INFO("gpu %s: node %d, xen node %d", name, numa_dom0_node,
+         numa_gpu_xen_node);
+
+    return 0;
+
+fail1:
+    return -1;
+}
+
+int
+numa_node(void)
+{
+    return numa_dom0_node;
+}
+
+int
+numa_xen_node(void)
+{
+    return numa_gpu_xen_node;
+}
+
+int
+numa_local_cpus(cpu_set_t *set)
+{
+    if (!numa_cpus_valid)
+        return -1;
+
+    *set = numa_cpus;
+    return 0;
+}
+
+/*
+ * Anonymous mappings are only populated on first touch, so a preferred
+ * policy set before then places the whole buffer. The system call is
+ * made directly rather than pulling in libnuma for it.
+ */
+void *
+numa_alloc(size_t size)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    if (numa_dom0_node >= 0 && numa_dom0_node < 64) {
+        unsigned long mask = 1ul << numa_dom0_node;
+
+        if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask,
+                    sizeof(mask) * 8, 0) < 0)
+            DBG("mbind: %s", strerror(errno));
+    }
+
+    return ptr;
+}
+
+void
+numa_free(void *ptr, size_t size)
+{
+    if (ptr != NULL)
+        (void) munmap(ptr, size);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-tab-always-indent: nil
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-basic-indent: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2017, Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef  _NUMA_H
+#define  _NUMA_H
+
+#include <sched.h>
+#include <stddef.h>
+
+#include <xenctrl.h>
+
+/*
+ * Placement relative to the physical GPU. Linux (dom0) and Xen each
+ * number NUMA nodes in their own right: the dom0 node and its CPUs
+ * govern where demu's threads run and where its own buffers live, the
+ * Xen node governs where guest memory demu populates is allocated.
+ * Either is -1 if unknown, in which case nothing is placed.
+ */
+int     numa_initialize(xc_interface *xch, const char *gpu);
+int     numa_node(void);
+int     numa_xen_node(void);
+int     numa_local_cpus(cpu_set_t *set);
+
+int     numa_parse_cpus(const char *str, cpu_set_t *set);
+void    numa_format_cpus(const cpu_set_t *set, char *buf, size_t size);
+
+/* Large buffers, preferring the GPU's node; free with numa_free() */
+void    *numa_alloc(size_t size);
+void    numa_free(void *ptr, size_t size);
+
+#endif  /* _NUMA_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-tab-always-indent: nil
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-basic-indent: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
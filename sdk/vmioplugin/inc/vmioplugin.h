@@ -2046,8 +2046,9 @@ enum vmiop_display_type_e {
     vmiop_dt_hdcp_request = 5,                  /*!< HDCP request message */
     vmiop_dt_get_memory_optimization_info = 6,  /*!< request to get memory optimization info */
     vmiop_dt_set_vnc_console_state = 7,         /*!< request to set vnc console state to active/inactve */
+    vmiop_dt_frame_damage = 8,                  /*!< damaged regions of a frame to display */
 
-    vmiop_dt_max = 7                            /*!< highest value in range */
+    vmiop_dt_max = 8                            /*!< highest value in range */
 };
 
 typedef uint32_t vmiop_display_type_t; /*!< type code for display message */
@@ -2060,6 +2061,9 @@ typedef uint32_t vmiop_display_type_t; /*!< type code for display message */
  * Header is followed by optional content.
  * - vmiop_dt_null:  no content
  * - vmiop_dt_frame: configuration record, followed by pixels in row-major order
+ * - vmiop_dt_frame_damage: configuration record, damage record and
+ *   rectangles, followed by the pixels of each rectangle in turn in
+ *   row-major order (no pixels if VMIOP_DAMAGE_IN_PLACE is set)
  * - vmiop_dt_edid_request:  no content
  * - vmiop_dt_set_configuration:  configuration record
  * - vmiop_dt_hdcp_request:  HDCP request message
@@ -2117,6 +2121,33 @@ typedef struct vmiop_display_configuration_s {
     uint32_t pitch;             /*!< pitch of surface   */
 } vmiop_display_configuration_t;
 
+#define VMIOP_DISPLAY_DAMAGE_MAX 64
+/*!< maximum number of rectangles in a damage record */
+
+#define VMIOP_DAMAGE_IN_PLACE 0x1u
+/*!< pixels were written directly to the surface via the page list
+     supplied with vmiop_dt_set_configuration, none follow */
+
+/**
+ * Display damage rectangle
+ */
+
+typedef struct vmiop_display_rect_s {
+    uint32_t x;                 /*!< left edge in pixels    */
+    uint32_t y;                 /*!< top edge in pixels     */
+    uint32_t width;             /*!< width in pixels        */
+    uint32_t height;            /*!< height in pixels       */
+} vmiop_display_rect_t;
+
+/**
+ * Display damage record, followed by count rectangles
+ */
+
+typedef struct vmiop_display_damage_s {
+    uint32_t flags;             /*!< VMIOP_DAMAGE_* flags   */
+    uint32_t count;             /*!< number of rectangles   */
+} vmiop_display_damage_t;
+
 /*@}*/
 
 /**********************************************************************/
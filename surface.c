@@ -33,6 +33,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -41,7 +42,11 @@
 #include "log.h"
 #include "demu.h"
 #include "device.h"
+#include "numa.h"
 #include "surface.h"
+#include "trace.h"
+
+#include <vmiop-env.h>
 
 #define GMODE_TEXT      0
 #define GMODE_GRAPHIC   1
@@ -49,6 +54,11 @@
 
 #define CH_ATTR_SIZE (160 * 100)
 
+#define SURFACE_TILES   (VRAM_ACTUAL_SIZE >> TARGET_PAGE_SHIFT)
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+#define MAX(_x, _y) (((_x) > (_y)) ? (_x) : (_y))
+
 typedef struct surface {
     shared_surface_t    *shared;
     uint32_t            offset;
@@ -76,14 +86,63 @@ typedef struct surface {
     uint32_t            cursor_offset;
     unsigned int        (*rgb_to_pixel)(unsigned int r, unsigned int g, unsigned b);
     uint32_t            last_palette[256];
-    uint32_t            last_ch_attr[CH_ATTR_SIZE];
+    uint32_t            *last_ch_attr;
+    struct glyph        *glyph_cache;
+    uint32_t            glyph_gen;
+    int                 tile_hash;
+    int                 footprint;
+    uint32_t            frame;
+    uint32_t            tile_sum[SURFACE_TILES];
+    uint32_t            tile_frame[SURFACE_TILES];
+    uint8_t             tile_changed[SURFACE_TILES];
+    int                 batch;
+    unsigned int        nr_damage;
+    shared_rect_t       damage[SHARED_SURFACE_MAX_RECTS];
 } surface_t;
 
 static surface_t    surface_state;
 
-static uint32_t     expand4[256];
-static uint16_t     expand2[256];
-static uint8_t      expand4to8[16];
+/*
+ * Surface state has its own lock so the presentation plugin can post
+ * frames without the vmiope monitor. It nests inside the monitor (the
+ * console refresh runs holding both), is recursive so that
+ * surface_update() can be called between begin and end, and nothing
+ * is called into with it held that could take the monitor.
+ */
+static pthread_mutex_t surface_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/*
+ * The pixel expansion tables are built at compile time so they live in
+ * .rodata and are shared by every demu on the host rather than being
+ * written into each one's .bss.
+ */
+#define X4(_f, _i)      _f(_i), _f((_i) + 1), _f((_i) + 2), _f((_i) + 3)
+#define X16(_f, _i)     X4(_f, _i), X4(_f, (_i) + 4), \
+                        X4(_f, (_i) + 8), X4(_f, (_i) + 12)
+#define X64(_f, _i)     X16(_f, _i), X16(_f, (_i) + 16), \
+                        X16(_f, (_i) + 32), X16(_f, (_i) + 48)
+#define X256(_f)        X64(_f, 0), X64(_f, 64), X64(_f, 128), X64(_f, 192)
+
+/* Bit j of the index to bit 4j */
+#define EXPAND4(_i)                                             \
+    ((((_i) & 0x01) << 0) | (((_i) & 0x02) << 3) |              \
+     (((_i) & 0x04) << 6) | (((_i) & 0x08) << 9) |              \
+     (((_i) & 0x10) << 12) | (((_i) & 0x20) << 15) |            \
+     (((_i) & 0x40) << 18) | (((_i) & 0x80) << 21))
+
+/* Bit pair j of the index to bits 4j and 4j + 1 */
+#define EXPAND2(_i)                                             \
+    ((((_i) & 0x03) << 0) | (((_i) & 0x0c) << 2) |              \
+     (((_i) & 0x30) << 4) | (((_i) & 0xc0) << 6))
+
+/* Bit j of the index to bits 2j and 2j + 1 */
+#define EXPAND4TO8(_i)                                          \
+    ((((_i) & 0x01) * 0x03) | (((_i) & 0x02) * 0x06) |          \
+     (((_i) & 0x04) * 0x0c) | (((_i) & 0x08) * 0x18))
+
+static const uint32_t   expand4[256] = { X256(EXPAND4) };
+static const uint16_t   expand2[256] = { X256(EXPAND2) };
+static const uint8_t    expand4to8[16] = { X16(EXPAND4TO8, 0) };
 
 static uint8_t get_ar_index(surface_t *s)
 {
@@ -579,6 +638,201 @@ static vga_draw_line_func *vga_draw_line_table[NB_DEPTHS * VGA_DRAW_LINE_NB] = {
     __vga_draw_line32_32,
 };
 
+/*
+ * Vectorized versions of the hot converters to a 32 bit surface. They
+ * must produce exactly what the template.h versions do; the scalar
+ * versions above are kept as the fallback and as the reference that
+ * each vector version is checked against at start of day.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define VGA_SIMD_LINE(_v)   ((_v) * NB_DEPTHS + 3)
+
+__attribute__((target("sse2")))
+static void __vga_draw_line15_32_sse2(uint32_t *palette, uint32_t plane_enable, uint8_t *d,
+        const uint8_t *s, int width)
+{
+    const __m128i mask = _mm_set1_epi16(0xf8);
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + x * 2));
+        __m128i r = _mm_and_si128(_mm_srli_epi16(v, 7), mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, 2), mask);
+        __m128i b = _mm_and_si128(_mm_slli_epi16(v, 3), mask);
+        __m128i gb = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i *)(d + x * 4), _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *)(d + x * 4 + 16), _mm_unpackhi_epi16(gb, r));
+    }
+
+    if (x < width)
+        __vga_draw_line15_32(palette, plane_enable, d + x * 4, s + x * 2,
+                             width - x);
+}
+
+__attribute__((target("sse2")))
+static void __vga_draw_line16_32_sse2(uint32_t *palette, uint32_t plane_enable, uint8_t *d,
+        const uint8_t *s, int width)
+{
+    const __m128i mask5 = _mm_set1_epi16(0xf8);
+    const __m128i mask6 = _mm_set1_epi16(0xfc);
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + x * 2));
+        __m128i r = _mm_and_si128(_mm_srli_epi16(v, 8), mask5);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, 3), mask6);
+        __m128i b = _mm_and_si128(_mm_slli_epi16(v, 3), mask5);
+        __m128i gb = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i *)(d + x * 4), _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *)(d + x * 4 + 16), _mm_unpackhi_epi16(gb, r));
+    }
+
+    if (x < width)
+        __vga_draw_line16_32(palette, plane_enable, d + x * 4, s + x * 2,
+                             width - x);
+}
+
+__attribute__((target("ssse3")))
+static void __vga_draw_line24_32_ssse3(uint32_t *palette, uint32_t plane_enable, uint8_t *d,
+        const uint8_t *s, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1);
+    int x;
+
+    /* Each 16 byte load consumes 12 bytes so stop short of the end */
+    for (x = 0; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + x * 3));
+
+        _mm_storeu_si128((__m128i *)(d + x * 4), _mm_shuffle_epi8(v, shuffle));
+    }
+
+    if (x < width)
+        __vga_draw_line24_32(palette, plane_enable, d + x * 4, s + x * 3,
+                             width - x);
+}
+
+__attribute__((target("avx2")))
+static void __vga_draw_line8_32_avx2(uint32_t *palette, uint32_t plane_enable, uint8_t *d,
+        const uint8_t *s, int width)
+{
+    int x;
+
+    width >>= 3;
+    for (x = 0; x < width; x++) {
+        __m256i i = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)s));
+
+        _mm256_storeu_si256((__m256i *)d,
+                            _mm256_i32gather_epi32((const int *)palette, i, 4));
+        d += 32;
+        s += 8;
+    }
+}
+
+__attribute__((target("avx2")))
+static void __vga_draw_line8d2_32_avx2(uint32_t *palette, uint32_t plane_enable, uint8_t *d,
+        const uint8_t *s, int width)
+{
+    int x;
+
+    width >>= 3;
+    for (x = 0; x < width; x++) {
+        __m128i i = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(const int *)s));
+        __m128i p = _mm_i32gather_epi32((const int *)palette, i, 4);
+
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi32(p, p));
+        _mm_storeu_si128((__m128i *)(d + 16), _mm_unpackhi_epi32(p, p));
+        d += 32;
+        s += 4;
+    }
+}
+
+#define VGA_SIMD_TEST_WIDTH 61
+
+static int
+vga_draw_line_check(int v, vga_draw_line_func *fn)
+{
+    static uint32_t palette[256];
+    static uint8_t  src[VGA_SIMD_TEST_WIDTH * 4 + 16];
+    static uint32_t ref[VGA_SIMD_TEST_WIDTH * 2];
+    static uint32_t out[VGA_SIMD_TEST_WIDTH * 2];
+    vga_draw_line_func *scalar = vga_draw_line_table[VGA_SIMD_LINE(v)];
+    int width;
+    int i;
+
+    for (i = 0; i < 256; i++)
+        palette[i] = (i * 0x010203) ^ 0x00a5c3e1;
+
+    for (i = 0; i < sizeof (src); i++)
+        src[i] = (i * 37) ^ (i >> 3);
+
+    for (width = 1; width <= VGA_SIMD_TEST_WIDTH; width++) {
+        memset(ref, 0, sizeof (ref));
+        memset(out, 0, sizeof (out));
+
+        scalar(palette, 0xf, (uint8_t *)ref, src, width);
+        fn(palette, 0xf, (uint8_t *)out, src, width);
+
+        if (memcmp(ref, out, sizeof (ref)) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+vga_draw_line_select(int v, const char *isa, vga_draw_line_func *fn)
+{
+    if (vga_draw_line_check(v, fn) < 0) {
+        ERR("%s line %d converter mismatch: using scalar", isa, v);
+        return;
+    }
+
+    DBG("line %d: %s", v, isa);
+    vga_draw_line_table[VGA_SIMD_LINE(v)] = fn;
+}
+
+static void
+vga_draw_line_simd_init(void)
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) {
+        vga_draw_line_select(VGA_DRAW_LINE15, "sse2",
+                             __vga_draw_line15_32_sse2);
+        vga_draw_line_select(VGA_DRAW_LINE16, "sse2",
+                             __vga_draw_line16_32_sse2);
+    }
+
+    if (__builtin_cpu_supports("ssse3"))
+        vga_draw_line_select(VGA_DRAW_LINE24, "ssse3",
+                             __vga_draw_line24_32_ssse3);
+
+    if (__builtin_cpu_supports("avx2")) {
+        vga_draw_line_select(VGA_DRAW_LINE8, "avx2",
+                             __vga_draw_line8_32_avx2);
+        vga_draw_line_select(VGA_DRAW_LINE8D2, "avx2",
+                             __vga_draw_line8d2_32_avx2);
+    }
+}
+
+#undef VGA_SIMD_TEST_WIDTH
+#undef VGA_SIMD_LINE
+
+#else   /* __x86_64__ || __i386__ */
+
+static void
+vga_draw_line_simd_init(void)
+{
+}
+
+#endif  /* __x86_64__ || __i386__ */
+
 typedef unsigned int rgb_to_pixel_dup_func(unsigned int r, unsigned int g, unsigned b);
 
 static rgb_to_pixel_dup_func *rgb_to_pixel_dup_table[NB_DEPTHS] = {
@@ -589,36 +843,15 @@ static rgb_to_pixel_dup_func *rgb_to_pixel_dup_table[NB_DEPTHS] = {
 };
 
 int
-surface_initialize(void)
+surface_initialize(int tile_hash, int footprint)
 {
-    int i;
-    int j;
-    int v;
-    int b;
-
-    for (i = 0; i < 256; i++) {
-        v = 0;
-        for (j = 0; j < 8; j++)
-            v |= ((i >> j) & 1) << (j * 4);
-        expand4[i] = v;
-
-        v = 0;
-        for (j = 0; j < 4; j++)
-            v |= ((i >> (2 * j)) & 3) << (j * 4);
-        expand2[i] = v;
-    }
-
-    for (i = 0; i < 16; i++) {
-        v = 0;
-        for (j = 0; j < 4; j++) {
-            b = ((i >> j) & 1);
-            v |= b << (2 * j);
-            v |= b << (2 * j + 1);
-        }
-        expand4to8[i] = v;
-    }
+    vga_draw_line_simd_init();
+    vmiope_lock_profile_register("surface", &surface_lock);
 
     surface_state.graphic_mode = -1;
+    surface_state.glyph_gen = 1;
+    surface_state.tile_hash = !!tile_hash;
+    surface_state.footprint = !!footprint;
     surface_state.vram = demu_get_vram();
     surface_state.shared = (shared_surface_t *)(surface_state.vram +
                            VRAM_RESERVED_SIZE -
@@ -629,6 +862,9 @@ surface_initialize(void)
 
     INFO("port = %u", surface_state.shared->port);
 
+    if (surface_state.tile_hash)
+        INFO("tile hashing enabled");
+
     return 0;
 }
 
@@ -639,6 +875,8 @@ surface_resize(uint32_t offset, uint32_t linesize, uint32_t width, uint32_t heig
 {
     DBG("%ux%ux%u @ %x", width, height, depth, offset);
 
+    vmiope_lock_acquire(&surface_lock);
+
     surface_state.bits_per_pixel = depth;
     surface_state.bytes_per_pixel = P2ROUNDUP(depth, 8) / 8;
     surface_state.linesize = linesize;
@@ -652,20 +890,129 @@ surface_resize(uint32_t offset, uint32_t linesize, uint32_t width, uint32_t heig
     surface_state.shared->width = width;
     surface_state.shared->height = height;
     surface_state.shared->depth = depth;
+
+    pthread_mutex_unlock(&surface_lock);
+}
+
+static void
+surface_damage_add(surface_t *s, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    shared_rect_t *rect;
+    unsigned int i;
+
+    if (width == 0 || height == 0)
+        return;
+
+    /* Fold into an existing rectangle if it overlaps or touches */
+    for (i = 0; i < s->nr_damage; i++) {
+        rect = &s->damage[i];
+
+        if (x <= rect->x + rect->width && rect->x <= x + width &&
+                y <= rect->y + rect->height && rect->y <= y + height)
+            goto merge;
+    }
+
+    if (s->nr_damage < SHARED_SURFACE_MAX_RECTS) {
+        rect = &s->damage[s->nr_damage++];
+
+        rect->x = x;
+        rect->y = y;
+        rect->width = width;
+        rect->height = height;
+        return;
+    }
+
+    /* Out of rectangles: collapse everything into a bounding box */
+    rect = &s->damage[0];
+    for (i = 1; i < s->nr_damage; i++) {
+        shared_rect_t *other = &s->damage[i];
+        uint32_t x1 = MAX(rect->x + rect->width, other->x + other->width);
+        uint32_t y1 = MAX(rect->y + rect->height, other->y + other->height);
+
+        rect->x = MIN(rect->x, other->x);
+        rect->y = MIN(rect->y, other->y);
+        rect->width = x1 - rect->x;
+        rect->height = y1 - rect->y;
+    }
+    s->nr_damage = 1;
+
+merge:
+    {
+        uint32_t x1 = MAX(rect->x + rect->width, x + width);
+        uint32_t y1 = MAX(rect->y + rect->height, y + height);
+
+        rect->x = MIN(rect->x, x);
+        rect->y = MIN(rect->y, y);
+        rect->width = x1 - rect->x;
+        rect->height = y1 - rect->y;
+    }
+}
+
+static int
+surface_damage_publish(surface_t *s)
+{
+    shared_surface_t *shared = s->shared;
+
+    if (s->nr_damage == 0)
+        return 0;
+
+    memcpy(shared->rects, s->damage, s->nr_damage * sizeof (shared_rect_t));
+    shared->nr_rects = s->nr_damage;
+    __sync_synchronize();
+    shared->update++;
+
+    s->nr_damage = 0;
+
+    return 1;
 }
 
 void
 surface_update(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
-    surface_state.shared->update++;
+    surface_t *s = &surface_state;
+
+    vmiope_lock_acquire(&surface_lock);
+
+    surface_damage_add(s, x, y, width, height);
+
+    /* Updates made during a refresh are published when it completes */
+    if (s->batch == 0)
+        surface_damage_publish(s);
+
+    pthread_mutex_unlock(&surface_lock);
+}
+
+/*
+ * Publish the updates made between begin and end as one frame. The
+ * surface lock is held in between.
+ */
+void
+surface_update_begin(void)
+{
+    vmiope_lock_acquire(&surface_lock);
+    surface_state.batch++;
+}
+
+void
+surface_update_end(void)
+{
+    surface_t *s = &surface_state;
+
+    assert(s->batch > 0);
+    if (--s->batch == 0)
+        surface_damage_publish(s);
+
+    pthread_mutex_unlock(&surface_lock);
 }
 
 void
 surface_get_dimensions(uint32_t *width, uint32_t *height, uint32_t *depth)
 {
+    vmiope_lock_acquire(&surface_lock);
     *width = surface_state.last_scr_width;
     *height = surface_state.last_scr_height;
     *depth = surface_state.bits_per_pixel;
+    pthread_mutex_unlock(&surface_lock);
 }
 
 void *
@@ -674,6 +1021,121 @@ surface_get_buffer(void)
     return surface_state.vram + surface_state.offset;
 }
 
+/*
+ * Glyphs are cached pre-rendered at the surface depth so that drawing a
+ * changed cell is a copy of cheight rows. An entry is only valid for the
+ * generation it was rendered in; the generation is bumped on any full
+ * update, which covers font, plane 2, palette and geometry changes.
+ */
+#define GLYPH_CACHE_SHIFT   9
+#define GLYPH_CACHE_SIZE    (1 << GLYPH_CACHE_SHIFT)
+#define GLYPH_MAX_WIDTH     16
+#define GLYPH_MAX_HEIGHT    32
+#define GLYPH_STRIDE        (GLYPH_MAX_WIDTH * 4)
+
+typedef struct glyph {
+    uint32_t        gen;
+    const uint8_t   *font_ptr;
+    uint32_t        fgcol;
+    uint32_t        bgcol;
+    uint8_t         cw;
+    uint8_t         cheight;
+    uint8_t         dup9;
+    uint8_t         data[GLYPH_MAX_HEIGHT * GLYPH_STRIDE];
+} glyph_t;
+
+/*
+ * The text state (the glyph cache and the character/attribute shadow)
+ * is only needed to draw text mode, which most guests leave early in
+ * boot, so it is allocated on the first text frame. In footprint mode
+ * it is released again when the console stops or the guest leaves text
+ * mode; it comes back zeroed, which the full update that follows
+ * treats like any other change.
+ */
+#define SURFACE_TEXT_SIZE                               \
+    P2ROUNDUP(GLYPH_CACHE_SIZE * sizeof(glyph_t) +      \
+              CH_ATTR_SIZE * sizeof(uint32_t), TARGET_PAGE_SIZE)
+
+static int
+surface_text_alloc(surface_t *s)
+{
+    uint8_t *p;
+
+    if (s->glyph_cache != NULL)
+        return 0;
+
+    p = numa_alloc(SURFACE_TEXT_SIZE);
+    if (p == NULL)
+        goto fail1;
+
+    s->glyph_cache = (glyph_t *)p;
+    s->last_ch_attr = (uint32_t *)(p + GLYPH_CACHE_SIZE * sizeof(glyph_t));
+
+    DBG("%zu bytes", (size_t)SURFACE_TEXT_SIZE);
+
+    return 1;
+
+fail1:
+    ERR("fail1");
+
+    return -1;
+}
+
+static void
+surface_text_free(surface_t *s)
+{
+    if (s->glyph_cache == NULL)
+        return;
+
+    numa_free(s->glyph_cache, SURFACE_TEXT_SIZE);
+    s->glyph_cache = NULL;
+    s->last_ch_attr = NULL;
+
+    DBG("done");
+}
+
+static const glyph_t *
+surface_get_glyph(surface_t *s, const uint8_t *font_ptr, int ch_attr,
+                  uint32_t fgcol, uint32_t bgcol, int cw, int cheight,
+                  int dup9, vga_draw_glyph8_func *vga_draw_glyph8,
+                  vga_draw_glyph9_func *vga_draw_glyph9)
+{
+    glyph_t *glyph;
+
+    glyph = &s->glyph_cache[((uint32_t)ch_attr * 2654435761u) >>
+                            (32 - GLYPH_CACHE_SHIFT)];
+
+    if (glyph->gen == s->glyph_gen &&
+            glyph->font_ptr == font_ptr &&
+            glyph->fgcol == fgcol &&
+            glyph->bgcol == bgcol &&
+            glyph->cw == cw &&
+            glyph->cheight == cheight &&
+            glyph->dup9 == dup9)
+        return glyph;
+
+    if (cheight > GLYPH_MAX_HEIGHT ||
+            cw * s->bytes_per_pixel > GLYPH_STRIDE)
+        return NULL;
+
+    if (cw != 9)
+        vga_draw_glyph8(glyph->data, GLYPH_STRIDE, font_ptr, cheight,
+                        fgcol, bgcol);
+    else
+        vga_draw_glyph9(glyph->data, GLYPH_STRIDE, font_ptr, cheight,
+                        fgcol, bgcol, dup9);
+
+    glyph->gen = s->glyph_gen;
+    glyph->font_ptr = font_ptr;
+    glyph->fgcol = fgcol;
+    glyph->bgcol = bgcol;
+    glyph->cw = cw;
+    glyph->cheight = cheight;
+    glyph->dup9 = dup9;
+
+    return glyph;
+}
+
 static void
 surface_draw_text(surface_t *s, int full_update)
 {
@@ -682,11 +1144,12 @@ surface_draw_text(surface_t *s, int full_update)
     uint32_t offset, fgcol, bgcol, v, cursor_offset;
     uint8_t *d1, *d, *src, *s1, *dest, *cursor_ptr;
     const uint8_t *font_ptr, *font_base[2];
-    int dup9, line_offset, depth_index;
+    int dup9, line_offset, depth_index, scan_all, glyph_width;
     uint32_t *palette;
     uint32_t *ch_attr_ptr;
     vga_draw_glyph8_func *vga_draw_glyph8;
     vga_draw_glyph9_func *vga_draw_glyph9;
+    const glyph_t *glyph;
 
     /* compute font data address (in plane 2) */
     v = get_sr(s, 3);
@@ -737,6 +1200,16 @@ surface_draw_text(surface_t *s, int full_update)
         return;
     }
 
+    switch (surface_text_alloc(s)) {
+    case -1:
+        return;
+    case 1:
+        full_update = 1;
+        break;
+    default:
+        break;
+    }
+
     if (width * cw != s->last_scr_width ||
             height * cheight != s->last_scr_height ||
             cw != s->last_cw ||
@@ -757,6 +1230,10 @@ surface_draw_text(surface_t *s, int full_update)
     palette = s->last_palette;
     x_incr = cw * s->bytes_per_pixel;
 
+    scan_all = full_update;
+    if (full_update)
+        s->glyph_gen++;
+
     cursor_offset = ((get_cr(s, 0x0e) << 8) | get_cr(s, 0x0f)) - s->start_addr;
     if (cursor_offset != s->cursor_offset ||
             get_cr(s, 0xa) != s->cursor_start ||
@@ -770,7 +1247,12 @@ surface_draw_text(surface_t *s, int full_update)
         s->cursor_offset = cursor_offset;
         s->cursor_start = get_cr(s, 0xa);
         s->cursor_end = get_cr(s, 0xb);
+        scan_all = 1;
     }
+
+    /* Nothing written to the text buffer and the cursor has not moved */
+    if (!demu_sync_vram_dirty_map() && !scan_all)
+        return;
     cursor_ptr = s->vram + (s->start_addr + cursor_offset) * 4;
 
     depth_index = get_depth_index(s);
@@ -779,11 +1261,25 @@ surface_draw_text(surface_t *s, int full_update)
     else
         vga_draw_glyph8 = vga_draw_glyph8_table[depth_index];
     vga_draw_glyph9 = vga_draw_glyph9_table[depth_index];
+    glyph_width = cw * s->bytes_per_pixel;
 
     dest = s->vram + s->offset;
     linesize = s->linesize;
     ch_attr_ptr = s->last_ch_attr;
     for(cy = 0; cy < height; cy++) {
+        if (!scan_all) {
+            xen_pfn_t page0, page1, first, last;
+
+            /* skip rows whose character cells were not written */
+            page0 = (s1 - s->vram) >> TARGET_PAGE_SHIFT;
+            page1 = (s1 - s->vram + width * 4 - 1) >> TARGET_PAGE_SHIFT;
+            if (!demu_vram_next_dirty_run(page0, page1 + 1, &first, &last)) {
+                ch_attr_ptr += width;
+                dest += linesize * cheight;
+                s1 += line_offset;
+                continue;
+            }
+        }
         d1 = dest;
         src = s1;
         cx_min = width;
@@ -802,12 +1298,25 @@ surface_draw_text(surface_t *s, int full_update)
                 font_ptr += 32 * 4 * ch;
                 bgcol = palette[cattr >> 4];
                 fgcol = palette[cattr & 0x0f];
-                if (cw != 9) {
+                dup9 = 0;
+                if (cw == 9 && ch >= 0xb0 && ch <= 0xdf && (get_ar(s, 0x10) & 0x04))
+                    dup9 = 1;
+                glyph = surface_get_glyph(s, font_ptr, ch_attr, fgcol, bgcol,
+                                          cw, cheight, dup9,
+                                          vga_draw_glyph8, vga_draw_glyph9);
+                if (glyph != NULL) {
+                    const uint8_t *g = glyph->data;
+                    int i;
+
+                    d = d1;
+                    for (i = 0; i < cheight; i++) {
+                        memcpy(d, g, glyph_width);
+                        g += GLYPH_STRIDE;
+                        d += linesize;
+                    }
+                } else if (cw != 9) {
                     vga_draw_glyph8(d1, linesize, font_ptr, cheight, fgcol, bgcol);
                 } else {
-                    dup9 = 0;
-                    if (ch >= 0xb0 && ch <= 0xdf && (get_ar(s, 0x10) & 0x04))
-                        dup9 = 1;
                     vga_draw_glyph9(d1, linesize, font_ptr, cheight, fgcol, bgcol, dup9);
                 }
                 if (src == cursor_ptr &&
@@ -833,20 +1342,98 @@ surface_draw_text(surface_t *s, int full_update)
             d1 += x_incr;
             src += 4;
             ch_attr_ptr++;
-            if (cx_max != -1)
-                surface_update(cx_min * cw, cy * cheight,
-                               (cx_max - cx_min + 1) * cw, cheight);
-
         }
+        if (cx_max != -1)
+            surface_update(cx_min * cw, cy * cheight,
+                           (cx_max - cx_min + 1) * cw, cheight);
         dest += linesize * cheight;
         s1 += line_offset;
     }
+
+    demu_clear_vram_dirty_map();
+}
+
+static uint32_t
+surface_tile_sum(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = 0xcbf29ce484222325ull;
+    int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / sizeof (uint64_t); i++) {
+        h ^= w[i];
+        h *= 0x100000001b3ull;
+    }
+
+    /* Never return 0 so that an unhashed tile always looks changed */
+    return (uint32_t)(h ^ (h >> 32)) | 1;
+}
+
+/*
+ * A dirty VRAM page is only treated as changed if its content differs
+ * from what it held when last drawn. A page may sit under several
+ * scanlines so its verdict is cached for the rest of the frame.
+ */
+static int
+surface_tile_changed(surface_t *s, xen_pfn_t page)
+{
+    uint32_t sum;
+
+    assert(page < SURFACE_TILES);
+    if (s->tile_frame[page] == s->frame)
+        return s->tile_changed[page];
+
+    sum = surface_tile_sum(s->vram + (page << TARGET_PAGE_SHIFT));
+
+    s->tile_changed[page] = (sum != s->tile_sum[page]);
+    s->tile_sum[page] = sum;
+    s->tile_frame[page] = s->frame;
+
+    return s->tile_changed[page];
+}
+
+/*
+ * Find the first and last changed pages in [page0, page1]. Every dirty
+ * page is hashed, even in the middle of a run, so that its checksum is
+ * current for the next frame.
+ */
+static int
+surface_find_damage(surface_t *s, xen_pfn_t page0, xen_pfn_t page1,
+                    xen_pfn_t *first, xen_pfn_t *last)
+{
+    xen_pfn_t page, start, end;
+    int found = 0;
+
+    for (page = page0;
+         demu_vram_next_dirty_run(page, page1 + 1, &start, &end);
+         page = end) {
+        if (s->tile_hash) {
+            for (; start < end; start++) {
+                if (!surface_tile_changed(s, start))
+                    continue;
+
+                if (!found)
+                    *first = start;
+                *last = start;
+                found = 1;
+            }
+        } else {
+            if (!found)
+                *first = start;
+            *last = end - 1;
+            found = 1;
+        }
+    }
+
+    return found;
 }
 
 static void
 surface_draw_graphic(surface_t *s, int full_update)
 {
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
+    int x_start, x_end, row_start, row_end;
+    uint32_t row_addr;
     int width, height, shift_control, line_offset, bwidth, bits;
     xen_pfn_t page0, page1;
     int disp_width, multi_scan, multi_run;
@@ -970,7 +1557,14 @@ surface_draw_graphic(surface_t *s, int full_update)
     linesize = s->linesize;
     y1 = 0;
 
-    demu_sync_vram_dirty_map();
+    /* Nothing has been written since the last frame */
+    if (!demu_sync_vram_dirty_map() && !full_update)
+        return;
+
+    x_start = x_end = 0;
+    row_start = row_end = 0;
+    row_addr = ~0u;
+    s->frame++;
 
     for(y = 0; y < height; y++) {
         addr = addr1;
@@ -985,18 +1579,50 @@ surface_draw_graphic(surface_t *s, int full_update)
         }
         page0 = addr >> TARGET_PAGE_SHIFT;
         page1 = (addr + bwidth - 1) >> TARGET_PAGE_SHIFT;
-        update = full_update;
-        if (!update) {
-            xen_pfn_t page;
+        /* multi-scan repeats a line, so only look at new addresses */
+        if (addr != row_addr && (!full_update || s->tile_hash)) {
+            xen_pfn_t first, last;
+
+            row_addr = addr;
+            row_start = row_end = 0;
 
-            for (page = page0; page <= page1; page++)
-                update |= demu_vram_get_page_dirty(page);
+            /* Map the changed pages onto the columns they back */
+            if (surface_find_damage(s, page0, page1, &first, &last)) {
+                uint32_t lo, hi;
+
+                lo = MAX(first << TARGET_PAGE_SHIFT, addr) - addr;
+                hi = MIN((last + 1) << TARGET_PAGE_SHIFT, addr + bwidth) - addr;
+
+                row_start = (lo * 8 / bits) * disp_width / width;
+                row_end = ((hi * 8 + bits - 1) / bits * disp_width +
+                           width - 1) / width;
+                row_end = MIN(row_end, disp_width);
+            }
         }
+        if (full_update) {
+            row_start = 0;
+            row_end = disp_width;
+        }
+        update = (row_start < row_end);
         if (update) {
             uint32_t plane_enable;
 
-            if (y_start < 0)
+            if (y_start >= 0 &&
+                    (row_start > x_end || row_end < x_start)) {
+                /* disjoint from the rows above so start a new rectangle */
+                surface_update(x_start, y_start,
+                               x_end - x_start, y - y_start);
+                y_start = -1;
+            }
+
+            if (y_start < 0) {
                 y_start = y;
+                x_start = row_start;
+                x_end = row_end;
+            } else {
+                x_start = MIN(x_start, row_start);
+                x_end = MAX(x_end, row_end);
+            }
 
             plane_enable = get_ar(s, 0x12) & 0xf;
             if (s->offset != s->start_addr * 4)
@@ -1004,8 +1630,8 @@ surface_draw_graphic(surface_t *s, int full_update)
         } else {
             if (y_start >= 0) {
                 /* flush to display */
-                surface_update(0, y_start,
-                               disp_width, y - y_start);
+                surface_update(x_start, y_start,
+                               x_end - x_start, y - y_start);
                 y_start = -1;
             }
         }
@@ -1025,8 +1651,8 @@ surface_draw_graphic(surface_t *s, int full_update)
     }
     if (y_start >= 0) {
         /* flush to display */
-        surface_update(0, y_start,
-                       disp_width, y - y_start);
+        surface_update(x_start, y_start,
+                       x_end - x_start, y - y_start);
         y_start = -1;
     }
 
@@ -1057,11 +1683,16 @@ surface_draw_blank(surface_t *s, int full_update)
                    s->last_scr_width, s->last_scr_height);
 }
 
-void
+int
 surface_refresh(int full_update)
 {
     surface_t *s = &surface_state;
     int graphic_mode;
+    int rc = 0;
+    uint64_t start;
+
+    start = trace_begin(TRACE_SURFACE_REFRESH);
+    vmiope_lock_acquire(&surface_lock);
 
     if (!(get_ar_index(s) & 0x20)) {
         graphic_mode = GMODE_BLANK;
@@ -1072,6 +1703,9 @@ surface_refresh(int full_update)
     if (graphic_mode != s->graphic_mode) {
         s->graphic_mode = graphic_mode;
 
+        if (s->footprint && graphic_mode != GMODE_TEXT)
+            surface_text_free(s);
+
         switch(s->graphic_mode) {
         case GMODE_TEXT:
             DBG("text");
@@ -1088,6 +1722,8 @@ surface_refresh(int full_update)
         full_update = 1;
     }
 
+    s->batch++;
+
     switch(graphic_mode) {
     case GMODE_TEXT:
         surface_draw_text(s, full_update);
@@ -1100,11 +1736,50 @@ surface_refresh(int full_update)
         surface_draw_blank(s, full_update);
         break;
     }
+
+    if (--s->batch == 0)
+        rc = surface_damage_publish(s);
+
+    pthread_mutex_unlock(&surface_lock);
+    trace_end(TRACE_SURFACE_REFRESH, start);
+
+    return rc;
+}
+
+/*
+ * Drop state that is rebuilt on demand, for when the console goes idle.
+ * The next refresh is a full one.
+ */
+void
+surface_release(void)
+{
+    surface_t *s = &surface_state;
+
+    vmiope_lock_acquire(&surface_lock);
+
+    surface_text_free(s);
+    s->graphic_mode = -1;
+
+    pthread_mutex_unlock(&surface_lock);
+}
+
+void
+surface_get_memory(size_t *state, size_t *text)
+{
+    vmiope_lock_acquire(&surface_lock);
+
+    *state = sizeof(surface_state);
+    *text = (surface_state.glyph_cache != NULL) ? SURFACE_TEXT_SIZE : 0;
+
+    pthread_mutex_unlock(&surface_lock);
 }
 
 void
 surface_teardown(void)
 {
+    vmiope_lock_acquire(&surface_lock);
+    surface_text_free(&surface_state);
+    pthread_mutex_unlock(&surface_lock);
 }
 
 /*
@@ -34,13 +34,20 @@
 #define SURFACE_SIZE                0x00c00000
 
 #define CONSOLE_REFRESH_PERIOD      40000
+#define CONSOLE_IDLE_PERIOD         640000
+#define CONSOLE_KEEPALIVE_PERIOD    5000000
+#define CONSOLE_PUBLISH_PERIOD      1000000
 
-int     surface_initialize(void);
+int     surface_initialize(int tile_hash, int footprint);
 void    surface_resize(uint32_t offset, uint32_t linesize, uint32_t width, uint32_t height, uint32_t depth);
 void    surface_get_dimensions(uint32_t *width, uint32_t *height, uint32_t *depth);
 void    *surface_get_buffer(void);
 void    surface_update(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
-void    surface_refresh(int full_update);
+void    surface_update_begin(void);
+void    surface_update_end(void);
+int     surface_refresh(int full_update);
+void    surface_release(void);
+void    surface_get_memory(size_t *state, size_t *text);
 void    surface_teardown(void);
 
 #endif  /* _SURFACE_H */
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2017, Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "demu.h"
+#include "mapcache.h"
+#include "trace.h"
+
+#define P2ROUNDUP(_x, _a) -(-(_x) & -(_a))
+
+static const char *trace_name[TRACE_NR_POINTS] = {
+    [TRACE_IOREQ_PIO] = "ioreq-pio",
+    [TRACE_IOREQ_COPY] = "ioreq-copy",
+    [TRACE_IOREQ_PCI_CONFIG] = "ioreq-pci",
+    [TRACE_IOREQ_INVALIDATE] = "ioreq-inval",
+    [TRACE_IOREQ_OTHER] = "ioreq-other",
+    [TRACE_BUFFERED_POLL] = "buffered-poll",
+    [TRACE_SURFACE_REFRESH] = "refresh",
+    [TRACE_VMIOP_DUMP] = "vmiop-dump",
+    [TRACE_PLUGIN_CALLBACK] = "plugin-callback",
+};
+
+int trace_enabled;
+
+static trace_header_t *trace_header;
+static size_t trace_size;
+static char trace_path[sizeof("/dev/shm/vgpu-trace.XXXXX")];
+
+/*
+ * The calling thread's slot, claimed on its first traced operation and
+ * released by trace_slot_key's destructor when the thread exits.
+ */
+static __thread trace_slot_t *trace_slot;
+static __thread int trace_slot_full;
+static pthread_key_t trace_slot_key;
+
+static trace_slot_t *
+trace_get_slot(unsigned int i)
+{
+    return (trace_slot_t *)((uint8_t *)trace_header +
+                            trace_header->slot_offset +
+                            i * trace_header->slot_size);
+}
+
+static void
+trace_release_slot(void *arg)
+{
+    trace_slot_t *slot = arg;
+
+    __atomic_store_n(&slot->tid, 0, __ATOMIC_RELEASE);
+}
+
+/* Take the first slot with no owner, and raise slots_used to cover it */
+static trace_slot_t *
+trace_claim_slot(void)
+{
+    uint32_t tid = (uint32_t)syscall(SYS_gettid);
+    unsigned int i, used;
+
+    if (trace_slot_full)
+        return NULL;
+
+    for (i = 0; i < trace_header->nr_slots; i++) {
+        trace_slot_t *slot = trace_get_slot(i);
+        uint32_t free = 0;
+
+        if (__atomic_compare_exchange_n(&slot->tid, &free, tid, 0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (i == trace_header->nr_slots) {
+        /* Threads that find every slot owned go untraced */
+        trace_slot_full = 1;
+        return NULL;
+    }
+
+    used = __atomic_load_n(&trace_header->slots_used, __ATOMIC_RELAXED);
+    while (used < i + 1 &&
+           !__atomic_compare_exchange_n(&trace_header->slots_used, &used,
+                                        i + 1, 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+        ;
+
+    trace_slot = trace_get_slot(i);
+    (void) pthread_setspecific(trace_slot_key, trace_slot);
+
+    return trace_slot;
+}
+
+void
+__trace_end(trace_point_t point, uint64_t start)
+{
+    trace_slot_t *slot = trace_slot;
+    trace_hist_t *hist;
+    struct timespec ts;
+    uint64_t ns;
+    unsigned int bucket;
+
+    if (slot == NULL && (slot = trace_claim_slot()) == NULL)
+        return;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - start;
+
+    bucket = (ns < 2) ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= TRACE_NR_BUCKETS)
+        bucket = TRACE_NR_BUCKETS - 1;
+
+    hist = &slot->hist[point];
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    hist->count++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+    hist->bucket[bucket]++;
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+void
+trace_set_mapcache(const mapcache_stats_t *stats)
+{
+    if (!trace_enabled)
+        return;
+
+    __atomic_store_n(&trace_header->mapcache_seq,
+                     trace_header->mapcache_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    trace_header->mapcache = *stats;
+
+    __atomic_store_n(&trace_header->mapcache_seq,
+                     trace_header->mapcache_seq + 1, __ATOMIC_RELEASE);
+}
+
+int
+trace_initialize(unsigned int domid)
+{
+    size_t slot_offset;
+    size_t slot_size;
+    int fd;
+    int i;
+
+    slot_offset = P2ROUNDUP(sizeof(trace_header_t), 64);
+    slot_size = P2ROUNDUP(sizeof(trace_slot_t), 64);
+    trace_size = slot_offset + TRACE_NR_SLOTS * slot_size;
+
+    (void) snprintf(trace_path, sizeof(trace_path), "/dev/shm/vgpu-trace.%u",
+                    domid);
+
+    /*
+     * /dev/shm is world writable: never follow or reuse whatever is at
+     * the path, and keep the timings private to root. A file left by a
+     * previous instance is removed first; anything that reappears in
+     * its place makes the open fail.
+     */
+    (void) unlink(trace_path);
+
+    fd = open(trace_path,
+              O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        goto fail1;
+
+    if (ftruncate(fd, trace_size) < 0)
+        goto fail2;
+
+    trace_header = mmap(NULL, trace_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    if (trace_header == MAP_FAILED)
+        goto fail3;
+
+    errno = pthread_key_create(&trace_slot_key, trace_release_slot);
+    if (errno != 0)
+        goto fail4;
+
+    (void) close(fd);
+
+    trace_header->version = TRACE_VERSION;
+    trace_header->nr_points = TRACE_NR_POINTS;
+    trace_header->nr_buckets = TRACE_NR_BUCKETS;
+    trace_header->nr_slots = TRACE_NR_SLOTS;
+    trace_header->slot_size = slot_size;
+    trace_header->slot_offset = slot_offset;
+
+    for (i = 0; i < TRACE_NR_POINTS; i++)
+        (void) strncpy(trace_header->name[i], trace_name[i],
+                       TRACE_NAME_LEN - 1);
+
+    /* A reader can trust the layout once it sees the magic */
+    __atomic_store_n(&trace_header->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+    INFO("tracing to %s", trace_path);
+
+    return 0;
+
+fail4:
+    ERR("fail4");
+
+    (void) munmap(trace_header, trace_size);
+
+fail3:
+    ERR("fail3");
+
+    trace_header = NULL;
+
+fail2:
+    ERR("fail2");
+
+    (void) close(fd);
+    (void) unlink(trace_path);
+
+fail1:
+    ERR("fail1: %s", strerror(errno));
+
+    return -1;
+}
+
+/* Approximate percentile: the upper bound of the bucket that reaches it */
+static uint64_t
+trace_percentile(const trace_hist_t *hist, unsigned int pct)
+{
+    uint64_t want = (hist->count * pct + 99) / 100;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < TRACE_NR_BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen >= want)
+            break;
+    }
+
+    return (i < TRACE_NR_BUCKETS) ? (2ull << i) : hist->max_ns;
+}
+
+void
+trace_teardown(void)
+{
+    trace_hist_t sum;
+    unsigned int used;
+    unsigned int i, j, k;
+
+    if (!trace_enabled)
+        return;
+
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+
+    used = __atomic_load_n(&trace_header->slots_used, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < TRACE_NR_POINTS; i++) {
+        memset(&sum, 0, sizeof(sum));
+
+        for (j = 0; j < used; j++) {
+            const trace_hist_t *hist = &trace_get_slot(j)->hist[i];
+
+            sum.count += hist->count;
+            sum.total_ns += hist->total_ns;
+            if (hist->max_ns > sum.max_ns)
+                sum.max_ns = hist->max_ns;
+            for (k = 0; k < TRACE_NR_BUCKETS; k++)
+                sum.bucket[k] += hist->bucket[k];
+        }
+
+        if (sum.count == 0)
+            continue;
+
+        INFO("%s: %" PRIu64 " calls, mean %" PRIu64 " ns, p50 < %" PRIu64
+             " ns, p99 < %" PRIu64 " ns, max %" PRIu64 " ns",
+             trace_name[i], sum.count, sum.total_ns / sum.count,
+             trace_percentile(&sum, 50), trace_percentile(&sum, 99),
+             sum.max_ns);
+    }
+
+    /*
+     * The mapping is left in place: a thread that sampled trace_enabled
+     * just before it was cleared may still be updating its slot.
+     */
+    (void) unlink(trace_path);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-tab-always-indent: nil
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-basic-indent: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
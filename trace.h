@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2017, Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef  _TRACE_H
+#define  _TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef DEMU_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(_name, _point) DTRACE_PROBE1(demu, _name, _point)
+#else
+#define TRACE_PROBE(_name, _point)
+#endif
+
+#include "mapcache.h"
+
+/*
+ * Static tracepoints. Each records the latency of one traced operation
+ * in a per-thread histogram; the synchronous ioreq types are separate
+ * points so their service times can be told apart.
+ */
+typedef enum trace_point {
+    TRACE_IOREQ_PIO = 0,
+    TRACE_IOREQ_COPY,
+    TRACE_IOREQ_PCI_CONFIG,
+    TRACE_IOREQ_INVALIDATE,
+    TRACE_IOREQ_OTHER,
+    TRACE_BUFFERED_POLL,
+    TRACE_SURFACE_REFRESH,
+    TRACE_VMIOP_DUMP,
+    TRACE_PLUGIN_CALLBACK,
+    TRACE_NR_POINTS
+} trace_point_t;
+
+/*
+ * Layout of the trace file (/dev/shm/vgpu-trace.<domid>), which an
+ * external tool can map read-only and sample while the VM runs.
+ *
+ * The header is followed, at slot_offset, by nr_slots slots of
+ * slot_size bytes, of which only the first slots_used (never more than
+ * nr_slots) have ever been used. A slot's tid is that of the thread
+ * that owns it, or 0 once that thread has exited; a later thread may
+ * then take the slot over, adding to the counts already in it. Each
+ * slot is written only by its owner. Its seq is odd while an update is
+ * in progress, so a reader should re-read a slot whose seq was odd or
+ * changed while it was being copied.
+ *
+ * Bucket 0 of a histogram counts latencies below 2 ns, and bucket i
+ * (i > 0) counts latencies in [2^i, 2^(i+1)) ns; the last bucket also
+ * takes everything longer.
+ */
+#define TRACE_MAGIC         0x31435254554d4544ull   /* "DEMUTRC1" */
+#define TRACE_VERSION       1
+#define TRACE_NR_BUCKETS    32
+#define TRACE_NR_SLOTS      32
+#define TRACE_NAME_LEN      16
+
+typedef struct trace_hist {
+    uint64_t    count;
+    uint64_t    total_ns;
+    uint64_t    max_ns;
+    uint64_t    bucket[TRACE_NR_BUCKETS];
+} trace_hist_t;
+
+typedef struct trace_slot {
+    uint32_t        seq;
+    uint32_t        tid;
+    trace_hist_t    hist[TRACE_NR_POINTS];
+} trace_slot_t;
+
+typedef struct trace_header {
+    uint64_t            magic;
+    uint32_t            version;
+    uint32_t            nr_points;
+    uint32_t            nr_buckets;
+    uint32_t            nr_slots;
+    uint32_t            slots_used;
+    uint32_t            slot_size;
+    uint32_t            slot_offset;
+    uint32_t            mapcache_seq;
+    mapcache_stats_t    mapcache;
+    char                name[TRACE_NR_POINTS][TRACE_NAME_LEN];
+} trace_header_t;
+
+extern int trace_enabled;
+
+static inline uint64_t
+trace_begin(trace_point_t point)
+{
+    struct timespec ts;
+
+    TRACE_PROBE(begin, point);
+
+    if (!trace_enabled)
+        return 0;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void    __trace_end(trace_point_t point, uint64_t start);
+
+/* start is the value returned by trace_begin() */
+static inline void
+trace_end(trace_point_t point, uint64_t start)
+{
+    TRACE_PROBE(end, point);
+
+    if (start != 0)
+        __trace_end(point, start);
+}
+
+int     trace_initialize(unsigned int domid);
+void    trace_set_mapcache(const mapcache_stats_t *stats);
+void    trace_teardown(void);
+
+#endif  /* _TRACE_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-tab-always-indent: nil
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-basic-indent: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
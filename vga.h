@@ -110,14 +110,32 @@ typedef struct vga {
     uint32_t    plane_updated;
 } vga_t;
 
-typedef struct shared_surface {
-    uint32_t    offset;
-    uint32_t    linesize;
+#define SHARED_SURFACE_MAX_RECTS    64
+
+typedef struct shared_rect {
+    uint32_t    x;
+    uint32_t    y;
     uint32_t    width;
     uint32_t    height;
-    uint32_t    depth;
-    uint32_t    update;
-    uint16_t    port;
+} shared_rect_t;
+
+/*
+ * rects[] describes the area damaged by the frame that advanced update.
+ * It is written before update is incremented, so a consumer should read
+ * update, then the rects, then update again and repaint the whole
+ * surface if update moved by anything other than one since its last
+ * look. nr_rects == 0 also means the whole surface.
+ */
+typedef struct shared_surface {
+    uint32_t        offset;
+    uint32_t        linesize;
+    uint32_t        width;
+    uint32_t        height;
+    uint32_t        depth;
+    uint32_t        update;
+    uint16_t        port;
+    uint16_t        nr_rects;
+    shared_rect_t   rects[SHARED_SURFACE_MAX_RECTS];
 } shared_surface_t;
 #pragma pack(0)
 